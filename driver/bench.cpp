@@ -0,0 +1,146 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#include "userspace_utils.h"
+#include "userspace_emu.h"
+#include "userspace_bench.h"
+
+/*
+    Run the MMIO micro-benchmarks (userspace_bench.h) against several
+    mappings of the core and write one JSON document.
+    Usage: ./bench [-a addr] [-m] [-u /dev/uioN]... [-e] [-c clock] [-k] [-n samples]
+                   [-o out.json]
+*/
+
+#define BENCH_MAX_UIO 4
+
+static void usage(const char *progname)
+{
+    printf("Usage: %s [options]\n"
+           "  -a <addr>     physical address of the core (default 0x%x)\n"
+           "  -m            benchmark the /dev/mem mapping at <addr>\n"
+           "  -u <dev>      benchmark a UIO mapping (e.g. /dev/uio0), repeatable\n"
+           "  -e            benchmark the software emulator\n"
+           "  -c <hz>       benchmark the bit timing solvers for a CAN clock of <hz>\n"
+           "  -k            benchmark the CRC15/17/21 kernels (./selftest checks them)\n"
+           "  -n <samples>  timed samples per case (default %u)\n"
+           "  -b <batch>    operations per sample (default %u)\n"
+           "  -o <file>     write JSON to file instead of stdout\n"
+           "Without -m/-u/-e/-c/-k the /dev/mem mapping is used.\n",
+           progname, 0x43c30000, 20000, 8);
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_config cfg;
+    uint32_t addr = 0x43c30000;
+    const char *uio[BENCH_MAX_UIO];
+    unsigned nuio = 0;
+    bool mem = false, emu = false, crc = false;
+    uint32_t clock = 0;
+    FILE *out = stdout;
+    char *e;
+    int c;
+
+    bench_config_defaults(&cfg);
+    while ((c = getopt(argc, argv, "a:mu:ec:kn:b:o:h")) != -1) {
+        switch (c) {
+        case 'a':
+            addr = strtoul(optarg, &e, 0);
+            if (*e != '\0')
+                errx(1, "-a expects a number");
+            break;
+        case 'm':
+            mem = true;
+            break;
+        case 'u':
+            if (nuio == BENCH_MAX_UIO)
+                errx(1, "at most %d UIO devices", BENCH_MAX_UIO);
+            uio[nuio++] = optarg;
+            break;
+        case 'e':
+            emu = true;
+            break;
+        case 'c':
+            clock = strtoul(optarg, &e, 0);
+            if (*e != '\0' || !clock)
+                errx(1, "-c expects a non-zero frequency");
+            break;
+        case 'k':
+            crc = true;
+            break;
+        case 'n':
+            cfg.samples = strtoul(optarg, &e, 0);
+            if (*e != '\0' || !cfg.samples)
+                errx(1, "-n expects a non-zero number");
+            break;
+        case 'b':
+            cfg.batch = strtoul(optarg, &e, 0);
+            if (*e != '\0' || !cfg.batch)
+                errx(1, "-b expects a non-zero number");
+            break;
+        case 'o':
+            out = fopen(optarg, "w");
+            if (!out)
+                err(1, "%s", optarg);
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!mem && !nuio && !emu && !clock && !crc)
+        mem = true;
+
+    bench_json_begin(out);
+    if (mem)
+        bench_run(ctucanfd_init(addr), "mem", &cfg, out);
+    for (unsigned i = 0; i < nuio; i++)
+        bench_run(ctucanfd_init_uio(uio[i]), uio[i], &cfg, out);
+    if (emu) {
+        struct ctucan_emu_config ecfg;
+        struct ctucan_hw_priv *priv;
+
+        ctucan_emu_config_defaults(&ecfg);
+        priv = ctucan_emu_create(&ecfg);
+        bench_run(priv, "emu", &cfg, out);
+        ctucan_emu_destroy(priv);
+    }
+    if (clock)
+        bench_bittiming(clock, &cfg, out);
+    if (crc)
+        bench_crc(&cfg, out);
+    bench_json_end(out);
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
@@ -0,0 +1,395 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "userspace_utils.h"
+#include "userspace_busdec.h"
+#include "userspace_refgen.h"
+
+/*
+    Decode sampled bus traces into frames (userspace_busdec.h): data sets
+    written by tools/Kvaser_logger (one capture per line), or raw captures
+    with one byte per sample. -j splits the trace at bus idle and decodes
+    the parts in parallel.
+    Usage: ./busdec [-C] [options] data_set
+           ./busdec -r bit [-I] [options] capture
+*/
+
+#define SEGMENT_SAMPLES     (16u << 20)     /* Raw captures are decoded in pieces */
+#define MAX_THREADS         64
+#define MAX_REPORTED        10
+
+static void usage(const char *progname)
+{
+    printf("Usage: %s [options] file\n"
+           "  -r <bit>          raw capture, the CAN signal in this bit of each sample byte\n"
+           "  -I                raw capture: the signal is 1 when dominant\n"
+           "  -C                data set: compare frames with the recorded fields\n"
+           "  -j <threads>      decode parts split at bus idle in parallel\n"
+           "  -q                only the summary\n"
+           "  -c <hz>           sample rate (default 100000000)\n"
+           "  -b <bps>          nominal bit rate (default 500000)\n"
+           "  -B <bps>          data bit rate (default 2000000)\n"
+           "  -p <sp>[,<dsp>]   sample points in per mille (default 800,800)\n"
+           "  -N                non-ISO CAN FD\n",
+           progname);
+}
+
+static double now_s(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+struct opts {
+    struct busdec_config cfg;
+    bool raw;
+    uint8_t mask;
+    bool invert;
+    bool check;
+    bool keep;                  /* Frames are printed or checked */
+};
+
+static struct opts opt;
+
+struct part_frame {
+    struct busdec_frame f;
+    uint64_t line;              /* Data set line in the part, from 1 */
+};
+
+struct part {
+    const uint8_t *buf;
+    size_t begin, end;
+    struct busdec dec;
+    struct part_frame *frames;
+    size_t nframes, cap;
+    uint32_t *runs;
+    size_t runs_cap;
+    uint64_t line;              /* Lines of the part so far */
+    uint64_t captures, bad_lines, mismatches;
+    uint64_t mismatch_line[MAX_REPORTED];
+};
+
+static void on_frame(void *arg, const struct busdec_frame *f)
+{
+    struct part *p = (struct part *)arg;
+
+    if (!opt.keep)
+        return;
+    if (p->nframes == p->cap) {
+        p->cap = p->cap ? p->cap * 2 : 1024;
+        p->frames = (struct part_frame *)realloc(p->frames, p->cap * sizeof(*p->frames));
+        if (!p->frames)
+            errx(1, "out of memory");
+    }
+    p->frames[p->nframes].f = *f;
+    p->frames[p->nframes].line = p->line;
+    p->nframes++;
+}
+
+/* The capture of a data set line holds exactly its recorded frame */
+static bool capture_matches(const struct refgen_frame *rec, const struct part_frame *pf,
+                            size_t n)
+{
+    const struct canfd_frame *a = &rec->cf, *b = &pf->f.cf;
+
+    if (n != 1 || pf->f.status != BUSDEC_OK || pf->f.fdf != rec->fdf)
+        return false;
+    if (a->can_id != b->can_id || a->len != b->len ||
+        (a->flags & CANFD_BRS) != (b->flags & CANFD_BRS))
+        return false;
+    return (a->can_id & CAN_RTR_FLAG) || !memcmp(a->data, b->data, a->len);
+}
+
+static void part_text(struct part *p)
+{
+    static __thread char line[REFGEN_LINE_MAX];
+    static __thread uint32_t run[REFGEN_MAX_RUNS];
+    const char *s = (const char *)p->buf + p->begin;
+    const char *end = (const char *)p->buf + p->end;
+    struct refgen_frame rec;
+
+    while (s < end) {
+        const char *nl = (const char *)memchr(s, '\n', end - s);
+        size_t len = (nl ? nl : end) - s;
+        size_t first = p->nframes;
+        int n = -1;
+
+        p->line++;
+        if (len < sizeof(line)) {
+            memcpy(line, s, len);
+            line[len] = '\0';
+            n = refgen_parse(line, &rec, run, REFGEN_MAX_RUNS);
+        }
+        s = nl ? nl + 1 : end;
+        if (n < 0) {
+            p->bad_lines += len != 0;
+            continue;
+        }
+        p->captures++;
+        busdec_runs(&p->dec, run, n, false, 0, false);
+        if (opt.check && !capture_matches(&rec, p->frames + first, p->nframes - first)) {
+            if (p->mismatches < MAX_REPORTED)
+                p->mismatch_line[p->mismatches] = p->line;
+            p->mismatches++;
+        }
+    }
+}
+
+static void part_raw(struct part *p)
+{
+    size_t pos = p->begin;
+    bool idle = p->begin != 0;
+
+    while (pos < p->end) {
+        size_t end = p->end, nruns = 0, at = pos;
+        bool dominant = false;
+
+        if (end - pos > SEGMENT_SAMPLES)
+            end = busdec_idle_split(&p->dec, p->buf, p->end, opt.mask, opt.invert,
+                                    pos + SEGMENT_SAMPLES);
+        /* Pieces of the run array end at a level change, so runs alternate */
+        while (at < end) {
+            size_t used, k;
+            bool d;
+
+            if (nruns == p->runs_cap) {
+                p->runs_cap = p->runs_cap ? p->runs_cap * 2 : 1 << 20;
+                p->runs = (uint32_t *)realloc(p->runs, p->runs_cap * sizeof(*p->runs));
+                if (!p->runs)
+                    errx(1, "out of memory");
+            }
+            k = busdec_sample_runs(p->buf + at, end - at, opt.mask, opt.invert,
+                                   p->runs + nruns, p->runs_cap - nruns, &d, &used);
+            if (!nruns)
+                dominant = d;
+            nruns += k;
+            at += used;
+        }
+        busdec_runs(&p->dec, p->runs, nruns, dominant, pos, idle);
+        idle = true;
+        pos = end;
+    }
+}
+
+static void *part_run(void *arg)
+{
+    struct part *p = (struct part *)arg;
+
+    if (opt.raw)
+        part_raw(p);
+    else
+        part_text(p);
+    return NULL;
+}
+
+static void print_frame(const struct part_frame *pf, uint64_t line_base)
+{
+    const struct busdec_frame *f = &pf->f;
+    const struct canfd_frame *cf = &f->cf;
+    bool ext = cf->can_id & CAN_EFF_FLAG;
+    bool rtr = cf->can_id & CAN_RTR_FLAG;
+
+    if (!opt.raw)
+        printf("%8llu ", (unsigned long long)(line_base + pf->line));
+    printf("%12llu  %s %s %*x [%2u]", (unsigned long long)f->sof,
+           f->fdf ? "FD " : "CAN", cf->flags & CANFD_BRS ? "B" : rtr ? "R" : "-",
+           ext ? 8 : 3, cf->can_id & (ext ? CAN_EFF_MASK : CAN_SFF_MASK), cf->len);
+    if (!rtr)
+        for (unsigned i = 0; i < cf->len; i++)
+            printf(" %02x", cf->data[i]);
+    if (f->status)
+        printf("  <%s at bit %u%s>", busdec_status_names[f->status], f->bits,
+               f->error_flag ? ", error flag" : "");
+    putchar('\n');
+}
+
+int main(int argc, char *argv[])
+{
+    static struct part parts[MAX_THREADS];
+    static pthread_t threads[MAX_THREADS];
+    struct busdec_stats st = {};
+    unsigned long nthreads = 1;
+    uint64_t line_base = 0, captures = 0, bad_lines = 0, mismatches = 0;
+    bool quiet = false;
+    const uint8_t *buf;
+    struct stat sb;
+    size_t size;
+    double t0, t1;
+    char *e;
+    int c, fd;
+
+    busdec_config_defaults(&opt.cfg);
+    while ((c = getopt(argc, argv, "r:ICj:qc:b:B:p:Nh")) != -1) {
+        switch (c) {
+        case 'r': {
+            unsigned long bit = strtoul(optarg, &e, 0);
+
+            if (*e != '\0' || bit > 7)
+                errx(1, "-r expects a bit number 0..7");
+            opt.raw = true;
+            opt.mask = 1u << bit;
+            break;
+        }
+        case 'I':
+            opt.invert = true;
+            break;
+        case 'C':
+            opt.check = true;
+            break;
+        case 'j':
+            nthreads = strtoul(optarg, &e, 0);
+            if (*e != '\0' || !nthreads || nthreads > MAX_THREADS)
+                errx(1, "-j expects 1..%d threads", MAX_THREADS);
+            break;
+        case 'q':
+            quiet = true;
+            break;
+        case 'c':
+            opt.cfg.clk_freq = strtoul(optarg, &e, 0);
+            if (*e != '\0' || !opt.cfg.clk_freq)
+                errx(1, "-c expects a frequency in Hz");
+            break;
+        case 'b':
+            opt.cfg.bitrate = strtoul(optarg, &e, 0);
+            if (*e != '\0' || !opt.cfg.bitrate)
+                errx(1, "-b expects a bit rate");
+            break;
+        case 'B':
+            opt.cfg.dbitrate = strtoul(optarg, &e, 0);
+            if (*e != '\0' || !opt.cfg.dbitrate)
+                errx(1, "-B expects a bit rate");
+            break;
+        case 'p':
+            opt.cfg.sp = strtoul(optarg, &e, 0);
+            opt.cfg.dsp = opt.cfg.sp;
+            if (*e == ',')
+                opt.cfg.dsp = strtoul(e + 1, &e, 0);
+            if (*e != '\0' || opt.cfg.sp >= 1000 || opt.cfg.dsp >= 1000)
+                errx(1, "-p expects <sp>[,<dsp>] per mille");
+            break;
+        case 'N':
+            opt.cfg.iso = false;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind + 1 != argc || (opt.check && opt.raw)) {
+        usage(argv[0]);
+        return 1;
+    }
+    opt.keep = !quiet || opt.check;
+
+    fd = open(argv[optind], O_RDONLY);
+    if (fd < 0 || fstat(fd, &sb))
+        err(1, "%s", argv[optind]);
+    size = sb.st_size;
+    if (!size)
+        errx(1, "%s: empty", argv[optind]);
+    buf = (const uint8_t *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (buf == MAP_FAILED)
+        err(1, "mmap %s", argv[optind]);
+    madvise((void *)buf, size, MADV_SEQUENTIAL);
+    close(fd);
+
+    t0 = now_s();
+    /* Parts start at bus idle: in captures after idle, in data sets at a line */
+    for (unsigned i = 0; i < nthreads; i++) {
+        struct part *p = &parts[i];
+        size_t at = size / nthreads * i;
+
+        if (busdec_init(&p->dec, &opt.cfg, on_frame, p))
+            return 1;
+        p->buf = buf;
+        if (!i) {
+            p->begin = 0;
+        } else if (opt.raw) {
+            p->begin = busdec_idle_split(&p->dec, buf, size, opt.mask, opt.invert, at);
+        } else {
+            const uint8_t *nl = (const uint8_t *)memchr(buf + at - 1, '\n', size - at + 1);
+
+            p->begin = nl ? nl + 1 - buf : size;
+        }
+        if (i && p->begin < parts[i - 1].begin)
+            p->begin = parts[i - 1].begin;
+        if (i)
+            parts[i - 1].end = p->begin;
+    }
+    parts[nthreads - 1].end = size;
+
+    for (unsigned i = 1; i < nthreads; i++)
+        if (pthread_create(&threads[i], NULL, part_run, &parts[i]))
+            errx(1, "pthread_create");
+    part_run(&parts[0]);
+    for (unsigned i = 1; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    t1 = now_s();
+
+    for (unsigned i = 0; i < nthreads; i++) {
+        struct part *p = &parts[i];
+
+        if (!quiet)
+            for (size_t k = 0; k < p->nframes; k++)
+                print_frame(&p->frames[k], line_base);
+        for (uint64_t k = 0; k < p->mismatches && k < MAX_REPORTED; k++)
+            if (mismatches + k < MAX_REPORTED)
+                fprintf(stderr, "%s:%llu: frame differs from the recorded one\n",
+                        argv[optind], (unsigned long long)(line_base + p->mismatch_line[k]));
+        busdec_stats_add(&st, &p->dec.stats);
+        captures += p->captures;
+        bad_lines += p->bad_lines;
+        mismatches += p->mismatches;
+        line_base += p->line;
+        free(p->frames);
+        free(p->runs);
+    }
+    fflush(stdout);
+
+    busdec_report(&st, stderr);
+    if (!opt.raw)
+        fprintf(stderr, "%llu captures, %llu malformed lines\n",
+                (unsigned long long)captures, (unsigned long long)bad_lines);
+    if (opt.check)
+        fprintf(stderr, "%llu captures differ from the recorded frame\n",
+                (unsigned long long)mismatches);
+    fprintf(stderr, "%lu threads, %.3f s, %.1f M samples/s, %.0f MB/s of input\n",
+            nthreads, t1 - t0, st.samples / (t1 - t0) / 1e6, size / (t1 - t0) / 1e6);
+    munmap((void *)buf, size);
+    return opt.check && mismatches;
+}
@@ -0,0 +1,164 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#include "userspace_utils.h"
+#include "userspace_canlog.h"
+
+/*
+    Print frames from a log recorded by ./test -L (userspace_canlog.h),
+    selected by time and ID range through the block and ID index.
+    Usage: ./canlog [-t from[,to]] [-i id[-id]] [-x] [-n count] [-s] file.clog
+*/
+
+static void usage(const char *progname)
+{
+    printf("Usage: %s [options] file.clog\n"
+           "  -t <from>[,<to>]  seconds since the start of the recording\n"
+           "  -i <id>[-<id>]    CAN ID or inclusive ID range\n"
+           "  -x                IDs given to -i are 29-bit extended IDs\n"
+           "  -n <count>        print at most count frames\n"
+           "  -s                print only the log summary and frames matched\n",
+           progname);
+}
+
+static u64 secs_to_ticks(const struct canlog_reader *r, double s)
+{
+    /* Frames already in the RX FIFO at start are before start_ts */
+    if (s <= 0)
+        return 0;
+    return r->hdr->start_ts + (u64)(s * r->hdr->ts_freq);
+}
+
+int main(int argc, char *argv[])
+{
+    struct canlog_reader r;
+    struct canlog_query q;
+    struct canlog_iter it;
+    struct canfd_frame cf;
+    double t_from = 0, t_to = -1;
+    unsigned long id_from = 0, id_to = CAN_EFF_MASK;
+    bool have_id = false, ext = false, summary = false;
+    unsigned long long max = ~0ull, n = 0;
+    bool fdf;
+    u64 ts;
+    char *e;
+    int c;
+
+    while ((c = getopt(argc, argv, "t:i:xn:sh")) != -1) {
+        switch (c) {
+        case 't':
+            t_from = strtod(optarg, &e);
+            if (*e == ',')
+                t_to = strtod(e + 1, &e);
+            if (*e != '\0' || t_from < 0 || (t_to >= 0 && t_to < t_from))
+                errx(1, "-t expects <from>[,<to>] seconds");
+            break;
+        case 'i':
+            id_from = id_to = strtoul(optarg, &e, 0);
+            if (*e == '-')
+                id_to = strtoul(e + 1, &e, 0);
+            if (*e != '\0' || id_to < id_from || id_to > CAN_EFF_MASK)
+                errx(1, "-i expects <id>[-<id>]");
+            have_id = true;
+            break;
+        case 'x':
+            ext = true;
+            break;
+        case 'n':
+            max = strtoull(optarg, &e, 0);
+            if (*e != '\0' || !max)
+                errx(1, "-n expects a non-zero number");
+            break;
+        case 's':
+            summary = true;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind + 1 != argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (canlog_open(&r, argv[optind]))
+        return 1;
+
+    memset(&q, 0, sizeof(q));
+    q.ts_from = secs_to_ticks(&r, t_from);
+    q.ts_to = t_to < 0 ? ~(u64)0 : secs_to_ticks(&r, t_to);
+    if (!have_id) {
+        q.id_from = 0;
+        q.id_to = CAN_EFF_FLAG | CAN_EFF_MASK;
+    } else if (ext) {
+        q.id_from = CAN_EFF_FLAG | id_from;
+        q.id_to = CAN_EFF_FLAG | id_to;
+    } else {
+        if (id_to > CAN_SFF_MASK)
+            errx(1, "-i: 11-bit IDs end at 0x7ff, use -x for extended IDs");
+        q.id_from = id_from;
+        q.id_to = id_to;
+    }
+
+    if (canlog_iter_init(&it, &r, &q))
+        errx(1, "out of memory");
+    while (n < max && canlog_iter_next(&it, &cf, &fdf, &ts)) {
+        n++;
+        if (summary)
+            continue;
+        printf("%llu: #%x [%u]%s", (unsigned long long)ts, cf.can_id, cf.len,
+               fdf ? (cf.flags & CANFD_BRS ? " FD BRS" : " FD") : "");
+        for (int i = 0; i < cf.len && !(cf.can_id & CAN_RTR_FLAG); ++i)
+            printf(" %02x", cf.data[i]);
+        printf("\n");
+    }
+
+    if (summary) {
+        printf("channel %u, block size %u, timestamp %u Hz\n",
+               r.hdr->channel, r.hdr->block_size, r.hdr->ts_freq);
+        printf("%llu blocks, %llu index runs%s, %zu bytes\n",
+               (unsigned long long)r.nblocks, (unsigned long long)r.nruns,
+               r.runs ? "" : " (no index)", r.size);
+        if (r.nblocks) {
+            const struct canlog_block_hdr *last = canlog_block(&r, r.nblocks - 1);
+
+            printf("time %.6f .. %.6f s\n",
+                   (double)(int64_t)(canlog_block(&r, 0)->first_ts - r.hdr->start_ts) / r.hdr->ts_freq,
+                   (double)(int64_t)(last->last_ts - r.hdr->start_ts) / r.hdr->ts_freq);
+        }
+        printf("%llu frames matched, %llu blocks read\n", n,
+               (unsigned long long)it.blocks_read);
+    }
+    canlog_iter_free(&it);
+    canlog_close_reader(&r);
+    return 0;
+}
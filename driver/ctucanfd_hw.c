@@ -30,6 +30,8 @@
 
 #ifdef __KERNEL__
 # include <linux/can/dev.h>
+# define CREATE_TRACE_POINTS
+# include "ctucanfd_trace.h"
 #else
 /* The hardware registers mapping and low level layer should build
  * in userspace to allow development and verification of CTU CAN IP
@@ -41,6 +43,9 @@
  * and QEMU emulation model consistency keeping.
  */
 # include "ctucanfd_linux_defs.h"
+/* Userspace traces in the priv wrapper instead, see userspace_trace.h */
+# define trace_ctucan_reg_read(base, reg, val) do { } while (0)
+# define trace_ctucan_reg_write(base, reg, val) do { } while (0)
 #endif
 
 #include "ctucanfd_frame.h"
@@ -49,25 +54,33 @@
 void ctucan_hw_write32(struct ctucan_hw_priv *priv,
 		       enum ctu_can_fd_can_registers reg, u32 val)
 {
+	trace_ctucan_reg_write(priv->mem_base, reg, val);
 	iowrite32(val, priv->mem_base + reg);
 }
 
 void ctucan_hw_write32_be(struct ctucan_hw_priv *priv,
 			  enum ctu_can_fd_can_registers reg, u32 val)
 {
+	trace_ctucan_reg_write(priv->mem_base, reg, val);
 	iowrite32be(val, priv->mem_base + reg);
 }
 
 u32 ctucan_hw_read32(struct ctucan_hw_priv *priv,
 		     enum ctu_can_fd_can_registers reg)
 {
-	return ioread32(priv->mem_base + reg);
+	u32 val = ioread32(priv->mem_base + reg);
+
+	trace_ctucan_reg_read(priv->mem_base, reg, val);
+	return val;
 }
 
 u32 ctucan_hw_read32_be(struct ctucan_hw_priv *priv,
 			enum ctu_can_fd_can_registers reg)
 {
-	return ioread32be(priv->mem_base + reg);
+	u32 val = ioread32be(priv->mem_base + reg);
+
+	trace_ctucan_reg_read(priv->mem_base, reg, val);
+	return val;
 }
 
 static void ctucan_hw_write_txt_buf(struct ctucan_hw_priv *priv,
@@ -555,6 +568,10 @@ void ctucan_hw_read_rx_frame_ffw(struct ctucan_hw_priv *priv,
 	/* BRS, ESI, RTR Flags */
 	cf->flags = 0;
 	if (ffw.s.fdf == FD_CAN) {
+#ifndef __KERNEL__
+		/* Userspace consumers (pcapng, logs) tell short FD frames by it */
+		cf->flags |= CANFD_FDF;
+#endif
 		if (ffw.s.brs == BR_SHIFT)
 			cf->flags |= CANFD_BRS;
 		if (ffw.s.esi_rsv == ESI_ERR_PASIVE)
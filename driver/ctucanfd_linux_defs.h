@@ -451,6 +451,7 @@ struct can_frame {
  */
 #define CANFD_BRS 0x01 /* bit rate switch (second bitrate for payload data) */
 #define CANFD_ESI 0x02 /* error state indicator of the transmitting node */
+#define CANFD_FDF 0x04 /* mark CAN FD for dual use of struct canfd_frame */
 
 /**
  * struct canfd_frame - CAN flexible data rate frame structure
@@ -626,8 +627,8 @@ int can_get_bittiming(struct net_device *dev, struct can_bittiming *bt,
 	__builtin_types_compatible_p(typeof(x), unsigned type),		\
 	({ signed type __x = (x); __x < 0 ? -__x : __x; }), other)
 
-#define netdev_warn(dev, format, ...) printf("%s" format, "netdev_warn: ", ##__VA_ARGS__);
-#define netdev_err(dev, format, ...) printf("%s" format, "netdev_err: ", ##__VA_ARGS__);
+#define netdev_warn(dev, format, ...) fprintf(stderr, "%s" format, "netdev_warn: ", ##__VA_ARGS__);
+#define netdev_err(dev, format, ...) fprintf(stderr, "%s" format, "netdev_err: ", ##__VA_ARGS__);
 
 #ifndef likely
 #define likely
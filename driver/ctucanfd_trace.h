@@ -0,0 +1,73 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+/* Register access tracepoints, see also userspace_trace.h and trace_replay */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ctucanfd
+
+#if !defined(__CTUCANFD_TRACE_H__) || defined(TRACE_HEADER_MULTI_READ)
+#define __CTUCANFD_TRACE_H__
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(ctucan_reg,
+	TP_PROTO(const void __iomem *base, u32 reg, u32 val),
+	TP_ARGS(base, reg, val),
+	TP_STRUCT__entry(
+		__field(const void *, base)
+		__field(u32, reg)
+		__field(u32, val)
+	),
+	TP_fast_assign(
+		__entry->base = (const void __force *)base;
+		__entry->reg = reg;
+		__entry->val = val;
+	),
+	TP_printk("base=%p reg=0x%03x val=0x%08x",
+		  __entry->base, __entry->reg, __entry->val)
+);
+
+DEFINE_EVENT(ctucan_reg, ctucan_reg_read,
+	TP_PROTO(const void __iomem *base, u32 reg, u32 val),
+	TP_ARGS(base, reg, val)
+);
+
+DEFINE_EVENT(ctucan_reg, ctucan_reg_write,
+	TP_PROTO(const void __iomem *base, u32 reg, u32 val),
+	TP_ARGS(base, reg, val)
+);
+
+#endif /* __CTUCANFD_TRACE_H__ */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ctucanfd_trace
+#include <trace/define_trace.h>
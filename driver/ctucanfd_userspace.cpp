@@ -28,8 +28,23 @@
  ******************************************************************************/
 
 #include "userspace_utils.h"
+#include "userspace_rxpoll.h"
+#include "userspace_rxring.h"
+#include "userspace_shm.h"
+#include "userspace_tx.h"
+#include "userspace_cyclic.h"
+#include "userspace_trace.h"
+#include "userspace_bench.h"
+#include "userspace_e2e.h"
+#include "userspace_pcapng.h"
+#include "userspace_canlog.h"
+#include "userspace_replay.h"
+#include "userspace_busstat.h"
+#include "userspace_ssp.h"
+#include "userspace_autobaud.h"
 
 #include <iostream>
+#include <signal.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <dirent.h>
@@ -187,6 +202,151 @@ timespec_sub (struct timespec *diff, const struct timespec *left,
     }
 }
 
+static struct rxpoll rxpoll;
+static struct rxpoll capture_poll;     /* Second core of -x */
+static struct rxring rxring;
+static volatile sig_atomic_t rx_stop_requested;
+static struct shmring shmring;
+static struct tx_sched tx_sched;
+static struct cyclic_sched cyclic;
+static struct replay replay;
+
+static void tx_sched_print_done(void *arg, const struct tx_sched_frame *f,
+                                bool ok, u64 ts)
+{
+    (void)arg;
+    if (!ok)
+        printf("%llu: TX #%x failed\n", ts, f->cf.can_id);
+}
+
+static void rxpoll_sigint(int sig)
+{
+    (void)sig;
+    rx_stop_requested = 1;
+    rxpoll.stop = true;
+    capture_poll.stop = true;
+    cyclic.stop = true;
+    replay.stop = true;
+}
+
+static void rxpoll_print_frame(void *arg, const struct canfd_frame *cf, u64 ts)
+{
+    (void)arg;
+    printf("%llu: #%x [%u]", ts, cf->can_id, cf->len);
+    for (int i=0; i<cf->len; ++i)
+        printf(" %02x", cf->data[i]);
+    printf("\n");
+}
+
+struct capture_chan {
+    struct pcapng_writer *w;
+    unsigned iface;
+};
+
+static void pcapng_capture_frame(void *arg, const struct canfd_frame *cf, u64 ts)
+{
+    struct capture_chan *c = (struct capture_chan *)arg;
+
+    pcapng_write_frame(c->w, c->iface, cf, ts);
+}
+
+static struct capture_chan capture_chan[2];
+
+static void canlog_capture_frame(void *arg, const struct canfd_frame *cf, u64 ts)
+{
+    struct canlog_writer *w = (struct canlog_writer *)arg;
+
+    /* Stop recording on the first failed write, the rest would be dropped */
+    if (canlog_write(w, cf, cf->flags & CANFD_FDF, ts) < 0) {
+        rx_stop_requested = 1;
+        rxpoll.stop = true;
+    }
+}
+
+static void *capture_thread(void *arg)
+{
+    rxpoll_run(&capture_poll, pcapng_capture_frame, arg);
+    return NULL;
+}
+
+static void busstat_frame(void *arg, const struct canfd_frame *cf, u64 ts)
+{
+    busstat_add((struct busstat *)arg, cf, cf->flags & CANFD_FDF, ts);
+}
+
+static void busstat_print_snapshot(void *arg, const struct busstat_snapshot *s)
+{
+    if (arg)
+        busstat_print_json(stdout, s);
+    else
+        busstat_print(stdout, s, 20);
+}
+
+static void shmring_publish_frame(void *arg, const struct canfd_frame *cf, u64 ts)
+{
+    shmring_publish((struct shmring *)arg, cf, ts);
+}
+
+/* Reader side of -D: print frames published by another process */
+static int shmring_attach_and_print(const char *name)
+{
+    struct canfd_frame cf[64];
+    u64 ts[64];
+
+    if (shmring_attach(&shmring, name))
+        return 1;
+    signal(SIGINT, rxpoll_sigint);
+    while (!rx_stop_requested) {
+        unsigned n = shmring_read(&shmring, cf, ts, 64);
+
+        for (unsigned i = 0; i < n; i++)
+            rxpoll_print_frame(NULL, &cf[i], ts[i]);
+        if (!n)
+            usleep(1000);
+    }
+    shmring_report(&shmring, stderr);
+    shmring_close(&shmring);
+    return 0;
+}
+
+/* Reset the core, program bit timing and enable it */
+static void core_setup(struct ctucan_hw_priv *priv, struct can_bittiming *nom,
+                       struct can_bittiming *data, bool loopback)
+{
+    //printf("NOT RESETTING!\n");
+    ctucan_hw_reset(priv);
+
+    {
+        union ctu_can_fd_mode_settings mode;
+        mode.u32 = priv->read_reg(priv, CTU_CAN_FD_MODE);
+
+        if (mode.s.ena) {
+            printf("Core is enabled but should be disabled!\n");
+        }
+    }
+
+    //priv->write_reg(priv, CTU_CAN_FD_INT_MASK_CLR, 0xffff);
+    //priv->write_reg(priv, CTU_CAN_FD_INT_ENA_SET, 0xffff);
+    ctucan_hw_set_nom_bittiming(priv, nom);
+    ctucan_hw_set_data_bittiming(priv, data);
+    //ctucan_hw_rel_rx_buf(priv);
+    //ctucan_hw_set_ret_limit(priv, true, 1);
+    //ctucan_hw_set_ret_limit(priv, false, 0);
+    //ctucan_hw_abort_tx(priv);
+    //ctucan_hw_txt_set_abort(priv, CTU_CAN_FD_TXT_BUFFER_1);
+    //ctucan_hw_txt_set_empty(priv, CTU_CAN_FD_TXT_BUFFER_1);
+
+    if (loopback) {
+        struct can_ctrlmode mode = {0, 0};
+	mode.mask  = CAN_CTRLMODE_LOOPBACK | CAN_CTRLMODE_PRESUME_ACK;
+	mode.flags = CAN_CTRLMODE_LOOPBACK | CAN_CTRLMODE_PRESUME_ACK;
+        ctucan_hw_set_mode(priv, &mode);
+    }
+
+    ctucan_hw_enable(priv, true);
+    usleep(10000);
+}
+
 int main(int argc, char *argv[])
 {
     uintptr_t addr_base = 0;
@@ -198,16 +358,48 @@ int main(int argc, char *argv[])
     int dbitrate = 0;
     int tx_can_id = 0x1ff;
     bool do_periodic_transmit = false;
+    unsigned tx_count = 1;
     bool transmit_fdf = false;
     bool loopback_mode = false;
     bool test_read_speed = false;
+    bool do_rx_poll = false;
+    unsigned rx_ring_size = 0;
+    const char *shm_publish = NULL;
+    const char *shm_attach = NULL;
+    const char *cyclic_file = NULL;
+    bool cyclic_echo = false;
+    bool do_e2e = false;
+    const char *pcap_file = NULL;
+    bool capture_both = false;
+    struct pcapng_config pcap_cfg;
+    const char *canlog_file = NULL;
+    const char *replay_file = NULL;
+    struct replay_config replay_cfg;
+    struct busstat_config busstat_cfg;
+    bool do_busstat = false;
+    bool busstat_json = false;
+    struct ssp_config ssp_cfg;
+    unsigned ssp_frames = 0;
+    bool do_ssp = false;
+    struct autobaud_config autobaud_cfg;
+    bool do_autobaud = false;
+    struct canlog_query replay_q = {0, ~(u64)0, 0, CAN_EFF_FLAG | CAN_EFF_MASK};
+    struct rxpoll_config rxpoll_cfg;
+    struct e2e_config e2e_cfg;
     //bool do_showhelp = false;
     static uintptr_t addrs[] = {0x43C30000, 0x43C70000};
 
     int c;
     char *e;
     const char *progname = argv[0];
-    while ((c = getopt(argc, argv, "i:a:g:b:B:I:fltThpr")) != -1) {
+    rxpoll_config_defaults(&rxpoll_cfg);
+    e2e_config_defaults(&e2e_cfg);
+    pcapng_config_defaults(&pcap_cfg);
+    replay_config_defaults(&replay_cfg);
+    busstat_config_defaults(&busstat_cfg);
+    ssp_config_defaults(&ssp_cfg);
+    autobaud_config_defaults(&autobaud_cfg);
+    while ((c = getopt(argc, argv, "i:a:g:b:B:I:N:fltThprRC:P:Q:D:A:S:eE:M:d:w:W:xL:Y:s:F:vu:jc:G:")) != -1) {
         switch (c) {
             case 'i':
                 ifc = strtoul(optarg, &e, 0);
@@ -245,11 +437,111 @@ int main(int argc, char *argv[])
                     err(1, "-I expects a number");
             break;
 
+            case 'N':
+                tx_count = strtoul(optarg, &e, 0);
+                if (*e != '\0' || !tx_count)
+                    errx(1, "-N expects a non-zero number");
+            break;
+
             case 'l': loopback_mode = true; break;
             case 't': do_transmit = true; break;
             case 'T': do_periodic_transmit = true; break;
             case 'f': transmit_fdf = true; break;
             case 'r': test_read_speed  = true; break;
+            case 'R': do_rx_poll = true; break;
+            case 'C':
+                rxpoll_cfg.cpu = strtol(optarg, &e, 0);
+                if (*e != '\0')
+                    errx(1, "-C expects a number");
+            break;
+            case 'Q':
+                rx_ring_size = strtoul(optarg, &e, 0);
+                if (*e != '\0' || !rx_ring_size)
+                    errx(1, "-Q expects a non-zero number");
+            break;
+            case 'D': shm_publish = optarg; break;
+            case 'A': shm_attach = optarg; break;
+            case 'S': cyclic_file = optarg; break;
+            case 'e': cyclic_echo = true; break;
+            case 'E':
+                do_e2e = true;
+                e2e_cfg.load_pct = strtoul(optarg, &e, 0);
+                if (*e != '\0' || !e2e_cfg.load_pct)
+                    errx(1, "-E expects a non-zero load in percent");
+            break;
+            case 'w': pcap_file = optarg; break;
+            case 'W':
+                if (pcapng_rotate_parse(&pcap_cfg, optarg))
+                    exit(1);
+            break;
+            case 'x': capture_both = true; break;
+            case 'L': canlog_file = optarg; break;
+            case 'Y': replay_file = optarg; break;
+            case 's':
+                replay_cfg.speed = strtod(optarg, &e);
+                if (*e != '\0' || !(replay_cfg.speed > 0))
+                    errx(1, "-s expects a positive speed factor");
+            break;
+            case 'F': {
+                unsigned long lo, hi;
+
+                lo = hi = strtoul(optarg, &e, 0);
+                if (*e == '-')
+                    hi = strtoul(e + 1, &e, 0);
+                replay_q.id_from = lo;
+                replay_q.id_to = hi;
+                if (*e == 'x') {
+                    replay_q.id_from |= CAN_EFF_FLAG;
+                    replay_q.id_to |= CAN_EFF_FLAG;
+                    e++;
+                } else if (hi > CAN_SFF_MASK) {
+                    e = optarg;
+                }
+                if (*e != '\0' || hi < lo || hi > CAN_EFF_MASK)
+                    errx(1, "-F expects <id>[-<id>][x]");
+            }
+            break;
+            case 'v': replay_cfg.frames = stdout; break;
+            case 'u':
+                do_busstat = true;
+                busstat_cfg.window_ms = strtoul(optarg, &e, 0);
+                if (!strcmp(e, ",worst")) {
+                    busstat_cfg.stuffing = BUSSTAT_STUFF_WORST;
+                    e += strlen(e);
+                }
+                if (*e != '\0' || !busstat_cfg.window_ms)
+                    errx(1, "-u expects <ms>[,worst]");
+                if (busstat_cfg.slot_ms > busstat_cfg.window_ms)
+                    busstat_cfg.slot_ms = busstat_cfg.window_ms;
+            break;
+            case 'j': busstat_json = true; break;
+            case 'c':
+                do_ssp = true;
+                ssp_cfg.burst = strtoul(optarg, &e, 0);
+                if (*e == ',')
+                    ssp_frames = strtoul(e + 1, &e, 0);
+                if (*e != '\0' || !ssp_cfg.burst)
+                    errx(1, "-c expects <burst>[,frames]");
+            break;
+            case 'G':
+                do_autobaud = true;
+                autobaud_cfg.timeout_ms = strtoul(optarg, &e, 0);
+                if (*e != '\0' || !autobaud_cfg.timeout_ms)
+                    errx(1, "-G expects a timeout in ms");
+            break;
+            case 'M':
+                if (e2e_mix_parse(&e2e_cfg, optarg))
+                    exit(1);
+            break;
+            case 'd':
+                e2e_cfg.duration_ms = strtod(optarg, &e) * 1000;
+                if (*e != '\0' || !e2e_cfg.duration_ms)
+                    errx(1, "-d expects a duration in seconds");
+            break;
+            case 'P':
+                if (rxpoll_config_parse(&rxpoll_cfg, optarg))
+                    errx(1, "-P expects spin,pause,sleep_min_us[,sleep_max_us]");
+            break;
             case 'p':
                 addrs[0] = pci_find_bar(0x1172, 0xcafd, 0, 1);
                 if (!addrs[0])
@@ -259,14 +551,54 @@ int main(int argc, char *argv[])
                 addrs[1] = addrs[0] + 0x4000;
             break;
             case 'h':
-                printf("Usage: %s [-i ifc] [-a address] [-l] [-t] [-T]\n\n"
-                       "  -t: Transmit\n",
-                       progname
+                printf("Usage: %s [-i ifc] [-a address] [-l] [-t [-N count]] [-T] [-r] [-R [-C cpu] [-P spin,pause,sleep_us] [-Q ring_size]]\n"
+                       "       %s -D shm_name [-Q ring_size]\n"
+                       "       %s -S cyclic_file [-e] [-f] [-C cpu]\n"
+                       "       %s -A shm_name\n"
+                       "       %s -E load_pct [-M mix] [-d seconds] [-C cpu]\n"
+                       "       %s -w file.pcapng [-W MiB[,seconds]] [-x] [-C cpu]\n"
+                       "       %s -L file.clog [-C cpu]\n"
+                       "       %s -Y file.clog [-s speed] [-F id[-id][x]] [-e] [-v] [-C cpu]\n"
+                       "       %s -u ms[,worst] [-j] [-C cpu]\n"
+                       "       %s -c burst[,frames] [-B dbitrate]\n"
+                       "       %s -G timeout_ms [-R|-w file.pcapng|-L file.clog|-u ms]\n\n"
+                       "  -t: Transmit\n"
+                       "  -N: Number of frames to transmit back-to-back with -t\n"
+                       "  -r: MMIO micro-benchmarks of this core, JSON to stdout (./bench compares mappings)\n"
+                       "  -R: Busy-poll receive, print statistics on SIGINT\n"
+                       "  -C: Pin busy-poll receiver to CPU\n"
+                       "  -P: Busy-poll backoff: spins, pauses, sleep [us]\n"
+                       "  -Q: Poll from a separate thread into a frame ring of given size\n"
+                       "  -D: Publish received frames to shared memory for other processes\n"
+                       "  -A: Attach to frames published by -D and print them\n"
+                       "  -S: Send cyclic messages, lines \"<id> <period_ms> [<phase_ms>|auto [<hex data>]]\"\n"
+                       "  -e: Measure cyclic jitter or replay deviation on loopback RX timestamps\n"
+                       "  -E: End-to-end benchmark, ifc transmits at load_pct %% of the bus, the other ifc receives\n"
+                       "  -M: Frame mix for -E, \"<len>[f][b][x][:<weight>],...\" (f FD, b BRS, x 29-bit ID)\n"
+                       "  -d: Duration of -E in seconds (default 10)\n"
+                       "  -w: Capture received frames to pcapng (Wireshark) until SIGINT\n"
+                       "  -W: Start a new capture file after MiB and/or seconds\n"
+                       "  -x: Capture both ifcs into one file\n"
+                       "  -L: Record received frames to a compact indexed log until SIGINT (./canlog reads it)\n"
+                       "  -Y: Replay a log recorded by -L with its original timing\n"
+                       "  -s: Replay speed factor (default 1)\n"
+                       "  -F: Replay only this CAN ID or ID range, x for 29-bit IDs\n"
+                       "  -v: Print \"<seq> <target> <actual> <deviation_ns> <id>\" for every replayed frame\n"
+                       "  -u: Bus load and per-ID period/jitter of received frames every ms (worst case stuffing)\n"
+                       "  -j: Print -u snapshots as JSON lines\n"
+                       "  -c: Calibrate the secondary sample point from TRV_DELAY over burst FD frames (TXT buffer 1),\n"
+                       "      then send <frames> more with online retuning and exit; without <frames> continue normally\n"
+                       "  -G: Detect nominal and data bitrate in listen-only mode, then continue listen-only with them\n",
+                       progname, progname, progname, progname, progname, progname, progname, progname, progname,
+                       progname, progname
                 );
                 return 0;
         }
     }
 
+    if (shm_attach)
+        return shmring_attach_and_print(shm_attach);
+
     if (ifc >= 2) {
         std::cerr << "Err: ifc number must be 0 or 1.\n";
         exit(1);
@@ -277,6 +609,16 @@ int main(int argc, char *argv[])
     struct ctucan_hw_priv *priv = ctucanfd_init(addr_base);
     int res;
 
+    if (test_read_speed) {
+        struct bench_config bcfg;
+
+        bench_config_defaults(&bcfg);
+        bench_json_begin(stdout);
+        bench_run(priv, "mem", &bcfg, stdout);
+        bench_json_end(stdout);
+        return 0;
+    }
+
     union ctu_can_fd_device_id_version reg;
     reg.u32 = priv->read_reg(priv, CTU_CAN_FD_DEVICE_ID);
 
@@ -291,60 +633,22 @@ int main(int argc, char *argv[])
     //struct can_ctrlmode ctrlmode = {CAN_CTRLMODE_FD, CAN_CTRLMODE_FD};
     //ctucan_hw_set_mode(priv, &ctrlmode);
 
-    if (test_read_speed) {
-        struct timespec tic, tac, diff;
-	int i;
-	u32 dummy;
-	(void)dummy;
-        clock_gettime(CLOCK_MONOTONIC, &tic);
-	for (i = 0; i < 1000 * 1000; i++) {
-		dummy = ctucan_hw_read32(priv, CTU_CAN_FD_RX_DATA);
-	}
-        clock_gettime(CLOCK_MONOTONIC, &tac);
-
-	timespec_sub(&diff, &tac, &tic);
-	printf("%d reads takes %ld.%09ld s\n",
-	       i, (long)diff.tv_sec, diff.tv_nsec);
-
-	dummy = 0;
-        clock_gettime(CLOCK_MONOTONIC, &tic);
-	for (i = 0; i < 1000 * 1000; i++) {
-		ctucan_hw_write32(priv, CTU_CAN_FD_FILTER_C_VAL, dummy);
-	}
-        clock_gettime(CLOCK_MONOTONIC, &tac);
-
-	timespec_sub(&diff, &tac, &tic);
-	printf("%d writes takes %ld.%09ld s\n",
-	       i, (long)diff.tv_sec, diff.tv_nsec);
-
-        return 0;
-    }
 
 
-    //printf("NOT RESETTING!\n");
-    ctucan_hw_reset(priv);
-
-    {
-        union ctu_can_fd_mode_settings mode;
-        mode.u32 = priv->read_reg(priv, CTU_CAN_FD_MODE);
-
-        if (mode.s.ena) {
-            printf("Core is enabled but should be disabled!\n");
-        }
-    }
-
     struct net_device nd;
     nd.can.clock.freq = 100000000;
 
+    /* Ranked solver, cached: setting the same bitrates again costs a lookup */
+    static struct bittiming_cache bt_cache;
+    bittiming_cache_init(&bt_cache);
+
     struct can_bittiming nom_timing = {
         .bitrate = bitrate,
     };
-    res = can_get_bittiming(&nd, &nom_timing,
-                      &ctu_can_fd_bit_timing_max,
-                      NULL,
-                      0);
+    res = bittiming_get(&bt_cache, &ctu_can_fd_bit_timing_max, nd.can.clock.freq,
+                        &nom_timing);
     if (res)
-        err(res, "can_get_bittiming");
+        errx(1, "no nominal bit timing for %d bit/s", bitrate);
     printf("sample_point .%03d, tq %d, prop %d, seg1 %d, seg2 %d, sjw %d, brp %d, bitrate %d\n",
            nom_timing.sample_point,
            nom_timing.tq,
@@ -362,12 +666,10 @@ int main(int argc, char *argv[])
     struct can_bittiming data_timing = {
         .bitrate = dbitrate,
     };
-    res = can_get_bittiming(&nd, &data_timing,
-                      &ctu_can_fd_bit_timing_data_max,
-                      NULL,
-                      0);
+    res = bittiming_get(&bt_cache, &ctu_can_fd_bit_timing_data_max, nd.can.clock.freq,
+                        &data_timing);
     if (res)
-        err(res, "can_get_bittiming data");
+        errx(1, "no data bit timing for %d bit/s", dbitrate);
     printf("data sample_point .%03d, tq %d, prop %d, seg1 %d, seg2 %d, sjw %d, brp %d, bitrate %d\n",
            data_timing.sample_point,
            data_timing.tq,
@@ -379,31 +681,102 @@ int main(int argc, char *argv[])
            data_timing.bitrate
     );
 
-    //priv->write_reg(priv, CTU_CAN_FD_INT_MASK_CLR, 0xffff);
-    //priv->write_reg(priv, CTU_CAN_FD_INT_ENA_SET, 0xffff);
-    ctucan_hw_set_nom_bittiming(priv, &nom_timing);
-    ctucan_hw_set_data_bittiming(priv, &data_timing);
-    //ctucan_hw_rel_rx_buf(priv);
-    //ctucan_hw_set_ret_limit(priv, true, 1);
-    //ctucan_hw_set_ret_limit(priv, false, 0);
-    //ctucan_hw_abort_tx(priv);
-    //ctucan_hw_txt_set_abort(priv, CTU_CAN_FD_TXT_BUFFER_1);
-    //ctucan_hw_txt_set_empty(priv, CTU_CAN_FD_TXT_BUFFER_1);
 
-    if (loopback_mode) {
-        struct can_ctrlmode mode = {0, 0};
-	mode.mask  = CAN_CTRLMODE_LOOPBACK | CAN_CTRLMODE_PRESUME_ACK;
-	mode.flags = CAN_CTRLMODE_LOOPBACK | CAN_CTRLMODE_PRESUME_ACK;
-        ctucan_hw_set_mode(priv, &mode);
+    core_setup(priv, &nom_timing, &data_timing, loopback_mode);
+
+    printf("MODE=0x%02x\n", priv->read_reg(priv, CTU_CAN_FD_MODE));
+
+    if (do_autobaud) {
+        static struct autobaud ab;
+        int found;
+
+        autobaud_cfg.clk_freq = nd.can.clock.freq;
+        if (autobaud_init(&ab, priv, &autobaud_cfg))
+            return 1;
+        found = autobaud_run(&ab);
+        autobaud_report(&ab, stdout);
+        if (found)
+            return 1;
+        nom_timing = *autobaud_nominal(&ab);
+        data_timing = *autobaud_data(&ab);
     }
 
-    ctucan_hw_enable(priv, true);
-    usleep(10000);
+    if (do_ssp) {
+        static struct ssp_calib ssp;
 
-    printf("MODE=0x%02x\n", priv->read_reg(priv, CTU_CAN_FD_MODE));
+        ssp_cfg.clk_freq = nd.can.clock.freq;
+        if (ssp_init(&ssp, priv, &ssp_cfg, &data_timing) || ssp_calibrate(&ssp))
+            return 1;
+        if (ssp_frames) {
+            ssp_exercise(&ssp, ssp_frames);
+            ssp_report(&ssp, stdout);
+            return 0;
+        }
+        ssp_report(&ssp, stdout);
+    }
+
+    if (do_e2e) {
+        static struct e2e_result e2e_res;
+        struct ctucan_hw_priv *rx_priv = ctucanfd_init(addrs[ifc ^ 1]);
+
+        if (!ctucan_hw_check_access(rx_priv))
+            errx(1, "error: ctucan_hw_check_access on RX ifc %u", ifc ^ 1);
+        core_setup(rx_priv, &nom_timing, &data_timing, false);
+        e2e_cfg.bitrate = nom_timing.bitrate;
+        e2e_cfg.dbitrate = data_timing.bitrate;
+        e2e_cfg.ts_freq = rxpoll_cfg.ts_freq;
+        e2e_cfg.rx_cpu = rxpoll_cfg.cpu;
+        if (e2e_run(priv, rx_priv, &e2e_cfg, &e2e_res))
+            return 1;
+        e2e_report(&e2e_cfg, &e2e_res, stdout);
+        return 0;
+    }
+
+    if (cyclic_file) {
+        struct cyclic_config cfg;
+
+        cyclic_config_defaults(&cfg);
+        cfg.echo_ts = cyclic_echo;
+        cfg.cpu = rxpoll_cfg.cpu;
+        cfg.ts_freq = rxpoll_cfg.ts_freq;
+        if (cyclic_init(&cyclic, priv, &cfg, rxpoll_print_frame, NULL))
+            return 1;
+        if (cyclic_load_file(&cyclic, cyclic_file, transmit_fdf) < 0)
+            return 1;
+        signal(SIGINT, rxpoll_sigint);
+        cyclic_run(&cyclic);
+        cyclic_report(&cyclic, stderr);
+        cyclic_free(&cyclic);
+        return 0;
+    }
+
+    if (replay_file) {
+        struct canlog_reader log;
+        struct canlog_iter it;
+
+        if (canlog_open(&log, replay_file))
+            return 1;
+        if (canlog_iter_init(&it, &log, &replay_q))
+            errx(1, "out of memory");
+        replay_cfg.echo_ts = cyclic_echo;
+        replay_cfg.cpu = rxpoll_cfg.cpu;
+        replay_cfg.ts_freq = rxpoll_cfg.ts_freq;
+        replay_init(&replay, priv, &replay_cfg, &it, log.hdr->ts_freq);
+        signal(SIGINT, rxpoll_sigint);
+        replay_run(&replay);
+        replay_report(&replay, stderr);
+        canlog_iter_free(&it);
+        canlog_close_reader(&log);
+        return 0;
+    }
+
+    if (tx_sched_init(&tx_sched, priv, 1024, tx_sched_print_done, NULL))
+        return 1;
 
     if (do_transmit) {
         struct canfd_frame txf;
+        struct timespec t0, t1, dt;
+        memset(&txf, 0, sizeof(txf));
         txf.can_id = tx_can_id;
         txf.flags = 0;
         //u8 d[] = {0xde, 0xad, 0xbe, 0xef};
@@ -411,17 +784,170 @@ int main(int argc, char *argv[])
         memcpy(txf.data, d, sizeof(d));
         txf.len = sizeof(d);
 
-        res = ctucan_hw_insert_frame(priv, &txf, 0, CTU_CAN_FD_TXT_BUFFER_1, false);
-        if (!res)
-            printf("TX failed\n");
-        ctucan_hw_txt_set_rdy(priv, CTU_CAN_FD_TXT_BUFFER_1);
+        ctucan_trace_mark(priv, "tx burst");
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (unsigned i = 0; i < tx_count; i++) {
+            if (tx_count > 1) {
+                txf.data[4] = i >> 24;
+                txf.data[5] = i >> 16;
+                txf.data[6] = i >> 8;
+                txf.data[7] = i;
+                txf.len = 8;
+            }
+            /* Keep the TXT buffers busy while the queue is full */
+            while (tx_sched.depth >= tx_sched.max_queue)
+                tx_sched_poll(&tx_sched);
+            tx_sched_queue(&tx_sched, &txf, false, i);
+            tx_sched_poll(&tx_sched);
+        }
+        do {
+            tx_sched_poll(&tx_sched);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            timespec_sub(&dt, &t1, &t0);
+        } while (tx_sched_pending(&tx_sched) && dt.tv_sec < 1 + tx_count / 1000);
+        if (tx_sched_pending(&tx_sched))
+            printf("TX failed, %zu frames not sent\n", tx_sched_pending(&tx_sched));
+        if (tx_count > 1)
+            tx_sched_report(&tx_sched, stderr);
+        return 0;
+    }
+
+    if (pcap_file) {
+        static struct pcapng_writer pcap;
+        struct ctucan_hw_priv *cap_priv[2] = {priv, NULL};
+        unsigned ncap = capture_both ? 2 : 1;
+        struct rxpoll_config cfg2 = rxpoll_cfg;
+        pthread_t thread;
+
+        if (capture_both) {
+            cap_priv[1] = ctucanfd_init(addrs[ifc ^ 1]);
+            if (!ctucan_hw_check_access(cap_priv[1]))
+                errx(1, "error: ctucan_hw_check_access on ifc %u", ifc ^ 1);
+            core_setup(cap_priv[1], &nom_timing, &data_timing, false);
+        }
+        if (pcapng_open(&pcap, pcap_file, &pcap_cfg))
+            return 1;
+        for (unsigned i = 0; i < ncap; i++) {
+            char name[32];
+            int iface;
+
+            snprintf(name, sizeof(name), "ctucanfd%u", i ? ifc ^ 1 : ifc);
+            iface = pcapng_add_interface(&pcap, name, rxpoll_cfg.ts_freq,
+                                         ctucan_hw_read_timestamp(cap_priv[i]));
+            if (iface < 0)
+                return 1;
+            capture_chan[i].w = &pcap;
+            capture_chan[i].iface = iface;
+        }
+
+        signal(SIGINT, rxpoll_sigint);
+        rxpoll_init(&rxpoll, priv, &rxpoll_cfg);
+        if (capture_both) {
+            if (cfg2.cpu >= 0)
+                cfg2.cpu++;
+            rxpoll_init(&capture_poll, cap_priv[1], &cfg2);
+            if (pthread_create(&thread, NULL, capture_thread, &capture_chan[1]))
+                errx(1, "cannot start second capture thread");
+        }
+        rxpoll_run(&rxpoll, pcapng_capture_frame, &capture_chan[0]);
+        if (capture_both)
+            pthread_join(thread, NULL);
+        rxpoll_report(&rxpoll, stderr);
+        if (capture_both)
+            rxpoll_report(&capture_poll, stderr);
+        res = pcapng_close(&pcap);
+        pcapng_report(&pcap, stderr);
+        return res ? 1 : 0;
+    }
+
+    if (canlog_file) {
+        static struct canlog_writer clog;
+        struct canlog_config clog_cfg;
+
+        canlog_config_defaults(&clog_cfg);
+        clog_cfg.ts_freq = rxpoll_cfg.ts_freq;
+        clog_cfg.channel = ifc;
+        if (canlog_create(&clog, canlog_file, &clog_cfg, ctucan_hw_read_timestamp(priv)))
+            return 1;
+        signal(SIGINT, rxpoll_sigint);
+        rxpoll_init(&rxpoll, priv, &rxpoll_cfg);
+        rxpoll_run(&rxpoll, canlog_capture_frame, &clog);
+        rxpoll_report(&rxpoll, stderr);
+        res = canlog_close(&clog) || clog.error;
+        canlog_writer_report(&clog, stderr);
+        return res ? 1 : 0;
+    }
+
+    if (do_busstat) {
+        static struct busstat bstat;
+
+        busstat_cfg.ts_freq = rxpoll_cfg.ts_freq;
+        if (busstat_init(&bstat, priv, &busstat_cfg, busstat_print_snapshot,
+                         busstat_json ? &bstat : NULL))
+            return 1;
+        signal(SIGINT, rxpoll_sigint);
+        rxpoll_init(&rxpoll, priv, &rxpoll_cfg);
+        if (rxpoll_cfg.cpu >= 0 || rxpoll_cfg.rt_prio > 0)
+            rxpoll_pin_thread(rxpoll_cfg.cpu, rxpoll_cfg.rt_prio);
+        while (!rx_stop_requested) {
+            /* Idle bus still closes windows */
+            if (!rxpoll_poll(&rxpoll, busstat_frame, &bstat))
+                busstat_idle(&bstat, ctucan_hw_read_timestamp(priv));
+        }
+        rxpoll_report(&rxpoll, stderr);
+        busstat_free(&bstat);
+        return 0;
+    }
+
+    if (shm_publish) {
+        if (shmring_create(&shmring, shm_publish,
+                           rx_ring_size ? rx_ring_size : 4096))
+            return 1;
+        rxpoll_init(&rxpoll, priv, &rxpoll_cfg);
+        signal(SIGINT, rxpoll_sigint);
+        rxpoll_run(&rxpoll, shmring_publish_frame, &shmring);
+        rxpoll_report(&rxpoll, stderr);
+        shmring_report(&shmring, stderr);
+        shmring_close(&shmring);
         return 0;
     }
 
-    while (1) {
+    if (do_rx_poll && rx_ring_size) {
+        struct rxring_frame batch[64];
+
+        signal(SIGINT, rxpoll_sigint);
+        if (rxring_start(&rxring, priv, &rxpoll_cfg, rx_ring_size))
+            errx(1, "rxring_start");
+        while (!rx_stop_requested) {
+            unsigned n = rxring_read(&rxring, batch, 64);
+
+            for (unsigned i = 0; i < n; i++)
+                rxpoll_print_frame(NULL, &batch[i].cf, batch[i].ts);
+            if (!n)
+                usleep(1000);
+        }
+        rxring_stop(&rxring);
+        while (rxring_read(&rxring, batch, 64))
+            ;
+        rxring_report(&rxring, stderr);
+        return 0;
+    }
+
+    if (do_rx_poll) {
+        rxpoll_init(&rxpoll, priv, &rxpoll_cfg);
+        signal(SIGINT, rxpoll_sigint);
+        rxpoll_run(&rxpoll, rxpoll_print_frame, NULL);
+        rxpoll_report(&rxpoll, stderr);
+        return 0;
+    }
+
+    /* Leave the loop on SIGINT so that exit handlers (trace) run */
+    signal(SIGINT, rxpoll_sigint);
+    while (!rx_stop_requested) {
+        ctucan_trace_mark(priv, "status");
         u32 nrxf = ctucan_hw_get_rx_frame_count(priv);//ctucan_hw_get_rx_frame_ctr(priv);
         union ctu_can_fd_rx_mem_info reg;
-        reg.u32 = ctucan_hw_read32(priv, CTU_CAN_FD_RX_MEM_INFO);
+        reg.u32 = priv->read_reg(priv, CTU_CAN_FD_RX_MEM_INFO);
         u32 rxsz = reg.s.rx_buff_size - reg.s.rx_mem_free;
         union ctu_can_fd_status status = ctu_can_get_status(priv);
         union ctu_can_fd_err_capt_alc err_capt_alc;
@@ -454,6 +980,7 @@ int main(int argc, char *argv[])
             printf("  0x%08x\n", data);
         }
         */
+        ctucan_trace_mark(priv, "rx");
         while (nrxf || rxsz) {
             struct canfd_frame cf;
             u64 ts;
@@ -483,11 +1010,12 @@ int main(int argc, char *argv[])
                 txf.len = sizeof(d);
 	    }
 
-            res = ctucan_hw_insert_frame(priv, &txf, 0, CTU_CAN_FD_TXT_BUFFER_1, transmit_fdf);
-            if (!res)
+            if (!tx_sched_queue(&tx_sched, &txf, transmit_fdf, loop_cycle))
                 printf("TX failed\n");
-            ctucan_hw_txt_set_rdy(priv, CTU_CAN_FD_TXT_BUFFER_1);
-
+        }
+        if (do_periodic_transmit) {
+            ctucan_trace_mark(priv, "tx");
+            tx_sched_poll(&tx_sched);
         }
 
         usleep(1000 * gap);
@@ -0,0 +1 @@
+../ctucanfd_trace.h
\ No newline at end of file
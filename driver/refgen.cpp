@@ -0,0 +1,271 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#include <time.h>
+
+#include "userspace_utils.h"
+#include "userspace_refgen.h"
+#include "userspace_reflog.h"
+
+/*
+    Reference bit sequences for test/reference without the Kvaser/SignalTap
+    setup (userspace_refgen.h): random frames, or the frames of a recorded
+    data set re-encoded and compared with their recorded sequences.
+    Usage: ./refgen [-n count] [-s seed] [-o file] [options]
+           ./refgen -i data_set [-t tolerance] [options]
+*/
+
+static void usage(const char *progname)
+{
+    printf("Usage: %s [options]\n"
+           "  -n <count>        random frames (default 1000)\n"
+           "  -s <seed>         of the random frames\n"
+           "  -i <file>         encode the frames of a recorded data set instead, text\n"
+           "                    or binary (userspace_reflog.h)\n"
+           "  -t <samples>      with -i, compare with the recorded sequences, runs may\n"
+           "                    differ by up to samples (first and last run are ignored)\n"
+           "  -o <file>         output (default stdout)\n"
+           "  -q                no output, only the encoding rate\n"
+           "  -c <hz>           sample rate (default 100000000)\n"
+           "  -b <bps>          nominal bit rate (default 500000)\n"
+           "  -B <bps>          data bit rate (default 2000000)\n"
+           "  -p <sp>[,<dsp>]   sample points in per mille (default 800,800)\n"
+           "  -a <samples>      ACK delay (default 10)\n"
+           "  -N                non-ISO CAN FD\n",
+           progname);
+}
+
+static double now_s(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+struct refgen_out {
+    FILE *f;
+    char *buf;
+    size_t len, size;
+};
+
+static void out_flush(struct refgen_out *o)
+{
+    if (o->f && o->len && fwrite(o->buf, 1, o->len, o->f) != o->len)
+        err(1, "write");
+    o->len = 0;
+}
+
+/* Nothing is formatted without a file (-q, -t), only the runs are encoded */
+static void out_frame(struct refgen_out *o, const struct refgen_frame *f,
+                      const uint32_t *run, unsigned n)
+{
+    if (!o->f)
+        return;
+    if (o->size - o->len < REFGEN_LINE_MAX)
+        out_flush(o);
+    o->len += refgen_format(o->buf + o->len, f, run, n);
+}
+
+/* Generated runs against recorded ones, without the idle first and last */
+static bool runs_match(const uint32_t *a, unsigned na, const uint32_t *b, unsigned nb,
+                       unsigned tol, unsigned *worst)
+{
+    if (na != nb)
+        return false;
+    for (unsigned i = 1; i + 1 < na; i++) {
+        unsigned d = a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+
+        if (d > *worst)
+            *worst = d;
+        if (d > tol)
+            return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    static uint32_t run[REFGEN_MAX_RUNS], rec[REFGEN_MAX_RUNS];
+    struct refgen_config cfg;
+    struct refgen_frame f;
+    struct refgen_out out = {stdout, NULL, 0, 1 << 20};
+    const char *in_path = NULL;
+    unsigned long long count = 1000, n = 0, mismatches = 0;
+    uint64_t seed = 1;
+    long tol = -1;
+    unsigned worst = 0;
+    bool quiet = false;
+    double t0, t1;
+    char *e;
+    int c;
+
+    refgen_config_defaults(&cfg);
+    while ((c = getopt(argc, argv, "n:s:i:t:o:qc:b:B:p:a:Nh")) != -1) {
+        switch (c) {
+        case 'n':
+            count = strtoull(optarg, &e, 0);
+            if (*e != '\0')
+                errx(1, "-n expects a number");
+            break;
+        case 's':
+            seed = strtoull(optarg, &e, 0);
+            if (*e != '\0')
+                errx(1, "-s expects a number");
+            break;
+        case 'i':
+            in_path = optarg;
+            break;
+        case 't':
+            tol = strtol(optarg, &e, 0);
+            if (*e != '\0' || tol < 0)
+                errx(1, "-t expects a number of samples");
+            break;
+        case 'o':
+            out.f = fopen(optarg, "w");
+            if (!out.f)
+                err(1, "%s", optarg);
+            break;
+        case 'q':
+            quiet = true;
+            break;
+        case 'c':
+            cfg.clk_freq = strtoul(optarg, &e, 0);
+            if (*e != '\0' || !cfg.clk_freq)
+                errx(1, "-c expects a frequency in Hz");
+            break;
+        case 'b':
+            cfg.bitrate = strtoul(optarg, &e, 0);
+            if (*e != '\0' || !cfg.bitrate)
+                errx(1, "-b expects a bit rate");
+            break;
+        case 'B':
+            cfg.dbitrate = strtoul(optarg, &e, 0);
+            if (*e != '\0' || !cfg.dbitrate)
+                errx(1, "-B expects a bit rate");
+            break;
+        case 'p':
+            cfg.sp = strtoul(optarg, &e, 0);
+            cfg.dsp = cfg.sp;
+            if (*e == ',')
+                cfg.dsp = strtoul(e + 1, &e, 0);
+            if (*e != '\0' || cfg.sp >= 1000 || cfg.dsp >= 1000)
+                errx(1, "-p expects <sp>[,<dsp>] per mille");
+            break;
+        case 'a':
+            cfg.ack_delay = strtoul(optarg, &e, 0);
+            if (*e != '\0')
+                errx(1, "-a expects a number of samples");
+            break;
+        case 'N':
+            cfg.iso = false;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc || (tol >= 0 && !in_path)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (cfg.bitrate > cfg.clk_freq || cfg.dbitrate > cfg.clk_freq)
+        errx(1, "bit rate above the sample rate");
+    if (quiet || tol >= 0)
+        out.f = NULL;
+    out.buf = (char *)malloc(out.size);
+    if (!out.buf)
+        errx(1, "out of memory");
+
+    t0 = now_s();
+    if (in_path) {
+        bool binary = reflog_detect(in_path);
+        struct reflog_reader r;
+        FILE *in = NULL;
+        char *line = NULL;
+        size_t line_size = 0;
+        unsigned long long lineno = 0;
+
+        if (binary ? reflog_open(&r, in_path) : !(in = fopen(in_path, "r")))
+            err(1, "%s", in_path);
+        for (;;) {
+            int nrec;
+            unsigned nrun;
+
+            if (binary ? reflog_end(&r) : getline(&line, &line_size, in) <= 0)
+                break;
+            lineno++;
+            nrec = binary ? reflog_next(&r, &f, tol >= 0 ? rec : NULL, REFGEN_MAX_RUNS) :
+                            refgen_parse(line, &f, tol >= 0 ? rec : NULL, REFGEN_MAX_RUNS);
+            if (nrec < 0)
+                errx(1, "%s:%llu: %s", in_path, lineno,
+                     binary ? "malformed record" : "not a logger line");
+            nrun = refgen_runs(&cfg, &f, run);
+            n++;
+            if (tol >= 0) {
+                if (!runs_match(run, nrun, rec, nrec, tol, &worst)) {
+                    if (mismatches < 10)
+                        fprintf(stderr, "%s:%llu: %u runs, recorded %d\n",
+                                in_path, lineno, nrun, nrec);
+                    mismatches++;
+                }
+                continue;
+            }
+            out_frame(&out, &f, run, nrun);
+        }
+        free(line);
+        if (binary)
+            reflog_close(&r);
+        else
+            fclose(in);
+    } else {
+        for (; n < count; n++) {
+            unsigned nrun;
+
+            refgen_random(&seed, &f);
+            nrun = refgen_runs(&cfg, &f, run);
+            out_frame(&out, &f, run, nrun);
+        }
+    }
+    out_flush(&out);
+    t1 = now_s();
+
+    if (tol >= 0)
+        fprintf(stderr, "%llu frames, %llu differ by more than %ld samples, "
+                        "largest difference %u\n", n, mismatches, tol, worst);
+    fprintf(stderr, "%llu frames in %.3f s, %.2f M frames/s\n",
+            n, t1 - t0, n / (t1 - t0) / 1e6);
+    if (out.f && out.f != stdout)
+        fclose(out.f);
+    free(out.buf);
+    return tol >= 0 && mismatches;
+}
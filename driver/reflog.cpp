@@ -0,0 +1,184 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#include <time.h>
+
+#include "userspace_utils.h"
+#include "userspace_reflog.h"
+
+/*
+    Convert a reference data set (userspace_reflog.h) between the text
+    format of tools/Kvaser_logger and the binary one: text input is written
+    as binary, binary input as text.
+    Usage: ./reflog [-o file] [-q] data_set
+*/
+
+/* Captures are not limited to one frame's runs like generated sequences */
+#define REFLOG_MAX_RUNS     (1 << 20)
+
+static void usage(const char *progname)
+{
+    printf("Usage: %s [options] <data_set>\n"
+           "  -o <file>   output (default stdout)\n"
+           "  -q          only parse the input and report the rate\n",
+           progname);
+}
+
+static double now_s(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+struct reflog_out {
+    FILE *f;
+    char *buf;
+    size_t len, size, total;
+};
+
+static void out_flush(struct reflog_out *o)
+{
+    if (o->f && o->len && fwrite(o->buf, 1, o->len, o->f) != o->len)
+        err(1, "write");
+    o->total += o->len;
+    o->len = 0;
+}
+
+static char *out_reserve(struct reflog_out *o, size_t n)
+{
+    if (o->size - o->len < n)
+        out_flush(o);
+    if (o->size < n) {
+        o->buf = (char *)realloc(o->buf, n);
+        if (!o->buf)
+            errx(1, "out of memory");
+        o->size = n;
+    }
+    return o->buf + o->len;
+}
+
+int main(int argc, char *argv[])
+{
+    static uint32_t run[REFLOG_MAX_RUNS];
+    struct reflog_out out = {stdout, NULL, 0, 1 << 20, 0};
+    struct refgen_frame f;
+    const char *in_path;
+    unsigned long long n = 0;
+    size_t in_size = 0;
+    bool quiet = false, binary;
+    double t0, t1;
+    int c;
+
+    while ((c = getopt(argc, argv, "o:qh")) != -1) {
+        switch (c) {
+        case 'o':
+            out.f = fopen(optarg, "w");
+            if (!out.f)
+                err(1, "%s", optarg);
+            break;
+        case 'q':
+            quiet = true;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    in_path = argv[optind];
+    if (quiet)
+        out.f = NULL;
+    out.buf = (char *)malloc(out.size);
+    if (!out.buf)
+        errx(1, "out of memory");
+    binary = reflog_detect(in_path);
+
+    t0 = now_s();
+    if (binary) {
+        struct reflog_reader r;
+
+        if (reflog_open(&r, in_path))
+            return 1;
+        in_size = r.size;
+        while (!reflog_end(&r)) {
+            int nrun = reflog_next(&r, &f, run, REFLOG_MAX_RUNS);
+
+            if (nrun < 0)
+                errx(1, "%s: record %llu is malformed", in_path, n + 1);
+            n++;
+            if (!quiet)
+                out.len += refgen_format(out_reserve(&out, REFGEN_LINE_LEN(nrun)), &f, run, nrun);
+        }
+        reflog_close(&r);
+    } else {
+        FILE *in = fopen(in_path, "r");
+        char *line = NULL;
+        size_t line_size = 0;
+        ssize_t len;
+
+        if (!in)
+            err(1, "%s", in_path);
+        if (!quiet) {
+            reflog_header((uint8_t *)out.buf);
+            out.len = REFLOG_HDR_SIZE;
+        }
+        while ((len = getline(&line, &line_size, in)) > 0) {
+            int nrun = refgen_parse(line, &f, run, REFLOG_MAX_RUNS);
+
+            if (nrun < 0)
+                errx(1, "%s:%llu: not a logger line", in_path, n + 1);
+            in_size += len;
+            n++;
+            if (!quiet)
+                out.len += reflog_encode((uint8_t *)out_reserve(&out, REFLOG_REC_MAX(nrun)),
+                                         &f, run, nrun);
+        }
+        free(line);
+        fclose(in);
+    }
+    out_flush(&out);
+    t1 = now_s();
+
+    fprintf(stderr, "%llu frames, %zu bytes of %s", n, in_size, binary ? "binary" : "text");
+    if (!quiet)
+        fprintf(stderr, " to %zu bytes of %s", out.total, binary ? "text" : "binary");
+    fprintf(stderr, " in %.3f s, %.2f M frames/s\n", t1 - t0, n / (t1 - t0) / 1e6);
+    if (out.f && out.f != stdout)
+        fclose(out.f);
+    free(out.buf);
+    return 0;
+}
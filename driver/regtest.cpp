@@ -73,19 +73,18 @@ void apb_write(uint32_t reg, uint32_t value, uint8_t be)
         default:
             assert(!"invalid byte enable");
     }
-    uint8_t * addr = (uint8_t*)priv->mem_base + reg;
+    enum ctu_can_fd_can_registers addr = (enum ctu_can_fd_can_registers)(reg + offset);
     switch (access)
     {
-        case U8: iowrite8(value,   addr+offset); break;
-        case U16: iowrite16(value, addr+offset); break;
-        case U32: iowrite32(value, addr+offset); break;
+        case U8: ctu_can_fd_write8(priv, addr, value); break;
+        case U16: ctu_can_fd_write16(priv, addr, value); break;
+        case U32: priv->write_reg(priv, addr, value); break;
     }
 }
 
 void apb_read(uint32_t reg)
 {
-    uint8_t * addr = (uint8_t*)priv->mem_base + reg;
-    s_apb_prdata = ioread32(addr);
+    s_apb_prdata = priv->read_reg(priv, (enum ctu_can_fd_can_registers)reg);
 }
 
 void apb_test_pattern(uint32_t reg, uint32_t data)
@@ -0,0 +1,297 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#include "userspace_utils.h"
+#include "userspace_shm.h"
+#include "userspace_tx.h"
+#include "userspace_emu.h"
+#include "userspace_crc.h"
+#include "userspace_bitstream.h"
+#include "userspace_refgen.h"
+#include "userspace_reflog.h"
+
+#include <sys/wait.h>
+
+/*
+    Checks of the userspace modules that run without the core.
+    Usage: ./selftest
+    Prints the failed checks and exits with their number.
+*/
+
+static unsigned failed;
+
+#define CHECK(cond, ...) do {                   \
+        if (!(cond)) {                          \
+            printf("%s:%d: ", __func__, __LINE__); \
+            printf(__VA_ARGS__);                \
+            printf("\n");                       \
+            failed++;                           \
+        }                                       \
+    } while (0)
+
+/* Readers that exit without shmring_close() must not keep their slots */
+static void test_shm_dead_readers(void)
+{
+    struct shmring pub, rd[SHMRING_MAX_READERS + 1];
+    char name[64];
+    int n;
+
+    snprintf(name, sizeof(name), "/ctucan_selftest_%d", (int)getpid());
+    if (shmring_create(&pub, name, 64)) {
+        CHECK(false, "shmring_create %s", name);
+        return;
+    }
+
+    /* One live reader, the other slots held by processes that died */
+    CHECK(!shmring_attach(&rd[0], name), "first attach");
+    for (n = 1; n < SHMRING_MAX_READERS; n++) {
+        pid_t pid = fork();
+        int status;
+
+        if (!pid) {
+            struct shmring sr;
+
+            _exit(shmring_attach(&sr, name) ? 1 : 0);
+        }
+        CHECK(pid > 0 && waitpid(pid, &status, 0) == pid &&
+              WIFEXITED(status) && !WEXITSTATUS(status),
+              "reader %d in child", n);
+    }
+
+    /* All slots are in use now, the dead ones are taken over */
+    for (n = 1; n < SHMRING_MAX_READERS; n++) {
+        if (shmring_attach(&rd[n], name)) {
+            CHECK(false, "attach %d over a dead reader", n);
+            break;
+        }
+        CHECK(rd[n].reader != rd[0].reader, "live slot %d taken", rd[0].reader);
+    }
+    if (n == SHMRING_MAX_READERS) {
+        printf("selftest: the next attach is expected to fail\n");
+        fflush(stdout);
+        CHECK(shmring_attach(&rd[n], name), "attach with all readers alive");
+    }
+
+    while (n-- > 0)
+        shmring_close(&rd[n]);
+    CHECK(!shmring_attach(&rd[0], name), "attach after close");
+    shmring_close(&rd[0]);
+    shmring_close(&pub);
+}
+
+static uint64_t test_clock_ns;
+
+static uint64_t test_clock(void *arg)
+{
+    (void)arg;
+    return test_clock_ns;
+}
+
+static unsigned tx_aborting(const struct tx_sched *ts)
+{
+    unsigned n = 0;
+
+    for (unsigned i = 0; i < ts->nbufs; i++)
+        n += ts->buf[i].state == TX_SCHED_BUF_ABORTING;
+    return n;
+}
+
+static void tx_queue_id(struct tx_sched *ts, canid_t id)
+{
+    struct canfd_frame cf;
+
+    memset(&cf, 0, sizeof(cf));
+    cf.can_id = id;
+    cf.len = 8;
+    CHECK(tx_sched_queue(ts, &cf, false, id), "queue 0x%x", id);
+}
+
+/* One urgent frame aborts one buffer, also over polls before the abort ends */
+static void test_tx_preempt_once(void)
+{
+    struct ctucan_emu_config ecfg;
+    struct ctucan_hw_priv *priv;
+    struct can_bittiming bt;
+    struct tx_sched ts;
+
+    ctucan_emu_config_defaults(&ecfg);
+    ecfg.unlocked = true;
+    ecfg.clock = test_clock;
+    test_clock_ns = 1000000;
+    priv = ctucan_emu_create(&ecfg);
+    ctucan_hw_reset(priv);
+    memset(&bt, 0, sizeof(bt));
+    bt.bitrate = 500000;        /* 2 us bits at 100 MHz */
+    bt.brp = 4;
+    bt.prop_seg = 29;
+    bt.phase_seg1 = 10;
+    bt.phase_seg2 = 10;
+    bt.sjw = 10;
+    ctucan_hw_set_nom_bittiming(priv, &bt);
+    ctucan_hw_enable(priv, true);
+    if (tx_sched_init(&ts, priv, 64, NULL, NULL) < 0) {
+        CHECK(false, "tx_sched_init");
+        ctucan_emu_destroy(priv);
+        return;
+    }
+
+    /* A low priority frame goes on the bus, more urgent ones fill the rest */
+    tx_queue_id(&ts, 0x700);
+    tx_sched_poll(&ts);
+    test_clock_ns += 10000;
+    tx_sched_poll(&ts);
+    for (unsigned i = 1; i < ts.nbufs; i++)
+        tx_queue_id(&ts, 0x100 + i);
+    tx_sched_poll(&ts);
+    CHECK(ts.depth == 0, "%zu frames not loaded", ts.depth);
+
+    /* The frame on the bus is aborted, which takes until its end */
+    tx_queue_id(&ts, 0x001);
+    for (int i = 0; i < 5; i++) {
+        tx_sched_poll(&ts);
+        CHECK(tx_aborting(&ts) == 1, "poll %d: %u buffers aborting", i,
+              tx_aborting(&ts));
+    }
+
+    /* A second urgent frame is worth a second abort */
+    tx_queue_id(&ts, 0x002);
+    tx_sched_poll(&ts);
+    CHECK(tx_aborting(&ts) == 2, "second urgent frame: %u buffers aborting",
+          tx_aborting(&ts));
+    for (int i = 0; i < 5; i++)
+        tx_sched_poll(&ts);
+    CHECK(ts.stats.preempted <= 2, "%llu frames preempted",
+          (unsigned long long)ts.stats.preempted);
+
+    /* Everything still gets sent */
+    for (int i = 0; i < 100 && tx_sched_pending(&ts); i++) {
+        test_clock_ns += 100000;
+        tx_sched_poll(&ts);
+    }
+    CHECK(!tx_sched_pending(&ts), "%zu frames pending", tx_sched_pending(&ts));
+    CHECK(ts.stats.sent == ts.nbufs + 2, "%llu frames sent",
+          (unsigned long long)ts.stats.sent);
+
+    tx_sched_free(&ts);
+    ctucan_emu_destroy(priv);
+}
+
+/* Text to binary to text gives the same line, extra trailing spaces included */
+static void test_reflog_roundtrip(void)
+{
+    static char line[REFGEN_LINE_MAX], back[REFGEN_LINE_MAX];
+    static uint32_t run[REFGEN_MAX_RUNS], run2[REFGEN_MAX_RUNS];
+    static uint8_t rec[REFLOG_HDR_SIZE + REFLOG_REC_MAX(REFGEN_MAX_RUNS)];
+    struct refgen_config cfg;
+    struct reflog_reader r;
+    struct refgen_frame f, f2;
+    uint64_t seed = 7;
+
+    refgen_config_defaults(&cfg);
+    for (unsigned pad = 0; pad < 3; pad++) {
+        size_t len;
+        int n;
+
+        refgen_random(&seed, &f);
+        f.pad = pad;
+        len = refgen_format(line, &f, run, refgen_runs(&cfg, &f, run));
+        line[len] = '\0';
+
+        n = refgen_parse(line, &f2, run2, REFGEN_MAX_RUNS);
+        CHECK(n > 0 && f2.pad == pad, "pad %u parsed as %u", pad, f2.pad);
+        reflog_header(rec);
+        r.fd = -1;
+        r.map = rec;
+        r.size = REFLOG_HDR_SIZE + reflog_encode(rec + REFLOG_HDR_SIZE, &f2, run2, n);
+        r.pos = rec + REFLOG_HDR_SIZE;
+
+        memset(run2, 0, sizeof(run2));
+        n = reflog_next(&r, &f2, run2, REFGEN_MAX_RUNS);
+        CHECK(n > 0 && reflog_end(&r), "pad %u: record not decoded", pad);
+        if (n <= 0)
+            continue;
+        len = refgen_format(back, &f2, run2, n);
+        back[len] = '\0';
+        CHECK(!strcmp(line, back), "pad %u: line differs after round trip", pad);
+    }
+}
+
+/* can_frame_bits() gives the lengths can_bitstream_encode() builds */
+static void test_frame_bits(void)
+{
+    static struct can_bitstream bs;
+    const unsigned count = 200000;
+    uint64_t seed = 11;
+    unsigned bad = 0;
+
+    for (unsigned k = 0; k < count; k++) {
+        struct refgen_frame f;
+        struct canfd_frame *cf = &f.cf;
+        bool iso = k & 1;
+        unsigned nbits, dbits;
+
+        refgen_random(&seed, &f);
+        if (f.fdf && (k & 2))
+            cf->flags |= CANFD_ESI;
+        /* Equal data bits stuff the most, also right before the CRC field */
+        if (k % 8 == 7)
+            memset(cf->data, k & 8 ? 0xff : 0x00, cf->len);
+
+        can_bitstream_encode(&bs, cf, f.fdf, iso);
+        can_frame_bits(cf, f.fdf, iso, &nbits, &dbits);
+        if (nbits == bs.len && dbits == bs.data_end - bs.data_start)
+            continue;
+        if (!bad++)
+            printf("%s: first: %s id %x len %u flags %x iso %d: %u/%u bits, "
+                   "encoded %u/%u\n", __func__, f.fdf ? "FD" : "CAN", cf->can_id,
+                   cf->len, cf->flags, iso, nbits, dbits, bs.len,
+                   bs.data_end - bs.data_start);
+    }
+    CHECK(!bad, "%u of %u frames differ", bad, count);
+}
+
+/* All CRC kernels against the model of crc_calc.vhd */
+static void test_crc_kernels(void)
+{
+    unsigned n = can_crc_check(100000, 0x9e3779b97f4a7c15ull, stdout);
+
+    CHECK(!n, "%u CRC checks failed", n);
+}
+
+int main(void)
+{
+    test_shm_dead_readers();
+    test_tx_preempt_once();
+    test_reflog_roundtrip();
+    test_frame_bits();
+    test_crc_kernels();
+
+    printf("selftest: %u failed\n", failed);
+    return failed ? 1 : 0;
+}
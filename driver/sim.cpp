@@ -0,0 +1,162 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#include "userspace_sim.h"
+#include <time.h>
+
+/*
+    Multi-node CAN bus simulator, see userspace_sim.h.
+    Usage: ./sim -n 200 -l 0.7 -p prio
+*/
+
+static void usage(const char *progname)
+{
+    printf("Usage: %s [options]\n"
+           "  -n <nodes>     number of nodes (100)\n"
+           "  -m <msgs>      messages per node (8)\n"
+           "  -l <load>      offered load, fraction of bus capacity (0.6)\n"
+           "  -b <bitrate>   nominal bit rate (500000)\n"
+           "  -B <bitrate>   data bit rate, implies -f and bit rate switch\n"
+           "  -f             send CAN FD frames\n"
+           "  -L <bytes>     payload length (8)\n"
+           "  -x             29-bit identifiers\n"
+           "  -p <policy>    driver policy: prio, fifo, single (prio)\n"
+           "  -P             Poisson releases instead of periodic\n"
+           "  -q <frames>    per node TX queue (64)\n"
+           "  -e <prob>      probability a transmission is destroyed (0)\n"
+           "  -r <limit>     retransmission limit, -1 = unlimited (-1)\n"
+           "  -R <nodes>     nodes reading all frames from RX buffer (1)\n"
+           "  -F <frames>    stop after this many frames (1000000)\n"
+           "  -d <ms>        stop after this much simulated time\n"
+           "  -s <seed>      random seed (1)\n",
+           progname);
+}
+
+static double num_arg(const char *opt, const char *s)
+{
+    char *e;
+    double v = strtod(s, &e);
+
+    if (*e != '\0' || e == s)
+        errx(1, "%s expects a number", opt);
+    return v;
+}
+
+int main(int argc, char *argv[])
+{
+    struct sim_config cfg;
+    struct timespec t0, t1;
+    struct sim sim;
+    int c;
+
+    sim_config_defaults(&cfg);
+    while ((c = getopt(argc, argv, "n:m:l:b:B:fL:xp:Pq:e:r:R:F:d:s:h")) != -1) {
+        switch (c) {
+        case 'n':
+            cfg.nodes = num_arg("-n", optarg);
+            break;
+        case 'm':
+            cfg.msgs_per_node = num_arg("-m", optarg);
+            break;
+        case 'l':
+            cfg.load = num_arg("-l", optarg);
+            break;
+        case 'b':
+            cfg.bitrate = num_arg("-b", optarg);
+            break;
+        case 'B':
+            cfg.dbitrate = num_arg("-B", optarg);
+            cfg.fdf = true;
+            cfg.brs = true;
+            break;
+        case 'f':
+            cfg.fdf = true;
+            break;
+        case 'L':
+            cfg.len = num_arg("-L", optarg);
+            break;
+        case 'x':
+            cfg.ext = true;
+            break;
+        case 'p':
+            if (!strcmp(optarg, "prio"))
+                cfg.policy = SIM_POLICY_PRIO;
+            else if (!strcmp(optarg, "fifo"))
+                cfg.policy = SIM_POLICY_FIFO;
+            else if (!strcmp(optarg, "single"))
+                cfg.policy = SIM_POLICY_SINGLE;
+            else
+                errx(1, "-p expects prio, fifo or single");
+            break;
+        case 'P':
+            cfg.traffic = SIM_TRAFFIC_POISSON;
+            break;
+        case 'q':
+            cfg.max_queue = num_arg("-q", optarg);
+            break;
+        case 'e':
+            cfg.err_rate = num_arg("-e", optarg);
+            break;
+        case 'r':
+            cfg.retr_limit = num_arg("-r", optarg);
+            if (cfg.retr_limit > 15)
+                errx(1, "-r expects -1..15");
+            break;
+        case 'R':
+            cfg.rx_nodes = num_arg("-R", optarg);
+            break;
+        case 'F':
+            cfg.frames = num_arg("-F", optarg);
+            break;
+        case 'd':
+            cfg.duration_ns = num_arg("-d", optarg) * 1e6;
+            cfg.frames = UINT64_MAX;
+            break;
+        case 's':
+            cfg.seed = num_arg("-s", optarg);
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (sim_init(&sim, &cfg) < 0)
+        return 1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    sim_run(&sim);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    sim_report(&sim, (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9,
+               stdout);
+    sim_free(&sim);
+    return 0;
+}
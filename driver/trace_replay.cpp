@@ -0,0 +1,398 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#include "userspace_utils.h"
+#include "userspace_hist.h"
+#include "userspace_trace.h"
+#include <time.h>
+
+/*
+    Replay and analysis of register access traces, see userspace_trace.h.
+    Usage: ./trace_replay [-a addr] [-n] [-p] [-k] trace.bin
+*/
+
+#define REPLAY_REGS     (0x500 / 4)
+#define REPLAY_PATHS    (CTUCAN_TRACE_MARKS + 1)    /* Path 0 = before any mark */
+
+struct replay_entry {
+    uint64_t count;
+    uint64_t rec_ns;            /* Recorded time until the next access */
+    uint64_t differ;            /* Read returned another value than recorded */
+    struct userspace_hist *cost;
+};
+
+struct replay_trace {
+    struct ctucan_trace_rec *rec;
+    uint64_t count;
+    uint64_t dropped;
+    unsigned nmarks;
+    char marks[CTUCAN_TRACE_MARKS][CTUCAN_TRACE_MARK_LEN];
+};
+
+static struct replay_entry entries[REPLAY_PATHS][REPLAY_REGS][2];
+
+static void usage(const char *progname)
+{
+    printf("Usage: %s [options] <trace>\n"
+           "  -a <addr>   replay against core at this address (default 0x%x,\n"
+           "              CTUCANFD_EMU=1 replays against the emulator)\n"
+           "  -n          do not replay, analyse the recorded trace only\n"
+           "  -p          keep recorded pacing between accesses\n"
+           "  -k          trace is ftrace output of ctucanfd:ctucan_reg_* events\n",
+           progname, 0x43c30000);
+}
+
+static int load_binary(struct replay_trace *tr, const char *path)
+{
+    struct ctucan_trace_hdr hdr;
+    FILE *f = fopen(path, "rb");
+
+    if (!f) {
+        warn("%s", path);
+        return -1;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != CTUCAN_TRACE_MAGIC ||
+        hdr.version != CTUCAN_TRACE_VERSION ||
+        hdr.rec_size != sizeof(struct ctucan_trace_rec) ||
+        hdr.nmarks > CTUCAN_TRACE_MARKS) {
+        warnx("%s: not a register trace", path);
+        fclose(f);
+        return -1;
+    }
+    tr->rec = (struct ctucan_trace_rec *)calloc(hdr.count ? hdr.count : 1,
+                                                sizeof(*tr->rec));
+    if (!tr->rec) {
+        warnx("cannot allocate %llu records", (unsigned long long)hdr.count);
+        fclose(f);
+        return -1;
+    }
+    tr->count = fread(tr->rec, sizeof(*tr->rec), hdr.count, f);
+    if (tr->count != hdr.count)
+        warnx("%s: truncated, %llu of %llu records", path,
+              (unsigned long long)tr->count, (unsigned long long)hdr.count);
+    tr->dropped = hdr.dropped;
+    tr->nmarks = hdr.nmarks;
+    memcpy(tr->marks, hdr.marks, sizeof(tr->marks));
+    fclose(f);
+    return 0;
+}
+
+/*
+ * ftrace text, e.g.
+ *   irq/48-ctucan-212 [001] d..1.  4567.123456: ctucan_reg_read: base=... reg=0x070 val=0x00008888
+ * Only the first core (base) seen is used.
+ */
+static int load_ftrace(struct replay_trace *tr, const char *path)
+{
+    char line[512], base[64], first_base[64] = "";
+    uint64_t cap = 0, t0 = 0;
+    FILE *f = fopen(path, "r");
+
+    if (!f) {
+        warn("%s", path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char *p = strstr(line, ": ctucan_reg_");
+        char *q;
+        const char *args;
+        unsigned reg, val;
+        double t;
+        struct ctucan_trace_rec *r;
+
+        if (!p)
+            continue;
+        for (q = p; q > line && q[-1] != ' '; q--)
+            ;
+        args = strstr(p, "base=");
+        if (sscanf(q, "%lf", &t) != 1 || !args ||
+            sscanf(args, "base=%63s reg=%x val=%x", base, &reg, &val) != 3)
+            continue;
+        if (!first_base[0])
+            snprintf(first_base, sizeof(first_base), "%s", base);
+        else if (strcmp(base, first_base))
+            continue;
+
+        if (tr->count == cap) {
+            cap = cap ? 2 * cap : 4096;
+            tr->rec = (struct ctucan_trace_rec *)realloc(tr->rec, cap * sizeof(*tr->rec));
+            if (!tr->rec)
+                errx(1, "cannot allocate %llu records", (unsigned long long)cap);
+        }
+        r = &tr->rec[tr->count++];
+        if (tr->count == 1)
+            t0 = (uint64_t)(t * 1e9);
+        r->ns = (uint64_t)(t * 1e9) - t0;
+        r->reg = reg;
+        r->val = val;
+        r->op = !strncmp(p + 2, "ctucan_reg_write", 16) ? CTUCAN_TRACE_WRITE
+                                                         : CTUCAN_TRACE_READ;
+        r->size = 4;
+    }
+    fclose(f);
+    if (!tr->count) {
+        warnx("%s: no ctucan_reg_read/write events", path);
+        return -1;
+    }
+    return 0;
+}
+
+static uint64_t now_ns()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+/* Cost of the two clock reads around an access, subtracted from samples */
+static uint64_t clock_overhead()
+{
+    uint64_t best = UINT64_MAX;
+
+    for (int i = 0; i < 1000; i++) {
+        uint64_t a = now_ns();
+        uint64_t b = now_ns();
+
+        if (b - a < best)
+            best = b - a;
+    }
+    return best;
+}
+
+static struct replay_entry *entry_of(unsigned path, const struct ctucan_trace_rec *r)
+{
+    unsigned idx = r->reg / 4;
+
+    if (idx >= REPLAY_REGS || r->op > CTUCAN_TRACE_WRITE)
+        return NULL;
+    return &entries[path][idx][r->op];
+}
+
+static void replay(const struct replay_trace *tr, struct ctucan_hw_priv *priv,
+                   bool pace)
+{
+    uint64_t overhead = clock_overhead();
+    uint64_t start = now_ns();
+    unsigned path = 0;
+
+    for (uint64_t i = 0; i < tr->count; i++) {
+        const struct ctucan_trace_rec *r = &tr->rec[i];
+        enum ctu_can_fd_can_registers reg = (enum ctu_can_fd_can_registers)r->reg;
+        struct replay_entry *e;
+        uint64_t a, b;
+        u32 val = 0;
+
+        if (r->op == CTUCAN_TRACE_MARK) {
+            path = r->val + 1;
+            continue;
+        }
+        e = entry_of(path, r);
+        if (!e)
+            continue;
+        if (pace)
+            while (now_ns() - start < r->ns)
+                ;
+
+        a = now_ns();
+        if (r->op == CTUCAN_TRACE_READ)
+            val = priv->read_reg(priv, reg);
+        else if (r->size == 1)
+            ctu_can_fd_write8(priv, reg, r->val);
+        else if (r->size == 2)
+            ctu_can_fd_write16(priv, reg, r->val);
+        else
+            priv->write_reg(priv, reg, r->val);
+        b = now_ns();
+
+        if (!e->cost) {
+            e->cost = (struct userspace_hist *)malloc(sizeof(*e->cost));
+            if (!e->cost)
+                errx(1, "out of memory");
+            userspace_hist_init(e->cost);
+        }
+        userspace_hist_add(e->cost, b - a > overhead ? b - a - overhead : 0);
+        if (r->op == CTUCAN_TRACE_READ && val != r->val)
+            e->differ++;
+    }
+}
+
+/* Recorded counts and time to the next access per path and register */
+static void analyse(const struct replay_trace *tr)
+{
+    unsigned path = 0;
+
+    for (uint64_t i = 0; i < tr->count; i++) {
+        const struct ctucan_trace_rec *r = &tr->rec[i];
+        struct replay_entry *e;
+
+        if (r->op == CTUCAN_TRACE_MARK) {
+            path = r->val + 1;
+            continue;
+        }
+        e = entry_of(path, r);
+        if (!e)
+            continue;
+        e->count++;
+        if (i + 1 < tr->count)
+            e->rec_ns += tr->rec[i + 1].ns - r->ns;
+    }
+}
+
+struct report_row {
+    struct replay_entry *e;
+    unsigned reg;
+    unsigned op;
+    uint64_t weight;
+};
+
+static int row_cmp(const void *a, const void *b)
+{
+    uint64_t wa = ((const struct report_row *)a)->weight;
+    uint64_t wb = ((const struct report_row *)b)->weight;
+
+    return wa > wb ? -1 : wa < wb;
+}
+
+static void report(const struct replay_trace *tr, bool replayed)
+{
+    static struct report_row rows[REPLAY_REGS * 2];
+    uint64_t span = tr->count ? tr->rec[tr->count - 1].ns - tr->rec[0].ns : 0;
+
+    printf("trace: %llu records (%llu dropped), %u paths, %.6f s recorded\n",
+           (unsigned long long)tr->count, (unsigned long long)tr->dropped,
+           tr->nmarks, span / 1e9);
+
+    for (unsigned p = 0; p < REPLAY_PATHS; p++) {
+        uint64_t count = 0, rec_ns = 0, cost_ns = 0;
+        unsigned n = 0;
+
+        for (unsigned r = 0; r < REPLAY_REGS; r++) {
+            for (unsigned op = 0; op < 2; op++) {
+                struct replay_entry *e = &entries[p][r][op];
+
+                if (!e->count)
+                    continue;
+                rows[n].e = e;
+                rows[n].reg = r * 4;
+                rows[n].op = op;
+                rows[n].weight = replayed && e->cost ? e->cost->sum : e->rec_ns;
+                count += e->count;
+                rec_ns += e->rec_ns;
+                cost_ns += e->cost ? e->cost->sum : 0;
+                n++;
+            }
+        }
+        if (!n)
+            continue;
+        qsort(rows, n, sizeof(rows[0]), row_cmp);
+
+        printf("\npath \"%s\": %llu accesses, %.3f ms recorded",
+               p ? tr->marks[p - 1] : "(start)", (unsigned long long)count,
+               rec_ns / 1e6);
+        if (replayed)
+            printf(", %.3f ms replayed", cost_ns / 1e6);
+        printf("\n  %-16s %-5s %10s %7s %10s", "register", "op", "count",
+               "share", "rec avg");
+        if (replayed)
+            printf(" %8s %8s %8s %8s %8s", "avg", "p50", "p99", "max", "differ");
+        printf("\n");
+
+        for (unsigned i = 0; i < n; i++) {
+            const struct replay_entry *e = rows[i].e;
+            char buf[32];
+
+            printf("  %-16s %-5s %10llu %6.1f%% %10llu",
+                   ctucan_reg_name(rows[i].reg, buf, sizeof(buf)),
+                   rows[i].op == CTUCAN_TRACE_READ ? "read" : "write",
+                   (unsigned long long)e->count,
+                   100.0 * rows[i].weight / ((replayed ? cost_ns : rec_ns) ?: 1),
+                   (unsigned long long)(e->rec_ns / e->count));
+            if (replayed && e->cost)
+                printf(" %8llu %8llu %8llu %8llu %8llu",
+                       (unsigned long long)(e->cost->sum / e->cost->count),
+                       (unsigned long long)userspace_hist_percentile(e->cost, 500),
+                       (unsigned long long)userspace_hist_percentile(e->cost, 990),
+                       (unsigned long long)e->cost->max,
+                       (unsigned long long)e->differ);
+            printf("\n");
+        }
+    }
+    if (replayed)
+        printf("\ntimes in ns; rec avg = recorded time to the next access, "
+               "replay columns = access cost, differ = reads with another value\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct replay_trace tr;
+    uint32_t addr = 0x43c30000;
+    bool analyse_only = false, pace = false, ftrace = false;
+    char *e;
+    int c;
+
+    while ((c = getopt(argc, argv, "a:npkh")) != -1) {
+        switch (c) {
+        case 'a':
+            addr = strtoul(optarg, &e, 0);
+            if (*e != '\0')
+                errx(1, "-a expects a number");
+            break;
+        case 'n':
+            analyse_only = true;
+            break;
+        case 'p':
+            pace = true;
+            break;
+        case 'k':
+            ftrace = true;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    memset(&tr, 0, sizeof(tr));
+    if ((ftrace ? load_ftrace : load_binary)(&tr, argv[optind]) < 0)
+        return 1;
+    analyse(&tr);
+    if (!analyse_only)
+        replay(&tr, ctucanfd_init(addr), pace);
+    report(&tr, !analyse_only);
+    free(tr.rec);
+    return 0;
+}
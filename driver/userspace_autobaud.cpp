@@ -0,0 +1,290 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#include <time.h>
+#include <unistd.h>
+
+#include "userspace_autobaud.h"
+
+/* Most common first, a hit ends the sweep */
+static const uint32_t autobaud_default_bitrates[] = {
+    500000, 250000, 125000, 1000000, 800000, 100000, 83333, 50000, 20000, 10000, 0
+};
+static const uint32_t autobaud_default_dbitrates[] = {
+    2000000, 5000000, 4000000, 8000000, 1000000, 0
+};
+
+void autobaud_config_defaults(struct autobaud_config *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->clk_freq = 100000000;
+    cfg->dwell_ms = 20;
+    cfg->timeout_ms = 1000;
+    cfg->poll_us = 50;
+    cfg->fd_frames = 16;
+}
+
+static uint64_t mono_ns(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+static unsigned autobaud_candidates(struct autobaud *ab, struct autobaud_candidate *c,
+                                    const uint32_t *rates,
+                                    const struct can_bittiming_const *btc)
+{
+    unsigned n = 0;
+
+    for (; *rates && n < AUTOBAUD_MAX_RATES; rates++, n++) {
+        memset(&c[n], 0, sizeof(c[n]));
+        c[n].bitrate = *rates;
+        c[n].bt.bitrate = *rates;
+        c[n].usable = !bittiming_get(&ab->bt_cache, btc, ab->cfg.clk_freq, &c[n].bt);
+    }
+    return n;
+}
+
+int autobaud_init(struct autobaud *ab, struct ctucan_hw_priv *priv,
+                  const struct autobaud_config *cfg)
+{
+    unsigned usable = 0;
+
+    memset(ab, 0, sizeof(*ab));
+    ab->priv = priv;
+    ab->cfg = *cfg;
+    ab->nom_found = ab->data_found = -1;
+
+    bittiming_cache_init(&ab->bt_cache);
+    ab->nnom = autobaud_candidates(ab, ab->nom, cfg->bitrates ? cfg->bitrates :
+                                   autobaud_default_bitrates,
+                                   &ctu_can_fd_bit_timing_max);
+    ab->ndata = autobaud_candidates(ab, ab->data, cfg->dbitrates ? cfg->dbitrates :
+                                    autobaud_default_dbitrates,
+                                    &ctu_can_fd_bit_timing_data_max);
+    for (unsigned i = 0; i < ab->nnom; i++)
+        usable += ab->nom[i].usable;
+    if (!usable) {
+        warnx("autobaud: no candidate bitrate fits a %u Hz clock", cfg->clk_freq);
+        return -1;
+    }
+    return 0;
+}
+
+const struct can_bittiming *autobaud_nominal(const struct autobaud *ab)
+{
+    return ab->nom_found >= 0 ? &ab->nom[ab->nom_found].bt : NULL;
+}
+
+const struct can_bittiming *autobaud_data(const struct autobaud *ab)
+{
+    if (ab->data_found >= 0)
+        return &ab->data[ab->data_found].bt;
+    for (unsigned i = 0; i < ab->ndata; i++)
+        if (ab->data[i].usable)
+            return &ab->data[i].bt;
+    return autobaud_nominal(ab);
+}
+
+/*
+ * Timings are only written with the core disabled; RX keeps nothing older.
+ * The HAL adjusts the timing it is given, the candidates stay as computed.
+ */
+static void autobaud_program(struct autobaud *ab, const struct can_bittiming *nbt,
+                             const struct can_bittiming *dbt)
+{
+    struct can_bittiming bt;
+
+    ctucan_hw_enable(ab->priv, false);
+    bt = *nbt;
+    ctucan_hw_set_nom_bittiming(ab->priv, &bt);
+    if (dbt) {
+        bt = *dbt;
+        ctucan_hw_set_data_bittiming(ab->priv, &bt);
+    }
+    ctucan_hw_rel_rx_buf(ab->priv);
+    ctucan_hw_enable(ab->priv, true);
+}
+
+/*
+ * Watch the bus with @nbt/@dbt until the first frame decides. In the data
+ * stage only a frame with BRS is a match.
+ */
+static enum autobaud_verdict autobaud_probe(struct autobaud *ab, struct autobaud_candidate *c,
+                                            const struct can_bittiming *nbt,
+                                            const struct can_bittiming *dbt,
+                                            bool data_stage, uint64_t deadline)
+{
+    struct ctucan_hw_priv *priv = ab->priv;
+    uint64_t end = mono_ns() + (uint64_t)ab->cfg.dwell_ms * 1000000;
+    unsigned plain = 0;
+    u16 norm0, fd0;
+
+    if (end > deadline)
+        end = deadline;
+    c->probes++;
+    ab->probes++;
+    autobaud_program(ab, nbt, dbt);
+    norm0 = ctucan_hw_read_nom_errs(priv);
+    fd0 = ctucan_hw_read_fd_errs(priv);
+
+    do {
+        struct canfd_frame cf;
+        u64 ts;
+        u16 norm, fd;
+
+        usleep(ab->cfg.poll_us);
+        /* Errors first: a frame read later may follow the failed one */
+        norm = ctucan_hw_read_nom_errs(priv) - norm0;
+        fd = ctucan_hw_read_fd_errs(priv) - fd0;
+        while (ctucan_hw_get_rx_frame_count(priv)) {
+            ctucan_hw_read_rx_frame(priv, &cf, &ts);
+            if (!data_stage || (cf.flags & CANFD_BRS))
+                return AUTOBAUD_MATCH;
+            plain++;
+        }
+        if (norm || (data_stage && fd)) {
+            c->mismatches++;
+            c->capt = ctu_can_fd_read_err_capt_alc(priv);
+            return AUTOBAUD_MISMATCH;
+        }
+        if (fd)
+            return AUTOBAUD_MATCH;      /* Got as far as the data phase */
+        if (data_stage && plain >= ab->cfg.fd_frames)
+            return AUTOBAUD_NO_BRS;
+    } while (mono_ns() < end);
+    return AUTOBAUD_SILENT;
+}
+
+int autobaud_run(struct autobaud *ab)
+{
+    struct ctucan_hw_priv *priv = ab->priv;
+    uint64_t t0 = mono_ns();
+    uint64_t deadline = t0 + (uint64_t)ab->cfg.timeout_ms * 1000000;
+    struct can_ctrlmode mode;
+    const struct can_bittiming *dbt;
+
+    ab->nom_found = ab->data_found = -1;
+    ab->no_brs = false;
+    ctucan_hw_enable(priv, false);
+    mode.mask = CAN_CTRLMODE_LISTENONLY | CAN_CTRLMODE_FD;
+    mode.flags = CAN_CTRLMODE_LISTENONLY | CAN_CTRLMODE_FD;
+    ctucan_hw_set_mode(priv, &mode);
+
+    /* Rounds over the nominal candidates, until one sees a frame */
+    dbt = autobaud_data(ab);
+    while (ab->nom_found < 0 && mono_ns() < deadline) {
+        for (unsigned i = 0; i < ab->nnom && mono_ns() < deadline; i++) {
+            struct autobaud_candidate *c = &ab->nom[i];
+
+            if (!c->usable)
+                continue;
+            if (autobaud_probe(ab, c, &c->bt, dbt, false, deadline) == AUTOBAUD_MATCH) {
+                ab->nom_found = i;
+                break;
+            }
+        }
+    }
+    ab->nom_us = (mono_ns() - t0) / 1000;
+    if (ab->nom_found < 0) {
+        ab->total_us = ab->nom_us;
+        ctucan_hw_enable(priv, false);
+        return -1;
+    }
+
+    while (ab->data_found < 0 && !ab->no_brs && mono_ns() < deadline) {
+        bool any = false;
+
+        for (unsigned i = 0; i < ab->ndata && mono_ns() < deadline; i++) {
+            struct autobaud_candidate *c = &ab->data[i];
+            enum autobaud_verdict v;
+
+            if (!c->usable)
+                continue;
+            any = true;
+            v = autobaud_probe(ab, c, autobaud_nominal(ab), &c->bt, true, deadline);
+            if (v == AUTOBAUD_MATCH)
+                ab->data_found = i;
+            else if (v == AUTOBAUD_NO_BRS)
+                ab->no_brs = true;
+            if (v == AUTOBAUD_MATCH || v == AUTOBAUD_NO_BRS)
+                break;
+        }
+        if (!any)
+            break;
+    }
+
+    autobaud_program(ab, autobaud_nominal(ab), autobaud_data(ab));
+    ab->total_us = (mono_ns() - t0) / 1000;
+    return 0;
+}
+
+static void autobaud_report_list(const struct autobaud_candidate *c, unsigned n,
+                                 int found, const char *what, FILE *f)
+{
+    for (unsigned i = 0; i < n; i++) {
+        if (!c[i].usable) {
+            fprintf(f, "  %s %8u: no timing\n", what, c[i].bitrate);
+            continue;
+        }
+        if (!c[i].probes)
+            continue;
+        fprintf(f, "  %s %8u: brp %u, tq %u ns, %u probes, %u mismatches",
+                what, c[i].bitrate, c[i].bt.brp, c[i].bt.tq, c[i].probes,
+                c[i].mismatches);
+        if (c[i].mismatches)
+            fprintf(f, " (last ERR_CAPT type %u pos %u)",
+                    c[i].capt.s.err_type, c[i].capt.s.err_pos);
+        fprintf(f, "%s\n", (int)i == found ? ", detected" : "");
+    }
+}
+
+void autobaud_report(const struct autobaud *ab, FILE *f)
+{
+    if (ab->nom_found < 0)
+        fprintf(f, "autobaud: no bitrate detected in %llu us, %u probes\n",
+                (unsigned long long)ab->total_us, ab->probes);
+    else if (ab->data_found >= 0)
+        fprintf(f, "autobaud: %u bit/s, data %u bit/s, in %llu us (nominal %llu us), "
+                   "%u probes\n",
+                ab->nom[ab->nom_found].bitrate, ab->data[ab->data_found].bitrate,
+                (unsigned long long)ab->total_us, (unsigned long long)ab->nom_us,
+                ab->probes);
+    else
+        fprintf(f, "autobaud: %u bit/s, data rate %s, in %llu us (nominal %llu us), "
+                   "%u probes\n",
+                ab->nom[ab->nom_found].bitrate,
+                ab->no_brs ? "unused (no BRS frames)" : "not detected",
+                (unsigned long long)ab->total_us, (unsigned long long)ab->nom_us,
+                ab->probes);
+    autobaud_report_list(ab->nom, ab->nnom, ab->nom_found, "nominal", f);
+    autobaud_report_list(ab->data, ab->ndata, ab->data_found, "data   ", f);
+}
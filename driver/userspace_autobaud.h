@@ -0,0 +1,121 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#pragma once
+
+#include "userspace_utils.h"
+#include "userspace_bittiming.h"
+
+/*
+ * Automatic bitrate detection on a bus with traffic.
+ *
+ * The core is switched to bus monitoring mode (CAN_CTRLMODE_LISTENONLY),
+ * so it never drives the bus: no ACK, no error flags. Each candidate
+ * bitrate gets the best ranked timing of bittiming_get(), solved once at
+ * init and cached. The core is reprogrammed with it and watched until the
+ * first frame ends:
+ *
+ *  - a frame in the RX buffer (RX_FR_CTR moves) is a match,
+ *  - ERR_NORM moving is a mismatch, ERR_CAPT says where it was seen,
+ *  - nothing within cfg.dwell_ms means no traffic; the candidate is tried
+ *    again in the next round.
+ *
+ * A frame on a wrong nominal rate breaks in the arbitration or control
+ * field, so the first frame decides. ERR_FD moving without ERR_NORM means
+ * the nominal rate is right and the data rate is not.
+ *
+ * After the nominal rate, the data rates are tried the same way. A frame
+ * with BRS received is a match, ERR_FD a mismatch. When cfg.fd_frames
+ * frames arrive without BRS and no data phase error is seen, nobody on the
+ * bus switches bitrate and the data rate stays undetected.
+ *
+ * With traffic every few ms, a candidate costs one frame time plus one
+ * poll interval, so a full sweep of the default lists takes tens of ms.
+ * The core is left in bus monitoring mode with the detected timing.
+ */
+
+#define AUTOBAUD_MAX_RATES      16
+
+enum autobaud_verdict {
+    AUTOBAUD_SILENT,            /* No traffic within the dwell time */
+    AUTOBAUD_MATCH,
+    AUTOBAUD_MISMATCH,
+    AUTOBAUD_NO_BRS,            /* Frames, none with a data phase */
+};
+
+struct autobaud_config {
+    uint32_t clk_freq;          /* Core clock, Hz */
+    const uint32_t *bitrates;   /* Zero terminated, NULL for the defaults */
+    const uint32_t *dbitrates;  /* Zero terminated, NULL for the defaults */
+    unsigned dwell_ms;          /* Per candidate without traffic */
+    unsigned timeout_ms;        /* Whole detection */
+    unsigned poll_us;
+    unsigned fd_frames;         /* Frames without BRS before giving up on data rate */
+};
+
+struct autobaud_candidate {
+    uint32_t bitrate;
+    struct can_bittiming bt;
+    bool usable;                /* bittiming_get() found a timing */
+    unsigned probes;
+    unsigned mismatches;
+    union ctu_can_fd_err_capt_alc capt;     /* At the last mismatch */
+};
+
+struct autobaud {
+    struct ctucan_hw_priv *priv;
+    struct autobaud_config cfg;
+    struct autobaud_candidate nom[AUTOBAUD_MAX_RATES];
+    struct autobaud_candidate data[AUTOBAUD_MAX_RATES];
+    unsigned nnom, ndata;
+    int nom_found, data_found;  /* Candidate index, -1 if none */
+    bool no_brs;                /* Traffic seen, none with BRS */
+    unsigned probes;
+    uint64_t nom_us, total_us;  /* Time to the nominal match, whole run */
+    struct bittiming_cache bt_cache;
+};
+
+void autobaud_config_defaults(struct autobaud_config *cfg);
+
+/* Compute the candidate timings. Returns -1 if no nominal one is usable. */
+int autobaud_init(struct autobaud *ab, struct ctucan_hw_priv *priv,
+                  const struct autobaud_config *cfg);
+
+/*
+ * Run the detection. The core must be set up (reset, out of any loopback
+ * mode); it is reprogrammed and left enabled. Returns -1 if no nominal
+ * bitrate was found within cfg.timeout_ms.
+ */
+int autobaud_run(struct autobaud *ab);
+
+/* Detected timings, data falls back to the first usable candidate */
+const struct can_bittiming *autobaud_nominal(const struct autobaud *ab);
+const struct can_bittiming *autobaud_data(const struct autobaud *ab);
+
+void autobaud_report(const struct autobaud *ab, FILE *f);
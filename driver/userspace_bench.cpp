@@ -0,0 +1,550 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#include "userspace_bench.h"
+#include "userspace_emu.h"
+#include "userspace_hist.h"
+#include "userspace_bittiming.h"
+#include "userspace_crc.h"
+#include <time.h>
+#include <sys/utsname.h>
+
+#define BENCH_TXT_BUF   3       /* TXT buffer 4, the last one used by -t */
+
+static unsigned bench_nbackends;
+
+struct bench_ctx {
+    struct ctucan_hw_priv *priv;
+    const struct bench_config *cfg;
+    FILE *out;
+    uint64_t overhead;
+    unsigned ncases;
+    struct userspace_hist hist;
+};
+
+enum bench_op {
+    BENCH_READ8,
+    BENCH_READ16,
+    BENCH_READ32,
+    BENCH_WRITE8,
+    BENCH_WRITE16,
+    BENCH_WRITE32,
+};
+
+struct bench_reg {
+    const char *cls;
+    enum ctu_can_fd_can_registers reg;
+    enum bench_op op;
+};
+
+static const struct bench_reg bench_regs[] = {
+    {"status",     CTU_CAN_FD_STATUS,       BENCH_READ32},
+    {"interrupt",  CTU_CAN_FD_INT_STAT,     BENCH_READ32},
+    {"config",     CTU_CAN_FD_FILTER_C_VAL, BENCH_READ32},
+    {"config",     CTU_CAN_FD_FILTER_C_VAL, BENCH_WRITE32},
+    {"counter",    CTU_CAN_FD_RX_FR_CTR,    BENCH_READ32},
+    {"timestamp",  CTU_CAN_FD_TIMESTAMP_LOW, BENCH_READ32},
+    {"rx_status",  CTU_CAN_FD_RX_STATUS,    BENCH_READ32},
+    {"rx_data",    CTU_CAN_FD_RX_DATA,      BENCH_READ32},
+    {"tx_status",  CTU_CAN_FD_TX_STATUS,    BENCH_READ32},
+    {"txt_buffer", (enum ctu_can_fd_can_registers)(CTU_CAN_FD_TXTB4_DATA_1 + 0x10),
+                   BENCH_WRITE32},
+};
+
+static const char * const bench_op_names[] = {
+    "read8", "read16", "read32", "write8", "write16", "write32",
+};
+
+void bench_config_defaults(struct bench_config *cfg)
+{
+    cfg->samples = 20000;
+    cfg->batch = 8;
+}
+
+static inline uint64_t bench_now()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+static uint64_t bench_clock_overhead()
+{
+    uint64_t best = UINT64_MAX;
+
+    for (int i = 0; i < 10000; i++) {
+        uint64_t a = bench_now();
+        uint64_t b = bench_now();
+
+        if (b - a < best)
+            best = b - a;
+    }
+    return best;
+}
+
+static void json_string(FILE *out, const char *s)
+{
+    fputc('"', out);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fputc('\\', out);
+        if ((unsigned char)*s >= 0x20)
+            fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+static void cpu_model(char *buf, size_t len)
+{
+    static const char * const keys[] = {"model name", "Hardware", "Processor"};
+    char line[256];
+    FILE *f = fopen("/proc/cpuinfo", "r");
+
+    snprintf(buf, len, "unknown");
+    if (!f)
+        return;
+    while (fgets(line, sizeof(line), f)) {
+        char *colon = strchr(line, ':');
+
+        if (!colon)
+            continue;
+        for (unsigned i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+            if (strncmp(line, keys[i], strlen(keys[i])))
+                continue;
+            colon += 1 + strspn(colon + 1, " \t");
+            colon[strcspn(colon, "\n")] = '\0';
+            snprintf(buf, len, "%s", colon);
+            fclose(f);
+            return;
+        }
+    }
+    fclose(f);
+}
+
+void bench_json_begin(FILE *out)
+{
+    struct utsname u;
+    char cpu[128];
+
+    if (uname(&u) < 0)
+        memset(&u, 0, sizeof(u));
+    cpu_model(cpu, sizeof(cpu));
+
+    fprintf(out, "{\n  \"tool\": \"ctucanfd-bench\",\n  \"format\": 1,\n"
+                 "  \"host\": {\"machine\": ");
+    json_string(out, u.machine);
+    fprintf(out, ", \"kernel\": ");
+    json_string(out, u.release);
+    fprintf(out, ", \"cpu\": ");
+    json_string(out, cpu);
+    fprintf(out, ", \"cpus\": %ld},\n  \"backends\": [", sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+void bench_json_end(FILE *out)
+{
+    fprintf(out, "\n  ]\n}\n");
+}
+
+static void bench_sample(struct bench_ctx *ctx, uint64_t t0, uint64_t t1)
+{
+    uint64_t d = t1 - t0;
+
+    userspace_hist_add(&ctx->hist, d > ctx->overhead ? d - ctx->overhead : 0);
+}
+
+/* Emit the case collected in ctx->hist, @extra is appended to the object */
+static void bench_emit(struct bench_ctx *ctx, const char *group, const char *name,
+                       const char *extra)
+{
+    static const unsigned pct[] = {500, 900, 990, 999};
+    static const char * const pct_names[] = {"p50", "p90", "p99", "p999"};
+    const struct userspace_hist *h = &ctx->hist;
+    double batch = ctx->cfg->batch;
+
+    fprintf(ctx->out, "%s\n        {\"group\": \"%s\", \"name\": \"%s\"%s, \"n\": %llu",
+            ctx->ncases++ ? "," : "", group, name, extra ? extra : "",
+            (unsigned long long)h->count);
+    if (h->count) {
+        fprintf(ctx->out, ", \"min_ns\": %.1f, \"avg_ns\": %.1f",
+                h->min / batch, (double)h->sum / h->count / batch);
+        for (unsigned i = 0; i < sizeof(pct) / sizeof(pct[0]); i++)
+            fprintf(ctx->out, ", \"%s_ns\": %.1f", pct_names[i],
+                    userspace_hist_percentile(h, pct[i]) / batch);
+        fprintf(ctx->out, ", \"max_ns\": %.1f", h->max / batch);
+    }
+    fprintf(ctx->out, "}");
+}
+
+static void bench_access(struct bench_ctx *ctx, enum ctu_can_fd_can_registers reg,
+                         enum bench_op op)
+{
+    struct ctucan_hw_priv *priv = ctx->priv;
+    volatile unsigned sink = 0;
+
+    userspace_hist_init(&ctx->hist);
+    for (unsigned s = 0; s < ctx->cfg->samples; s++) {
+        unsigned n = ctx->cfg->batch;
+        uint64_t t0 = 0, t1 = 0;
+
+        /* One loop per width keeps the dispatch out of the timed region */
+        switch (op) {
+        case BENCH_READ8:
+            t0 = bench_now();
+            for (unsigned i = 0; i < n; i++)
+                sink = ctu_can_fd_read8(priv, (enum ctu_can_fd_can_registers)(reg + (i & 3)));
+            t1 = bench_now();
+            break;
+        case BENCH_READ16:
+            t0 = bench_now();
+            for (unsigned i = 0; i < n; i++)
+                sink = ctu_can_fd_read16(priv, (enum ctu_can_fd_can_registers)(reg + (i & 1) * 2));
+            t1 = bench_now();
+            break;
+        case BENCH_READ32:
+            t0 = bench_now();
+            for (unsigned i = 0; i < n; i++)
+                sink = priv->read_reg(priv, reg);
+            t1 = bench_now();
+            break;
+        case BENCH_WRITE8:
+            t0 = bench_now();
+            for (unsigned i = 0; i < n; i++)
+                ctu_can_fd_write8(priv, (enum ctu_can_fd_can_registers)(reg + (i & 3)), i);
+            t1 = bench_now();
+            break;
+        case BENCH_WRITE16:
+            t0 = bench_now();
+            for (unsigned i = 0; i < n; i++)
+                ctu_can_fd_write16(priv, (enum ctu_can_fd_can_registers)(reg + (i & 1) * 2), i);
+            t1 = bench_now();
+            break;
+        case BENCH_WRITE32:
+            t0 = bench_now();
+            for (unsigned i = 0; i < n; i++)
+                priv->write_reg(priv, reg, i);
+            t1 = bench_now();
+            break;
+        }
+        bench_sample(ctx, t0, t1);
+    }
+    (void)sink;
+}
+
+static void bench_frame(struct canfd_frame *cf, unsigned dlc)
+{
+    memset(cf, 0, sizeof(*cf));
+    cf->can_id = 0x123;
+    cf->len = can_dlc2len(dlc);
+    for (unsigned i = 0; i < cf->len; i++)
+        cf->data[i] = i;
+}
+
+static void bench_rx_decode(struct bench_ctx *ctx, unsigned dlc, bool emu)
+{
+    struct ctucan_hw_priv *priv = ctx->priv;
+    union ctu_can_fd_frame_format_w ffw;
+    struct canfd_frame cf, rx;
+    bool fdf = dlc > 8;
+    u64 ts;
+
+    bench_frame(&cf, dlc);
+    ffw.u32 = 0;
+    ffw.s.dlc = dlc;
+    ffw.s.fdf = fdf ? FD_CAN : NORMAL_CAN;
+    ffw.s.rwcnt = 3 + (cf.len + 3) / 4;
+
+    userspace_hist_init(&ctx->hist);
+    for (unsigned s = 0; s < ctx->cfg->samples; s++) {
+        unsigned n = ctx->cfg->batch;
+        uint64_t t0, t1;
+
+        if (emu) {
+            for (unsigned i = 0; i < n; i++)
+                ctucan_emu_inject(priv, &cf, fdf);
+            t0 = bench_now();
+            for (unsigned i = 0; i < n; i++)
+                ctucan_hw_read_rx_frame(priv, &rx, &ts);
+            t1 = bench_now();
+        } else {
+            t0 = bench_now();
+            for (unsigned i = 0; i < n; i++)
+                ctucan_hw_read_rx_frame_ffw(priv, &rx, &ts, ffw);
+            t1 = bench_now();
+        }
+        bench_sample(ctx, t0, t1);
+    }
+}
+
+static bool bench_txt_fill(struct bench_ctx *ctx, unsigned dlc)
+{
+    struct canfd_frame cf;
+    bool fdf = dlc > 8, ok = true;
+
+    bench_frame(&cf, dlc);
+    userspace_hist_init(&ctx->hist);
+    for (unsigned s = 0; s < ctx->cfg->samples; s++) {
+        unsigned n = ctx->cfg->batch;
+        uint64_t t0, t1;
+
+        t0 = bench_now();
+        for (unsigned i = 0; i < n; i++)
+            ok &= ctucan_hw_insert_frame(ctx->priv, &cf, 0, BENCH_TXT_BUF, fdf);
+        t1 = bench_now();
+        bench_sample(ctx, t0, t1);
+    }
+    return ok;
+}
+
+enum bench_bt_method {
+    BENCH_BT_CALC,
+    BENCH_BT_SOLVE,
+    BENCH_BT_CACHED,
+};
+
+static const char * const bench_bt_names[] = {"calc_bittiming", "solve", "cached"};
+
+/* Time one solver on one bitrate, @cand gets the quality of its result */
+static int bench_bt_case(struct bench_ctx *ctx, enum bench_bt_method m,
+                         const struct can_bittiming_const *btc, uint32_t clock,
+                         uint32_t bitrate, struct bittiming_candidate *cand)
+{
+    static struct bittiming_cache cache;
+    struct bittiming_solution sol;
+    struct net_device nd;
+    struct can_bittiming bt;
+    int res = 0;
+
+    memset(&nd, 0, sizeof(nd));
+    nd.can.clock.freq = clock;
+    bittiming_cache_init(&cache);
+    bittiming_lookup(&cache, btc, clock, bitrate, 0);
+    userspace_hist_init(&ctx->hist);
+    for (unsigned s = 0; s < ctx->cfg->samples; s++) {
+        uint64_t t0 = 0, t1 = 0;
+
+        memset(&bt, 0, sizeof(bt));
+        bt.bitrate = bitrate;
+        switch (m) {
+        case BENCH_BT_CALC:
+            t0 = bench_now();
+            res = can_get_bittiming(&nd, &bt, btc, NULL, 0);
+            t1 = bench_now();
+            break;
+        case BENCH_BT_SOLVE:
+            t0 = bench_now();
+            res = bittiming_solve(btc, clock, bitrate, 0, &sol);
+            t1 = bench_now();
+            break;
+        case BENCH_BT_CACHED:
+            t0 = bench_now();
+            res = bittiming_get(&cache, btc, clock, &bt);
+            t1 = bench_now();
+            break;
+        }
+        bench_sample(ctx, t0, t1);
+    }
+    if (res)
+        return res;
+    if (m == BENCH_BT_SOLVE)
+        bittiming_to_can(&sol.c[0], clock, &bt);
+    bittiming_evaluate(btc, clock, bitrate, 0, &bt, cand);
+    return 0;
+}
+
+void bench_bittiming(uint32_t clock, const struct bench_config *cfg, FILE *out)
+{
+    static const uint32_t nominal[] = {125000, 250000, 500000, 800000, 1000000};
+    static const uint32_t data[] = {1000000, 2000000, 4000000, 5000000, 8000000};
+    static const struct {
+        const char *group;
+        const struct can_bittiming_const *btc;
+        const uint32_t *bitrates;
+    } phases[] = {
+        {"bittiming_nominal", &ctu_can_fd_bit_timing_max, nominal},
+        {"bittiming_data", &ctu_can_fd_bit_timing_data_max, data},
+    };
+    struct bench_config bcfg;
+    struct bench_ctx ctx;
+    char extra[160];
+
+    /* A full search takes tens of microseconds, one call per sample */
+    bcfg.samples = cfg->samples / 20 ? cfg->samples / 20 : 1;
+    bcfg.batch = 1;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.cfg = &bcfg;
+    ctx.out = out;
+    ctx.overhead = bench_clock_overhead();
+
+    fprintf(out, "%s\n    {\"name\": \"bittiming\", \"clock_hz\": %u,\n"
+                 "     \"samples\": %u, \"batch\": %u, \"clock_overhead_ns\": %llu,\n"
+                 "     \"cases\": [",
+            bench_nbackends++ ? "," : "", clock, bcfg.samples, bcfg.batch,
+            (unsigned long long)ctx.overhead);
+    for (unsigned p = 0; p < sizeof(phases) / sizeof(phases[0]); p++) {
+        for (unsigned i = 0; i < sizeof(nominal) / sizeof(nominal[0]); i++) {
+            uint32_t bitrate = phases[p].bitrates[i];
+
+            for (unsigned m = BENCH_BT_CALC; m <= BENCH_BT_CACHED; m++) {
+                struct bittiming_candidate c;
+
+                if (bench_bt_case(&ctx, (enum bench_bt_method)m, phases[p].btc, clock,
+                                  bitrate, &c))
+                    snprintf(extra, sizeof(extra), ", \"bitrate\": %u, \"ok\": false",
+                             bitrate);
+                else
+                    snprintf(extra, sizeof(extra),
+                             ", \"bitrate\": %u, \"ok\": true, \"bitrate_error_ppm\": %u, "
+                             "\"sp_error_ppm\": %u, \"tolerance_ppm\": %u",
+                             bitrate, c.bitrate_error, c.sp_error, c.tolerance);
+                bench_emit(&ctx, phases[p].group, bench_bt_names[m], extra);
+            }
+        }
+    }
+    fprintf(out, "\n     ]}");
+    fflush(out);
+}
+
+void bench_crc(const struct bench_config *cfg, FILE *out)
+{
+    static const char *const groups[] = {"crc15", "crc17", "crc21"};
+    /* Stuffed lengths of a classic 8 byte, an FD 16 byte and an FD 64 byte frame */
+    static const unsigned lengths[] = {128, 240, 640};
+    uint64_t w[(640 + 63) / 64 + 1];
+    uint64_t seed = 0x9e3779b97f4a7c15ull;
+    struct bench_ctx ctx;
+    char extra[64];
+
+    for (unsigned i = 0; i < sizeof(w) / sizeof(w[0]); i++) {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        w[i] = seed;
+    }
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.cfg = cfg;
+    ctx.out = out;
+    ctx.overhead = bench_clock_overhead();
+
+    fprintf(out, "%s\n    {\"name\": \"crc\", \"clmul\": %s,\n"
+                 "     \"samples\": %u, \"batch\": %u, \"clock_overhead_ns\": %llu,\n"
+                 "     \"cases\": [",
+            bench_nbackends++ ? "," : "", can_crc_clmul_supported() ? "true" : "false",
+            cfg->samples, cfg->batch, (unsigned long long)ctx.overhead);
+    for (unsigned type = CAN_CRC15; type <= CAN_CRC21; type++) {
+        for (unsigned l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+            for (unsigned impl = 0; impl < CAN_CRC_IMPLS; impl++) {
+                volatile uint32_t sink = 0;
+
+                userspace_hist_init(&ctx.hist);
+                for (unsigned s = 0; s < cfg->samples; s++) {
+                    uint32_t crc = 0;
+                    uint64_t t0, t1;
+
+                    /* Chained, so the calls cannot overlap; odd start offset */
+                    t0 = bench_now();
+                    for (unsigned i = 0; i < cfg->batch; i++)
+                        crc = can_crc_packed_impl((enum can_crc_impl)impl,
+                                                  (enum can_crc_type)type, crc, w, 3,
+                                                  lengths[l]);
+                    t1 = bench_now();
+                    sink = crc;
+                    bench_sample(&ctx, t0, t1);
+                }
+                (void)sink;
+                snprintf(extra, sizeof(extra), ", \"bits\": %u", lengths[l]);
+                bench_emit(&ctx, groups[type], can_crc_impl_names[impl], extra);
+            }
+        }
+    }
+    fprintf(out, "\n     ]}");
+    fflush(out);
+}
+
+void bench_run(struct ctucan_hw_priv *priv, const char *name,
+               const struct bench_config *cfg, FILE *out)
+{
+    struct bench_ctx ctx;
+    union ctu_can_fd_device_id_version id;
+    bool emu = ctucan_emu_is(priv);
+    u32 saved = priv->read_reg(priv, CTU_CAN_FD_FILTER_C_VAL);
+    char extra[64];
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.priv = priv;
+    ctx.cfg = cfg;
+    ctx.out = out;
+    ctx.overhead = bench_clock_overhead();
+    id.u32 = priv->read_reg(priv, CTU_CAN_FD_DEVICE_ID);
+
+    fprintf(out, "%s\n    {\"name\": ", bench_nbackends++ ? "," : "");
+    json_string(out, name);
+    fprintf(out, ", \"emulated\": %s, \"device_id\": \"0x%04x\", \"version\": \"%u.%u\",\n"
+                 "     \"samples\": %u, \"batch\": %u, \"clock_overhead_ns\": %llu,\n"
+                 "     \"cases\": [",
+            emu ? "true" : "false", id.s.device_id, id.s.ver_major, id.s.ver_minor,
+            cfg->samples, cfg->batch, (unsigned long long)ctx.overhead);
+
+    for (unsigned i = 0; i < sizeof(bench_regs) / sizeof(bench_regs[0]); i++) {
+        const struct bench_reg *r = &bench_regs[i];
+
+        bench_access(&ctx, r->reg, r->op);
+        snprintf(extra, sizeof(extra), ", \"op\": \"%s\", \"reg\": \"0x%03x\"",
+                 bench_op_names[r->op], r->reg);
+        bench_emit(&ctx, "register", r->cls, extra);
+    }
+
+    for (unsigned op = BENCH_READ8; op <= BENCH_WRITE32; op++) {
+        bench_access(&ctx, CTU_CAN_FD_FILTER_C_VAL, (enum bench_op)op);
+        bench_emit(&ctx, "width", bench_op_names[op], NULL);
+    }
+    priv->write_reg(priv, CTU_CAN_FD_FILTER_C_VAL, saved);
+
+    for (unsigned dlc = 0; dlc < 16; dlc++) {
+        char dname[8];
+
+        bench_rx_decode(&ctx, dlc, emu);
+        snprintf(dname, sizeof(dname), "dlc%u", dlc);
+        snprintf(extra, sizeof(extra), ", \"len\": %u, \"source\": \"%s\"",
+                 can_dlc2len(dlc), emu ? "fifo" : "synthetic");
+        bench_emit(&ctx, "rx_decode", dname, extra);
+    }
+
+    for (unsigned dlc = 0; dlc < 16; dlc++) {
+        char dname[8];
+        bool ok = bench_txt_fill(&ctx, dlc);
+
+        snprintf(dname, sizeof(dname), "dlc%u", dlc);
+        snprintf(extra, sizeof(extra), ", \"len\": %u, \"inserted\": %s",
+                 can_dlc2len(dlc), ok ? "true" : "false");
+        bench_emit(&ctx, "txt_fill", dname, extra);
+    }
+    ctucan_hw_txt_set_empty(priv, BENCH_TXT_BUF);
+
+    fprintf(out, "\n     ]}");
+    fflush(out);
+}
@@ -0,0 +1,83 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#pragma once
+
+#include "userspace_utils.h"
+
+/*
+ * MMIO micro-benchmarks, emitted as JSON for tracking across bitstreams and
+ * host CPUs.
+ *
+ * Cases (all times per access or frame, in ns, clock overhead subtracted):
+ *  - "register": read/write latency of one register of each class (status,
+ *    interrupt, config, counter, timestamp, RX data, TX status, TXT buffer)
+ *  - "width": 8/16/32-bit reads and writes as done by ctu_can_fd_read8/16,
+ *    ctu_can_fd_write8/16 and the byte enables of regtest
+ *  - "rx_decode": ctucan_hw_read_rx_frame() for every DLC. On the emulator
+ *    real frames are injected; on hardware the first frame word is
+ *    synthesized and the rest is read from RX_DATA, which costs the same
+ *    bus transactions without needing traffic.
+ *  - "txt_fill": ctucan_hw_insert_frame() into TXT buffer 4 for every DLC
+ *    (the buffer is filled, never marked ready)
+ *
+ * Each sample times cfg->batch back-to-back operations, percentiles are over
+ * the per-sample averages. FILTER_C_VAL is used as scratch and restored.
+ */
+
+struct bench_config {
+    unsigned samples;       /* Timed samples per case */
+    unsigned batch;         /* Operations per sample */
+};
+
+void bench_config_defaults(struct bench_config *cfg);
+
+/* Start the JSON document: tool, format and host description */
+void bench_json_begin(FILE *out);
+
+/* Run all cases on @priv and append them as backend @name */
+void bench_run(struct ctucan_hw_priv *priv, const char *name,
+               const struct bench_config *cfg, FILE *out);
+
+/*
+ * Bit timing solvers at CAN clock @clock, appended as backend "bittiming":
+ * can_get_bittiming(), bittiming_solve() and a bittiming_cache hit for
+ * common nominal and data bitrates, each with the quality of its result.
+ * Every sample is one call.
+ */
+void bench_bittiming(uint32_t clock, const struct bench_config *cfg, FILE *out);
+
+/*
+ * CAN CRC kernels (userspace_crc.h), appended as backend "crc": every
+ * implementation and CRC over bit streams of a classic, an FD and a long FD
+ * frame. Correctness is checked by can_crc_check() in selftest.
+ */
+void bench_crc(const struct bench_config *cfg, FILE *out);
+
+void bench_json_end(FILE *out);
@@ -0,0 +1,478 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#include "userspace_bitstream.h"
+
+/*
+ * Stuffing state: last bit and length of its run (0 only before SOF).
+ * Packed as last * 5 + run, a stuff bit restarts the run with its value.
+ */
+struct can_stuff_walk {
+    unsigned run;
+    unsigned last;
+    unsigned stuff;
+    uint32_t crc;
+};
+
+static inline void can_walk_bit(struct can_stuff_walk *w, unsigned b)
+{
+    if (w->run && b == w->last) {
+        w->run++;
+    } else {
+        w->run = 1;
+        w->last = b;
+    }
+    if (w->run == 5) {
+        w->stuff++;
+        w->last = !b;
+        w->run = 1;
+    }
+}
+
+struct can_stuff_table {
+    /* New state (low 4 bits) and stuff bits (high 4 bits) per state and byte */
+    uint8_t next[10][256];
+};
+
+static struct can_stuff_table can_stuff_table_build()
+{
+    struct can_stuff_table t;
+
+    for (unsigned st = 0; st < 10; st++) {
+        for (unsigned byte = 0; byte < 256; byte++) {
+            struct can_stuff_walk w = {st % 5, st / 5, 0, 0};
+
+            for (int i = 7; i >= 0; i--)
+                can_walk_bit(&w, (byte >> i) & 1);
+            t.next[st][byte] = (w.last * 5 + w.run) | w.stuff << 4;
+        }
+    }
+    return t;
+}
+
+static const struct can_stuff_table *can_stuff_table()
+{
+    static const struct can_stuff_table t = can_stuff_table_build();
+
+    return &t;
+}
+
+struct can_encoder {
+    struct can_bitstream *bs;
+    uint8_t *bit;                   /* bs->bit, counts kept here while encoding */
+    unsigned len;
+    unsigned stuff;
+    uint32_t crc;
+    const uint32_t *crc_tab;        /* Byte table of the CRC */
+    uint32_t crc_poly;
+    uint32_t crc_mask;
+    unsigned crc_top;               /* Shift of the CRC MSB */
+    bool crc_stuff;                 /* Stuff bits are covered by CRC */
+    bool stuff_due;                 /* Five equal bits, stuff bit before the next one */
+    unsigned run;
+    uint8_t last;
+};
+
+static inline void can_enc_raw(struct can_encoder *e, unsigned b)
+{
+    e->bit[e->len++] = b;
+}
+
+static inline void can_enc_crc(struct can_encoder *e, unsigned b)
+{
+    uint32_t x = ((e->crc >> e->crc_top) ^ b) & 1;
+
+    e->crc = ((e->crc << 1) & e->crc_mask) ^ (e->crc_poly & -x);
+}
+
+/*
+ * A stuff bit goes in only once another stuffed bit follows: after the last
+ * bit before the CAN FD CRC field, the fixed stuff bit takes its place.
+ */
+static inline void can_enc_stuff(struct can_encoder *e, bool crc)
+{
+    unsigned b = !e->last;
+
+    e->stuff_due = false;
+    can_enc_raw(e, b);
+    if (crc && e->crc_stuff)
+        can_enc_crc(e, b);
+    e->stuff++;
+    e->run = 1;
+    e->last = b;
+}
+
+/* Bit in the dynamically stuffed part of the frame */
+static inline void can_enc_put(struct can_encoder *e, unsigned b, bool crc)
+{
+    if (e->stuff_due)
+        can_enc_stuff(e, crc);
+    can_enc_raw(e, b);
+    if (crc)
+        can_enc_crc(e, b);
+    e->run = b == e->last ? e->run + 1 : 1;
+    e->last = b;
+    if (e->run == 5)
+        e->stuff_due = true;
+}
+
+static inline void can_enc_field(struct can_encoder *e, uint32_t v, unsigned n, bool crc)
+{
+    while (n--)
+        can_enc_put(e, (v >> n) & 1, crc);
+}
+
+/*
+ * Data byte. If it needs no stuff bit, all 8 bits at once with the CRC
+ * from the byte table, else bit by bit.
+ */
+static inline void can_enc_byte(struct can_encoder *e, uint8_t byte)
+{
+    const struct can_stuff_table *t = can_stuff_table();
+    unsigned n;
+
+    if (!e->stuff_due) {
+        n = t->next[e->last * 5 + e->run][byte];
+        if (!(n >> 4)) {
+            for (int i = 7; i >= 0; i--)
+                e->bit[e->len++] = (byte >> i) & 1;
+            e->crc = ((e->crc << 8) ^ e->crc_tab[((e->crc >> (e->crc_top - 7)) ^ byte) & 0xff]) &
+                     e->crc_mask;
+            e->last = n / 5;
+            e->run = n % 5;
+            return;
+        }
+    }
+    can_enc_field(e, byte, 8, true);
+}
+
+static inline void can_enc_fixed_stuff(struct can_encoder *e)
+{
+    can_enc_raw(e, !e->bit[e->len - 1]);
+    e->bs->fixed_stuff++;
+}
+
+void can_bitstream_encode(struct can_bitstream *bs, const struct canfd_frame *cf,
+                          bool fdf, bool iso)
+{
+    struct can_encoder e;
+    bool ext = cf->can_id & CAN_EFF_FLAG;
+    bool rtr = !fdf && (cf->can_id & CAN_RTR_FLAG);
+    bool brs = fdf && (cf->flags & CANFD_BRS);
+    const struct can_crc_param *p;
+    enum can_crc_type type;
+    unsigned dlc, len;
+    u32 id;
+
+    if (fdf) {
+        dlc = can_len2dlc(cf->len);
+        len = can_dlc2len(dlc);
+    } else {
+        dlc = cf->len > 8 ? 8 : cf->len;
+        len = rtr ? 0 : dlc;
+    }
+
+    bs->fixed_stuff = 0;
+    bs->data_start = 0;
+    bs->data_end = 0;
+    bs->brs_pos = 0;
+    e.bs = bs;
+    e.bit = bs->bit;
+    e.len = 0;
+    e.stuff = 0;
+    e.run = 0;
+    e.last = 0;
+    e.stuff_due = false;
+    type = !fdf ? CAN_CRC15 : len > 16 ? CAN_CRC21 : CAN_CRC17;
+    p = &can_crc_params[type];
+    e.crc = fdf && iso ? p->init : 0;
+    e.crc_tab = can_crc_tables()->byte[type];
+    e.crc_poly = p->poly;
+    e.crc_mask = (1u << p->width) - 1;
+    e.crc_top = p->width - 1;
+    e.crc_stuff = fdf;
+
+    /* Arbitration and control field */
+    can_enc_put(&e, 0, true);                       /* SOF */
+    if (ext) {
+        id = cf->can_id & CAN_EFF_MASK;
+        can_enc_field(&e, id >> 18, 11, true);
+        can_enc_put(&e, 1, true);                   /* SRR */
+        can_enc_put(&e, 1, true);                   /* IDE */
+        can_enc_field(&e, id & 0x3ffff, 18, true);
+        can_enc_put(&e, rtr, true);                 /* RTR / RRS */
+        can_enc_put(&e, fdf, true);                 /* r1 / FDF */
+    } else {
+        id = cf->can_id & CAN_SFF_MASK;
+        can_enc_field(&e, id, 11, true);
+        can_enc_put(&e, rtr, true);                 /* RTR / RRS */
+        can_enc_put(&e, 0, true);                   /* IDE */
+        can_enc_put(&e, fdf, true);                 /* r0 / FDF */
+    }
+    if (fdf) {
+        can_enc_put(&e, 0, true);                   /* res */
+        if (brs)
+            bs->brs_pos = e.len;
+        can_enc_put(&e, brs, true);
+        if (brs)
+            bs->data_start = e.len;
+        can_enc_put(&e, !!(cf->flags & CANFD_ESI), true);
+    } else if (ext) {
+        can_enc_put(&e, 0, true);                   /* r0 */
+    }
+    can_enc_field(&e, dlc, 4, true);
+
+    for (unsigned i = 0; i < len; i++)
+        can_enc_byte(&e, cf->data[i]);
+
+    if (!fdf) {
+        bs->crc = e.crc;
+        can_enc_field(&e, e.crc, 15, false);
+        if (e.stuff_due)
+            can_enc_stuff(&e, false);
+    } else {
+        unsigned width = p->width;
+
+        if (iso) {
+            unsigned sc = e.stuff % 8;
+            unsigned gray = sc ^ (sc >> 1);
+            unsigned parity = (gray ^ (gray >> 1) ^ (gray >> 2)) & 1;
+
+            can_enc_fixed_stuff(&e);
+            for (int i = 2; i >= 0; i--) {
+                can_enc_raw(&e, (gray >> i) & 1);
+                can_enc_crc(&e, (gray >> i) & 1);
+            }
+            can_enc_raw(&e, parity);
+            can_enc_crc(&e, parity);
+        }
+        bs->crc = e.crc;
+        can_enc_fixed_stuff(&e);
+        for (unsigned i = 0; i < width; i++) {
+            can_enc_raw(&e, (e.crc >> (width - 1 - i)) & 1);
+            if (i % 4 == 3 && i != width - 1)
+                can_enc_fixed_stuff(&e);
+        }
+    }
+
+    can_enc_raw(&e, 1);                             /* CRC delimiter */
+    if (brs)
+        bs->data_end = e.len;
+    else
+        bs->data_start = bs->data_end = 0;
+    can_enc_raw(&e, 0);                             /* ACK slot */
+    can_enc_raw(&e, 1);                             /* ACK delimiter */
+    for (unsigned i = 0; i < 7; i++)
+        can_enc_raw(&e, 1);                         /* EOF */
+    bs->len = e.len;
+    bs->stuff = e.stuff;
+}
+
+void can_frame_from_words(const u32 *w, struct canfd_frame *cf, bool *fdf)
+{
+    union ctu_can_fd_frame_format_w ffw;
+    union ctu_can_fd_identifier_w idw;
+
+    ffw.u32 = w[0];
+    idw.u32 = w[1];
+    memset(cf, 0, sizeof(*cf));
+    if (ffw.s.ide == EXTENDED)
+        cf->can_id = (idw.s.identifier_base << 18 | idw.s.identifier_ext) |
+                     CAN_EFF_FLAG;
+    else
+        cf->can_id = idw.s.identifier_base;
+    *fdf = ffw.s.fdf == FD_CAN;
+    if (*fdf) {
+        cf->len = can_dlc2len(ffw.s.dlc);
+        if (ffw.s.brs == BR_SHIFT)
+            cf->flags |= CANFD_BRS;
+        if (ffw.s.esi_rsv == ESI_ERR_PASIVE)
+            cf->flags |= CANFD_ESI;
+    } else {
+        cf->len = ffw.s.dlc > 8 ? 8 : ffw.s.dlc;
+        if (ffw.s.rtr == RTR_FRAME)
+            cf->can_id |= CAN_RTR_FLAG;
+    }
+    if (!(cf->can_id & CAN_RTR_FLAG))
+        memcpy(cf->data, &w[4], cf->len);
+}
+
+static void can_walk_field(struct can_stuff_walk *w, uint32_t v, unsigned n,
+                           bool crc15)
+{
+    const struct can_crc_param *p = &can_crc_params[CAN_CRC15];
+
+    while (n--) {
+        unsigned b = (v >> n) & 1;
+
+        if (crc15)
+            w->crc = can_crc_bit(p, w->crc, b);
+        can_walk_bit(w, b);
+    }
+}
+
+/* Bits of the fixed stuffed FD CRC field incl. stuff count, and delimiter */
+static unsigned can_fd_crc_bits(unsigned len, bool iso)
+{
+    unsigned width = can_crc_params[len > 16 ? CAN_CRC21 : CAN_CRC17].width;
+
+    return (iso ? 1 + 4 : 0) + 1 + width + (width - 1) / 4 + 1;
+}
+
+/* Unstuffed bits from SOF to the end of data, and of those up to BRS */
+static void can_frame_raw_bits(const struct canfd_frame *cf, bool fdf,
+                               unsigned *dlc, unsigned *len,
+                               unsigned *head, unsigned *arb)
+{
+    bool ext = cf->can_id & CAN_EFF_FLAG;
+    bool rtr = !fdf && (cf->can_id & CAN_RTR_FLAG);
+
+    if (fdf) {
+        *dlc = can_len2dlc(cf->len);
+        *len = can_dlc2len(*dlc);
+    } else {
+        *dlc = cf->len > 8 ? 8 : cf->len;
+        *len = rtr ? 0 : *dlc;
+    }
+    /* SOF, ID, SRR/IDE, RTR/RRS, r1/r0/FDF (+ res, BRS, ESI for FD) */
+    *arb = ext ? 1 + 11 + 2 + 18 + 1 + 1 : 1 + 11 + 1 + 1 + 1;
+    if (fdf)
+        *arb += 2;
+    else if (ext)
+        *arb += 1;
+    *head = *arb + (fdf ? 1 : 0) + 4;
+}
+
+void can_frame_bits(const struct canfd_frame *cf, bool fdf, bool iso,
+                    unsigned *nbits, unsigned *dbits)
+{
+    const struct can_stuff_table *t = can_stuff_table();
+    const uint32_t *crc15 = can_crc_tables()->byte[CAN_CRC15];
+    struct can_stuff_walk w = {0, 0, 0, 0};
+    bool ext = cf->can_id & CAN_EFF_FLAG;
+    bool rtr = !fdf && (cf->can_id & CAN_RTR_FLAG);
+    bool brs = fdf && (cf->flags & CANFD_BRS);
+    unsigned dlc, len, head, arb, arb_stuff, st, last, total;
+
+    can_frame_raw_bits(cf, fdf, &dlc, &len, &head, &arb);
+
+    /* Header bit by bit, CRC15 only matters for classic frames */
+    can_walk_field(&w, 0, 1, !fdf);
+    if (ext) {
+        u32 id = cf->can_id & CAN_EFF_MASK;
+
+        can_walk_field(&w, id >> 18, 11, !fdf);
+        can_walk_field(&w, 3, 2, !fdf);
+        can_walk_field(&w, id & 0x3ffff, 18, !fdf);
+        can_walk_field(&w, rtr << 1 | fdf, 2, !fdf);
+    } else {
+        can_walk_field(&w, cf->can_id & CAN_SFF_MASK, 11, !fdf);
+        can_walk_field(&w, rtr << 2 | fdf, 3, !fdf);
+    }
+    if (fdf) {
+        can_walk_field(&w, 0, 1, false);            /* res */
+        /* A stuff bit after BRS is sent at the data bit rate */
+        arb_stuff = w.stuff;
+        can_walk_field(&w, brs, 1, false);
+        can_walk_field(&w, !!(cf->flags & CANFD_ESI), 1, false);
+    } else {
+        arb_stuff = w.stuff;
+        if (ext)
+            can_walk_field(&w, 0, 1, true);
+    }
+    /* CAN FD: the last bit before the CRC field is walked on its own */
+    last = fdf ? len ? cf->data[len - 1] & 1 : dlc & 1 : 2;
+    if (fdf && !len)
+        can_walk_field(&w, dlc >> 1, 3, false);
+    else
+        can_walk_field(&w, dlc, 4, !fdf);
+
+    /* Data bytes through the tables */
+    st = w.last * 5 + w.run;
+    for (unsigned i = 0; i < len; i++) {
+        uint8_t n;
+
+        if (fdf && i == len - 1) {
+            w.last = st / 5;
+            w.run = st % 5;
+            can_walk_field(&w, cf->data[i] >> 1, 7, false);
+            st = w.last * 5 + w.run;
+            break;
+        }
+        n = t->next[st][cf->data[i]];
+        if (!fdf)
+            w.crc = can_crc_byte(&can_crc_params[CAN_CRC15], crc15, w.crc, cf->data[i]);
+        st = n & 0xf;
+        w.stuff += n >> 4;
+    }
+    w.last = st / 5;
+    w.run = st % 5;
+    if (last < 2) {
+        unsigned stuff = w.stuff;
+
+        /* No stuff bit after it, the fixed stuff bit takes its place */
+        can_walk_bit(&w, last);
+        w.stuff = stuff;
+    }
+
+    if (!fdf) {
+        can_walk_field(&w, w.crc, 15, false);
+        total = head + 8 * len + 15 + w.stuff + 1;
+    } else {
+        total = head + 8 * len + w.stuff + can_fd_crc_bits(len, iso);
+    }
+    total += 2 + 7;                 /* ACK slot and delimiter, EOF */
+
+    *nbits = total;
+    /* After BRS to the CRC delimiter */
+    *dbits = brs ? total - 9 - arb - arb_stuff : 0;
+}
+
+void can_frame_bits_worst(const struct canfd_frame *cf, bool fdf, bool iso,
+                          unsigned *nbits, unsigned *dbits)
+{
+    bool brs = fdf && (cf->flags & CANFD_BRS);
+    unsigned dlc, len, head, arb, dyn, stuff, arb_stuff, total;
+
+    can_frame_raw_bits(cf, fdf, &dlc, &len, &head, &arb);
+    dyn = head + 8 * len + (fdf ? 0 : 15);
+    stuff = (dyn - 1) / 4;
+    arb_stuff = arb / 4;
+    if (arb_stuff > stuff)
+        arb_stuff = stuff;
+
+    if (!fdf)
+        total = dyn + stuff + 1;
+    else
+        total = dyn + stuff + can_fd_crc_bits(len, iso);
+    total += 2 + 7;
+
+    *nbits = total;
+    *dbits = brs ? total - 9 - arb - arb_stuff : 0;
+}
@@ -0,0 +1,94 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#pragma once
+
+#include "userspace_utils.h"
+#include "userspace_crc.h"
+
+/*
+ * Bit-accurate encoding of a CAN / CAN FD frame as seen on the bus, from
+ * SOF to the last EOF bit, with dynamic stuff bits, the CAN FD stuff count
+ * and fixed stuff bits, CRC and an acknowledged ACK slot. Used to get exact
+ * frame durations (stuff bits depend on content) and reference bit streams.
+ *
+ * Bits are stored one per byte, 0 = dominant. Bits from data_start up to
+ * data_end are sent at the data bit rate (after BRS to the CRC delimiter
+ * of frames with BRS set), all others at the nominal bit rate. In CAN FD
+ * frames no stuff bit follows the last bit before the CRC field even after
+ * five equal bits; the fixed stuff bit takes its place.
+ */
+
+#define CAN_BITSTREAM_MAX   800     /* Longest frame (FD, 64 B, ext. ID) fits */
+#define CAN_IFS_BITS        3       /* Intermission */
+#define CAN_ERROR_FRAME_BITS 20     /* Error flag, echo and delimiter, worst case */
+
+struct can_bitstream {
+    unsigned len;                   /* Number of bits SOF..EOF */
+    unsigned data_start;            /* First data bit rate bit, == data_end if none */
+    unsigned data_end;
+    unsigned brs_pos;               /* BRS bit of frames switching bit rate, else 0 */
+    unsigned stuff;                 /* Dynamic stuff bits */
+    unsigned fixed_stuff;           /* Fixed stuff bits in CRC field (CAN FD) */
+    uint32_t crc;
+    uint8_t bit[CAN_BITSTREAM_MAX];
+};
+
+/*
+ * Encode @cf, as CAN FD frame if @fdf. @iso selects ISO CAN FD (stuff
+ * count, non-zero CRC init) over the original non-ISO variant.
+ */
+void can_bitstream_encode(struct can_bitstream *bs, const struct canfd_frame *cf,
+                          bool fdf, bool iso);
+
+/* Duration of the encoded frame, without intermission */
+static inline uint64_t can_bitstream_ns(const struct can_bitstream *bs,
+                                        uint64_t nbit_ns, uint64_t dbit_ns)
+{
+    unsigned dbits = bs->data_end - bs->data_start;
+
+    return (uint64_t)(bs->len - dbits) * nbit_ns + (uint64_t)dbits * dbit_ns;
+}
+
+/*
+ * Length of a frame without building the bit stream: all bits SOF..EOF in
+ * @nbits, the part of them sent at the data bit rate in @dbits. Gives the
+ * same lengths as can_bitstream_encode, but stuff bits are counted with a
+ * table over whole data bytes (plus a CRC15 table for classic frames, whose
+ * CRC is stuffed), so it is cheap enough for every received frame.
+ */
+void can_frame_bits(const struct canfd_frame *cf, bool fdf, bool iso,
+                    unsigned *nbits, unsigned *dbits);
+
+/* Same with worst case stuffing, a stuff bit every 4 bits after the first 5 */
+void can_frame_bits_worst(const struct canfd_frame *cf, bool fdf, bool iso,
+                          unsigned *nbits, unsigned *dbits);
+
+/* Frame from TXT buffer / RX buffer words (FFW, IDW, 2 timestamp words, data) */
+void can_frame_from_words(const u32 *w, struct canfd_frame *cf, bool *fdf);
@@ -0,0 +1,274 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#include <errno.h>
+
+#include "userspace_bittiming.h"
+
+/* CiA recommendation, as can_calc_bittiming() */
+static unsigned default_sample_point(uint32_t bitrate)
+{
+    if (bitrate > 800000)
+        return 750;
+    if (bitrate > 500000)
+        return 800;
+    return 875;
+}
+
+static bool is_data_phase(const struct can_bittiming_const *btc)
+{
+    return btc == &ctu_can_fd_bit_timing_data_max;
+}
+
+/* True if @a ranks before @b */
+static bool bittiming_better(const struct bittiming_candidate *a,
+                             const struct bittiming_candidate *b)
+{
+    if (a->bitrate_error != b->bitrate_error)
+        return a->bitrate_error < b->bitrate_error;
+    if (a->sp_error != b->sp_error)
+        return a->sp_error < b->sp_error;
+    if (a->tolerance != b->tolerance)
+        return a->tolerance > b->tolerance;
+    if (a->ntq != b->ntq)
+        return a->ntq > b->ntq;
+    return a->brp < b->brp;
+}
+
+static void fill_candidate(struct bittiming_candidate *c, bool data, uint32_t clock,
+                           uint32_t bitrate, unsigned sample_point, unsigned brp,
+                           unsigned prop, unsigned ph1, unsigned ph2, unsigned sjw)
+{
+    unsigned ntq = 1 + prop + ph1 + ph2;
+    uint64_t prod = (uint64_t)bitrate * brp * ntq;
+    uint64_t diff = prod > clock ? prod - clock : clock - prod;
+    int64_t spd = (int64_t)(1 + prop + ph1) * 1000000 - (int64_t)sample_point * 1000 * ntq;
+    uint64_t tol = (uint64_t)sjw * 1000000 / (20 * ntq);
+
+    c->brp = brp;
+    c->prop = prop;
+    c->ph1 = ph1;
+    c->ph2 = ph2;
+    c->sjw = sjw;
+    c->ntq = ntq;
+    c->bitrate = clock / (brp * ntq);
+    c->sample_point = 1000 * (1 + prop + ph1) / ntq;
+    c->bitrate_error = diff * 1000000 / prod;
+    c->sp_error = (spd < 0 ? -spd : spd) / ntq;
+    if (!data) {
+        unsigned ph = ph1 < ph2 ? ph1 : ph2;
+        uint64_t t1 = (uint64_t)ph * 1000000 / (2 * (13 * ntq - ph2));
+
+        if (t1 < tol)
+            tol = t1;
+    }
+    c->tolerance = tol;
+}
+
+/* prop/ph1 split as programmed by ctucan_hw_set_nom/data_bittiming() */
+static void split_tseg1(unsigned tseg1, bool data, unsigned *prop, unsigned *ph1)
+{
+    unsigned ph1_max = data ? 31 : 63;
+
+    *prop = tseg1 / 2;
+    *ph1 = tseg1 - *prop;
+    if (*ph1 > ph1_max) {
+        *prop += *ph1 - ph1_max;
+        *ph1 = ph1_max;
+    }
+}
+
+static void rank_insert(struct bittiming_solution *sol, const struct bittiming_candidate *c)
+{
+    unsigned i;
+
+    if (sol->n == BITTIMING_RANKED) {
+        if (!bittiming_better(c, &sol->c[BITTIMING_RANKED - 1]))
+            return;
+        sol->n--;
+    }
+    for (i = sol->n; i && bittiming_better(c, &sol->c[i - 1]); i--)
+        sol->c[i] = sol->c[i - 1];
+    sol->c[i] = *c;
+    sol->n++;
+}
+
+int bittiming_solve(const struct can_bittiming_const *btc, uint32_t clock,
+                    uint32_t bitrate, unsigned sample_point,
+                    struct bittiming_solution *sol)
+{
+    bool data = is_data_phase(btc);
+    unsigned ntq_min = 1 + btc->tseg1_min + btc->tseg2_min;
+    unsigned ntq_max = 1 + btc->tseg1_max + btc->tseg2_max;
+    unsigned brp_inc = btc->brp_inc ? btc->brp_inc : 1;
+
+    memset(sol, 0, sizeof(*sol));
+    if (!sample_point)
+        sample_point = default_sample_point(bitrate);
+    sol->sample_point = sample_point;
+    if (!bitrate || !clock)
+        return -1;
+
+    for (unsigned brp = btc->brp_min; brp <= btc->brp_max; brp += brp_inc) {
+        for (unsigned ntq = ntq_min; ntq <= ntq_max; ntq++) {
+            uint64_t prod = (uint64_t)bitrate * brp * ntq;
+            uint64_t diff = prod > clock ? prod - clock : clock - prod;
+
+            if (diff * 1000000 > prod * BITTIMING_MAX_ERROR_PPM) {
+                /* Bit time only grows from here */
+                if (prod > clock)
+                    break;
+                continue;
+            }
+            for (unsigned tseg2 = btc->tseg2_min; tseg2 <= btc->tseg2_max; tseg2++) {
+                struct bittiming_candidate c;
+                unsigned tseg1 = ntq - 1 - tseg2;
+                unsigned prop, ph1, sjw;
+
+                if (tseg2 + 1 + btc->tseg1_min > ntq)
+                    break;
+                if (tseg1 > btc->tseg1_max)
+                    continue;
+                split_tseg1(tseg1, data, &prop, &ph1);
+                sjw = btc->sjw_max ? btc->sjw_max : 1;
+                if (sjw > ph1)
+                    sjw = ph1;
+                if (sjw > tseg2)
+                    sjw = tseg2;
+                fill_candidate(&c, data, clock, bitrate, sample_point, brp,
+                               prop, ph1, tseg2, sjw);
+                sol->evaluated++;
+                rank_insert(sol, &c);
+            }
+        }
+    }
+    return sol->n ? 0 : -1;
+}
+
+void bittiming_cache_init(struct bittiming_cache *c)
+{
+    memset(c, 0, sizeof(*c));
+}
+
+const struct bittiming_solution *bittiming_lookup(struct bittiming_cache *c,
+                                                  const struct can_bittiming_const *btc,
+                                                  uint32_t clock, uint32_t bitrate,
+                                                  unsigned sample_point)
+{
+    uint32_t h = ((uint32_t)(uintptr_t)btc ^ clock ^ bitrate * 0x9e3779b1u ^
+                  sample_point * 0x85ebca6bu);
+    struct bittiming_cache_entry *set = &c->e[((h ^ (h >> 16)) % BITTIMING_CACHE_SETS) *
+                                               BITTIMING_CACHE_WAYS];
+    struct bittiming_cache_entry *victim = set;
+
+    for (unsigned w = 0; w < BITTIMING_CACHE_WAYS; w++) {
+        struct bittiming_cache_entry *e = &set[w];
+
+        if (e->used && e->btc == btc && e->clock == clock && e->bitrate == bitrate &&
+            e->sample_point == sample_point) {
+            c->hits++;
+            e->used = ++c->tick;
+            return e->sol.n ? &e->sol : NULL;
+        }
+        if (e->used < victim->used)
+            victim = e;
+    }
+
+    c->misses++;
+    victim->btc = btc;
+    victim->clock = clock;
+    victim->bitrate = bitrate;
+    victim->sample_point = sample_point;
+    victim->used = ++c->tick;
+    if (bittiming_solve(btc, clock, bitrate, sample_point, &victim->sol))
+        return NULL;
+    return &victim->sol;
+}
+
+void bittiming_cache_warm(struct bittiming_cache *c, const struct can_bittiming_const *btc,
+                          uint32_t clock, const uint32_t *bitrates)
+{
+    for (; *bitrates; bitrates++)
+        bittiming_lookup(c, btc, clock, *bitrates, 0);
+}
+
+void bittiming_to_can(const struct bittiming_candidate *cand, uint32_t clock,
+                      struct can_bittiming *bt)
+{
+    bt->bitrate = cand->bitrate;
+    bt->sample_point = cand->sample_point;
+    bt->tq = (uint64_t)cand->brp * 1000000000 / clock;
+    bt->prop_seg = cand->prop;
+    bt->phase_seg1 = cand->ph1;
+    bt->phase_seg2 = cand->ph2;
+    bt->sjw = cand->sjw;
+    bt->brp = cand->brp;
+}
+
+int bittiming_get(struct bittiming_cache *c, const struct can_bittiming_const *btc,
+                  uint32_t clock, struct can_bittiming *bt)
+{
+    const struct bittiming_solution *sol;
+    struct bittiming_candidate cand;
+    unsigned sjw = bt->sjw;
+
+    sol = bittiming_lookup(c, btc, clock, bt->bitrate, bt->sample_point);
+    if (!sol)
+        return -EDOM;
+    cand = sol->c[0];
+    if (sjw && sjw < cand.sjw)
+        cand.sjw = sjw;
+    bittiming_to_can(&cand, clock, bt);
+    return 0;
+}
+
+void bittiming_evaluate(const struct can_bittiming_const *btc, uint32_t clock,
+                        uint32_t bitrate, unsigned sample_point,
+                        const struct can_bittiming *bt, struct bittiming_candidate *cand)
+{
+    if (!sample_point)
+        sample_point = default_sample_point(bitrate);
+    fill_candidate(cand, is_data_phase(btc), clock, bitrate, sample_point, bt->brp,
+                   bt->prop_seg, bt->phase_seg1, bt->phase_seg2, bt->sjw);
+}
+
+void bittiming_print(const struct bittiming_solution *sol, FILE *f)
+{
+    fprintf(f, "bittiming: %u settings evaluated, sample point %u.%u%% requested\n",
+            sol->evaluated, sol->sample_point / 10, sol->sample_point % 10);
+    fprintf(f, "  rank brp prop ph1 ph2 sjw  tq    bitrate  err[ppm]    sp  sp_err[ppm]  tol[ppm]\n");
+    for (unsigned i = 0; i < sol->n; i++) {
+        const struct bittiming_candidate *c = &sol->c[i];
+
+        fprintf(f, "  %4u %3u %4u %3u %3u %3u %3u %10u %9u %3u.%u %12u %9u\n",
+                i + 1, c->brp, c->prop, c->ph1, c->ph2, c->sjw, c->ntq, c->bitrate,
+                c->bitrate_error, c->sample_point / 10, c->sample_point % 10,
+                c->sp_error, c->tolerance);
+    }
+}
@@ -0,0 +1,129 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#pragma once
+
+#include "userspace_utils.h"
+
+/*
+ * Bit timing solver with full search and ranking.
+ *
+ * Unlike can_calc_bittiming(), which returns the first setting within its
+ * error bounds, every (brp, tseg1, tseg2) of a can_bittiming_const is
+ * evaluated whose bitrate is within BITTIMING_MAX_ERROR_PPM. tseg1 is split
+ * into prop/ph1 as ctucan_hw_set_nom/data_bittiming() program it, and SJW
+ * is the largest allowed, min(sjw_max, ph1, ph2): a smaller one only lowers
+ * the tolerance, so these two choices are not searched.
+ *
+ * Candidates are ranked by bitrate error, then sample point error, then
+ * oscillator tolerance (larger first), then number of time quanta (more
+ * first). Tolerance is the ISO 11898-1 clock tolerance bound of the phase:
+ *   nominal: min(min(ph1, ph2) / (2 (13 NBT - ph2)), sjw / (20 NBT))
+ *   data:    sjw / (20 DBT)
+ * with NBT/DBT the bit time in time quanta.
+ *
+ * Results are cached per (constants, clock, bitrate, sample point), so
+ * repeated reconfiguration costs one cache lookup.
+ */
+
+#define BITTIMING_RANKED        8       /* Candidates kept per solution */
+#define BITTIMING_MAX_ERROR_PPM 50000   /* As CAN_CALC_MAX_ERROR */
+#define BITTIMING_CACHE_SETS    16
+#define BITTIMING_CACHE_WAYS    4
+
+struct bittiming_candidate {
+    uint16_t brp, prop, ph1, ph2, sjw;
+    uint16_t ntq;               /* 1 + prop + ph1 + ph2 */
+    uint32_t bitrate;           /* Actual, Hz */
+    uint16_t sample_point;      /* Per mille, rounded down */
+    uint32_t bitrate_error;     /* |actual - requested| in ppm of requested */
+    uint32_t sp_error;          /* |actual - requested| sample point, ppm of bit */
+    uint32_t tolerance;         /* Oscillator tolerance, ppm */
+};
+
+struct bittiming_solution {
+    struct bittiming_candidate c[BITTIMING_RANKED];   /* Best first */
+    unsigned n;
+    uint16_t sample_point;      /* Requested, per mille, CiA default filled in */
+    uint32_t evaluated;         /* Settings within the bitrate error */
+};
+
+struct bittiming_cache_entry {
+    const struct can_bittiming_const *btc;
+    uint32_t clock, bitrate;
+    uint16_t sample_point;      /* As requested, 0 = CiA default */
+    uint32_t used;              /* For LRU, 0 = free */
+    struct bittiming_solution sol;
+};
+
+struct bittiming_cache {
+    struct bittiming_cache_entry e[BITTIMING_CACHE_SETS * BITTIMING_CACHE_WAYS];
+    uint32_t tick;
+    uint64_t hits, misses;
+};
+
+/*
+ * Rank all settings of @btc for @bitrate at @clock. @sample_point is in
+ * per mille, 0 selects the CiA recommendation used by can_calc_bittiming().
+ * Returns -1 if no setting is within BITTIMING_MAX_ERROR_PPM.
+ */
+int bittiming_solve(const struct can_bittiming_const *btc, uint32_t clock,
+                    uint32_t bitrate, unsigned sample_point,
+                    struct bittiming_solution *sol);
+
+void bittiming_cache_init(struct bittiming_cache *c);
+
+/* As bittiming_solve(), cached. The solution stays valid until evicted. */
+const struct bittiming_solution *bittiming_lookup(struct bittiming_cache *c,
+                                                  const struct can_bittiming_const *btc,
+                                                  uint32_t clock, uint32_t bitrate,
+                                                  unsigned sample_point);
+
+/* Solve for a zero terminated list of bitrates in advance */
+void bittiming_cache_warm(struct bittiming_cache *c, const struct can_bittiming_const *btc,
+                          uint32_t clock, const uint32_t *bitrates);
+
+/*
+ * Replacement for can_get_bittiming() with a computed setting: takes
+ * bt->bitrate and bt->sample_point, fills in the best candidate. A non-zero
+ * bt->sjw caps SJW as there. Returns -EDOM if nothing is close enough.
+ */
+int bittiming_get(struct bittiming_cache *c, const struct can_bittiming_const *btc,
+                  uint32_t clock, struct can_bittiming *bt);
+
+/* Fill @bt from @cand */
+void bittiming_to_can(const struct bittiming_candidate *cand, uint32_t clock,
+                      struct can_bittiming *bt);
+
+/* Tolerance and errors of a setting, e.g. one from can_calc_bittiming() */
+void bittiming_evaluate(const struct can_bittiming_const *btc, uint32_t clock,
+                        uint32_t bitrate, unsigned sample_point,
+                        const struct can_bittiming *bt, struct bittiming_candidate *cand);
+
+void bittiming_print(const struct bittiming_solution *sol, FILE *f);
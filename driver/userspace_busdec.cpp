@@ -0,0 +1,619 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#include "userspace_busdec.h"
+
+const char *const busdec_status_names[BUSDEC_STATUS_NUM] = {
+    "ok", "stuff", "form", "crc", "stuff count", "ack", "truncated",
+};
+
+#define BUSDEC_WORDS        (CAN_BITSTREAM_MAX / 64 + 2)
+
+/*
+ * Destuffing state: last bit * 6 + length of its run (1..5), 0 before
+ * SOF. At run 5 the next bit is a stuff bit.
+ */
+#define DS_STATES           12
+
+/* Destuff table entry: output bits, their number, new state, stuff bits */
+#define DS_OUT(e)           ((e) & 0xff)
+#define DS_NOUT(e)          (((e) >> 8) & 0xf)
+#define DS_STATE(e)         (((e) >> 12) & 0xf)
+#define DS_STUFF(e)         (((e) >> 16) & 0xf)
+#define DS_ERR              (1u << 20)
+
+enum {
+    DS_BIT_STUFF = -1,
+    DS_BIT_ERR = -2,
+};
+
+/* One stuffed bit, @out gets the bit, DS_BIT_STUFF or DS_BIT_ERR */
+static unsigned busdec_destuff_bit(unsigned st, unsigned b, int *out)
+{
+    unsigned last = st / 6, run = st % 6;
+
+    if (run == 5) {
+        if (b == last) {
+            *out = DS_BIT_ERR;
+            return st;
+        }
+        *out = DS_BIT_STUFF;
+        return b * 6 + 1;
+    }
+    *out = b;
+    return run && b == last ? st + 1 : b * 6 + 1;
+}
+
+struct busdec_tables {
+    uint32_t destuff[DS_STATES][256];
+};
+
+static struct busdec_tables busdec_tables_build()
+{
+    struct busdec_tables t;
+
+    for (unsigned st0 = 0; st0 < DS_STATES; st0++) {
+        for (unsigned byte = 0; byte < 256; byte++) {
+            uint32_t out = 0, nout = 0, stuff = 0, err = 0;
+            unsigned st = st0;
+            int o;
+
+            for (int i = 7; i >= 0 && !err; i--) {
+                st = busdec_destuff_bit(st, (byte >> i) & 1, &o);
+                if (o == DS_BIT_ERR) {
+                    err = DS_ERR;
+                } else if (o == DS_BIT_STUFF) {
+                    stuff++;
+                } else {
+                    out = out << 1 | o;
+                    nout++;
+                }
+            }
+            t.destuff[st0][byte] = out | nout << 8 | st << 12 | stuff << 16 | err;
+        }
+    }
+    return t;
+}
+
+static const struct busdec_tables *busdec_tables()
+{
+    static const struct busdec_tables t = busdec_tables_build();
+
+    return &t;
+}
+
+/* Packed bit buffers, first bit in the MSB of word 0 */
+
+static inline uint32_t bits_get(const uint64_t *w, unsigned pos, unsigned n)
+{
+    unsigned off = pos & 63;
+    uint64_t v = w[pos >> 6] << off;
+
+    if (off)
+        v |= w[(pos >> 6) + 1] >> (64 - off);
+    return v >> (64 - n);
+}
+
+/* @n ones from @pos */
+static inline void bits_set(uint64_t *w, unsigned pos, unsigned n)
+{
+    while (n) {
+        unsigned off = pos & 63;
+        unsigned k = 64 - off < n ? 64 - off : n;
+
+        w[pos >> 6] |= (~0ull >> off) & ~(off + k == 64 ? 0 : ~0ull >> (off + k));
+        pos += k;
+        n -= k;
+    }
+}
+
+/* Low @n bits of @v (1..32) to @pos, the buffer is zeroed */
+static inline void bits_append(uint64_t *w, unsigned pos, uint32_t v, unsigned n)
+{
+    unsigned off = pos & 63;
+    uint64_t x = (uint64_t)v << (64 - n);
+
+    w[pos >> 6] |= x >> off;
+    if (off + n > 64)
+        w[(pos >> 6) + 1] |= x << (64 - off);
+}
+
+struct busdec_sampler {
+    const uint32_t *run;
+    size_t n, i;
+    uint64_t start, end;        /* Of run i */
+    unsigned level;             /* Of run i, 0 = dominant */
+    uint64_t t;                 /* Next sample point */
+    uint32_t q, spq;            /* Bit length and sample point at the current rate */
+};
+
+static inline bool busdec_next_run(struct busdec_sampler *s)
+{
+    if (++s->i >= s->n)
+        return false;
+    s->start = s->end;
+    s->end += s->run[s->i];
+    s->level ^= 1;
+    return true;
+}
+
+/* Up to @max equal bits from the next sample point on. Returns 0 at the end. */
+static inline unsigned busdec_sample_bits(struct busdec_sampler *s, unsigned max,
+                                          unsigned *level)
+{
+    uint64_t left;
+    unsigned k;
+
+    while (s->t >= s->end) {
+        if (!busdec_next_run(s))
+            return 0;
+        if (!s->level)
+            s->t = s->start + s->spq;       /* Resync */
+    }
+    left = s->end - 1 - s->t;
+    k = left >= (uint64_t)s->q * max ? max : (uint32_t)left / s->q + 1;
+    *level = s->level;
+    s->t += (uint64_t)k * s->q;
+    return k;
+}
+
+/* Switch the bit rate at the sample point just taken */
+static inline void busdec_rate(struct busdec_sampler *s, uint32_t q, uint32_t spq)
+{
+    s->t = s->t - s->q + q;
+    s->q = q;
+    s->spq = spq;
+}
+
+struct busdec_dec {
+    struct busdec *d;
+    struct busdec_sampler *s;
+    struct busdec_frame *f;
+    uint64_t raw[BUSDEC_WORDS];     /* As sampled, 1 = recessive */
+    uint64_t data[BUSDEC_WORDS];    /* Destuffed */
+    unsigned nraw, ndata;
+    unsigned st;                    /* Destuffing state */
+};
+
+/* @n more bits as sampled */
+static bool busdec_take(struct busdec_dec *x, unsigned n)
+{
+    unsigned level, k;
+
+    if (x->nraw + n > CAN_BITSTREAM_MAX)
+        return false;
+    while (n) {
+        k = busdec_sample_bits(x->s, n, &level);
+        if (!k)
+            return false;
+        if (level)
+            bits_set(x->raw, x->nraw, k);
+        x->nraw += k;
+        n -= k;
+    }
+    return true;
+}
+
+static inline unsigned busdec_raw(const struct busdec_dec *x, unsigned pos)
+{
+    return (x->raw[pos >> 6] >> (63 - (pos & 63))) & 1;
+}
+
+/* Destuff the sampled bits from @pos on, 8 at a time where possible */
+static bool busdec_destuff(struct busdec_dec *x, unsigned pos)
+{
+    const struct busdec_tables *t = busdec_tables();
+
+    while (x->nraw - pos >= 8) {
+        uint32_t e = t->destuff[x->st][bits_get(x->raw, pos, 8)];
+
+        if (e & DS_ERR)
+            break;
+        if (DS_NOUT(e))
+            bits_append(x->data, x->ndata, DS_OUT(e), DS_NOUT(e));
+        x->ndata += DS_NOUT(e);
+        x->f->stuff += DS_STUFF(e);
+        x->st = DS_STATE(e);
+        pos += 8;
+    }
+    for (; pos < x->nraw; pos++) {
+        unsigned b = busdec_raw(x, pos);
+        int out;
+
+        x->st = busdec_destuff_bit(x->st, b, &out);
+        if (out == DS_BIT_ERR) {
+            x->f->error_flag = !b;
+            x->nraw = pos + 1;
+            return false;
+        }
+        if (out == DS_BIT_STUFF) {
+            x->f->stuff++;
+        } else {
+            if (b)
+                bits_set(x->data, x->ndata, 1);
+            x->ndata++;
+        }
+    }
+    return true;
+}
+
+/*
+ * Destuffed bits up to @n. Sampling as many bits as are missing never
+ * runs past them, so the bit rate can switch right after any of them.
+ */
+static enum busdec_status busdec_fill(struct busdec_dec *x, unsigned n)
+{
+    while (x->ndata < n) {
+        unsigned pos = x->nraw;
+
+        if (!busdec_take(x, n - x->ndata))
+            return BUSDEC_TRUNCATED;
+        if (!busdec_destuff(x, pos))
+            return BUSDEC_STUFF_ERR;
+    }
+    return BUSDEC_OK;
+}
+
+static inline uint32_t busdec_get(const struct busdec_dec *x, unsigned pos, unsigned n)
+{
+    return bits_get(x->data, pos, n);
+}
+
+/* Fixed stuffed CAN FD CRC field, from the stuff count on */
+static enum busdec_status busdec_fd_crc(struct busdec_dec *x, unsigned len)
+{
+    const struct busdec_config *cfg = &x->d->cfg;
+    struct busdec_frame *f = x->f;
+    enum can_crc_type type = len > 16 ? CAN_CRC21 : CAN_CRC17;
+    unsigned width = can_crc_params[type].width;
+    unsigned nfix = (cfg->iso ? 5 : 0) + 1 + width + (width - 1) / 4;
+    unsigned pos = x->nraw;
+    uint32_t v = 0;
+
+    if (!busdec_take(x, nfix))
+        return BUSDEC_TRUNCATED;
+
+    /* A fixed stuff bit before every 4 bits */
+    for (unsigned i = 0; i < nfix; i++) {
+        unsigned b = busdec_raw(x, pos + i);
+
+        if (i % 5) {
+            v = v << 1 | b;
+        } else if (b == busdec_raw(x, pos + i - 1)) {
+            f->error_flag = !b;
+            x->nraw = pos + i + 1;
+            return BUSDEC_STUFF_ERR;
+        }
+    }
+    f->crc = v & ((1u << width) - 1);
+
+    f->crc_calc = can_crc_packed(type, cfg->iso ? can_crc_params[type].init : 0,
+                                 x->raw, 0, pos);
+    if (cfg->iso) {
+        unsigned sc = v >> width;
+        unsigned gray = sc >> 1;
+
+        f->crc_calc = can_crc_packed(type, f->crc_calc, x->raw, pos + 1, 4);
+        f->stuff_count = gray ^ (gray >> 1) ^ (gray >> 2);
+        if (((gray ^ (gray >> 1) ^ (gray >> 2)) & 1) != (sc & 1) ||
+            f->stuff_count != f->stuff % 8)
+            return BUSDEC_STUFF_COUNT_ERR;
+    }
+    return f->crc == f->crc_calc ? BUSDEC_OK : BUSDEC_CRC_ERR;
+}
+
+static enum busdec_status busdec_frame_decode(struct busdec_dec *x)
+{
+    struct busdec *d = x->d;
+    struct busdec_frame *f = x->f;
+    struct canfd_frame *cf = &f->cf;
+    enum busdec_status r;
+    unsigned p, dlc, len;
+    bool ext, rtr, brs = false;
+
+    /* SOF, base ID, RTR / SRR, IDE */
+    if ((r = busdec_fill(x, 14)))
+        return r;
+    ext = busdec_get(x, 13, 1);
+    if (ext) {
+        if ((r = busdec_fill(x, 34)))
+            return r;
+        cf->can_id = busdec_get(x, 1, 11) << 18 | busdec_get(x, 14, 18) | CAN_EFF_FLAG;
+        rtr = busdec_get(x, 32, 1);
+        f->fdf = busdec_get(x, 33, 1);
+        p = 34;
+    } else {
+        if ((r = busdec_fill(x, 15)))
+            return r;
+        cf->can_id = busdec_get(x, 1, 11);
+        rtr = busdec_get(x, 12, 1);
+        f->fdf = busdec_get(x, 14, 1);
+        p = 15;
+    }
+
+    if (f->fdf) {
+        /* res, BRS; the rate switches at the sample point of BRS */
+        if ((r = busdec_fill(x, p + 2)))
+            return r;
+        if (busdec_get(x, p, 1))
+            return BUSDEC_FORM_ERR;
+        brs = busdec_get(x, p + 1, 1);
+        if (brs) {
+            cf->flags |= CANFD_BRS;
+            busdec_rate(x->s, d->dq, d->dsp);
+        }
+        if ((r = busdec_fill(x, p + 7)))
+            return r;
+        if (busdec_get(x, p + 2, 1))
+            cf->flags |= CANFD_ESI;
+        dlc = busdec_get(x, p + 3, 4);
+        len = can_dlc2len(dlc);
+        cf->len = len;
+        p += 7;
+    } else {
+        /* r0 (and r1) are not checked, receivers accept both levels */
+        p += ext ? 1 : 0;
+        if ((r = busdec_fill(x, p + 4)))
+            return r;
+        dlc = busdec_get(x, p, 4);
+        cf->len = dlc > 8 ? 8 : dlc;
+        len = rtr ? 0 : cf->len;
+        if (rtr)
+            cf->can_id |= CAN_RTR_FLAG;
+        p += 4;
+    }
+
+    if (!f->fdf) {
+        if ((r = busdec_fill(x, p + len * 8 + 15)))
+            return r;
+        for (unsigned i = 0; i < len; i++)
+            cf->data[i] = busdec_get(x, p + i * 8, 8);
+        f->crc = busdec_get(x, p + len * 8, 15);
+        f->crc_calc = can_crc_packed(CAN_CRC15, 0, x->data, 0, p + len * 8);
+        /* The CRC is stuffed up to its last bit */
+        if (x->st % 6 == 5) {
+            unsigned pos = x->nraw;
+
+            if (!busdec_take(x, 1))
+                return BUSDEC_TRUNCATED;
+            if (!busdec_destuff(x, pos))
+                return BUSDEC_STUFF_ERR;
+        }
+        if (f->crc != f->crc_calc)
+            return BUSDEC_CRC_ERR;
+    } else {
+        /* No stuff bit after the last data bit, the fixed stuff bit follows */
+        if ((r = busdec_fill(x, p + len * 8)))
+            return r;
+        for (unsigned i = 0; i < len; i++)
+            cf->data[i] = busdec_get(x, p + i * 8, 8);
+        if ((r = busdec_fd_crc(x, len)))
+            return r;
+    }
+
+    /* CRC delimiter, the rate switches back at its sample point */
+    if (!busdec_take(x, 1))
+        return BUSDEC_TRUNCATED;
+    if (!busdec_raw(x, x->nraw - 1))
+        return BUSDEC_FORM_ERR;
+    if (brs)
+        busdec_rate(x->s, d->nq, d->nsp);
+
+    /* ACK slot and delimiter, EOF (a dominant last bit is an overload) */
+    if (!busdec_take(x, 2))
+        return BUSDEC_TRUNCATED;
+    if (busdec_raw(x, x->nraw - 2))
+        return BUSDEC_ACK_ERR;
+    if (!busdec_raw(x, x->nraw - 1))
+        return BUSDEC_FORM_ERR;
+    if (!busdec_take(x, 7))
+        return BUSDEC_TRUNCATED;
+    for (unsigned i = 7; i > 1; i--)
+        if (!busdec_raw(x, x->nraw - i))
+            return BUSDEC_FORM_ERR;
+    return BUSDEC_OK;
+}
+
+void busdec_config_defaults(struct busdec_config *cfg)
+{
+    /* The reference data sets */
+    cfg->clk_freq = 100000000;
+    cfg->bitrate = 500000;
+    cfg->dbitrate = 2000000;
+    cfg->sp = 800;
+    cfg->dsp = 800;
+    cfg->iso = true;
+}
+
+int busdec_init(struct busdec *d, const struct busdec_config *cfg,
+                busdec_fn fn, void *arg)
+{
+    memset(d, 0, sizeof(*d));
+    d->cfg = *cfg;
+    d->fn = fn;
+    d->arg = arg;
+    if (!cfg->bitrate || !cfg->dbitrate || cfg->sp >= 1000 || cfg->dsp >= 1000) {
+        warnx("busdec: invalid bit rate or sample point");
+        return -1;
+    }
+    d->nq = (cfg->clk_freq + cfg->bitrate / 2) / cfg->bitrate;
+    d->dq = (cfg->clk_freq + cfg->dbitrate / 2) / cfg->dbitrate;
+    if (d->nq < 2 || d->dq < 2) {
+        warnx("busdec: bit rate too high for %u samples/s", cfg->clk_freq);
+        return -1;
+    }
+    d->nsp = d->nq * cfg->sp / 1000;
+    d->dsp = d->dq * cfg->dsp / 1000;
+    /* Sample point of the last idle bit */
+    d->idle = (BUSDEC_IDLE_BITS - 1) * d->nq + d->nsp;
+    return 0;
+}
+
+void busdec_runs(struct busdec *d, const uint32_t *run, size_t n, bool dominant,
+                 uint64_t t0, bool idle)
+{
+    struct busdec_sampler s;
+    struct busdec_frame f;
+    struct busdec_dec x;
+    bool need_idle = !idle;
+    uint64_t samples = 0;
+
+    if (!n)
+        return;
+    for (size_t i = 0; i < n; i++)
+        samples += run[i];
+    d->stats.samples += samples;
+    d->stats.runs += n;
+
+    s.run = run;
+    s.n = n;
+    s.i = 0;
+    s.start = t0;
+    s.end = t0 + run[0];
+    s.level = !dominant;
+    x.d = d;
+    x.s = &s;
+    x.f = &f;
+
+    for (;;) {
+        /* SOF: a dominant run longer than the sample point, after idle if needed */
+        for (;;) {
+            if (s.level && s.end - s.start >= d->idle)
+                need_idle = false;
+            if (!busdec_next_run(&s))
+                return;
+            if (!s.level && !need_idle && s.end - s.start > d->nsp)
+                break;
+        }
+
+        /* Hard sync */
+        s.t = s.start + d->nsp;
+        s.q = d->nq;
+        s.spq = d->nsp;
+        memset(&f, 0, sizeof(f));
+        memset(x.raw, 0, sizeof(x.raw));
+        memset(x.data, 0, sizeof(x.data));
+        x.nraw = 0;
+        x.ndata = 0;
+        x.st = 0;
+        f.sof = s.start;
+
+        f.status = busdec_frame_decode(&x);
+        f.bits = x.nraw;
+        f.end = s.t - s.q;
+        d->stats.frames++;
+        d->stats.status[f.status]++;
+        d->stats.error_flags += f.error_flag;
+        if (d->fn)
+            d->fn(d->arg, &f);
+        if (f.status == BUSDEC_TRUNCATED)
+            return;
+        need_idle = f.status != BUSDEC_OK;
+    }
+}
+
+/* First sample from @i on whose signal bit differs from @level (0 or @mask) */
+static size_t busdec_scan(const uint8_t *s, size_t n, size_t i, uint8_t mask, uint8_t level)
+{
+    const uint64_t m = 0x0101010101010101ull * mask;
+    const uint64_t l = 0x0101010101010101ull * level;
+
+    for (; i + 32 <= n; i += 32) {
+        uint64_t w[4];
+
+        memcpy(w, s + i, sizeof(w));
+        if (((w[0] ^ l) | (w[1] ^ l) | (w[2] ^ l) | (w[3] ^ l)) & m)
+            break;
+    }
+    for (; i < n; i++)
+        if ((s[i] & mask) != level)
+            return i;
+    return n;
+}
+
+size_t busdec_sample_runs(const uint8_t *s, size_t n, uint8_t mask, bool invert,
+                          uint32_t *run, size_t max, bool *dominant, size_t *used)
+{
+    size_t i = 0, k = 0;
+    uint8_t level;
+
+    *used = 0;
+    if (!n || !max)
+        return 0;
+    level = s[0] & mask;
+    *dominant = !level != invert;
+    while (i < n && k < max) {
+        size_t j = busdec_scan(s, n, i, mask, level);
+
+        run[k++] = j - i;
+        i = j;
+        level ^= mask;
+    }
+    *used = i;
+    return k;
+}
+
+size_t busdec_idle_split(const struct busdec *d, const uint8_t *s, size_t n,
+                         uint8_t mask, bool invert, size_t at)
+{
+    uint8_t rec = invert ? 0 : mask;
+    size_t i = at;
+
+    while (i < n) {
+        size_t j = busdec_scan(s, n, i, mask, rec);
+
+        if (j - i >= d->idle)
+            return i + d->idle;
+        i = busdec_scan(s, n, j, mask, rec ^ mask);
+    }
+    return n;
+}
+
+void busdec_stats_add(struct busdec_stats *to, const struct busdec_stats *from)
+{
+    to->samples += from->samples;
+    to->runs += from->runs;
+    to->frames += from->frames;
+    for (unsigned i = 0; i < BUSDEC_STATUS_NUM; i++)
+        to->status[i] += from->status[i];
+    to->error_flags += from->error_flags;
+}
+
+void busdec_report(const struct busdec_stats *st, FILE *f)
+{
+    fprintf(f, "%llu samples, %llu runs, %llu frames, %llu ok\n",
+            (unsigned long long)st->samples, (unsigned long long)st->runs,
+            (unsigned long long)st->frames, (unsigned long long)st->status[BUSDEC_OK]);
+    for (unsigned i = 1; i < BUSDEC_STATUS_NUM; i++)
+        if (st->status[i])
+            fprintf(f, "  %-12s %llu\n", busdec_status_names[i],
+                    (unsigned long long)st->status[i]);
+    if (st->error_flags)
+        fprintf(f, "  %-12s %llu\n", "error flags", (unsigned long long)st->error_flags);
+}
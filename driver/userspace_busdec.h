@@ -0,0 +1,149 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#pragma once
+
+#include "userspace_utils.h"
+#include "userspace_bitstream.h"
+
+/*
+ * Decoding of sampled bus traces back into frames: the run-length bit
+ * sequences of tools/Kvaser_logger (userspace_refgen.h), or logic analyzer
+ * captures with one byte per sample.
+ *
+ * A trace is a sequence of runs of alternating levels, in samples. Bits
+ * are sampled at the sample point, with a hard sync on SOF and a resync on
+ * every recessive to dominant edge (as with an unlimited SJW). A run gives
+ * all its bits at once. The rate switches to the data bit rate at the
+ * sample point of BRS and back at the one of the CRC delimiter.
+ *
+ * The stuffed bits are destuffed 8 at a time through a table over the
+ * stuffing state and the next 8 bits, which also flags stuff errors. The
+ * decoder checks the CRC, the CAN FD stuff count and its parity, the fixed
+ * stuff bits, the ACK and the fixed form fields. A stuff error on six
+ * dominant bits is taken as an error flag of another node. After an error
+ * the next SOF needs bus idle: BUSDEC_IDLE_BITS recessive bits. The same
+ * holds at the start of a trace, unless it is known to start in idle.
+ *
+ * Traces split at bus idle decode independently, which is what the parallel
+ * mode of busdec does.
+ */
+
+#define BUSDEC_IDLE_BITS    11
+
+struct busdec_config {
+    uint32_t clk_freq;          /* Samples per second */
+    uint32_t bitrate;
+    uint32_t dbitrate;
+    unsigned sp;                /* Nominal sample point, per mille */
+    unsigned dsp;               /* Data sample point, per mille */
+    bool iso;                   /* ISO CAN FD */
+};
+
+enum busdec_status {
+    BUSDEC_OK,
+    BUSDEC_STUFF_ERR,           /* Six equal bits, or a wrong fixed stuff bit */
+    BUSDEC_FORM_ERR,            /* Recessive bit of a fixed field dominant, or res */
+    BUSDEC_CRC_ERR,
+    BUSDEC_STUFF_COUNT_ERR,     /* ISO CAN FD stuff count or its parity */
+    BUSDEC_ACK_ERR,             /* ACK slot recessive */
+    BUSDEC_TRUNCATED,           /* Trace ends in the frame */
+    BUSDEC_STATUS_NUM,
+};
+
+extern const char *const busdec_status_names[BUSDEC_STATUS_NUM];
+
+struct busdec_frame {
+    struct canfd_frame cf;      /* Fields decoded up to the error */
+    bool fdf;
+    enum busdec_status status;
+    bool error_flag;            /* Stuff error on dominant bits */
+    uint64_t sof;               /* Sample of the SOF edge */
+    uint64_t end;               /* Sample point of the last bit decoded */
+    unsigned bits;              /* Bits decoded, with stuff bits */
+    unsigned stuff;             /* Dynamic stuff bits */
+    unsigned stuff_count;       /* Received (ISO CAN FD), Gray decoded */
+    uint32_t crc;               /* Received */
+    uint32_t crc_calc;
+};
+
+typedef void (*busdec_fn)(void *arg, const struct busdec_frame *f);
+
+struct busdec_stats {
+    uint64_t samples;
+    uint64_t runs;
+    uint64_t frames;            /* All SOFs, with errors */
+    uint64_t status[BUSDEC_STATUS_NUM];
+    uint64_t error_flags;
+};
+
+struct busdec {
+    struct busdec_config cfg;
+    uint32_t nq, dq;            /* Bit lengths, samples */
+    uint32_t nsp, dsp;          /* Sample points, samples into the bit */
+    uint32_t idle;              /* Samples of BUSDEC_IDLE_BITS */
+    busdec_fn fn;
+    void *arg;
+    struct busdec_stats stats;
+};
+
+void busdec_config_defaults(struct busdec_config *cfg);
+
+/* Returns -1 if the bit rates do not fit the sample rate */
+int busdec_init(struct busdec *d, const struct busdec_config *cfg,
+                busdec_fn fn, void *arg);
+
+/*
+ * Decode @n runs, the first one dominant if @dominant, starting at sample
+ * @t0. @idle: the trace starts in bus idle, so a SOF needs no idle first.
+ * @fn is called for every frame.
+ */
+void busdec_runs(struct busdec *d, const uint32_t *run, size_t n, bool dominant,
+                 uint64_t t0, bool idle);
+
+/*
+ * Runs of a sampled signal, @mask selects its bit in every sample byte, the
+ * signal is recessive when that bit is set (dominant if @invert). Converts
+ * up to @max runs of @s[0..n); the last one may be cut at @n. Returns the
+ * number of runs, the level of the first in @dominant, and the samples
+ * used in @used.
+ */
+size_t busdec_sample_runs(const uint8_t *s, size_t n, uint8_t mask, bool invert,
+                          uint32_t *run, size_t max, bool *dominant, size_t *used);
+
+/*
+ * First sample at or after @at that follows BUSDEC_IDLE_BITS of recessive
+ * bus, or @n. Traces split there decode as one.
+ */
+size_t busdec_idle_split(const struct busdec *d, const uint8_t *s, size_t n,
+                         uint8_t mask, bool invert, size_t at);
+
+void busdec_stats_add(struct busdec_stats *to, const struct busdec_stats *from);
+
+void busdec_report(const struct busdec_stats *st, FILE *f);
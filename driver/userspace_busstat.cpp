@@ -0,0 +1,393 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#include "userspace_busstat.h"
+#include "userspace_bitstream.h"
+
+#define PS_PER_SEC 1000000000000ull
+
+void busstat_config_defaults(struct busstat_config *cfg)
+{
+    cfg->clk_freq = 100000000;
+    cfg->ts_freq = 100000000;
+    cfg->window_ms = 1000;
+    cfg->slot_ms = 10;
+    cfg->max_ids = 2048;
+    cfg->stuffing = BUSSTAT_STUFF_EXACT;
+}
+
+static inline unsigned busstat_hash(uint32_t key)
+{
+    uint32_t h = key * 0x9e3779b1u;
+
+    return h ^ (h >> 15);
+}
+
+void busstat_set_bittiming(struct busstat *bs, uint64_t nbit_ps,
+                           uint64_t dbit_ps, bool iso)
+{
+    bs->nbit_ps = nbit_ps;
+    bs->dbit_ps = dbit_ps ? dbit_ps : nbit_ps;
+    bs->iso = iso;
+}
+
+int busstat_init(struct busstat *bs, struct ctucan_hw_priv *priv,
+                 const struct busstat_config *cfg, busstat_snapshot_fn cb,
+                 void *cb_arg)
+{
+    union ctu_can_fd_btr btr;
+    union ctu_can_fd_btr_fd btr_fd;
+    union ctu_can_fd_mode_settings mode;
+    uint64_t nbit_ps = 1000000, dbit_ps = 0;
+    unsigned cap = 16;
+
+    memset(bs, 0, sizeof(*bs));
+    bs->cfg = *cfg;
+    bs->cb = cb;
+    bs->cb_arg = cb_arg;
+    while (cap < 2 * cfg->max_ids)
+        cap <<= 1;
+    bs->mask = cap - 1;
+    bs->keys = (uint32_t *)malloc(cap * sizeof(*bs->keys));
+    bs->ids = (struct busstat_id *)calloc(cap, sizeof(*bs->ids));
+    bs->snap = (struct busstat_id *)calloc(cfg->max_ids, sizeof(*bs->snap));
+    if (!bs->keys || !bs->ids || !bs->snap) {
+        warnx("busstat: cannot allocate table for %u IDs", cfg->max_ids);
+        busstat_free(bs);
+        return -1;
+    }
+    memset(bs->keys, 0xff, cap * sizeof(*bs->keys));
+
+    bs->window_ticks = (u64)cfg->window_ms * cfg->ts_freq / 1000;
+    bs->slot_ticks = (u64)(cfg->slot_ms ? cfg->slot_ms : cfg->window_ms) * cfg->ts_freq / 1000;
+    if (bs->slot_ticks > bs->window_ticks)
+        bs->slot_ticks = bs->window_ticks;
+    bs->period_unit = (uint64_t)BUSSTAT_PERIOD_UNIT_US * cfg->ts_freq / 1000000;
+    bs->jitter_unit = (uint64_t)BUSSTAT_JITTER_UNIT_US * cfg->ts_freq / 1000000;
+    if (!bs->period_unit)
+        bs->period_unit = 1;
+    if (!bs->jitter_unit)
+        bs->jitter_unit = 1;
+
+    btr.u32 = priv->read_reg(priv, CTU_CAN_FD_BTR);
+    btr_fd.u32 = priv->read_reg(priv, CTU_CAN_FD_BTR_FD);
+    mode.u32 = priv->read_reg(priv, CTU_CAN_FD_MODE);
+    if (btr.s.brp)
+        nbit_ps = (uint64_t)(1 + btr.s.prop + btr.s.ph1 + btr.s.ph2) * btr.s.brp *
+                  PS_PER_SEC / cfg->clk_freq;
+    if (btr_fd.s.brp_fd)
+        dbit_ps = (uint64_t)(1 + btr_fd.s.prop_fd + btr_fd.s.ph1_fd + btr_fd.s.ph2_fd) *
+                  btr_fd.s.brp_fd * PS_PER_SEC / cfg->clk_freq;
+    busstat_set_bittiming(bs, nbit_ps, dbit_ps, !mode.s.nisofd);
+    return 0;
+}
+
+void busstat_free(struct busstat *bs)
+{
+    free(bs->keys);
+    free(bs->ids);
+    free(bs->snap);
+    bs->keys = NULL;
+    bs->ids = NULL;
+    bs->snap = NULL;
+}
+
+static inline unsigned busstat_bucket(uint32_t v, uint32_t unit)
+{
+    uint32_t q = v / unit;
+    unsigned b = q ? 32 - __builtin_clz(q) : 0;
+
+    return b < BUSSTAT_HIST ? b : BUSSTAT_HIST - 1;
+}
+
+static int busstat_key_cmp(const void *a, const void *b)
+{
+    uint32_t ka = ((const struct busstat_id *)a)->key;
+    uint32_t kb = ((const struct busstat_id *)b)->key;
+
+    return ka < kb ? -1 : ka > kb;
+}
+
+static void busstat_close_window(struct busstat *bs)
+{
+    struct busstat_snapshot s;
+    unsigned n = 0;
+
+    if (bs->slot_ps > bs->peak_ps)
+        bs->peak_ps = bs->slot_ps;
+
+    for (unsigned i = 0; i <= bs->mask; i++) {
+        struct busstat_id *e = &bs->ids[i];
+
+        if (bs->keys[i] == BUSSTAT_EMPTY || !e->frames)
+            continue;
+        bs->snap[n++] = *e;
+        e->frames = 0;
+        e->fd_frames = 0;
+        e->bus_ps = 0;
+        e->period_min = UINT32_MAX;
+        e->period_max = 0;
+        e->period_sum = 0;
+        e->periods = 0;
+        e->jitter_max = 0;
+        memset(e->period_hist, 0, sizeof(e->period_hist));
+        memset(e->jitter_hist, 0, sizeof(e->jitter_hist));
+    }
+    qsort(bs->snap, n, sizeof(*bs->snap), busstat_key_cmp);
+
+    memset(&s, 0, sizeof(s));
+    s.start_ts = bs->window_start;
+    s.end_ts = bs->window_start + bs->window_ticks;
+    s.frames = bs->frames;
+    s.fd_frames = bs->fd_frames;
+    s.untracked = bs->untracked;
+    s.bus_ps = bs->bus_ps;
+    s.load = (double)bs->bus_ps * bs->cfg.ts_freq / PS_PER_SEC / bs->window_ticks;
+    s.peak_load = (double)bs->peak_ps * bs->cfg.ts_freq / PS_PER_SEC / bs->slot_ticks;
+    s.ts_freq = bs->cfg.ts_freq;
+    s.nids = n;
+    s.ids = bs->snap;
+    bs->snapshots++;
+    if (bs->cb)
+        bs->cb(bs->cb_arg, &s);
+
+    bs->frames = bs->fd_frames = bs->untracked = bs->bus_ps = 0;
+    bs->slot_ps = bs->peak_ps = 0;
+}
+
+/* Close the current window if @ts is past it, skip empty ones in between */
+static void busstat_advance(struct busstat *bs, u64 ts)
+{
+    u64 skip;
+
+    if (ts < bs->window_start + bs->window_ticks) {
+        if (ts >= bs->slot_start + bs->slot_ticks) {
+            if (bs->slot_ps > bs->peak_ps)
+                bs->peak_ps = bs->slot_ps;
+            bs->slot_ps = 0;
+            bs->slot_start += (ts - bs->slot_start) / bs->slot_ticks * bs->slot_ticks;
+        }
+        return;
+    }
+    busstat_close_window(bs);
+    skip = (ts - bs->window_start) / bs->window_ticks;
+    bs->window_start += skip * bs->window_ticks;
+    bs->slot_start = bs->window_start +
+                     (ts - bs->window_start) / bs->slot_ticks * bs->slot_ticks;
+}
+
+void busstat_idle(struct busstat *bs, u64 now)
+{
+    if (bs->started && now >= bs->window_start + bs->window_ticks)
+        busstat_advance(bs, now);
+}
+
+static struct busstat_id *busstat_lookup(struct busstat *bs, uint32_t key)
+{
+    unsigned i = busstat_hash(key) & bs->mask;
+
+    for (;;) {
+        uint32_t k = bs->keys[i];
+
+        if (k == key)
+            return &bs->ids[i];
+        if (k == BUSSTAT_EMPTY)
+            break;
+        i = (i + 1) & bs->mask;
+    }
+    if (bs->nids == bs->cfg.max_ids)
+        return NULL;
+    bs->nids++;
+    bs->keys[i] = key;
+    memset(&bs->ids[i], 0, sizeof(bs->ids[i]));
+    bs->ids[i].key = key;
+    bs->ids[i].period_min = UINT32_MAX;
+    return &bs->ids[i];
+}
+
+void busstat_add(struct busstat *bs, const struct canfd_frame *cf, bool fdf, u64 ts)
+{
+    struct busstat_id *e;
+    unsigned nbits, dbits;
+    uint64_t ps;
+
+    if (bs->cfg.stuffing == BUSSTAT_STUFF_EXACT)
+        can_frame_bits(cf, fdf, bs->iso, &nbits, &dbits);
+    else
+        can_frame_bits_worst(cf, fdf, bs->iso, &nbits, &dbits);
+    ps = (uint64_t)(nbits - dbits + CAN_IFS_BITS) * bs->nbit_ps +
+         (uint64_t)dbits * bs->dbit_ps;
+
+    if (!bs->started) {
+        bs->window_start = bs->slot_start = ts;
+        bs->started = true;
+    } else if (ts >= bs->slot_start + bs->slot_ticks ||
+               ts >= bs->window_start + bs->window_ticks) {
+        busstat_advance(bs, ts);
+    }
+    bs->slot_ps += ps;
+    bs->bus_ps += ps;
+    bs->frames++;
+    bs->fd_frames += fdf;
+
+    e = busstat_lookup(bs, cf->can_id & (CAN_EFF_FLAG | CAN_EFF_MASK));
+    if (!e) {
+        bs->untracked++;
+        return;
+    }
+    e->frames++;
+    e->fd_frames += fdf;
+    e->bus_ps += ps;
+    if (e->total && ts > e->last_ts) {
+        u64 d = ts - e->last_ts;
+        uint32_t iv = d > UINT32_MAX ? UINT32_MAX : (uint32_t)d;
+
+        if (iv < e->period_min)
+            e->period_min = iv;
+        if (iv > e->period_max)
+            e->period_max = iv;
+        e->period_sum += iv;
+        e->periods++;
+        e->period_hist[busstat_bucket(iv, bs->period_unit)]++;
+        if (!e->period_avg) {
+            e->period_avg = iv;
+        } else {
+            int64_t dev = (int64_t)iv - e->period_avg;
+            uint32_t jit = dev < 0 ? -dev : dev;
+
+            if (jit > e->jitter_max)
+                e->jitter_max = jit;
+            e->jitter_hist[busstat_bucket(jit, bs->jitter_unit)]++;
+            e->period_avg += dev / 8;
+        }
+    }
+    e->total++;
+    e->last_ts = ts;
+}
+
+static int busstat_load_cmp(const void *a, const void *b)
+{
+    uint64_t la = (*(const struct busstat_id * const *)a)->bus_ps;
+    uint64_t lb = (*(const struct busstat_id * const *)b)->bus_ps;
+
+    return la > lb ? -1 : la < lb;
+}
+
+static double ticks_ms(const struct busstat_snapshot *s, uint64_t t)
+{
+    return (double)t * 1000.0 / s->ts_freq;
+}
+
+static double id_load(const struct busstat_snapshot *s, const struct busstat_id *e)
+{
+    return (double)e->bus_ps * s->ts_freq / PS_PER_SEC / (s->end_ts - s->start_ts);
+}
+
+void busstat_print(FILE *f, const struct busstat_snapshot *s, unsigned top)
+{
+    double secs = (double)(s->end_ts - s->start_ts) / s->ts_freq;
+    const struct busstat_id **order;
+    unsigned n = s->nids;
+
+    fprintf(f, "busstat %.3f-%.3f s: %llu frames (%llu FD), load %.2f %%, peak %.2f %%, %u IDs",
+            (double)s->start_ts / s->ts_freq, (double)s->end_ts / s->ts_freq,
+            (unsigned long long)s->frames, (unsigned long long)s->fd_frames,
+            100 * s->load, 100 * s->peak_load, s->nids);
+    if (s->untracked)
+        fprintf(f, ", %llu frames of untracked IDs", (unsigned long long)s->untracked);
+    fprintf(f, "\n");
+    if (!n)
+        return;
+
+    /* Highest load first */
+    order = (const struct busstat_id **)malloc(n * sizeof(*order));
+    if (!order)
+        return;
+    for (unsigned i = 0; i < n; i++)
+        order[i] = &s->ids[i];
+    qsort(order, n, sizeof(*order), busstat_load_cmp);
+    if (top && n > top)
+        n = top;
+
+    fprintf(f, "%10s %8s %9s %7s %28s %12s\n", "ID", "frames", "rate/s", "load %",
+            "period avg/min/max ms", "jitter us");
+    for (unsigned i = 0; i < n; i++) {
+        const struct busstat_id *e = order[i];
+
+        fprintf(f, "%9x%c %8u %9.1f %7.2f ", e->key & CAN_EFF_MASK,
+                e->key & CAN_EFF_FLAG ? 'x' : ' ', e->frames,
+                e->frames / secs, 100 * id_load(s, e));
+        if (e->periods)
+            fprintf(f, "%8.3f / %7.3f / %7.3f %12.1f\n",
+                    ticks_ms(s, e->period_sum) / e->periods,
+                    ticks_ms(s, e->period_min), ticks_ms(s, e->period_max),
+                    ticks_ms(s, e->jitter_max) * 1000);
+        else
+            fprintf(f, "%28s %12s\n", "-", "-");
+    }
+    free(order);
+}
+
+static void print_hist(FILE *f, const char *name, const uint32_t *h)
+{
+    fprintf(f, ",\"%s\":[", name);
+    for (unsigned i = 0; i < BUSSTAT_HIST; i++)
+        fprintf(f, "%s%u", i ? "," : "", h[i]);
+    fprintf(f, "]");
+}
+
+void busstat_print_json(FILE *f, const struct busstat_snapshot *s)
+{
+    fprintf(f, "{\"start_s\":%.6f,\"end_s\":%.6f,\"frames\":%llu,\"fd_frames\":%llu,"
+               "\"untracked\":%llu,\"load\":%.5f,\"peak_load\":%.5f,"
+               "\"period_unit_us\":%u,\"jitter_unit_us\":%u,\"ids\":[",
+            (double)s->start_ts / s->ts_freq, (double)s->end_ts / s->ts_freq,
+            (unsigned long long)s->frames, (unsigned long long)s->fd_frames,
+            (unsigned long long)s->untracked, s->load, s->peak_load,
+            BUSSTAT_PERIOD_UNIT_US, BUSSTAT_JITTER_UNIT_US);
+    for (unsigned i = 0; i < s->nids; i++) {
+        const struct busstat_id *e = &s->ids[i];
+
+        fprintf(f, "%s{\"id\":%u,\"ext\":%s,\"frames\":%u,\"fd_frames\":%u,\"load\":%.5f",
+                i ? "," : "", e->key & CAN_EFF_MASK,
+                e->key & CAN_EFF_FLAG ? "true" : "false", e->frames, e->fd_frames,
+                id_load(s, e));
+        if (e->periods)
+            fprintf(f, ",\"period_avg_us\":%.1f,\"period_min_us\":%.1f,"
+                       "\"period_max_us\":%.1f,\"jitter_max_us\":%.1f",
+                    ticks_ms(s, e->period_sum) * 1000 / e->periods,
+                    ticks_ms(s, e->period_min) * 1000, ticks_ms(s, e->period_max) * 1000,
+                    ticks_ms(s, e->jitter_max) * 1000);
+        print_hist(f, "period_hist", e->period_hist);
+        print_hist(f, "jitter_hist", e->jitter_hist);
+        fprintf(f, "}");
+    }
+    fprintf(f, "]}\n");
+    fflush(f);
+}
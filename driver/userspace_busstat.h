@@ -0,0 +1,156 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#pragma once
+
+#include "userspace_utils.h"
+
+/*
+ * Streaming bus load and per-ID statistics of received frames.
+ *
+ * Frame durations are bit-accurate (can_frame_bits), with exact or worst
+ * case stuffing, at the nominal and data bit rate taken from BTR/BTR_FD,
+ * plus intermission. Load is the bus time of the frames received in a
+ * window over the window length; peak load is the same over slot_ms.
+ *
+ * Per-ID state is kept in an open-addressing table with the keys in their
+ * own dense array, so a lookup touches one cache line of keys and then the
+ * entry. Every ID gets its frame count, bus time, period min/avg/max and
+ * two small log2 histograms: intervals between frames (bucket 0 below
+ * BUSSTAT_PERIOD_UNIT_US, then doubling) and jitter, the deviation of an
+ * interval from the ID's running average period (BUSSTAT_JITTER_UNIT_US).
+ *
+ * Windows follow the frame timestamps. When a frame or busstat_idle()
+ * passes the end of a window, a snapshot with the IDs seen in it (sorted
+ * by ID) is passed to the callback and the window counters are reset.
+ */
+
+#define BUSSTAT_HIST            16
+#define BUSSTAT_PERIOD_UNIT_US  64
+#define BUSSTAT_JITTER_UNIT_US  1
+#define BUSSTAT_EMPTY           0xffffffffu
+
+enum busstat_stuffing {
+    BUSSTAT_STUFF_EXACT,
+    BUSSTAT_STUFF_WORST,
+};
+
+struct busstat_config {
+    uint32_t clk_freq;          /* Core clock BTR/BTR_FD count in, Hz */
+    uint32_t ts_freq;           /* Timestamp counter frequency in Hz */
+    unsigned window_ms;         /* Snapshot interval */
+    unsigned slot_ms;           /* Peak load resolution */
+    unsigned max_ids;
+    enum busstat_stuffing stuffing;
+};
+
+struct busstat_id {
+    uint32_t key;               /* CAN ID with EFF flag */
+    uint32_t frames;            /* In the window */
+    uint64_t total;             /* Since start */
+    u64 last_ts;
+    uint64_t bus_ps;            /* Bus time in the window */
+    uint32_t period_min;        /* Ticks, in the window */
+    uint32_t period_max;
+    uint64_t period_sum;
+    uint32_t periods;
+    uint32_t period_avg;        /* Running average, reference for jitter */
+    uint32_t jitter_max;        /* Ticks, in the window */
+    uint32_t fd_frames;
+    uint32_t period_hist[BUSSTAT_HIST];
+    uint32_t jitter_hist[BUSSTAT_HIST];
+};
+
+struct busstat_snapshot {
+    u64 start_ts, end_ts;
+    uint64_t frames;
+    uint64_t fd_frames;
+    uint64_t untracked;         /* Frames of IDs beyond max_ids */
+    uint64_t bus_ps;
+    double load;                /* 0..1 */
+    double peak_load;
+    uint32_t ts_freq;
+    unsigned nids;
+    const struct busstat_id *ids;
+};
+
+typedef void (*busstat_snapshot_fn)(void *arg, const struct busstat_snapshot *s);
+
+struct busstat {
+    struct busstat_config cfg;
+    uint64_t nbit_ps, dbit_ps;
+    bool iso;
+    u64 window_ticks, slot_ticks;
+    uint32_t period_unit, jitter_unit;  /* Ticks */
+
+    uint32_t *keys;
+    struct busstat_id *ids;
+    unsigned mask;
+    unsigned nids;
+
+    bool started;
+    u64 window_start;
+    u64 slot_start;
+    uint64_t slot_ps;
+    uint64_t peak_ps;
+    uint64_t frames, fd_frames, untracked, bus_ps;
+
+    struct busstat_id *snap;    /* Snapshot buffer, max_ids entries */
+    uint64_t snapshots;
+    busstat_snapshot_fn cb;
+    void *cb_arg;
+};
+
+void busstat_config_defaults(struct busstat_config *cfg);
+
+/*
+ * Allocate tables and take bit timing and ISO/non-ISO FD from the core's
+ * BTR, BTR_FD and SETTINGS registers. Returns -1 if allocation fails.
+ */
+int busstat_init(struct busstat *bs, struct ctucan_hw_priv *priv,
+                 const struct busstat_config *cfg, busstat_snapshot_fn cb,
+                 void *cb_arg);
+
+/* Bit timing for frames not coming from @priv (e.g. a recorded log) */
+void busstat_set_bittiming(struct busstat *bs, uint64_t nbit_ps,
+                           uint64_t dbit_ps, bool iso);
+
+/* Account one received frame, @ts is its RX timestamp */
+void busstat_add(struct busstat *bs, const struct canfd_frame *cf, bool fdf, u64 ts);
+
+/* Close windows which ended before @now (TIMESTAMP) on an idle bus */
+void busstat_idle(struct busstat *bs, u64 now);
+
+void busstat_free(struct busstat *bs);
+
+/* Human readable table, at most @top IDs with the highest load */
+void busstat_print(FILE *f, const struct busstat_snapshot *s, unsigned top);
+
+/* One JSON object per line */
+void busstat_print_json(FILE *f, const struct busstat_snapshot *s);
@@ -0,0 +1,648 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#include "userspace_canlog.h"
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define BLK_ID_SLOTS    1024        /* Power of two */
+#define BLK_ID_MAX      (BLK_ID_SLOTS * 3 / 4)
+
+static inline uint32_t id_hash(uint32_t key)
+{
+    uint32_t h = key * 0x9e3779b1u;
+
+    return h ^ (h >> 15);
+}
+
+void canlog_config_defaults(struct canlog_config *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->block_size = 64 * 1024;
+    cfg->ts_freq = 100000000;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+
+    while (len) {
+        ssize_t r = write(fd, p, len);
+
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+static void block_reset(struct canlog_writer *w)
+{
+    memset(w->bh, 0, sizeof(*w->bh));
+    w->bh->magic = CANLOG_BLOCK_MAGIC;
+    w->bh->seq = w->nblocks;
+    w->pos = w->block + sizeof(*w->bh);
+    w->end = w->block + w->cfg.block_size;
+    w->blk_nids = 0;
+    if (!++w->gen) {
+        memset(w->blk_gen, 0, BLK_ID_SLOTS * sizeof(*w->blk_gen));
+        w->gen = 1;
+    }
+}
+
+int canlog_create(struct canlog_writer *w, const char *path,
+                  const struct canlog_config *cfg, u64 ts_now)
+{
+    struct canlog_file_hdr hdr;
+    struct timespec now;
+
+    memset(w, 0, sizeof(*w));
+    w->cfg = *cfg;
+    w->fd = -1;
+    if (cfg->block_size < 4096 || (cfg->block_size & (cfg->block_size - 1))) {
+        warnx("canlog: block size %u is not a power of two >= 4096", cfg->block_size);
+        return -1;
+    }
+    w->block = (uint8_t *)calloc(1, cfg->block_size);
+    w->blk_ids = (uint32_t *)calloc(BLK_ID_SLOTS, sizeof(*w->blk_ids));
+    w->blk_gen = (uint32_t *)calloc(BLK_ID_SLOTS, sizeof(*w->blk_gen));
+    w->blk_cnt = (uint32_t *)calloc(BLK_ID_SLOTS, sizeof(*w->blk_cnt));
+    if (!w->block || !w->blk_ids || !w->blk_gen || !w->blk_cnt) {
+        warnx("canlog: out of memory");
+        goto fail;
+    }
+    w->bh = (struct canlog_block_hdr *)w->block;
+    block_reset(w);
+
+    w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w->fd < 0) {
+        warn("canlog: %s", path);
+        goto fail;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CANLOG_MAGIC, sizeof(hdr.magic));
+    hdr.version = CANLOG_VERSION;
+    hdr.block_size = cfg->block_size;
+    hdr.ts_freq = cfg->ts_freq;
+    hdr.channel = cfg->channel;
+    hdr.start_realtime_ns = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+    hdr.start_ts = ts_now;
+    if (write_all(w->fd, &hdr, sizeof(hdr)) < 0) {
+        warn("canlog: %s", path);
+        goto fail;
+    }
+    w->bytes = sizeof(hdr);
+    return 0;
+
+fail:
+    if (w->fd >= 0)
+        close(w->fd);
+    free(w->block);
+    free(w->blk_ids);
+    free(w->blk_gen);
+    free(w->blk_cnt);
+    memset(w, 0, sizeof(*w));
+    w->fd = -1;
+    return -1;
+}
+
+void canlog_note_id(struct canlog_writer *w, uint32_t key)
+{
+    unsigned i = id_hash(key) & (BLK_ID_SLOTS - 1);
+
+    if (w->bh->flags & CANLOG_BLK_ALL_IDS)
+        return;
+    while (w->blk_gen[i] == w->gen) {
+        if (w->blk_ids[i] == key) {
+            w->blk_cnt[i]++;
+            return;
+        }
+        i = (i + 1) & (BLK_ID_SLOTS - 1);
+    }
+    if (w->blk_nids == BLK_ID_MAX) {
+        w->bh->flags |= CANLOG_BLK_ALL_IDS;
+        return;
+    }
+    w->blk_gen[i] = w->gen;
+    w->blk_ids[i] = key;
+    w->blk_cnt[i] = 1;
+    w->blk_nids++;
+}
+
+/* Slot of @key in the table of last runs, growing it when needed */
+static uint32_t *last_run_slot(struct canlog_writer *w, uint32_t key)
+{
+    size_t i;
+
+    if ((w->last_used + 1) * 4 > w->last_cap * 3) {
+        size_t ncap = w->last_cap ? w->last_cap * 2 : 256;
+        uint32_t *nkey = (uint32_t *)malloc(ncap * sizeof(*nkey));
+        uint32_t *nrun = (uint32_t *)malloc(ncap * sizeof(*nrun));
+
+        if (!nkey || !nrun) {
+            free(nkey);
+            free(nrun);
+            return NULL;
+        }
+        memset(nrun, 0xff, ncap * sizeof(*nrun));
+        for (i = 0; i < w->last_cap; i++) {
+            size_t j;
+
+            if (w->last_run[i] == UINT32_MAX)
+                continue;
+            j = id_hash(w->last_key[i]) & (ncap - 1);
+            while (nrun[j] != UINT32_MAX)
+                j = (j + 1) & (ncap - 1);
+            nkey[j] = w->last_key[i];
+            nrun[j] = w->last_run[i];
+        }
+        free(w->last_key);
+        free(w->last_run);
+        w->last_key = nkey;
+        w->last_run = nrun;
+        w->last_cap = ncap;
+    }
+
+    i = id_hash(key) & (w->last_cap - 1);
+    while (w->last_run[i] != UINT32_MAX && w->last_key[i] != key)
+        i = (i + 1) & (w->last_cap - 1);
+    if (w->last_run[i] == UINT32_MAX)
+        w->last_used++;
+    w->last_key[i] = key;
+    return &w->last_run[i];
+}
+
+static int add_run(struct canlog_writer *w, uint32_t key, uint32_t block,
+                   uint32_t frames)
+{
+    uint32_t *last = last_run_slot(w, key);
+    struct canlog_run *run;
+
+    if (!last)
+        return -1;
+    if (*last != UINT32_MAX && w->runs[*last].last_block + 1 == block) {
+        w->runs[*last].last_block = block;
+        w->runs[*last].frames += frames;
+        return 0;
+    }
+    if (w->nruns == w->runs_cap) {
+        size_t ncap = w->runs_cap ? w->runs_cap * 2 : 1024;
+        struct canlog_run *n = (struct canlog_run *)realloc(w->runs, ncap * sizeof(*n));
+
+        if (!n)
+            return -1;
+        w->runs = n;
+        w->runs_cap = ncap;
+    }
+    run = &w->runs[w->nruns];
+    run->id = key;
+    run->first_block = run->last_block = block;
+    run->frames = frames;
+    *last = w->nruns++;
+    return 0;
+}
+
+int canlog_flush_block(struct canlog_writer *w)
+{
+    struct canlog_block_hdr *bh = w->bh;
+    uint32_t block = (uint32_t)w->nblocks;
+
+    if (!bh->nframes)
+        return 0;
+    if (w->error)
+        return -1;
+
+    /* Index before writing, the block ID table is reset below */
+    if (bh->flags & CANLOG_BLK_ALL_IDS) {
+        w->error |= add_run(w, CANLOG_ANY_ID, block, bh->nframes);
+    } else {
+        for (unsigned i = 0; i < BLK_ID_SLOTS; i++)
+            if (w->blk_gen[i] == w->gen)
+                w->error |= add_run(w, w->blk_ids[i], block, w->blk_cnt[i]);
+    }
+    if (w->error) {
+        warnx("canlog: out of memory for the ID index");
+        return -1;
+    }
+
+    bh->used = w->pos - w->block - sizeof(*bh);
+    /* Zero the tail so that the file does not carry stale records */
+    memset(w->pos, 0, w->end - w->pos);
+    if (write_all(w->fd, w->block, w->cfg.block_size) < 0) {
+        warn("canlog: write");
+        w->error = -1;
+        return -1;
+    }
+    w->bytes += w->cfg.block_size;
+    w->nblocks++;
+    block_reset(w);
+    return 0;
+}
+
+static int run_cmp(const void *a, const void *b)
+{
+    const struct canlog_run *ra = (const struct canlog_run *)a;
+    const struct canlog_run *rb = (const struct canlog_run *)b;
+
+    if (ra->id != rb->id)
+        return ra->id < rb->id ? -1 : 1;
+    return ra->first_block < rb->first_block ? -1 : ra->first_block > rb->first_block;
+}
+
+int canlog_close(struct canlog_writer *w)
+{
+    struct canlog_trailer tr;
+    int ret = 0;
+
+    if (w->fd < 0)
+        return 0;
+    if (canlog_flush_block(w) < 0)
+        ret = -1;
+
+    if (!ret) {
+        qsort(w->runs, w->nruns, sizeof(*w->runs), run_cmp);
+        memset(&tr, 0, sizeof(tr));
+        tr.runs_offset = w->bytes;
+        tr.nruns = w->nruns;
+        tr.nblocks = w->nblocks;
+        tr.frames = w->frames;
+        memcpy(tr.magic, CANLOG_TRAILER, sizeof(tr.magic));
+        if (write_all(w->fd, w->runs, w->nruns * sizeof(*w->runs)) < 0 ||
+            write_all(w->fd, &tr, sizeof(tr)) < 0) {
+            warn("canlog: write index");
+            ret = -1;
+        } else {
+            w->bytes += w->nruns * sizeof(*w->runs) + sizeof(tr);
+        }
+    }
+    if (close(w->fd) < 0 && !ret) {
+        warn("canlog: close");
+        ret = -1;
+    }
+    w->fd = -1;
+    free(w->block);
+    free(w->blk_ids);
+    free(w->blk_gen);
+    free(w->blk_cnt);
+    free(w->runs);
+    free(w->last_key);
+    free(w->last_run);
+    w->block = NULL;
+    w->blk_ids = w->blk_gen = w->blk_cnt = NULL;
+    w->runs = NULL;
+    w->last_key = w->last_run = NULL;
+    return ret;
+}
+
+void canlog_writer_report(const struct canlog_writer *w, FILE *f)
+{
+    fprintf(f, "canlog: %llu frames, %llu blocks, %llu bytes",
+            (unsigned long long)w->frames, (unsigned long long)w->nblocks,
+            (unsigned long long)w->bytes);
+    if (w->frames)
+        fprintf(f, " (%.1f bytes/frame)", (double)w->bytes / w->frames);
+    fprintf(f, ", %zu index runs\n", w->nruns);
+}
+
+int canlog_open(struct canlog_reader *r, const char *path)
+{
+    const struct canlog_trailer *tr;
+    struct stat st;
+    void *map;
+
+    memset(r, 0, sizeof(*r));
+    r->fd = open(path, O_RDONLY);
+    if (r->fd < 0) {
+        warn("canlog: %s", path);
+        return -1;
+    }
+    if (fstat(r->fd, &st) < 0 || (size_t)st.st_size < CANLOG_HDR_SIZE) {
+        warnx("canlog: %s: not a log", path);
+        goto fail;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, r->fd, 0);
+    if (map == MAP_FAILED) {
+        warn("canlog: mmap %s", path);
+        goto fail;
+    }
+    r->map = (const uint8_t *)map;
+    r->size = st.st_size;
+    r->hdr = (const struct canlog_file_hdr *)r->map;
+    if (memcmp(r->hdr->magic, CANLOG_MAGIC, sizeof(r->hdr->magic)) ||
+        r->hdr->version != CANLOG_VERSION || r->hdr->block_size < 4096) {
+        warnx("canlog: %s: not a log or unsupported version", path);
+        goto fail;
+    }
+    madvise(map, st.st_size, MADV_RANDOM);
+
+    tr = (const struct canlog_trailer *)(r->map + r->size - sizeof(*tr));
+    if (r->size >= CANLOG_HDR_SIZE + sizeof(*tr) &&
+        !memcmp(tr->magic, CANLOG_TRAILER, sizeof(tr->magic)) &&
+        tr->runs_offset == CANLOG_HDR_SIZE + tr->nblocks * r->hdr->block_size &&
+        tr->runs_offset + tr->nruns * sizeof(struct canlog_run) + sizeof(*tr) == r->size) {
+        r->nblocks = tr->nblocks;
+        r->runs = (const struct canlog_run *)(r->map + tr->runs_offset);
+        r->nruns = tr->nruns;
+    } else {
+        /* Unfinished recording, a partially written last block is dropped */
+        r->nblocks = (r->size - CANLOG_HDR_SIZE) / r->hdr->block_size;
+        while (r->nblocks && canlog_block(r, r->nblocks - 1)->magic != CANLOG_BLOCK_MAGIC)
+            r->nblocks--;
+        warnx("canlog: %s: no index, recording was not closed", path);
+    }
+    return 0;
+
+fail:
+    canlog_close_reader(r);
+    return -1;
+}
+
+void canlog_close_reader(struct canlog_reader *r)
+{
+    if (r->map)
+        munmap((void *)r->map, r->size);
+    if (r->fd >= 0)
+        close(r->fd);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+uint64_t canlog_find_time(const struct canlog_reader *r, u64 ts)
+{
+    uint64_t lo = 0, hi = r->nblocks;
+
+    /* Blocks are in time order, find the first one ending at or after ts */
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+
+        if (canlog_block(r, mid)->last_ts < ts)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static int range_cmp(const void *a, const void *b)
+{
+    const uint64_t *ra = (const uint64_t *)a, *rb = (const uint64_t *)b;
+
+    return ra[0] < rb[0] ? -1 : ra[0] > rb[0];
+}
+
+static int add_range(struct canlog_iter *it, size_t *cap, uint64_t first, uint64_t last)
+{
+    if (it->nranges == *cap) {
+        size_t ncap = *cap ? *cap * 2 : 64;
+        uint64_t *n = (uint64_t *)realloc(it->blocks, ncap * 2 * sizeof(*n));
+
+        if (!n)
+            return -1;
+        it->blocks = n;
+        *cap = ncap;
+    }
+    it->blocks[2 * it->nranges] = first;
+    it->blocks[2 * it->nranges + 1] = last;
+    it->nranges++;
+    return 0;
+}
+
+int canlog_iter_init(struct canlog_iter *it, const struct canlog_reader *r,
+                     const struct canlog_query *q)
+{
+    uint64_t first, last;
+    size_t cap = 0;
+
+    memset(it, 0, sizeof(*it));
+    it->r = r;
+    it->q = *q;
+    if (!r->nblocks || q->ts_from > q->ts_to || q->id_from > q->id_to)
+        return 0;
+
+    first = canlog_find_time(r, q->ts_from);
+    last = canlog_find_time(r, q->ts_to);
+    if (last == r->nblocks)
+        last--;
+    if (first > last)
+        return 0;
+
+    if (!r->runs || (q->id_from == 0 && q->id_to >= (CAN_EFF_FLAG | CAN_EFF_MASK))) {
+        if (add_range(it, &cap, first, last) < 0)
+            return -1;
+        it->next = first;
+        return 0;
+    }
+
+    /* Runs of the IDs in range, then of the blocks not in the index */
+    size_t lo = 0, hi = r->nruns;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (r->runs[mid].id < q->id_from)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (; lo < r->nruns && r->runs[lo].id <= q->id_to; lo++) {
+        const struct canlog_run *run = &r->runs[lo];
+
+        if (run->last_block < first || run->first_block > last)
+            continue;
+        if (add_range(it, &cap, run->first_block > first ? run->first_block : first,
+                      run->last_block < last ? run->last_block : last) < 0)
+            return -1;
+    }
+    for (; lo < r->nruns; lo++) {
+        const struct canlog_run *run = &r->runs[lo];
+
+        if (run->id != CANLOG_ANY_ID || run->last_block < first || run->first_block > last)
+            continue;
+        if (add_range(it, &cap, run->first_block > first ? run->first_block : first,
+                      run->last_block < last ? run->last_block : last) < 0)
+            return -1;
+    }
+
+    /* Sort and merge overlapping ranges */
+    qsort(it->blocks, it->nranges, 2 * sizeof(*it->blocks), range_cmp);
+    size_t n = 0;
+
+    for (size_t i = 0; i < it->nranges; i++) {
+        uint64_t *cur = &it->blocks[2 * i];
+
+        if (n && cur[0] <= it->blocks[2 * n - 1] + 1) {
+            if (cur[1] > it->blocks[2 * n - 1])
+                it->blocks[2 * n - 1] = cur[1];
+            continue;
+        }
+        it->blocks[2 * n] = cur[0];
+        it->blocks[2 * n + 1] = cur[1];
+        n++;
+    }
+    it->nranges = n;
+    if (n)
+        it->next = it->blocks[0];
+    return 0;
+}
+
+static uint64_t get_varint(const uint8_t **pp, const uint8_t *end, bool *bad)
+{
+    const uint8_t *p = *pp;
+    uint64_t v = 0;
+    unsigned shift = 0;
+
+    while (p < end && shift < 64) {
+        uint8_t b = *p++;
+
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *pp = p;
+            return v;
+        }
+        shift += 7;
+    }
+    *bad = true;
+    return 0;
+}
+
+/* Load the next candidate block whose ranges overlap the query */
+static bool iter_next_block(struct canlog_iter *it)
+{
+    const struct canlog_reader *r = it->r;
+
+    while (it->range < it->nranges) {
+        const struct canlog_block_hdr *bh;
+
+        if (it->next > it->blocks[2 * it->range + 1]) {
+            if (++it->range < it->nranges)
+                it->next = it->blocks[2 * it->range];
+            continue;
+        }
+        it->block = it->next++;
+        it->blocks_read++;
+        bh = canlog_block(r, it->block);
+        if (bh->magic != CANLOG_BLOCK_MAGIC ||
+            bh->used > r->hdr->block_size - sizeof(*bh)) {
+            warnx("canlog: block %llu is corrupted, skipped",
+                  (unsigned long long)it->block);
+            continue;
+        }
+        if (bh->last_ts < it->q.ts_from || bh->first_ts > it->q.ts_to ||
+            bh->max_id < it->q.id_from || bh->min_id > it->q.id_to)
+            continue;
+        it->pos = (const uint8_t *)(bh + 1);
+        it->end = it->pos + bh->used;
+        it->left = bh->nframes;
+        it->ts = bh->first_ts;
+        return true;
+    }
+    return false;
+}
+
+bool canlog_iter_next(struct canlog_iter *it, struct canfd_frame *cf,
+                      bool *fdf, u64 *ts)
+{
+    for (;;) {
+        bool bad = false;
+        uint64_t v, id;
+        unsigned b0, len;
+        uint32_t key;
+
+        if (!it->left && !iter_next_block(it))
+            return false;
+
+        if (it->pos >= it->end) {
+            bad = true;
+        } else {
+            b0 = *it->pos++;
+            v = get_varint(&it->pos, it->end, &bad);
+            id = get_varint(&it->pos, it->end, &bad);
+        }
+        if (!bad) {
+            len = (b0 & 0x80) ? 0 : can_dlc2len(b0 & 0xf);
+            if (it->pos + len > it->end)
+                bad = true;
+        }
+        if (bad) {
+            warnx("canlog: block %llu is truncated", (unsigned long long)it->block);
+            it->left = 0;
+            continue;
+        }
+        it->left--;
+        it->ts += (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+
+        cf->can_id = (canid_t)(id >> 1);
+        if (id & 1)
+            cf->can_id |= CAN_EFF_FLAG;
+        key = canlog_id_key(cf->can_id);
+        if (b0 & 0x80)
+            cf->can_id |= CAN_RTR_FLAG;
+        if (it->ts > it->q.ts_to) {
+            /* Blocks are in time order, nothing after this one matches */
+            it->left = 0;
+            it->range = it->nranges;
+            return false;
+        }
+        if (it->ts < it->q.ts_from || key < it->q.id_from || key > it->q.id_to) {
+            it->pos += len;
+            continue;
+        }
+        cf->len = (b0 & 0x80) ? can_dlc2len(b0 & 0xf) : len;
+        cf->flags = 0;
+        if (b0 & 0x20)
+            cf->flags |= CANFD_BRS;
+        if (b0 & 0x40)
+            cf->flags |= CANFD_ESI;
+#ifdef CANFD_FDF
+        if (b0 & 0x10)
+            cf->flags |= CANFD_FDF;
+#endif
+        memcpy(cf->data, it->pos, len);
+        it->pos += len;
+        *fdf = b0 & 0x10;
+        *ts = it->ts;
+        return true;
+    }
+}
+
+void canlog_iter_free(struct canlog_iter *it)
+{
+    free(it->blocks);
+    it->blocks = NULL;
+    it->nranges = 0;
+}
@@ -0,0 +1,275 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#pragma once
+
+#include "userspace_utils.h"
+
+/*
+ * Compact block based log of received frames for long recordings.
+ *
+ * File: 64 byte header, then blocks of block_size bytes at fixed offsets
+ * (the last one padded), then the ID index and a trailer. Each block
+ * starts with a header holding its time range (core timestamp ticks), ID
+ * range and frame count, followed by records:
+ *
+ *   u8      DLC | FDF << 4 | BRS << 5 | ESI << 6 | RTR << 7
+ *   varint  zigzag timestamp delta to the previous frame of the block
+ *   varint  CAN ID << 1 | EFF
+ *   u8[]    data, length given by the DLC (none for RTR)
+ *
+ * An 8 byte classic frame every millisecond takes about 14 bytes.
+ *
+ * The ID index lists for every ID the runs of consecutive blocks it occurs
+ * in, sorted by ID, so periodic IDs cost one entry. The reader mmaps the
+ * file and finds the first block of a time by binary search over the
+ * block headers, and the blocks of an ID range by binary search in the
+ * index. A file without trailer (recording killed) is still readable, ID
+ * queries then fall back to the ID ranges in the block headers.
+ *
+ * The writer only encodes into the block buffer on the RX path; a syscall
+ * happens once per block.
+ */
+
+#define CANLOG_MAGIC        "CTUCLOG1"
+#define CANLOG_TRAILER      "CLOGIDX1"
+#define CANLOG_VERSION      1
+#define CANLOG_BLOCK_MAGIC  0x4b4c4243u     /* "CBLK" */
+#define CANLOG_HDR_SIZE     64
+#define CANLOG_REC_MAX      (1 + 10 + 5 + CANFD_MAX_DLEN)
+#define CANLOG_ANY_ID       0xffffffffu     /* Run of blocks with too many IDs */
+
+/* Key of a frame in the index: CAN ID with the EFF flag, without RTR */
+static inline uint32_t canlog_id_key(canid_t id)
+{
+    return id & (CAN_EFF_FLAG | CAN_EFF_MASK);
+}
+
+struct canlog_file_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t ts_freq;
+    uint32_t channel;
+    uint64_t start_realtime_ns;     /* Wall clock at start_ts */
+    uint64_t start_ts;              /* Core TIMESTAMP at start */
+    uint8_t reserved[24];
+};
+
+struct canlog_block_hdr {
+    uint32_t magic;
+    uint32_t used;                  /* Record bytes after this header */
+    uint32_t nframes;
+    uint32_t flags;
+    uint64_t first_ts;
+    uint64_t last_ts;
+    uint32_t min_id;                /* Index keys */
+    uint32_t max_id;
+    uint64_t seq;                   /* Block number */
+    uint8_t reserved[16];
+};
+
+#define CANLOG_BLK_ALL_IDS  0x1     /* Too many IDs, not in the index */
+
+struct canlog_run {
+    uint32_t id;                    /* Index key, CANLOG_ANY_ID for full blocks */
+    uint32_t first_block;
+    uint32_t last_block;
+    uint32_t frames;
+};
+
+struct canlog_trailer {
+    uint64_t runs_offset;
+    uint64_t nruns;
+    uint64_t nblocks;
+    uint64_t frames;
+    char magic[8];
+};
+
+struct canlog_config {
+    uint32_t block_size;            /* Bytes, power of two, >= 4096 */
+    uint32_t ts_freq;
+    uint32_t channel;
+};
+
+struct canlog_writer {
+    struct canlog_config cfg;
+    int fd;
+    uint8_t *block;
+    struct canlog_block_hdr *bh;
+    uint8_t *pos, *end;
+    u64 prev_ts;
+    uint64_t nblocks;
+    uint64_t frames;
+    uint64_t bytes;
+
+    /* IDs of the current block, open addressing, cleared by generation */
+    uint32_t *blk_ids;
+    uint32_t *blk_gen;
+    uint32_t *blk_cnt;
+    uint32_t gen;
+    unsigned blk_nids;
+
+    /* Runs and, per ID, the index of its last run */
+    struct canlog_run *runs;
+    size_t nruns, runs_cap;
+    uint32_t *last_key;
+    uint32_t *last_run;
+    size_t last_cap, last_used;
+    int error;
+};
+
+void canlog_config_defaults(struct canlog_config *cfg);
+
+/* Create log, @ts_now is the core TIMESTAMP now. Returns -1 on error. */
+int canlog_create(struct canlog_writer *w, const char *path,
+                  const struct canlog_config *cfg, u64 ts_now);
+
+/* Index and write the current block. Returns -1 on errors. */
+int canlog_flush_block(struct canlog_writer *w);
+
+/* Block ID set bookkeeping, called for every frame */
+void canlog_note_id(struct canlog_writer *w, uint32_t key);
+
+static inline uint8_t *canlog_put_varint(uint8_t *p, uint64_t v)
+{
+    while (v >= 0x80) {
+        *p++ = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+/* Append one frame, @fdf from the FFW (or cf->flags & CANFD_FDF) */
+static inline int canlog_write(struct canlog_writer *w, const struct canfd_frame *cf,
+                               bool fdf, u64 ts)
+{
+    struct canlog_block_hdr *bh;
+    uint32_t key = canlog_id_key(cf->can_id);
+    bool rtr = !fdf && (cf->can_id & CAN_RTR_FLAG);
+    unsigned dlc = can_len2dlc(cf->len);
+    unsigned len = rtr ? 0 : can_dlc2len(dlc);
+    int64_t delta;
+    uint8_t *p;
+
+    if (w->pos + CANLOG_REC_MAX > w->end) {
+        if (canlog_flush_block(w) < 0)
+            return -1;
+    }
+    bh = w->bh;
+    if (!bh->nframes) {
+        bh->first_ts = ts;
+        bh->min_id = bh->max_id = key;
+        w->prev_ts = ts;
+    }
+    delta = (int64_t)(ts - w->prev_ts);
+    w->prev_ts = ts;
+
+    p = w->pos;
+    *p++ = dlc | fdf << 4 | !!(cf->flags & CANFD_BRS) << 5 |
+           !!(cf->flags & CANFD_ESI) << 6 | rtr << 7;
+    p = canlog_put_varint(p, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+    p = canlog_put_varint(p, (uint64_t)(cf->can_id & CAN_EFF_MASK) << 1 |
+                             !!(cf->can_id & CAN_EFF_FLAG));
+    memcpy(p, cf->data, len);
+    w->pos = p + len;
+
+    bh->nframes++;
+    bh->last_ts = ts;
+    if (key < bh->min_id)
+        bh->min_id = key;
+    if (key > bh->max_id)
+        bh->max_id = key;
+    canlog_note_id(w, key);
+    w->frames++;
+    return 0;
+}
+
+/* Write the last block, index and trailer. Returns -1 on errors. */
+int canlog_close(struct canlog_writer *w);
+
+void canlog_writer_report(const struct canlog_writer *w, FILE *f);
+
+struct canlog_reader {
+    int fd;
+    const uint8_t *map;
+    size_t size;
+    const struct canlog_file_hdr *hdr;
+    uint64_t nblocks;
+    const struct canlog_run *runs;  /* NULL without trailer */
+    uint64_t nruns;
+};
+
+/* mmap a log. Returns -1 if it cannot be opened or is not a log. */
+int canlog_open(struct canlog_reader *r, const char *path);
+
+void canlog_close_reader(struct canlog_reader *r);
+
+static inline const struct canlog_block_hdr *
+canlog_block(const struct canlog_reader *r, uint64_t i)
+{
+    return (const struct canlog_block_hdr *)(r->map + CANLOG_HDR_SIZE +
+                                             i * r->hdr->block_size);
+}
+
+/* First block ending at or after @ts (nblocks if none), O(log n) */
+uint64_t canlog_find_time(const struct canlog_reader *r, u64 ts);
+
+struct canlog_query {
+    u64 ts_from, ts_to;             /* Inclusive, core ticks */
+    uint32_t id_from, id_to;        /* Inclusive index keys */
+};
+
+struct canlog_iter {
+    const struct canlog_reader *r;
+    struct canlog_query q;
+    uint64_t *blocks;               /* Candidate block ranges, pairs */
+    size_t nranges, range;
+    uint64_t block;                 /* Current block */
+    uint64_t next;                  /* Next block to load */
+    const uint8_t *pos, *end;
+    uint32_t left;                  /* Frames left in the block */
+    u64 ts;
+    uint64_t blocks_read;
+};
+
+/*
+ * Start iterating frames matching @q. Candidate blocks come from the time
+ * search and, for an ID range, from the index. Returns -1 on allocation
+ * failure.
+ */
+int canlog_iter_init(struct canlog_iter *it, const struct canlog_reader *r,
+                     const struct canlog_query *q);
+
+/* Next matching frame, false at the end */
+bool canlog_iter_next(struct canlog_iter *it, struct canfd_frame *cf,
+                      bool *fdf, u64 *ts);
+
+void canlog_iter_free(struct canlog_iter *it);
@@ -0,0 +1,390 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#include "userspace_crc.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CAN_CRC_CLMUL_X86
+#elif defined(__aarch64__) && (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_AES))
+#include <arm_neon.h>
+#define CAN_CRC_CLMUL_ARM
+#endif
+
+/* Shorter sequences are faster through the table */
+#define CAN_CRC_CLMUL_MIN_BITS  64
+
+const struct can_crc_param can_crc_params[3] = {
+    {15, 0x4599, 0},
+    {17, 0x1685b, 1u << 16},
+    {21, 0x102899, 1u << 20},
+};
+
+const char *const can_crc_impl_names[CAN_CRC_IMPLS] = {"bitwise", "table", "clmul"};
+
+uint32_t can_crc_bitwise(enum can_crc_type type, const uint8_t *bits,
+                         unsigned nbits)
+{
+    const struct can_crc_param *p = &can_crc_params[type];
+    uint32_t crc = p->init;
+
+    for (unsigned i = 0; i < nbits; i++)
+        crc = can_crc_bit(p, crc, bits[i]);
+    return crc;
+}
+
+/*
+ * Fold of 64 bits: crc' = (crc * x^64 + B * x^width) mod P
+ *                       = (A * x^width) mod P, A = crc * x^(64 - width) + B.
+ * Barrett: q = A * mu / x^64 with mu = x^(64 + width) / P, which has the
+ * x^64 term, so q = A + hi(A * mu_low). The remainder is lo(q * P).
+ */
+struct can_crc_fold {
+    uint64_t poly;              /* With the x^width term */
+    uint64_t mu;                /* Without the x^64 term */
+};
+
+struct can_crc_consts {
+    struct can_crc_tables t;
+    struct can_crc_fold fold[3];
+};
+
+static struct can_crc_consts can_crc_consts_build()
+{
+    struct can_crc_consts c;
+
+    for (unsigned type = CAN_CRC15; type <= CAN_CRC21; type++) {
+        const struct can_crc_param *p = &can_crc_params[type];
+        uint64_t full = (1ull << p->width) | p->poly;
+        uint64_t win = 0, mu = 0;
+
+        for (unsigned byte = 0; byte < 256; byte++) {
+            uint32_t crc = 0;
+
+            for (int i = 7; i >= 0; i--)
+                crc = can_crc_bit(p, crc, (byte >> i) & 1);
+            c.t.byte[type][byte] = crc;
+        }
+
+        /* Long division of x^(64 + width), the quotient's x^64 bit shifts out */
+        for (unsigned i = 0; i < 65 + p->width; i++) {
+            win = win << 1 | (i == 0);
+            mu <<= 1;
+            if (win >> p->width) {
+                win ^= full;
+                mu |= 1;
+            }
+        }
+        c.fold[type].poly = full;
+        c.fold[type].mu = mu;
+    }
+    return c;
+}
+
+static const struct can_crc_consts *can_crc_consts()
+{
+    static const struct can_crc_consts c = can_crc_consts_build();
+
+    return &c;
+}
+
+const struct can_crc_tables *can_crc_tables(void)
+{
+    return &can_crc_consts()->t;
+}
+
+uint32_t can_crc_bits(enum can_crc_type type, uint32_t crc, const uint8_t *bits,
+                      unsigned nbits)
+{
+    const struct can_crc_param *p = &can_crc_params[type];
+    const uint32_t *table = can_crc_tables()->byte[type];
+    unsigned i = 0;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    /* 8 bits of 0/1 bytes into one byte, the first bit ends up in the MSB */
+    for (; i + 8 <= nbits; i += 8) {
+        uint64_t x;
+
+        memcpy(&x, bits + i, sizeof(x));
+        x &= 0x0101010101010101ull;
+        crc = can_crc_byte(p, table, crc, (x * 0x8040201008040201ull) >> 56);
+    }
+#endif
+    for (; i < nbits; i++)
+        crc = can_crc_bit(p, crc, bits[i]);
+    return crc;
+}
+
+static inline unsigned can_crc_packed_bit(const uint64_t *w, unsigned pos)
+{
+    return (w[pos >> 6] >> (63 - (pos & 63))) & 1;
+}
+
+static uint32_t can_crc_packed_bitwise(enum can_crc_type type, uint32_t crc,
+                                       const uint64_t *w, unsigned pos, unsigned n)
+{
+    const struct can_crc_param *p = &can_crc_params[type];
+
+    for (unsigned i = pos; i < pos + n; i++)
+        crc = can_crc_bit(p, crc, can_crc_packed_bit(w, i));
+    return crc;
+}
+
+static uint32_t can_crc_packed_table(enum can_crc_type type, uint32_t crc,
+                                     const uint64_t *w, unsigned pos, unsigned n)
+{
+    const struct can_crc_param *p = &can_crc_params[type];
+    const uint32_t *table = can_crc_tables()->byte[type];
+    unsigned end = pos + n;
+
+    for (; pos < end && (pos & 7); pos++)
+        crc = can_crc_bit(p, crc, can_crc_packed_bit(w, pos));
+    for (; end - pos >= 8; pos += 8)
+        crc = can_crc_byte(p, table, crc, (w[pos >> 6] >> (56 - (pos & 63))) & 0xff);
+    for (; pos < end; pos++)
+        crc = can_crc_bit(p, crc, can_crc_packed_bit(w, pos));
+    return crc;
+}
+
+#if defined(CAN_CRC_CLMUL_X86)
+__attribute__((target("pclmul")))
+static uint32_t can_crc_fold64(const struct can_crc_fold *k, unsigned width, uint32_t crc,
+                               const uint64_t *w, unsigned pos, unsigned nblocks)
+{
+    const __m128i mu = _mm_cvtsi64_si128(k->mu);
+    const __m128i poly = _mm_cvtsi64_si128(k->poly);
+    const uint64_t *p = w + pos / 64;
+    unsigned off = pos & 63;
+    uint64_t r = crc;
+
+    for (unsigned i = 0; i < nblocks; i++) {
+        uint64_t b = off ? p[i] << off | p[i + 1] >> (64 - off) : p[i];
+        uint64_t a = r << (64 - width) ^ b;
+        __m128i x = _mm_clmulepi64_si128(_mm_cvtsi64_si128(a), mu, 0x00);
+        uint64_t q = (uint64_t)_mm_cvtsi128_si64(_mm_srli_si128(x, 8)) ^ a;
+
+        x = _mm_clmulepi64_si128(_mm_cvtsi64_si128(q), poly, 0x00);
+        r = (uint64_t)_mm_cvtsi128_si64(x) & ((1u << width) - 1);
+    }
+    return r;
+}
+#elif defined(CAN_CRC_CLMUL_ARM)
+static uint32_t can_crc_fold64(const struct can_crc_fold *k, unsigned width, uint32_t crc,
+                               const uint64_t *w, unsigned pos, unsigned nblocks)
+{
+    const uint64_t *p = w + pos / 64;
+    unsigned off = pos & 63;
+    uint64_t r = crc;
+
+    for (unsigned i = 0; i < nblocks; i++) {
+        uint64_t b = off ? p[i] << off | p[i + 1] >> (64 - off) : p[i];
+        uint64_t a = r << (64 - width) ^ b;
+        uint64x2_t x = vreinterpretq_u64_p128(vmull_p64(a, k->mu));
+        uint64_t q = vgetq_lane_u64(x, 1) ^ a;
+
+        x = vreinterpretq_u64_p128(vmull_p64(q, k->poly));
+        r = vgetq_lane_u64(x, 0) & ((1u << width) - 1);
+    }
+    return r;
+}
+#endif
+
+bool can_crc_clmul_supported(void)
+{
+#if defined(CAN_CRC_CLMUL_X86)
+    static const bool supported = __builtin_cpu_supports("pclmul");
+
+    return supported;
+#elif defined(CAN_CRC_CLMUL_ARM)
+    return true;
+#else
+    return false;
+#endif
+}
+
+static uint32_t can_crc_packed_clmul(enum can_crc_type type, uint32_t crc,
+                                     const uint64_t *w, unsigned pos, unsigned n)
+{
+#if defined(CAN_CRC_CLMUL_X86) || defined(CAN_CRC_CLMUL_ARM)
+    unsigned nblocks = n / 64;
+
+    if (nblocks && can_crc_clmul_supported()) {
+        crc = can_crc_fold64(&can_crc_consts()->fold[type], can_crc_params[type].width,
+                             crc, w, pos, nblocks);
+        pos += nblocks * 64;
+        n -= nblocks * 64;
+    }
+#endif
+    return can_crc_packed_table(type, crc, w, pos, n);
+}
+
+uint32_t can_crc_packed_impl(enum can_crc_impl impl, enum can_crc_type type,
+                             uint32_t crc, const uint64_t *w, unsigned pos, unsigned n)
+{
+    switch (impl) {
+    case CAN_CRC_BITWISE:
+        return can_crc_packed_bitwise(type, crc, w, pos, n);
+    case CAN_CRC_CLMUL:
+        return can_crc_packed_clmul(type, crc, w, pos, n);
+    default:
+        return can_crc_packed_table(type, crc, w, pos, n);
+    }
+}
+
+uint32_t can_crc_packed(enum can_crc_type type, uint32_t crc, const uint64_t *w,
+                        unsigned pos, unsigned n)
+{
+    if (n >= CAN_CRC_CLMUL_MIN_BITS)
+        return can_crc_packed_clmul(type, crc, w, pos, n);
+    return can_crc_packed_table(type, crc, w, pos, n);
+}
+
+/* crc_calc.vhd with the generics and init vectors of can_crc.vhd */
+static const uint32_t can_crc_vhdl_poly[3] = {0xC599, 0x3685B, 0x302899};
+
+static uint32_t can_crc_vhdl_init(enum can_crc_type type, bool iso)
+{
+    return type != CAN_CRC15 && iso ? 1u << (can_crc_params[type].width - 1) : 0;
+}
+
+static uint32_t can_crc_vhdl_bit(enum can_crc_type type, uint32_t crc_q, unsigned data_in)
+{
+    unsigned width = can_crc_params[type].width;
+    uint32_t mask = (1u << width) - 1;
+    unsigned crc_nxt = (data_in ^ (crc_q >> (width - 1))) & 1;
+    uint32_t crc_shift = (crc_q << 1) & mask;
+
+    /* G_POLYNOMIAL(G_CRC_WIDTH - 1 downto 0) */
+    return crc_nxt ? crc_shift ^ (can_crc_vhdl_poly[type] & mask) : crc_shift;
+}
+
+static uint64_t can_crc_rand(uint64_t *s)
+{
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 0x2545f4914f6cdd1dull;
+}
+
+#define CAN_CRC_CHECK_BITS      1024
+#define CAN_CRC_CHECK_WORDS     (CAN_CRC_CHECK_BITS / 64 + 3)
+
+static void can_crc_put_bit(uint64_t *w, unsigned pos, unsigned b)
+{
+    uint64_t m = 1ull << (63 - (pos & 63));
+
+    w[pos >> 6] = b ? w[pos >> 6] | m : w[pos >> 6] & ~m;
+}
+
+unsigned can_crc_check(unsigned iterations, uint64_t seed, FILE *f)
+{
+    static const char *const names[3] = {"crc15", "crc17", "crc21"};
+    uint64_t a[CAN_CRC_CHECK_WORDS], b[CAN_CRC_CHECK_WORDS], x[CAN_CRC_CHECK_WORDS];
+    uint64_t z[CAN_CRC_CHECK_WORDS] = {};
+    uint8_t bits[CAN_CRC_CHECK_BITS];
+    unsigned failed = 0;
+
+#define CAN_CRC_EXPECT(cond, what, got, want)                                   \
+    do {                                                                        \
+        if (!(cond)) {                                                          \
+            if (failed++ < 10)                                                  \
+                fprintf(f, "crc check: %s %s, %u bits from %u: 0x%x, "          \
+                        "expected 0x%x\n", names[type], what, n, pos,           \
+                        (unsigned)(got), (unsigned)(want));                     \
+        }                                                                       \
+    } while (0)
+
+    seed |= 1;
+    for (unsigned it = 0; it < iterations; it++) {
+        enum can_crc_type type = (enum can_crc_type)(can_crc_rand(&seed) % 3);
+        const struct can_crc_param *p = &can_crc_params[type];
+        uint32_t mask = (1u << p->width) - 1;
+        unsigned n = can_crc_rand(&seed) % (CAN_CRC_CHECK_BITS - 64);
+        unsigned pos = can_crc_rand(&seed) % 64;
+        unsigned k = n ? can_crc_rand(&seed) % n : 0;
+        bool iso = can_crc_rand(&seed) & 1;
+        uint32_t init, model = 0, crc, c0;
+
+        for (unsigned i = 0; i < CAN_CRC_CHECK_WORDS; i++) {
+            a[i] = can_crc_rand(&seed);
+            b[i] = can_crc_rand(&seed);
+            x[i] = a[i] ^ b[i];
+        }
+        /* Mostly the init vector, sometimes a register in the middle of a frame */
+        init = it % 4 ? can_crc_vhdl_init(type, iso) : can_crc_rand(&seed) & mask;
+
+        model = init;
+        for (unsigned i = 0; i < n; i++) {
+            bits[i] = can_crc_packed_bit(a, pos + i);
+            model = can_crc_vhdl_bit(type, model, bits[i]);
+        }
+        CAN_CRC_EXPECT(model <= mask, "model width", model, mask);
+
+        /* Every implementation, packed and one bit per byte */
+        crc = init;
+        for (unsigned i = 0; i < n; i++)
+            crc = can_crc_bit(p, crc, bits[i]);
+        CAN_CRC_EXPECT(crc == model, "can_crc_bit", crc, model);
+        if (init == p->init) {
+            crc = can_crc_bitwise(type, bits, n);
+            CAN_CRC_EXPECT(crc == model, "can_crc_bitwise", crc, model);
+        }
+        crc = can_crc_bits(type, init, bits, n);
+        CAN_CRC_EXPECT(crc == model, "can_crc_bits", crc, model);
+        for (unsigned impl = 0; impl < CAN_CRC_IMPLS; impl++) {
+            crc = can_crc_packed_impl((enum can_crc_impl)impl, type, init, a, pos, n);
+            CAN_CRC_EXPECT(crc == model, can_crc_impl_names[impl], crc, model);
+
+            /* Continued from a split anywhere */
+            crc = can_crc_packed_impl((enum can_crc_impl)impl, type, init, a, pos, k);
+            crc = can_crc_packed_impl((enum can_crc_impl)impl, type, crc, a, pos + k, n - k);
+            CAN_CRC_EXPECT(crc == model, "split", crc, model);
+        }
+        crc = can_crc_packed(type, init, a, pos, n);
+        CAN_CRC_EXPECT(crc == model, "can_crc_packed", crc, model);
+
+        /* Linear in the data: crc(a ^ b) = crc(a) ^ crc(b) ^ crc(0) */
+        c0 = can_crc_packed(type, init, z, pos, n);
+        crc = can_crc_packed(type, init, x, pos, n) ^ can_crc_packed(type, init, b, pos, n) ^ c0;
+        CAN_CRC_EXPECT(crc == model, "linearity", crc, model);
+
+        /* The sequence followed by its CRC leaves a zero register */
+        for (unsigned i = 0; i < p->width; i++)
+            can_crc_put_bit(a, pos + n + i, (model >> (p->width - 1 - i)) & 1);
+        for (unsigned i = 0; i < p->width; i++)
+            model = can_crc_vhdl_bit(type, model, (a[(pos + n + i) >> 6] >> (63 - ((pos + n + i) & 63))) & 1);
+        CAN_CRC_EXPECT(model == 0, "residue (model)", model, 0);
+        crc = can_crc_packed(type, init, a, pos, n + p->width);
+        CAN_CRC_EXPECT(crc == 0, "residue", crc, 0);
+    }
+#undef CAN_CRC_EXPECT
+    return failed;
+}
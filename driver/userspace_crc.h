@@ -0,0 +1,134 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * CAN CRC computation on bit sequences, in the order bits appear on the
+ * bus, 0 = dominant.
+ *
+ * CRC15 covers the unstuffed classic frame from SOF to the end of data.
+ * CRC17/CRC21 (ISO CAN FD) cover SOF to the end of the stuff count,
+ * including dynamic stuff bits but not fixed stuff bits.
+ *
+ * The shift register is the one of src/can_core/crc_calc.vhd: the
+ * polynomials are the generics of can_crc.vhd without their top term, and
+ * the register never holds more than width bits. All implementations give
+ * the same register value and can continue each other:
+ *  - bitwise: one bit per step, the reference
+ *  - table: 8 bits per step through a 256 entry table per CRC
+ *  - clmul: 64 bits per step, carry-less multiply by x^width with Barrett
+ *    reduction (PCLMULQDQ on x86, PMULL on AArch64 with the crypto
+ *    extension); only where the CPU has it, see can_crc_clmul_supported()
+ *
+ * Bit sequences are either one bit per byte, or packed: bit i is bit
+ * 63 - i % 64 of word i / 64, so the first bit is the MSB of word 0.
+ */
+
+enum can_crc_type {
+    CAN_CRC15,
+    CAN_CRC17,
+    CAN_CRC21,
+};
+
+struct can_crc_param {
+    unsigned width;
+    uint32_t poly;              /* Without the x^width term */
+    uint32_t init;              /* ISO CAN FD; non-ISO CAN FD starts at 0 */
+};
+
+extern const struct can_crc_param can_crc_params[3];
+
+enum can_crc_impl {
+    CAN_CRC_BITWISE,
+    CAN_CRC_TABLE,
+    CAN_CRC_CLMUL,
+    CAN_CRC_IMPLS,
+};
+
+extern const char *const can_crc_impl_names[CAN_CRC_IMPLS];
+
+/* Bit-serial reference implementation, shift register as in ISO 11898-1 */
+uint32_t can_crc_bitwise(enum can_crc_type type, const uint8_t *bits,
+                         unsigned nbits);
+
+/* Continue a bit-serial CRC with one more bit */
+static inline uint32_t can_crc_bit(const struct can_crc_param *p, uint32_t crc,
+                                   unsigned bit)
+{
+    uint32_t top = (crc >> (p->width - 1)) & 1;
+
+    crc = (crc << 1) & ((1u << p->width) - 1);
+    if (top ^ (bit & 1))
+        crc ^= p->poly;
+    return crc;
+}
+
+/* The CRC register after 8 bits of input, per CRC, indexed by (top 8 bits ^ input) */
+struct can_crc_tables {
+    uint32_t byte[3][256];
+};
+
+const struct can_crc_tables *can_crc_tables(void);
+
+/* Continue a CRC with 8 bits, the first in the MSB of @byte */
+static inline uint32_t can_crc_byte(const struct can_crc_param *p, const uint32_t *table,
+                                    uint32_t crc, unsigned byte)
+{
+    return ((crc << 8) ^ table[((crc >> (p->width - 8)) ^ byte) & 0xff]) &
+           ((1u << p->width) - 1);
+}
+
+/* Continue @crc with @nbits bits, one per byte, through the table */
+uint32_t can_crc_bits(enum can_crc_type type, uint32_t crc, const uint8_t *bits,
+                      unsigned nbits);
+
+/*
+ * Continue @crc with @n bits of a packed sequence from bit @pos on, with
+ * @impl. CAN_CRC_CLMUL falls back to the table without CPU support.
+ */
+uint32_t can_crc_packed_impl(enum can_crc_impl impl, enum can_crc_type type,
+                             uint32_t crc, const uint64_t *w, unsigned pos, unsigned n);
+
+/* Same with the fastest implementation for the length */
+uint32_t can_crc_packed(enum can_crc_type type, uint32_t crc, const uint64_t *w,
+                        unsigned pos, unsigned n);
+
+bool can_crc_clmul_supported(void);
+
+/*
+ * Property checks of all implementations on @iterations random sequences
+ * against a model of crc_calc.vhd, which uses the polynomials of
+ * can_crc.vhd as written there. Failures are reported to @f. Returns the
+ * number of failed checks.
+ */
+unsigned can_crc_check(unsigned iterations, uint64_t seed, FILE *f);
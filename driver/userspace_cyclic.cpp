@@ -0,0 +1,609 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#include "userspace_cyclic.h"
+#include "userspace_rxpoll.h"
+
+#include <ctype.h>
+#include <limits.h>
+
+#define LOAD_ACQ(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define LOAD_RLX(p)     __atomic_load_n((p), __ATOMIC_RELAXED)
+#define STORE_REL(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define STORE_RLX(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+
+#define NSEC_PER_SEC 1000000000ull
+
+static uint64_t timespec_ns(const struct timespec *t)
+{
+    return (uint64_t)t->tv_sec * NSEC_PER_SEC + t->tv_nsec;
+}
+
+static struct timespec ns_timespec(uint64_t ns)
+{
+    struct timespec t;
+
+    t.tv_sec = ns / NSEC_PER_SEC;
+    t.tv_nsec = ns % NSEC_PER_SEC;
+    return t;
+}
+
+void cyclic_config_defaults(struct cyclic_config *cfg)
+{
+    cfg->tick_us = 1000;
+    cfg->tx_poll_us = 200;
+    cfg->max_msgs = 1024;
+    cfg->spread_ticks = 1000;
+    cfg->ts_freq = 100000000;
+    cfg->echo_ts = false;
+    cfg->cpu = -1;
+    cfg->rt_prio = 0;
+}
+
+static unsigned cyclic_id_hash(const struct cyclic_sched *cs, canid_t id)
+{
+    return (uint32_t)(id * 0x9e3779b1u) >> (32 - __builtin_popcount(cs->idmap_mask));
+}
+
+static canid_t cyclic_id_key(canid_t id)
+{
+    return id & (CAN_EFF_FLAG | CAN_RTR_FLAG | CAN_EFF_MASK);
+}
+
+static int cyclic_id_lookup(const struct cyclic_sched *cs, canid_t id)
+{
+    unsigned i = cyclic_id_hash(cs, id);
+
+    for (;;) {
+        int32_t idx = cs->idmap[i];
+
+        if (idx < 0)
+            return -1;
+        if (cyclic_id_key(cs->msgs[idx].cf.can_id) == id)
+            return idx;
+        i = (i + 1) & cs->idmap_mask;
+    }
+}
+
+static void cyclic_done(void *arg, const struct tx_sched_frame *f, bool ok,
+                        u64 ts);
+
+int cyclic_init(struct cyclic_sched *cs, struct ctucan_hw_priv *priv,
+                const struct cyclic_config *cfg, cyclic_rx_fn rx, void *rx_arg)
+{
+    unsigned idmap_size = 16;
+
+    cs->priv = priv;
+    cs->cfg = *cfg;
+    if (!cs->cfg.tick_us)
+        cs->cfg.tick_us = 1;
+    if (!cs->cfg.spread_ticks)
+        cs->cfg.spread_ticks = 1;
+    cs->nmsgs = 0;
+    cs->wheel1_count = 0;
+    cs->tick = 0;
+    cs->rx = rx;
+    cs->rx_arg = rx_arg;
+    cs->stop = false;
+    memset(&cs->stats, 0, sizeof(cs->stats));
+    userspace_hist_init(&cs->stats.jitter);
+    userspace_hist_init(&cs->stats.release_lag);
+    memset(cs->bitmap0, 0, sizeof(cs->bitmap0));
+    for (unsigned i = 0; i < CYCLIC_WHEEL0_SLOTS; i++)
+        cs->wheel0[i] = -1;
+    for (unsigned i = 0; i < CYCLIC_WHEEL1_SLOTS; i++)
+        cs->wheel1[i] = -1;
+
+    while (idmap_size < 2 * cfg->max_msgs)
+        idmap_size <<= 1;
+    cs->idmap_mask = idmap_size - 1;
+    cs->msgs = (struct cyclic_msg *)calloc(cfg->max_msgs, sizeof(*cs->msgs));
+    cs->idmap = (int32_t *)malloc(idmap_size * sizeof(*cs->idmap));
+    cs->load = (uint16_t *)calloc(cs->cfg.spread_ticks, sizeof(*cs->load));
+    if (!cs->msgs || !cs->idmap || !cs->load) {
+        warnx("cannot allocate cyclic scheduler for %u messages", cfg->max_msgs);
+        cyclic_free(cs);
+        return -1;
+    }
+    memset(cs->idmap, 0xff, idmap_size * sizeof(*cs->idmap));
+
+    if (tx_sched_init(&cs->tx, priv, cfg->max_msgs, cyclic_done, cs)) {
+        cyclic_free(cs);
+        return -1;
+    }
+
+    if (cfg->echo_ts) {
+        struct can_ctrlmode mode = {CAN_CTRLMODE_LOOPBACK, CAN_CTRLMODE_LOOPBACK};
+
+        ctucan_hw_set_mode_reg(priv, &mode);
+        ctucan_hw_set_rx_tsop(priv, RTS_BEG);
+    }
+    return 0;
+}
+
+void cyclic_free(struct cyclic_sched *cs)
+{
+    tx_sched_free(&cs->tx);
+    free(cs->msgs);
+    free(cs->idmap);
+    free(cs->load);
+    cs->msgs = NULL;
+    cs->idmap = NULL;
+    cs->load = NULL;
+}
+
+static void cyclic_list_add(struct cyclic_sched *cs, int32_t *head, int32_t idx)
+{
+    struct cyclic_msg *m = &cs->msgs[idx];
+
+    m->prev = -1;
+    m->next = *head;
+    if (*head >= 0)
+        cs->msgs[*head].prev = idx;
+    *head = idx;
+}
+
+/* Put message on the wheel according to its expiry relative to cs->tick */
+static void cyclic_wheel_insert(struct cyclic_sched *cs, int32_t idx)
+{
+    struct cyclic_msg *m = &cs->msgs[idx];
+    uint64_t cur = cs->tick;
+    uint64_t rev;
+
+    if (m->expiry < cur)
+        m->expiry = cur;
+    if (m->expiry - cur < CYCLIC_WHEEL0_SLOTS) {
+        unsigned slot = m->expiry & (CYCLIC_WHEEL0_SLOTS - 1);
+
+        cyclic_list_add(cs, &cs->wheel0[slot], idx);
+        cs->bitmap0[slot / 64] |= 1ull << (slot % 64);
+        return;
+    }
+
+    /* Revolutions beyond level 1 range park in its last slot and come back */
+    rev = (m->expiry >> CYCLIC_WHEEL0_BITS) - (cur >> CYCLIC_WHEEL0_BITS);
+    if (rev >= CYCLIC_WHEEL1_SLOTS)
+        rev = CYCLIC_WHEEL1_SLOTS - 1;
+    rev += cur >> CYCLIC_WHEEL0_BITS;
+    cyclic_list_add(cs, &cs->wheel1[rev & (CYCLIC_WHEEL1_SLOTS - 1)], idx);
+    cs->wheel1_count++;
+}
+
+/* Ticks from @from to the next non-empty level 0 slot, -1 if none */
+static int cyclic_next_slot(const struct cyclic_sched *cs, uint64_t from)
+{
+    unsigned d = 0;
+
+    while (d < CYCLIC_WHEEL0_SLOTS) {
+        unsigned s = (from + d) & (CYCLIC_WHEEL0_SLOTS - 1);
+        uint64_t w = cs->bitmap0[s / 64] >> (s % 64);
+
+        if (w) {
+            d += __builtin_ctzll(w);
+            return d < CYCLIC_WHEEL0_SLOTS ? (int)d : -1;
+        }
+        d += 64 - s % 64;
+    }
+    return -1;
+}
+
+static void cyclic_spread(struct cyclic_sched *cs, struct cyclic_msg *m)
+{
+    unsigned horizon = cs->cfg.spread_ticks;
+    unsigned best = 0, best_cost = UINT_MAX;
+    unsigned span = m->period < horizon ? m->period : horizon;
+
+    for (unsigned p = 0; p < span && best_cost; p++) {
+        unsigned cost = 0;
+
+        for (unsigned t = p; t < horizon; t += m->period)
+            if (cs->load[t] > cost)
+                cost = cs->load[t];
+        if (cost < best_cost) {
+            best_cost = cost;
+            best = p;
+        }
+    }
+    m->phase = best;
+}
+
+int cyclic_add(struct cyclic_sched *cs, const struct canfd_frame *cf, bool fdf,
+               uint32_t period_us, uint32_t phase_us)
+{
+    struct cyclic_msg *m;
+    int32_t idx;
+    unsigned h;
+
+    if (cs->nmsgs >= cs->cfg.max_msgs) {
+        warnx("too many cyclic messages, max %u", cs->cfg.max_msgs);
+        return -1;
+    }
+    if (cyclic_id_lookup(cs, cyclic_id_key(cf->can_id)) >= 0) {
+        warnx("cyclic message with ID 0x%x already exists", cf->can_id);
+        return -1;
+    }
+
+    idx = cs->nmsgs++;
+    m = &cs->msgs[idx];
+    memset(m, 0, sizeof(*m));
+    m->cf = *cf;
+    m->fdf = fdf;
+    m->period = (period_us + cs->cfg.tick_us / 2) / cs->cfg.tick_us;
+    if (!m->period)
+        m->period = 1;
+    if (phase_us == CYCLIC_PHASE_AUTO)
+        cyclic_spread(cs, m);
+    else
+        m->phase = phase_us / cs->cfg.tick_us;
+    for (unsigned t = m->phase; t < cs->cfg.spread_ticks; t += m->period)
+        cs->load[t]++;
+
+    h = cyclic_id_hash(cs, cyclic_id_key(cf->can_id));
+    while (cs->idmap[h] >= 0)
+        h = (h + 1) & cs->idmap_mask;
+    cs->idmap[h] = idx;
+
+    m->expiry = cs->tick + m->phase;
+    cyclic_wheel_insert(cs, idx);
+    return idx;
+}
+
+void cyclic_update(struct cyclic_sched *cs, int handle,
+                   const struct canfd_frame *cf)
+{
+    struct cyclic_msg *m = &cs->msgs[handle];
+    uint32_t seq = LOAD_RLX(&m->seq);
+
+    STORE_RLX(&m->seq, seq + 1);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    m->cf.len = cf->len;
+    m->cf.flags = cf->flags;
+    memcpy(m->cf.data, cf->data, sizeof(m->cf.data));
+    STORE_REL(&m->seq, seq + 2);
+}
+
+static void cyclic_read_content(struct cyclic_msg *m, struct canfd_frame *cf)
+{
+    for (;;) {
+        uint32_t seq = LOAD_ACQ(&m->seq);
+
+        if (seq & 1) {
+            rxpoll_cpu_relax();
+            continue;
+        }
+        *cf = m->cf;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (LOAD_RLX(&m->seq) == seq)
+            return;
+    }
+}
+
+static void cyclic_tx_ts(struct cyclic_sched *cs, struct cyclic_msg *m, u64 ts)
+{
+    if (m->have_last) {
+        uint64_t nominal = (uint64_t)m->period * cs->cfg.tick_us *
+                           cs->cfg.ts_freq / 1000000;
+        uint64_t interval = ts - m->last_ts;
+        uint64_t dev = interval > nominal ? interval - nominal : nominal - interval;
+
+        userspace_hist_add(&cs->stats.jitter, dev);
+        if (dev > m->jitter_max)
+            m->jitter_max = dev;
+    }
+    m->last_ts = ts;
+    m->have_last = true;
+}
+
+static void cyclic_done(void *arg, const struct tx_sched_frame *f, bool ok,
+                        u64 ts)
+{
+    struct cyclic_sched *cs = (struct cyclic_sched *)arg;
+    struct cyclic_msg *m = &cs->msgs[f->tag];
+
+    m->in_flight = false;
+    if (!ok) {
+        m->have_last = false;
+        return;
+    }
+    m->sent++;
+    if (!cs->cfg.echo_ts)
+        cyclic_tx_ts(cs, m, ts);
+}
+
+static void cyclic_release(struct cyclic_sched *cs, int32_t idx)
+{
+    struct cyclic_msg *m = &cs->msgs[idx];
+    struct canfd_frame cf;
+
+    m->released++;
+    if (m->in_flight) {
+        /* Previous instance still waits for the bus */
+        m->overruns++;
+        m->have_last = false;
+        cs->stats.overruns++;
+        return;
+    }
+    cyclic_read_content(m, &cf);
+    if (tx_sched_queue(&cs->tx, &cf, m->fdf, idx)) {
+        m->in_flight = true;
+        cs->stats.releases++;
+    }
+}
+
+static void cyclic_process_tick(struct cyclic_sched *cs, uint64_t now_ns)
+{
+    uint64_t t = cs->tick;
+    unsigned slot = t & (CYCLIC_WHEEL0_SLOTS - 1);
+    uint64_t deadline;
+    int32_t idx;
+
+    if (!slot && cs->wheel1_count) {
+        int32_t *head = &cs->wheel1[(t >> CYCLIC_WHEEL0_BITS) &
+                                    (CYCLIC_WHEEL1_SLOTS - 1)];
+
+        idx = *head;
+        *head = -1;
+        while (idx >= 0) {
+            int32_t next = cs->msgs[idx].next;
+
+            cs->wheel1_count--;
+            cyclic_wheel_insert(cs, idx);
+            idx = next;
+        }
+    }
+
+    cs->stats.ticks++;
+    idx = cs->wheel0[slot];
+    if (idx < 0)
+        return;
+    cs->wheel0[slot] = -1;
+    cs->bitmap0[slot / 64] &= ~(1ull << (slot % 64));
+
+    deadline = t * cs->cfg.tick_us * 1000ull;
+    if (now_ns > deadline + cs->cfg.tick_us * 1000ull)
+        cs->stats.late_ticks++;
+    userspace_hist_add(&cs->stats.release_lag,
+                       now_ns > deadline ? now_ns - deadline : 0);
+
+    /* Re-arming goes to a later slot, never back to this list */
+    while (idx >= 0) {
+        struct cyclic_msg *m = &cs->msgs[idx];
+        int32_t next = m->next;
+
+        cyclic_release(cs, idx);
+        m->expiry += m->period;
+        cyclic_wheel_insert(cs, idx);
+        idx = next;
+    }
+}
+
+static void cyclic_poll_echo(struct cyclic_sched *cs)
+{
+    struct ctucan_hw_priv *priv = cs->priv;
+    u32 n = ctucan_hw_get_rx_frame_count(priv);
+
+    while (n--) {
+        struct canfd_frame cf;
+        u64 ts;
+        int idx;
+
+        ctucan_hw_read_rx_frame(priv, &cf, &ts);
+        idx = cyclic_id_lookup(cs, cyclic_id_key(cf.can_id));
+        if (idx >= 0) {
+            cs->stats.echoes++;
+            cyclic_tx_ts(cs, &cs->msgs[idx], ts);
+        } else {
+            cs->stats.foreign++;
+            if (cs->rx)
+                cs->rx(cs->rx_arg, &cf, ts);
+        }
+    }
+}
+
+void cyclic_run(struct cyclic_sched *cs)
+{
+    uint64_t tick_ns = cs->cfg.tick_us * 1000ull;
+    uint64_t t0;
+
+    if (cs->cfg.cpu >= 0 || cs->cfg.rt_prio > 0)
+        rxpoll_pin_thread(cs->cfg.cpu, cs->cfg.rt_prio);
+
+    clock_gettime(CLOCK_MONOTONIC, &cs->t0);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cs->cpu_start);
+    cs->run_start = cs->t0;
+    t0 = timespec_ns(&cs->t0);
+
+    while (!cs->stop.load(std::memory_order_relaxed)) {
+        struct timespec now, wake;
+        uint64_t now_ns, wake_ns;
+        int d;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        now_ns = timespec_ns(&now) - t0;
+
+        /* Collect completions first so a re-released message is not busy */
+        tx_sched_poll(&cs->tx);
+        while (cs->tick * tick_ns <= now_ns) {
+            cyclic_process_tick(cs, now_ns);
+            cs->tick++;
+        }
+
+        tx_sched_poll(&cs->tx);
+        if (cs->cfg.echo_ts)
+            cyclic_poll_echo(cs);
+
+        /* Sleep until next due slot or level 1 cascade */
+        d = cyclic_next_slot(cs, cs->tick);
+        if (d < 0) {
+            uint64_t rev = (cs->tick + CYCLIC_WHEEL0_SLOTS - 1) &
+                           ~(uint64_t)(CYCLIC_WHEEL0_SLOTS - 1);
+
+            wake_ns = rev * tick_ns;
+        } else {
+            wake_ns = (cs->tick + d) * tick_ns;
+        }
+        /*
+         * Frames waiting for a TXT buffer need an early refill. With echo
+         * timestamps, completion of loaded frames can wait for next tick.
+         */
+        if ((cs->cfg.echo_ts ? cs->tx.depth : tx_sched_pending(&cs->tx)) &&
+            wake_ns > now_ns + cs->cfg.tx_poll_us * 1000ull)
+            wake_ns = now_ns + cs->cfg.tx_poll_us * 1000ull;
+
+        wake = ns_timespec(t0 + wake_ns);
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL);
+        cs->stats.wakeups++;
+    }
+}
+
+static int cyclic_parse_hex(const char *s, u8 *data, unsigned max)
+{
+    unsigned n = 0;
+
+    while (s[0] && s[1]) {
+        unsigned v;
+
+        if (n >= max || !isxdigit((unsigned char)s[0]) ||
+            !isxdigit((unsigned char)s[1]) || sscanf(s, "%2x", &v) != 1)
+            return -1;
+        data[n++] = v;
+        s += 2;
+    }
+    return s[0] ? -1 : (int)n;
+}
+
+int cyclic_load_file(struct cyclic_sched *cs, const char *fname, bool fdf)
+{
+    char line[256];
+    unsigned lineno = 0;
+    int count = 0;
+    FILE *f = fopen(fname, "r");
+
+    if (!f) {
+        warn("%s", fname);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        struct canfd_frame cf;
+        char *tok[4], *save = NULL;
+        unsigned ntok = 0;
+        unsigned long id;
+        double period, phase;
+        uint32_t phase_us = CYCLIC_PHASE_AUTO;
+        int len = 0;
+        char *e;
+
+        lineno++;
+        for (char *t = strtok_r(line, " \t\r\n", &save); t && ntok < 4;
+             t = strtok_r(NULL, " \t\r\n", &save))
+            tok[ntok++] = t;
+        if (!ntok || tok[0][0] == '#')
+            continue;
+        if (ntok < 2)
+            goto bad;
+
+        memset(&cf, 0, sizeof(cf));
+        id = strtoul(tok[0], &e, 0);
+        if (*e || id > CAN_EFF_MASK)
+            goto bad;
+        cf.can_id = id > CAN_SFF_MASK ? (id | CAN_EFF_FLAG) : id;
+        period = strtod(tok[1], &e);
+        if (*e || period <= 0)
+            goto bad;
+        if (ntok > 2 && strcmp(tok[2], "auto")) {
+            phase = strtod(tok[2], &e);
+            if (*e || phase < 0)
+                goto bad;
+            phase_us = phase * 1000;
+        }
+        if (ntok > 3) {
+            len = cyclic_parse_hex(tok[3], cf.data, fdf ? CANFD_MAX_DLEN : CAN_MAX_DLEN);
+            if (len < 0)
+                goto bad;
+        }
+        cf.len = len;
+        if (fdf)
+            cf.flags |= CANFD_BRS;
+        if (cyclic_add(cs, &cf, fdf, period * 1000, phase_us) < 0)
+            break;
+        count++;
+        continue;
+bad:
+        warnx("%s:%u: expected <id> <period_ms> [<phase_ms>|auto [<hex data>]]",
+              fname, lineno);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    return count;
+}
+
+void cyclic_report(const struct cyclic_sched *cs, FILE *f)
+{
+    const struct cyclic_stats *st = &cs->stats;
+    struct timespec now, cpu;
+    uint64_t wall_ns, cpu_ns;
+    uint64_t sent = 0, worst = 0;
+    int worst_idx = -1;
+    uint64_t freq = cs->cfg.ts_freq ? cs->cfg.ts_freq : 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    wall_ns = timespec_ns(&now) - timespec_ns(&cs->run_start);
+    cpu_ns = timespec_ns(&cpu) - timespec_ns(&cs->cpu_start);
+
+    for (unsigned i = 0; i < cs->nmsgs; i++) {
+        sent += cs->msgs[i].sent;
+        if (cs->msgs[i].jitter_max > worst || worst_idx < 0) {
+            worst = cs->msgs[i].jitter_max;
+            worst_idx = i;
+        }
+    }
+
+    fprintf(f, "cyclic: %u messages, %llu ticks, %llu wakeups, %llu released, "
+               "%llu sent, %llu overruns, %llu late ticks\n",
+            cs->nmsgs, (unsigned long long)st->ticks,
+            (unsigned long long)st->wakeups, (unsigned long long)st->releases,
+            (unsigned long long)sent, (unsigned long long)st->overruns,
+            (unsigned long long)st->late_ticks);
+    if (cs->cfg.echo_ts)
+        fprintf(f, "cyclic: %llu echoed frames, %llu foreign frames\n",
+                (unsigned long long)st->echoes, (unsigned long long)st->foreign);
+    fprintf(f, "cyclic: CPU %.3f %% of one core (%llu us in %llu ms)\n",
+            wall_ns ? 100.0 * cpu_ns / wall_ns : 0.0,
+            (unsigned long long)(cpu_ns / 1000),
+            (unsigned long long)(wall_ns / 1000000));
+    userspace_hist_print(f, "cyclic release lag", &st->release_lag, 1, 1000, "us");
+    userspace_hist_print(f, "cyclic jitter", &st->jitter, 1000000, freq, "us");
+    if (worst_idx >= 0)
+        fprintf(f, "cyclic: worst jitter %llu us on ID 0x%x\n",
+                (unsigned long long)(worst * 1000000 / freq),
+                cs->msgs[worst_idx].cf.can_id);
+    tx_sched_report(&cs->tx, f);
+}
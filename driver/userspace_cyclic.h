@@ -0,0 +1,171 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#pragma once
+
+#include "userspace_utils.h"
+#include "userspace_hist.h"
+#include "userspace_tx.h"
+
+#include <atomic>
+#include <time.h>
+
+/*
+ * Cyclic message scheduler.
+ *
+ * Periodic frames are kept on a two level hierarchical timer wheel with
+ * a fixed tick (1 ms by default). Level 0 has one slot per tick for the
+ * next CYCLIC_WHEEL0_SLOTS ticks, level 1 one slot per level 0 revolution.
+ * Level 1 slots are cascaded into level 0 when their revolution starts.
+ * Adding, expiring and re-arming a message is O(1); an idle tick costs
+ * one bitmap lookup, and the scheduler sleeps with an absolute
+ * clock_nanosleep until the next non-empty slot.
+ *
+ * Due frames are released into the TX engine (userspace_tx.h), which keeps
+ * them in TXT buffers in arbitration order. A message whose previous frame
+ * has not been sent yet when it expires again is not queued twice, the
+ * release is counted as overrun.
+ *
+ * Frame content can be updated at any time from another thread with
+ * cyclic_update(), the period and phase are kept (one writer per message).
+ *
+ * Jitter is the deviation of the interval between two consecutive
+ * transmissions of a message from its period. With echo_ts the core's
+ * internal loopback is enabled and the SOF timestamps of the echoed frames
+ * are used; otherwise TIMESTAMP is read when TX_STATUS reports the frame
+ * as sent, which includes polling delay.
+ */
+
+#define CYCLIC_WHEEL0_BITS  8
+#define CYCLIC_WHEEL0_SLOTS (1u << CYCLIC_WHEEL0_BITS)
+#define CYCLIC_WHEEL1_BITS  6
+#define CYCLIC_WHEEL1_SLOTS (1u << CYCLIC_WHEEL1_BITS)
+#define CYCLIC_PHASE_AUTO   UINT32_MAX
+
+struct cyclic_config {
+    unsigned tick_us;       /* Wheel resolution */
+    unsigned tx_poll_us;    /* Poll interval while frames are in flight */
+    unsigned max_msgs;
+    unsigned spread_ticks;  /* Horizon for automatic phase placement */
+    uint32_t ts_freq;       /* Timestamp counter frequency in Hz */
+    bool echo_ts;           /* Measure jitter on loopback SOF timestamps */
+    int cpu;                /* CPU to pin the scheduler to, -1 = no pinning */
+    int rt_prio;            /* SCHED_FIFO priority, 0 = keep policy */
+};
+
+struct cyclic_msg {
+    uint32_t seq;           /* Content seqlock, odd while updated */
+    bool fdf;
+    struct canfd_frame cf;
+    uint32_t period;        /* In ticks */
+    uint32_t phase;
+    uint64_t expiry;        /* Absolute tick of next release */
+    int32_t next;           /* Wheel slot list */
+    int32_t prev;
+    bool in_flight;
+    bool have_last;
+    u64 last_ts;
+    uint64_t released;
+    uint64_t sent;
+    uint64_t overruns;
+    uint64_t jitter_max;    /* In timestamp ticks */
+};
+
+struct cyclic_stats {
+    uint64_t wakeups;
+    uint64_t ticks;
+    uint64_t releases;
+    uint64_t overruns;
+    uint64_t late_ticks;    /* Ticks processed after their deadline */
+    uint64_t echoes;
+    uint64_t foreign;       /* RX frames not matching any message */
+    struct userspace_hist jitter;   /* In timestamp ticks */
+    struct userspace_hist release_lag;  /* Tick deadline to release, ns */
+};
+
+typedef void (*cyclic_rx_fn)(void *arg, const struct canfd_frame *cf, u64 ts);
+
+struct cyclic_sched {
+    struct ctucan_hw_priv *priv;
+    struct cyclic_config cfg;
+    struct tx_sched tx;
+    struct cyclic_msg *msgs;
+    unsigned nmsgs;
+    int32_t wheel0[CYCLIC_WHEEL0_SLOTS];
+    int32_t wheel1[CYCLIC_WHEEL1_SLOTS];
+    uint64_t bitmap0[CYCLIC_WHEEL0_SLOTS / 64];
+    unsigned wheel1_count;
+    uint64_t tick;          /* Next tick to process */
+    struct timespec t0;     /* Wall time of tick 0 */
+    int32_t *idmap;         /* CAN ID to message, open addressing */
+    unsigned idmap_mask;
+    uint16_t *load;         /* Releases per tick within spread_ticks */
+    cyclic_rx_fn rx;
+    void *rx_arg;
+    std::atomic<bool> stop;
+    struct cyclic_stats stats;
+    struct timespec run_start;
+    struct timespec cpu_start;
+};
+
+void cyclic_config_defaults(struct cyclic_config *cfg);
+
+/*
+ * Set up the scheduler and its TX engine. With echo_ts the internal loopback
+ * is enabled and RX frames not sent by us are passed to @rx (may be NULL).
+ */
+int cyclic_init(struct cyclic_sched *cs, struct ctucan_hw_priv *priv,
+                const struct cyclic_config *cfg, cyclic_rx_fn rx, void *rx_arg);
+
+void cyclic_free(struct cyclic_sched *cs);
+
+/*
+ * Add a message sent every @period_us, first at @phase_us after start.
+ * With CYCLIC_PHASE_AUTO the phase is chosen to spread releases evenly.
+ * Must be called before cyclic_run(). Returns message handle or -1.
+ */
+int cyclic_add(struct cyclic_sched *cs, const struct canfd_frame *cf, bool fdf,
+               uint32_t period_us, uint32_t phase_us);
+
+/* Replace content of message @handle, takes effect at its next release */
+void cyclic_update(struct cyclic_sched *cs, int handle,
+                   const struct canfd_frame *cf);
+
+/* Run until cs->stop is set */
+void cyclic_run(struct cyclic_sched *cs);
+
+/*
+ * Load messages from a text file, one per line:
+ *   <id> <period_ms> [<phase_ms>|auto [<hex data>]]
+ * IDs above 0x7ff are sent as extended. Returns number of messages or -1.
+ */
+int cyclic_load_file(struct cyclic_sched *cs, const char *fname, bool fdf);
+
+/* Print release, overrun and jitter statistics and CPU usage */
+void cyclic_report(const struct cyclic_sched *cs, FILE *f);
@@ -0,0 +1,404 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#include "userspace_dispatch.h"
+
+#define CUCKOO_MAX_KICKS    64
+
+void dispatch_init(struct dispatch *d)
+{
+    memset(d, 0, sizeof(*d));
+    for (unsigned i = 0; i < DISPATCH_CACHE_SIZE; i++)
+        d->cache[i].key = DISPATCH_EMPTY;
+}
+
+void dispatch_free(struct dispatch *d)
+{
+    free(d->eff);
+    free(d->routes);
+    free(d->handlers);
+    free(d->route_hash);
+    free(d->route_tab);
+    free(d->subs);
+    dispatch_init(d);
+}
+
+void dispatch_set_default(struct dispatch *d, dispatch_fn fn, void *arg)
+{
+    d->deflt.fn = fn;
+    d->deflt.arg = arg;
+}
+
+static unsigned wildcard_bits(const struct dispatch_sub *s)
+{
+    return __builtin_popcount(~s->mask & (s->ext ? CAN_EFF_MASK : CAN_SFF_MASK));
+}
+
+int dispatch_subscribe(struct dispatch *d, canid_t id, canid_t mask,
+                       dispatch_fn fn, void *arg)
+{
+    struct dispatch_sub *s;
+
+    if (d->nsubs == d->subs_cap) {
+        unsigned ncap = d->subs_cap ? 2 * d->subs_cap : 16;
+        struct dispatch_sub *n = (struct dispatch_sub *)realloc(d->subs, ncap * sizeof(*n));
+
+        if (!n) {
+            warnx("dispatch: out of memory");
+            return -1;
+        }
+        d->subs = n;
+        d->subs_cap = ncap;
+    }
+    s = &d->subs[d->nsubs];
+    s->ext = id & CAN_EFF_FLAG;
+    s->mask = mask & (s->ext ? CAN_EFF_MASK : CAN_SFF_MASK);
+    s->id = id & s->mask;
+    s->h.fn = fn;
+    s->h.arg = arg;
+    if (s->ext && wildcard_bits(s) > DISPATCH_EXPAND_BITS) {
+        if (d->nwide == DISPATCH_MAX_WIDE) {
+            warnx("dispatch: more than %d extended masks with over %d wildcard bits",
+                  DISPATCH_MAX_WIDE, DISPATCH_EXPAND_BITS);
+            return -1;
+        }
+        d->wide[d->nwide++] = d->nsubs;
+    }
+    d->nsubs++;
+    return 0;
+}
+
+static uint64_t handlers_hash(const struct dispatch_handler *h, unsigned n)
+{
+    uint64_t x = 0xcbf29ce484222325ull;
+
+    for (unsigned i = 0; i < n; i++) {
+        x = (x ^ (uintptr_t)h[i].fn) * 0x100000001b3ull;
+        x = (x ^ (uintptr_t)h[i].arg) * 0x100000001b3ull;
+    }
+    return x ^ n;
+}
+
+static int route_tab_grow(struct dispatch *d)
+{
+    unsigned size = d->route_tab_size ? 2 * d->route_tab_size : 64;
+    uint32_t *tab = (uint32_t *)malloc(size * sizeof(*tab));
+
+    if (!tab)
+        return -1;
+    memset(tab, 0xff, size * sizeof(*tab));
+    for (unsigned r = 1; r < d->nroutes; r++) {
+        unsigned i = d->route_hash[r] & (size - 1);
+
+        while (tab[i] != DISPATCH_EMPTY)
+            i = (i + 1) & (size - 1);
+        tab[i] = r;
+    }
+    free(d->route_tab);
+    d->route_tab = tab;
+    d->route_tab_size = size;
+    return 0;
+}
+
+/* Route with handler list @h, created if new. Returns 0 on allocation failure. */
+static uint32_t route_intern(struct dispatch *d, const struct dispatch_handler *h,
+                             unsigned n)
+{
+    uint64_t hash = handlers_hash(h, n);
+    struct dispatch_route *r;
+    unsigned i;
+
+    if (!n)
+        return 0;
+    if (2 * (d->nroutes + 1) > d->route_tab_size && route_tab_grow(d))
+        return 0;
+    for (i = hash & (d->route_tab_size - 1); d->route_tab[i] != DISPATCH_EMPTY;
+         i = (i + 1) & (d->route_tab_size - 1)) {
+        r = &d->routes[d->route_tab[i]];
+        if (d->route_hash[d->route_tab[i]] == hash && r->count == n &&
+            !memcmp(&d->handlers[r->first], h, n * sizeof(*h)))
+            return d->route_tab[i];
+    }
+    if (d->nroutes > UINT16_MAX) {
+        warnx("dispatch: too many distinct handler sets");
+        return 0;
+    }
+
+    if (d->nroutes == d->routes_cap) {
+        unsigned ncap = 2 * d->routes_cap;
+        struct dispatch_route *nr = (struct dispatch_route *)realloc(d->routes, ncap * sizeof(*nr));
+        uint64_t *nh;
+
+        if (!nr)
+            return 0;
+        d->routes = nr;
+        nh = (uint64_t *)realloc(d->route_hash, ncap * sizeof(*nh));
+        if (!nh)
+            return 0;
+        d->route_hash = nh;
+        d->routes_cap = ncap;
+    }
+    if (d->nhandlers + n > d->handlers_cap) {
+        unsigned ncap = d->handlers_cap;
+        struct dispatch_handler *nh;
+
+        while (d->nhandlers + n > ncap)
+            ncap *= 2;
+        nh = (struct dispatch_handler *)realloc(d->handlers, ncap * sizeof(*nh));
+        if (!nh)
+            return 0;
+        d->handlers = nh;
+        d->handlers_cap = ncap;
+    }
+    memcpy(&d->handlers[d->nhandlers], h, n * sizeof(*h));
+    r = &d->routes[d->nroutes];
+    r->first = d->nhandlers;
+    r->count = n;
+    d->nhandlers += n;
+    d->route_hash[d->nroutes] = hash;
+    d->route_tab[i] = d->nroutes;
+    return d->nroutes++;
+}
+
+static inline bool sub_matches(const struct dispatch_sub *s, uint32_t id, bool ext)
+{
+    return s->ext == ext && !((id ^ s->id) & s->mask);
+}
+
+/* Handlers of all subscriptions matching @id, in subscription order */
+static unsigned collect(const struct dispatch *d, uint32_t id, bool ext,
+                        struct dispatch_handler *out)
+{
+    unsigned n = 0;
+
+    for (unsigned i = 0; i < d->nsubs; i++)
+        if (sub_matches(&d->subs[i], id, ext))
+            out[n++] = d->subs[i].h;
+    return n;
+}
+
+static bool cuckoo_insert(struct dispatch *d, uint32_t key, uint32_t route)
+{
+    struct dispatch_slot cur = {key, route};
+    unsigned mask = d->eff_size - 1;
+
+    for (unsigned kick = 0; kick < CUCKOO_MAX_KICKS; kick++) {
+        struct dispatch_slot *a = &d->eff[dispatch_hash1(cur.key) & mask];
+        struct dispatch_slot *b = &d->eff[d->eff_size + (dispatch_hash2(cur.key) & mask)];
+        struct dispatch_slot tmp;
+
+        if (a->key == DISPATCH_EMPTY) {
+            *a = cur;
+            return true;
+        }
+        if (b->key == DISPATCH_EMPTY) {
+            *b = cur;
+            return true;
+        }
+        /* Evict alternately from both halves */
+        if (kick & 1) {
+            tmp = *b;
+            *b = cur;
+        } else {
+            tmp = *a;
+            *a = cur;
+        }
+        cur = tmp;
+    }
+    return false;
+}
+
+static bool cuckoo_contains(const struct dispatch *d, uint32_t key)
+{
+    unsigned mask = d->eff_size - 1;
+
+    return d->eff[dispatch_hash1(key) & mask].key == key ||
+           d->eff[d->eff_size + (dispatch_hash2(key) & mask)].key == key;
+}
+
+/* Call @fn for every extended ID of a subscription with few wildcard bits */
+static int for_each_expanded(struct dispatch *d, const struct dispatch_sub *s,
+                             int (*fn)(struct dispatch *, uint32_t, void *), void *arg)
+{
+    uint32_t free_bits = ~s->mask & CAN_EFF_MASK;
+    uint32_t sub = 0;
+
+    /* Enumerate all subsets of free_bits */
+    do {
+        if (fn(d, s->id | sub, arg))
+            return -1;
+        sub = (sub - free_bits) & free_bits;
+    } while (sub);
+    return 0;
+}
+
+struct eff_build {
+    struct dispatch_handler *tmp;
+    unsigned count;
+    bool failed;
+};
+
+static int count_id(struct dispatch *d, uint32_t id, void *arg)
+{
+    (void)d;
+    (void)id;
+    ((struct eff_build *)arg)->count++;
+    return 0;
+}
+
+static int insert_id(struct dispatch *d, uint32_t id, void *arg)
+{
+    struct eff_build *b = (struct eff_build *)arg;
+    uint32_t route;
+
+    if (cuckoo_contains(d, id))
+        return 0;
+    route = route_intern(d, b->tmp, collect(d, id, true, b->tmp));
+    if (!cuckoo_insert(d, id, route)) {
+        b->failed = true;
+        return -1;
+    }
+    return 0;
+}
+
+int dispatch_compile(struct dispatch *d)
+{
+    struct dispatch_handler *tmp;
+    struct eff_build b;
+    unsigned size = 16;
+
+    /* Route 0: no subscribers */
+    free(d->route_tab);
+    d->route_tab = NULL;
+    d->route_tab_size = 0;
+    d->nroutes = 1;
+    d->nhandlers = 0;
+    if (!d->routes) {
+        d->routes = (struct dispatch_route *)calloc(64, sizeof(*d->routes));
+        d->route_hash = (uint64_t *)calloc(64, sizeof(*d->route_hash));
+        d->handlers = (struct dispatch_handler *)calloc(64, sizeof(*d->handlers));
+        d->routes_cap = d->handlers_cap = 64;
+    }
+    tmp = (struct dispatch_handler *)malloc((d->nsubs + 1) * sizeof(*tmp));
+    if (!d->routes || !d->route_hash || !d->handlers || !tmp || route_tab_grow(d))
+        goto nomem;
+    d->routes[0].first = d->routes[0].count = 0;
+
+    for (uint32_t id = 0; id <= CAN_SFF_MASK; id++)
+        d->sff[id] = route_intern(d, tmp, collect(d, id, false, tmp));
+
+    /* Cuckoo hash for at most half load, rebuilt larger if insertion fails */
+    memset(&b, 0, sizeof(b));
+    b.tmp = tmp;
+    for (unsigned i = 0; i < d->nsubs; i++)
+        if (d->subs[i].ext && wildcard_bits(&d->subs[i]) <= DISPATCH_EXPAND_BITS)
+            for_each_expanded(d, &d->subs[i], count_id, &b);
+    while (size < b.count)
+        size <<= 1;
+    for (;;) {
+        struct dispatch_slot *eff = (struct dispatch_slot *)malloc(2 * size * sizeof(*eff));
+
+        if (!eff)
+            goto nomem;
+        memset(eff, 0xff, 2 * size * sizeof(*eff));
+        free(d->eff);
+        d->eff = eff;
+        d->eff_size = size;
+        b.failed = false;
+        for (unsigned i = 0; i < d->nsubs && !b.failed; i++)
+            if (d->subs[i].ext && wildcard_bits(&d->subs[i]) <= DISPATCH_EXPAND_BITS)
+                for_each_expanded(d, &d->subs[i], insert_id, &b);
+        if (!b.failed)
+            break;
+        size <<= 1;
+    }
+
+    for (unsigned i = 0; i < DISPATCH_CACHE_SIZE; i++)
+        d->cache[i].key = DISPATCH_EMPTY;
+    free(tmp);
+    return 0;
+
+nomem:
+    free(tmp);
+    warnx("dispatch: out of memory compiling %u subscriptions", d->nsubs);
+    return -1;
+}
+
+uint32_t dispatch_route_wide(struct dispatch *d, uint32_t id)
+{
+    struct dispatch_handler h[DISPATCH_MAX_WIDE];
+    struct dispatch_slot *c = &d->cache[dispatch_hash1(id) & (DISPATCH_CACHE_SIZE - 1)];
+    unsigned n = 0;
+
+    /* IDs matching an exact or narrow subscription are in the cuckoo hash */
+    for (unsigned i = 0; i < d->nwide; i++) {
+        const struct dispatch_sub *s = &d->subs[d->wide[i]];
+
+        if (sub_matches(s, id, true))
+            h[n++] = s->h;
+    }
+    d->stats.slow++;
+    c->key = id;
+    c->route = route_intern(d, h, n);
+    return c->route;
+}
+
+void dispatch_deliver(void *arg, const struct canfd_frame *cf, u64 ts)
+{
+    dispatch_frame((struct dispatch *)arg, cf, ts);
+}
+
+void dispatch_batch(struct dispatch *d, const struct rxring_frame *f, unsigned n)
+{
+    uint32_t route[64];
+
+    while (n) {
+        unsigned k = n < 64 ? n : 64;
+
+        for (unsigned i = 0; i < k; i++)
+            route[i] = dispatch_route_of(d, f[i].cf.can_id);
+        for (unsigned i = 0; i < k; i++)
+            dispatch_run(d, route[i], &f[i].cf, f[i].ts);
+        f += k;
+        n -= k;
+    }
+}
+
+void dispatch_report(const struct dispatch *d, FILE *f)
+{
+    const struct dispatch_stats *st = &d->stats;
+
+    fprintf(f, "dispatch: %u subscriptions (%u wide extended masks), %u routes, "
+               "%u extended slots\n",
+            d->nsubs, d->nwide, d->nroutes, 2 * d->eff_size);
+    fprintf(f, "dispatch: %llu frames, %llu unmatched, %llu wide mask cache hits, "
+               "%llu wide mask lookups\n",
+            (unsigned long long)st->frames, (unsigned long long)st->unmatched,
+            (unsigned long long)st->cache_hits, (unsigned long long)st->slow);
+}
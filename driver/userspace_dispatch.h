@@ -0,0 +1,200 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#pragma once
+
+#include "userspace_utils.h"
+#include "userspace_rxring.h"
+
+/*
+ * Dispatch of received frames to per-ID handlers.
+ *
+ * Subscriptions (ID, mask, handler) are compiled into lookup tables; the
+ * set of handlers a frame goes to is a route, and every distinct set of
+ * subscriptions gets one route. Standard IDs index a 2048 entry table of
+ * route numbers directly, with masks fully expanded. Extended IDs of exact
+ * subscriptions, and of masks with up to DISPATCH_EXPAND_BITS wildcard
+ * bits, are in a cuckoo hash: a lookup checks exactly two slots.
+ *
+ * Wider extended masks are matched on a miss in the cuckoo hash; the
+ * result is kept in a direct mapped cache, so a repeating ID costs one
+ * more probe. Route 0 has no subscribers and goes to the default handler.
+ *
+ * Frames are dispatched from one thread. dispatch_compile() must not run
+ * concurrently with dispatching.
+ */
+
+#define DISPATCH_EXPAND_BITS    8
+#define DISPATCH_MAX_WIDE       64      /* Wide extended masks */
+#define DISPATCH_CACHE_SIZE     4096    /* Power of two */
+#define DISPATCH_EMPTY          0xffffffffu
+
+typedef void (*dispatch_fn)(void *arg, const struct canfd_frame *cf, u64 ts);
+
+struct dispatch_handler {
+    dispatch_fn fn;
+    void *arg;
+};
+
+struct dispatch_route {
+    uint32_t first;             /* Into handlers */
+    uint32_t count;
+};
+
+struct dispatch_sub {
+    uint32_t id;                /* Without flags */
+    uint32_t mask;              /* 1 bits must match */
+    bool ext;
+    struct dispatch_handler h;
+};
+
+struct dispatch_slot {
+    uint32_t key;               /* Extended ID, DISPATCH_EMPTY if free */
+    uint32_t route;
+};
+
+struct dispatch_stats {
+    uint64_t frames;
+    uint64_t unmatched;         /* Default handler */
+    uint64_t cache_hits;        /* Wide mask result from the cache */
+    uint64_t slow;              /* Wide masks evaluated */
+};
+
+struct dispatch {
+    uint16_t sff[CAN_SFF_MASK + 1];
+    struct dispatch_slot *eff;  /* Two halves of eff_size slots */
+    unsigned eff_size;
+    struct dispatch_slot cache[DISPATCH_CACHE_SIZE];
+
+    struct dispatch_route *routes;
+    unsigned nroutes, routes_cap;
+    struct dispatch_handler *handlers;
+    unsigned nhandlers, handlers_cap;
+    uint64_t *route_hash;       /* Of the handler list, per route */
+    uint32_t *route_tab;        /* Open addressing over routes by handler list */
+    unsigned route_tab_size;
+
+    struct dispatch_sub *subs;
+    unsigned nsubs, subs_cap;
+    unsigned wide[DISPATCH_MAX_WIDE];   /* Subscription indexes */
+    unsigned nwide;
+    struct dispatch_handler deflt;
+    struct dispatch_stats stats;
+};
+
+void dispatch_init(struct dispatch *d);
+
+/*
+ * Subscribe @fn to frames whose ID matches @id in the bits set in @mask.
+ * CAN_EFF_FLAG in @id selects extended IDs. Several subscriptions may
+ * match a frame; their handlers run in subscription order. Takes effect
+ * with the next dispatch_compile(). Returns -1 on allocation failure or
+ * too many wide extended masks.
+ */
+int dispatch_subscribe(struct dispatch *d, canid_t id, canid_t mask,
+                       dispatch_fn fn, void *arg);
+
+/* Handler for frames no subscription matches */
+void dispatch_set_default(struct dispatch *d, dispatch_fn fn, void *arg);
+
+/* Build the tables from the subscriptions. Returns -1 on allocation failure. */
+int dispatch_compile(struct dispatch *d);
+
+/* Route of an extended ID not in the cuckoo hash */
+uint32_t dispatch_route_wide(struct dispatch *d, uint32_t id);
+
+static inline uint32_t dispatch_hash1(uint32_t key)
+{
+    uint32_t h = key * 0x9e3779b1u;
+
+    return h ^ (h >> 15);
+}
+
+static inline uint32_t dispatch_hash2(uint32_t key)
+{
+    uint32_t h = (key ^ 0x5bd1e995u) * 0x85ebca6bu;
+
+    return h ^ (h >> 13);
+}
+
+static inline uint32_t dispatch_route_of(struct dispatch *d, canid_t can_id)
+{
+    uint32_t id, r;
+    const struct dispatch_slot *a, *b, *c;
+
+    if (!(can_id & CAN_EFF_FLAG))
+        return d->sff[can_id & CAN_SFF_MASK];
+
+    id = can_id & CAN_EFF_MASK;
+    a = &d->eff[dispatch_hash1(id) & (d->eff_size - 1)];
+    b = &d->eff[d->eff_size + (dispatch_hash2(id) & (d->eff_size - 1))];
+    r = a->key == id ? a->route : b->route;
+    if (a->key == id || b->key == id)
+        return r;
+    if (!d->nwide)
+        return 0;
+    c = &d->cache[dispatch_hash1(id) & (DISPATCH_CACHE_SIZE - 1)];
+    if (c->key == id) {
+        d->stats.cache_hits++;
+        return c->route;
+    }
+    return dispatch_route_wide(d, id);
+}
+
+static inline void dispatch_run(struct dispatch *d, uint32_t route,
+                                const struct canfd_frame *cf, u64 ts)
+{
+    const struct dispatch_route *r = &d->routes[route];
+    const struct dispatch_handler *h = &d->handlers[r->first];
+
+    d->stats.frames++;
+    if (!route) {
+        d->stats.unmatched++;
+        if (d->deflt.fn)
+            d->deflt.fn(d->deflt.arg, cf, ts);
+        return;
+    }
+    for (uint32_t i = 0; i < r->count; i++)
+        h[i].fn(h[i].arg, cf, ts);
+}
+
+static inline void dispatch_frame(struct dispatch *d, const struct canfd_frame *cf, u64 ts)
+{
+    dispatch_run(d, dispatch_route_of(d, cf->can_id), cf, ts);
+}
+
+/* rxpoll_deliver_fn, @arg is the struct dispatch */
+void dispatch_deliver(void *arg, const struct canfd_frame *cf, u64 ts);
+
+/* Dispatch frames read from an rxring: all lookups first, then handlers */
+void dispatch_batch(struct dispatch *d, const struct rxring_frame *f, unsigned n);
+
+void dispatch_report(const struct dispatch *d, FILE *f);
+
+void dispatch_free(struct dispatch *d);
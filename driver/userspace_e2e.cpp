@@ -0,0 +1,471 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#include "userspace_e2e.h"
+#include "userspace_tx.h"
+#include "userspace_rxpoll.h"
+#include "userspace_bitstream.h"
+
+#include <atomic>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#define E2E_SLOTS       65536u      /* Frames in flight, power of two */
+#define E2E_SEQ_ID_MASK 0xffu       /* Sequence bits in the ID of short frames */
+#define E2E_ID_BASE     0x100u
+#define E2E_EID_BASE    0x1000000u
+#define E2E_BACKLOG     4           /* Queued frames behind the TXT buffers at saturation */
+
+/* What the transmitter knows about a frame, looked up by the receiver */
+struct e2e_slot {
+    u64 ts;                 /* TX core TIMESTAMP right before queueing */
+    uint32_t seq;           /* Written last, validates the slot */
+    uint32_t bus_ns;
+    unsigned mix;
+};
+
+struct e2e_ctx {
+    const struct e2e_config *cfg;
+    struct e2e_result *res;
+    struct ctucan_hw_priv *tx;
+    struct ctucan_hw_priv *rx;
+    struct e2e_slot *slots;
+    std::atomic<bool> stop;
+    uint64_t nbit_ps, dbit_ps;
+    uint32_t rng;
+    uint32_t next_rx_seq;
+    bool have_rx;
+    u64 first_rx_ts, last_rx_ts;
+    struct can_bitstream bs;
+};
+
+void e2e_config_defaults(struct e2e_config *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->load_pct = 50;
+    cfg->duration_ms = 10000;
+    cfg->mix[0].len = 8;
+    cfg->mix[0].weight = 1;
+    cfg->nmix = 1;
+    cfg->bitrate = 1000000;
+    cfg->dbitrate = 5000000;
+    cfg->iso = true;
+    cfg->ts_freq = 100000000;
+    cfg->tx_cpu = -1;
+    cfg->rx_cpu = -1;
+}
+
+int e2e_mix_parse(struct e2e_config *cfg, const char *str)
+{
+    char buf[256], *save = NULL;
+    unsigned n = 0;
+
+    snprintf(buf, sizeof(buf), "%s", str);
+    for (char *t = strtok_r(buf, ",", &save); t; t = strtok_r(NULL, ",", &save)) {
+        struct e2e_mix_entry *m = &cfg->mix[n];
+        char *e;
+
+        if (n == E2E_MIX_MAX) {
+            warnx("frame mix: at most %d entries", E2E_MIX_MAX);
+            return -1;
+        }
+        memset(m, 0, sizeof(*m));
+        m->weight = 1;
+        m->len = strtoul(t, &e, 0);
+        for (; *e && *e != ':'; e++) {
+            if (*e == 'f') {
+                m->fdf = true;
+            } else if (*e == 'b') {
+                m->fdf = true;
+                m->brs = true;
+            } else if (*e == 'x') {
+                m->eff = true;
+            } else {
+                goto bad;
+            }
+        }
+        if (*e == ':') {
+            m->weight = strtoul(e + 1, &e, 0);
+            if (*e || !m->weight)
+                goto bad;
+        }
+        if (m->len > (m->fdf ? CANFD_MAX_DLEN : CAN_MAX_DLEN) ||
+            can_dlc2len(can_len2dlc(m->len)) != m->len)
+            goto bad;
+        n++;
+    }
+    if (!n)
+        goto bad;
+    cfg->nmix = n;
+    return 0;
+bad:
+    warnx("frame mix: <len>[f][b][x][:<weight>],..., len a valid CAN (FD) length");
+    return -1;
+}
+
+static uint64_t e2e_now()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+static uint32_t e2e_rand(struct e2e_ctx *ctx)
+{
+    uint32_t x = ctx->rng;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return ctx->rng = x;
+}
+
+static unsigned e2e_pick(struct e2e_ctx *ctx)
+{
+    const struct e2e_config *cfg = ctx->cfg;
+    unsigned total = 0, r;
+
+    for (unsigned i = 0; i < cfg->nmix; i++)
+        total += cfg->mix[i].weight;
+    r = e2e_rand(ctx) % total;
+    for (unsigned i = 0; i < cfg->nmix; i++) {
+        if (r < cfg->mix[i].weight)
+            return i;
+        r -= cfg->mix[i].weight;
+    }
+    return 0;
+}
+
+static void e2e_build(const struct e2e_mix_entry *m, uint32_t seq,
+                      struct canfd_frame *cf)
+{
+    memset(cf, 0, sizeof(*cf));
+    cf->can_id = (m->eff ? E2E_EID_BASE | CAN_EFF_FLAG : E2E_ID_BASE) |
+                 (seq & E2E_SEQ_ID_MASK);
+    cf->len = m->len;
+    if (m->brs)
+        cf->flags = CANFD_BRS;
+    for (unsigned i = 0; i < cf->len; i++)
+        cf->data[i] = i < 4 ? seq >> (8 * i) : i;
+}
+
+/* Bus time of a frame including intermission */
+static uint32_t e2e_bus_ns(struct e2e_ctx *ctx, const struct canfd_frame *cf, bool fdf)
+{
+    uint64_t dbit = cf->flags & CANFD_BRS ? ctx->dbit_ps : ctx->nbit_ps;
+
+    can_bitstream_encode(&ctx->bs, cf, fdf, ctx->cfg->iso);
+    return (can_bitstream_ns(&ctx->bs, ctx->nbit_ps, dbit) +
+            CAN_IFS_BITS * ctx->nbit_ps) / 1000;
+}
+
+static void e2e_tx_done(void *arg, const struct tx_sched_frame *f, bool ok, u64 ts)
+{
+    struct e2e_result *res = (struct e2e_result *)arg;
+
+    (void)f;
+    (void)ts;
+    if (ok)
+        res->sent++;
+    else
+        res->tx_failed++;
+}
+
+static void e2e_rx_frame(struct e2e_ctx *ctx, const struct canfd_frame *cf, u64 ts)
+{
+    struct e2e_result *res = ctx->res;
+    uint32_t expected = ctx->next_rx_seq;
+    uint32_t seq;
+    const struct e2e_slot *slot;
+    int64_t lat;
+
+    if (cf->len >= 4)
+        seq = cf->data[0] | cf->data[1] << 8 | cf->data[2] << 16 |
+              (uint32_t)cf->data[3] << 24;
+    else
+        seq = expected + ((cf->can_id - expected) & E2E_SEQ_ID_MASK);
+
+    if ((int32_t)(seq - expected) < 0) {
+        res->reordered++;
+    } else {
+        res->lost += seq - expected;
+        ctx->next_rx_seq = seq + 1;
+    }
+    res->received++;
+    if (!ctx->have_rx) {
+        ctx->have_rx = true;
+        ctx->first_rx_ts = ts;
+    }
+    ctx->last_rx_ts = ts;
+
+    slot = &ctx->slots[seq & (E2E_SLOTS - 1)];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq + 1)
+        return;
+    res->bus_ns += slot->bus_ns;
+    lat = (int64_t)(ts - slot->ts) - res->ts_offset;
+    if (lat < 0) {
+        res->ts_negative++;
+        lat = 0;
+    }
+    lat = (uint64_t)lat * 1000000000ull / ctx->cfg->ts_freq;
+    userspace_hist_add(&res->latency, lat);
+    userspace_hist_add(&res->mix_latency[slot->mix], lat);
+    res->mix_received[slot->mix]++;
+}
+
+static void *e2e_rx_thread(void *arg)
+{
+    struct e2e_ctx *ctx = (struct e2e_ctx *)arg;
+    struct ctucan_hw_priv *priv = ctx->rx;
+    struct e2e_result *res = ctx->res;
+
+    unsigned idle = 0;
+
+    if (ctx->cfg->rx_cpu >= 0)
+        rxpoll_pin_thread(ctx->cfg->rx_cpu, 0);
+    for (;;) {
+        union ctu_can_fd_rx_mem_info info;
+        union ctu_can_fd_status status;
+        bool stop = ctx->stop.load(std::memory_order_acquire);
+        unsigned n, used;
+
+        info.u32 = priv->read_reg(priv, CTU_CAN_FD_RX_MEM_INFO);
+        used = info.s.rx_buff_size - info.s.rx_mem_free;
+        if (used > res->fifo_hwm)
+            res->fifo_hwm = used;
+        n = ctucan_hw_get_rx_frame_count(priv);
+        if (n > res->fifo_hwm_frames)
+            res->fifo_hwm_frames = n;
+
+        status.u32 = priv->read_reg(priv, CTU_CAN_FD_STATUS);
+        if (status.s.dor) {
+            res->overruns++;
+            ctucan_hw_clr_overrun_flag(priv);
+        }
+
+        for (unsigned i = 0; i < n; i++) {
+            struct canfd_frame cf;
+            u64 ts;
+
+            ctucan_hw_read_rx_frame(priv, &cf, &ts);
+            e2e_rx_frame(ctx, &cf, ts);
+        }
+        if (n) {
+            idle = 0;
+        } else {
+            if (stop)
+                break;
+            /* Let the TX loop run when both share a CPU */
+            if (++idle % 256 == 0)
+                sched_yield();
+            else
+                rxpoll_cpu_relax();
+        }
+    }
+    return NULL;
+}
+
+/* RX minus TX timestamp counter, from the tightest of several read pairs */
+static int64_t e2e_ts_offset(struct ctucan_hw_priv *tx, struct ctucan_hw_priv *rx)
+{
+    u64 best = UINT64_MAX;
+    int64_t off = 0;
+
+    for (int i = 0; i < 32; i++) {
+        u64 a1 = ctucan_hw_read_timestamp(tx);
+        u64 b = ctucan_hw_read_timestamp(rx);
+        u64 a2 = ctucan_hw_read_timestamp(tx);
+
+        if (a2 - a1 < best) {
+            best = a2 - a1;
+            off = (int64_t)(b - (a1 + (a2 - a1) / 2));
+        }
+    }
+    return off;
+}
+
+int e2e_run(struct ctucan_hw_priv *tx, struct ctucan_hw_priv *rx,
+            const struct e2e_config *cfg, struct e2e_result *res)
+{
+    struct e2e_ctx ctx;
+    struct tx_sched ts;
+    union ctu_can_fd_rx_mem_info info;
+    uint64_t start, end, next;
+    uint32_t seq = 0;
+    pthread_t thread;
+    int err;
+
+    memset(res, 0, sizeof(*res));
+    userspace_hist_init(&res->latency);
+    for (unsigned i = 0; i < E2E_MIX_MAX; i++)
+        userspace_hist_init(&res->mix_latency[i]);
+
+    ctx.cfg = cfg;
+    ctx.res = res;
+    ctx.tx = tx;
+    ctx.rx = rx;
+    ctx.stop = false;
+    ctx.nbit_ps = 1000000000000ull / cfg->bitrate;
+    ctx.dbit_ps = 1000000000000ull / (cfg->dbitrate ? cfg->dbitrate : cfg->bitrate);
+    ctx.rng = 0x2545f491;
+    ctx.next_rx_seq = 0;
+    ctx.have_rx = false;
+    ctx.slots = (struct e2e_slot *)calloc(E2E_SLOTS, sizeof(*ctx.slots));
+    if (!ctx.slots) {
+        warnx("cannot allocate %u frame slots", E2E_SLOTS);
+        return -1;
+    }
+    if (tx_sched_init(&ts, tx, 1024, e2e_tx_done, res)) {
+        free(ctx.slots);
+        return -1;
+    }
+    /* One sender: keep queue order so sequence gaps mean loss */
+    ts.fifo = true;
+    ts.preempt = false;
+
+    ctucan_hw_set_rx_tsop(rx, RTS_END);
+    while (!ctucan_hw_is_rx_fifo_empty(rx))
+        ctucan_hw_rel_rx_buf(rx);
+    info.u32 = rx->read_reg(rx, CTU_CAN_FD_RX_MEM_INFO);
+    res->fifo_size = info.s.rx_buff_size;
+    res->ts_offset = e2e_ts_offset(tx, rx);
+
+    err = pthread_create(&thread, NULL, e2e_rx_thread, &ctx);
+    if (err) {
+        warnx("cannot start RX thread: %s", strerror(err));
+        tx_sched_free(&ts);
+        free(ctx.slots);
+        return -1;
+    }
+    if (cfg->tx_cpu >= 0)
+        rxpoll_pin_thread(cfg->tx_cpu, 0);
+
+    start = e2e_now();
+    end = start + (uint64_t)cfg->duration_ms * 1000000;
+    next = start;
+    for (uint64_t now = start; now < end; now = e2e_now()) {
+        tx_sched_poll(&ts);
+        /*
+         * Saturation keeps a short backlog behind the TXT buffers so the bus
+         * never idles, otherwise frames are due at next.
+         */
+        while (cfg->load_pct >= 100 ? ts.depth < E2E_BACKLOG : next <= now) {
+            const struct e2e_mix_entry *m;
+            struct e2e_slot *slot;
+            struct canfd_frame cf;
+            unsigned mix = e2e_pick(&ctx);
+            uint32_t bus_ns;
+
+            m = &cfg->mix[mix];
+            e2e_build(m, seq, &cf);
+            bus_ns = e2e_bus_ns(&ctx, &cf, m->fdf);
+            next += (uint64_t)bus_ns * 100 / (cfg->load_pct ? cfg->load_pct : 1);
+            res->offered++;
+            if (ts.depth >= ts.max_queue) {
+                res->rejected++;
+                continue;
+            }
+            slot = &ctx.slots[seq & (E2E_SLOTS - 1)];
+            slot->ts = ctucan_hw_read_timestamp(tx);
+            slot->bus_ns = bus_ns;
+            slot->mix = mix;
+            __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+            tx_sched_queue(&ts, &cf, m->fdf, seq);
+            seq++;
+        }
+    }
+
+    /* Drain: whatever is queued still goes out, then the receiver catches up */
+    end = e2e_now() + 1000000000ull + (uint64_t)ts.max_queue * 8 * ctx.nbit_ps / 1000;
+    while (tx_sched_pending(&ts) && e2e_now() < end)
+        tx_sched_poll(&ts);
+    usleep(20000);
+    ctx.stop.store(true, std::memory_order_release);
+    pthread_join(thread, NULL);
+
+    res->tx_failed += tx_sched_pending(&ts);
+    if (ctx.have_rx)
+        res->window_ns = (ctx.last_rx_ts - ctx.first_rx_ts) * 1000000000ull /
+                         cfg->ts_freq;
+    /* Frames never seen after the last received one are lost too */
+    if (seq > ctx.next_rx_seq)
+        res->lost += seq - ctx.next_rx_seq;
+    tx_sched_free(&ts);
+    free(ctx.slots);
+    return 0;
+}
+
+static void e2e_mix_name(const struct e2e_mix_entry *m, char *buf, size_t len)
+{
+    snprintf(buf, len, "%u%s%s%s", m->len, m->fdf && !m->brs ? "f" : "",
+             m->brs ? "b" : "", m->eff ? "x" : "");
+}
+
+void e2e_report(const struct e2e_config *cfg, const struct e2e_result *res,
+                FILE *f)
+{
+    double window = res->window_ns / 1e9;
+    char name[32];
+
+    fprintf(f, "e2e: %.3f s at %u%% offered load, %u/%u bit/s, mix",
+            cfg->duration_ms / 1e3, cfg->load_pct, cfg->bitrate, cfg->dbitrate);
+    for (unsigned i = 0; i < cfg->nmix; i++) {
+        e2e_mix_name(&cfg->mix[i], name, sizeof(name));
+        fprintf(f, "%s%s:%u", i ? "," : " ", name, cfg->mix[i].weight);
+    }
+    fprintf(f, "\n");
+    fprintf(f, "  TX: %llu offered, %llu rejected (queue full), %llu sent, %llu failed\n",
+            (unsigned long long)res->offered, (unsigned long long)res->rejected,
+            (unsigned long long)res->sent, (unsigned long long)res->tx_failed);
+    fprintf(f, "  RX: %llu received, %llu lost, %llu reordered, %llu overruns\n",
+            (unsigned long long)res->received, (unsigned long long)res->lost,
+            (unsigned long long)res->reordered, (unsigned long long)res->overruns);
+    if (window > 0)
+        fprintf(f, "  achieved %.1f frames/s, bus utilization %.1f %%\n",
+                (res->received - 1) / window,
+                100.0 * res->bus_ns / res->window_ns);
+    fprintf(f, "  RX FIFO high-watermark %u of %u words (%u frames)\n",
+            res->fifo_hwm, res->fifo_size, res->fifo_hwm_frames);
+    fprintf(f, "  timestamp offset RX-TX %lld ticks", (long long)res->ts_offset);
+    if (res->ts_negative)
+        fprintf(f, ", %llu latencies below zero", (unsigned long long)res->ts_negative);
+    fprintf(f, "\n");
+    userspace_hist_print(f, "  latency", &res->latency, 1, 1, "ns");
+    if (cfg->nmix < 2)
+        return;
+    for (unsigned i = 0; i < cfg->nmix; i++) {
+        char label[48];
+
+        e2e_mix_name(&cfg->mix[i], name, sizeof(name));
+        snprintf(label, sizeof(label), "  latency %s", name);
+        userspace_hist_print(f, label, &res->mix_latency[i], 1, 1, "ns");
+    }
+}
@@ -0,0 +1,113 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#pragma once
+
+#include "userspace_utils.h"
+#include "userspace_hist.h"
+
+/*
+ * End-to-end benchmark between two cores on one bus (e.g. the two cores of
+ * the Zynq design, or both cores found on the PCI card).
+ *
+ * One core transmits a frame mix at an offered load given as a share of
+ * the bus capacity, the other receives. Every frame carries a sequence
+ * number (first data word, or the low ID byte for frames shorter than 4
+ * bytes), so the receiver counts lost and reordered frames. Right before
+ * a frame is queued the transmitting core's TIMESTAMP is read; the one-way
+ * latency is the receiver's RX timestamp (end of frame) minus that value,
+ * corrected by the offset between the two counters measured at start.
+ * Achieved rate and bus utilization are taken over the receiver's
+ * timestamps of the first and last frame.
+ */
+
+#define E2E_MIX_MAX 8
+
+struct e2e_mix_entry {
+    unsigned len;           /* Data length in bytes */
+    bool fdf;               /* CAN FD frame */
+    bool brs;               /* Bit rate switch */
+    bool eff;               /* 29-bit identifier */
+    unsigned weight;
+};
+
+struct e2e_config {
+    unsigned load_pct;      /* Offered load in % of bus time, >= 100 saturates */
+    unsigned duration_ms;
+    struct e2e_mix_entry mix[E2E_MIX_MAX];
+    unsigned nmix;
+    uint32_t bitrate;       /* For bus time of frames */
+    uint32_t dbitrate;
+    bool iso;               /* ISO CAN FD (stuff count) */
+    uint32_t ts_freq;       /* Timestamp counter frequency in Hz, both cores */
+    int tx_cpu;             /* CPU of TX loop, -1 = no pinning */
+    int rx_cpu;             /* CPU of RX poller, -1 = no pinning */
+};
+
+struct e2e_result {
+    uint64_t offered;       /* Frames generated by the load model */
+    uint64_t rejected;      /* Not queued, TX queue full (load above capacity) */
+    uint64_t sent;
+    uint64_t tx_failed;
+    uint64_t received;
+    uint64_t lost;          /* Sequence gaps at the receiver */
+    uint64_t reordered;     /* Older sequence number than expected */
+    uint64_t overruns;      /* RX FIFO data overruns seen */
+    uint64_t bus_ns;        /* Bus time of received frames */
+    uint64_t window_ns;     /* RX timestamp of first to last frame */
+    unsigned fifo_size;     /* RX buffer in words */
+    unsigned fifo_hwm;      /* Most words used at once */
+    unsigned fifo_hwm_frames;
+    int64_t ts_offset;      /* RX minus TX timestamp counter, in ticks */
+    uint64_t ts_negative;   /* Latencies below zero (offset drift), counted as 0 */
+    struct userspace_hist latency;              /* ns, all frames */
+    struct userspace_hist mix_latency[E2E_MIX_MAX];
+    uint64_t mix_received[E2E_MIX_MAX];
+};
+
+/* 1 Mbit/s, 5 Mbit/s data, 10 s at 50 % load of 8 byte classic frames */
+void e2e_config_defaults(struct e2e_config *cfg);
+
+/*
+ * Parse a frame mix: comma separated "<len>[f][b][x][:<weight>]", f = CAN FD,
+ * b = bit rate switch (implies f), x = extended ID, e.g. "8:3,64fb,0x".
+ * Returns 0 on success, -1 on malformed input.
+ */
+int e2e_mix_parse(struct e2e_config *cfg, const char *str);
+
+/*
+ * Run the benchmark. Both cores must be configured and enabled; the RX
+ * timestamp of @rx is switched to end of frame. Returns -1 if the RX
+ * thread cannot be started.
+ */
+int e2e_run(struct ctucan_hw_priv *tx, struct ctucan_hw_priv *rx,
+            const struct e2e_config *cfg, struct e2e_result *res);
+
+void e2e_report(const struct e2e_config *cfg, const struct e2e_result *res,
+                FILE *f);
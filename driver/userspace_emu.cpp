@@ -0,0 +1,1186 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#include "userspace_emu.h"
+#include "userspace_bitstream.h"
+
+#include <mutex>
+#include <time.h>
+
+#define EMU_REGS_WORDS  (0x500 / 4)
+#define EMU_TXT_WORDS   (0x50 / 4)
+#define EMU_REG(r)      ((r) / 4)
+
+#define EMU_DEVICE_ID   (CTU_CAN_FD_ID | 0x02020000u)   /* Version 2.2 */
+#define EMU_YOLO        0xdeadbeefu
+#define EMU_NSEC        1000000000ull
+
+/* Interrupt bits in INT_STAT order */
+enum {
+    EMU_INT_RXI    = 1u << 0,
+    EMU_INT_TXI    = 1u << 1,
+    EMU_INT_DOI    = 1u << 3,
+    EMU_INT_BEI    = 1u << 6,
+    EMU_INT_RBNEI  = 1u << 10,
+    EMU_INT_TXBHCI = 1u << 11,
+    EMU_INT_ALL    = 0xfff,
+};
+
+#define EMU_LINK_MAX    8       /* Linked emulators per process */
+#define EMU_INBOX       256     /* Frames in flight to one linked emulator */
+
+struct ctucan_emu;
+
+/* Frame sent by a linked emulator, waiting for the receiver's next access */
+struct ctucan_emu_link_frame {
+    u32 words[EMU_TXT_WORDS];
+    uint64_t sof_ns, eof_ns;
+};
+
+struct ctucan_emu_priv {
+    struct ctucan_hw_priv priv;     /* Must be first */
+    struct ctucan_emu *emu;
+};
+
+struct ctucan_emu {
+    struct ctucan_emu_config cfg;
+    struct ctucan_emu_stats stats;
+    std::mutex lock;
+    struct timespec t0;
+
+    u32 regs[EMU_REGS_WORDS];       /* Plain storage registers */
+    u32 int_stat, int_ena, int_mask;
+    bool dor;
+    u32 rec, tec, err_norm, err_fd;
+    u32 rx_fr_ctr, tx_fr_ctr;
+    u32 trv_meas;                   /* TRV_DELAY value, clock cycles */
+    u32 err_capt;
+    uint64_t trv_rng;
+
+    /* RX buffer, whole frames only */
+    u32 *rx;
+    unsigned rx_size, rx_rd, rx_wr, rx_used;
+    unsigned rx_frames;
+    unsigned rx_frame_left;         /* Words left of frame being read */
+
+    /* TXT buffers */
+    u32 txt[CTU_CAN_FD_TXT_BUFFER_COUNT][EMU_TXT_WORDS];
+    unsigned txt_state[CTU_CAN_FD_TXT_BUFFER_COUNT];
+    uint64_t txt_rdy_ns[CTU_CAN_FD_TXT_BUFFER_COUNT];
+    unsigned txt_retr[CTU_CAN_FD_TXT_BUFFER_COUNT];
+    int tx_cur;                     /* Buffer on the bus, -1 = bus idle */
+    uint64_t tx_start_ns, tx_end_ns;
+    uint64_t bus_free_ns;           /* End of last frame incl. intermission */
+
+    uint64_t gen_next_ns;
+    uint64_t gen_seq;
+    struct can_bitstream bs;
+
+    /* Frames from linked emulators (cfg.link), own lock, taken last */
+    std::mutex inbox_lock;
+    struct ctucan_emu_link_frame inbox[EMU_INBOX];
+    unsigned inbox_len;
+    unsigned inbox_lost;            /* Inbox full, reported as overrun */
+
+    uint64_t now_ns();
+    u64 ns_to_ts(uint64_t ns);
+    void reset();
+    void raise(u32 bits);
+    void advance();
+    void bit_ns(uint64_t *nbit, uint64_t *dbit);
+    uint64_t frame_ns(const u32 *txt);
+    bool rx_store(u32 ffw, u32 idw, u64 ts, const u32 *data);
+    int trv_jitter();
+    bool data_sampled_ok(const u32 *words);
+    bool bus_rate_ok(bool brs);
+    void tx_failed(unsigned buf, bool data_phase);
+    void tx_complete();
+    void tx_pick(uint64_t now);
+    void generate(uint64_t now);
+    void link_send(const u32 *words);
+    void link_receive();
+    u32 rx_pop();
+    u32 read(unsigned reg);
+    void write(unsigned reg, u32 val, u32 mask);
+    void tx_command(u32 cmd);
+};
+
+void ctucan_emu_config_defaults(struct ctucan_emu_config *cfg)
+{
+    cfg->rx_words = 1024;
+    cfg->rx_rate = 0;
+    cfg->rx_id = 0x100;
+    cfg->clk_freq = 100000000;
+    cfg->ts_freq = 100000000;
+    cfg->instant = false;
+    cfg->link = false;
+    cfg->bus = false;
+    cfg->unlocked = false;
+    cfg->clock = NULL;
+    cfg->clock_arg = NULL;
+    cfg->trv_ns = 0;
+    cfg->trv_jitter_ns = 0;
+    cfg->bus_bitrate = 0;
+    cfg->bus_dbitrate = 0;
+}
+
+int ctucan_emu_config_parse(struct ctucan_emu_config *cfg, const char *str)
+{
+    char buf[256], *save = NULL;
+    int ntok = 0;
+
+    snprintf(buf, sizeof(buf), "%s", str);
+    for (char *t = strtok_r(buf, ",", &save); t; t = strtok_r(NULL, ",", &save)) {
+        char *val = strchr(t, '=');
+        unsigned long v = 0;
+        char *e;
+
+        ntok++;
+        if (!val) {
+            if (!strcmp(t, "instant"))
+                cfg->instant = true;
+            else if (!strcmp(t, "link"))
+                cfg->link = true;
+            else if (ntok > 1 || strtok_r(NULL, ",", &save))
+                goto bad;
+            continue;
+        }
+        *val++ = '\0';
+        v = strtoul(val, &e, 0);
+        if (*e)
+            goto bad;
+        if (!strcmp(t, "rx") && v >= 32 && v < 8192)
+            cfg->rx_words = v;
+        else if (!strcmp(t, "rate"))
+            cfg->rx_rate = v;
+        else if (!strcmp(t, "id") && v <= CAN_EFF_MASK)
+            cfg->rx_id = v > CAN_SFF_MASK ? (v | CAN_EFF_FLAG) : v;
+        else if (!strcmp(t, "clk") && v)
+            cfg->clk_freq = v;
+        else if (!strcmp(t, "ts") && v)
+            cfg->ts_freq = v;
+        else if (!strcmp(t, "trv"))
+            cfg->trv_ns = v;
+        else if (!strcmp(t, "trvj"))
+            cfg->trv_jitter_ns = v;
+        else if (!strcmp(t, "bus") && v)
+            cfg->bus_bitrate = v;
+        else if (!strcmp(t, "dbus") && v)
+            cfg->bus_dbitrate = v;
+        else
+            goto bad;
+    }
+    return 0;
+bad:
+    warnx("emulator options: rx=<32..8191 words>,rate=<fps>,id=<can id>,"
+          "clk=<Hz>,ts=<Hz>,trv=<ns>,trvj=<ns>,bus=<bps>,dbus=<bps>,instant,link");
+    return -1;
+}
+
+uint64_t ctucan_emu::now_ns()
+{
+    struct timespec t;
+
+    if (cfg.clock)
+        return cfg.clock(cfg.clock_arg);
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)(t.tv_sec - t0.tv_sec) * EMU_NSEC + t.tv_nsec - t0.tv_nsec;
+}
+
+u64 ctucan_emu::ns_to_ts(uint64_t ns)
+{
+    return ns / EMU_NSEC * cfg.ts_freq + ns % EMU_NSEC * cfg.ts_freq / EMU_NSEC;
+}
+
+void ctucan_emu::reset()
+{
+    union ctu_can_fd_mode_settings mode;
+    union ctu_can_fd_ewl_erp_fault_state ewl;
+
+    memset(regs, 0, sizeof(regs));
+    mode.u32 = 0;
+    mode.s.fde = FDE_ENABLE;
+    regs[EMU_REG(CTU_CAN_FD_MODE)] = mode.u32;
+    ewl.u32 = 0;
+    ewl.s.ew_limit = 96;
+    ewl.s.erp_limit = 128;
+    regs[EMU_REG(CTU_CAN_FD_EWL)] = ewl.u32;
+    regs[EMU_REG(CTU_CAN_FD_TX_PRIORITY)] = 0x1;
+
+    int_stat = int_ena = int_mask = 0;
+    dor = false;
+    rec = tec = err_norm = err_fd = 0;
+    rx_fr_ctr = tx_fr_ctr = 0;
+    trv_meas = 0;
+    err_capt = ERC_POS_OTHER;
+    rx_rd = rx_wr = rx_used = rx_frames = rx_frame_left = 0;
+    memset(txt, 0, sizeof(txt));
+    for (unsigned i = 0; i < CTU_CAN_FD_TXT_BUFFER_COUNT; i++) {
+        txt_state[i] = TXT_ETY;
+        txt_retr[i] = 0;
+    }
+    tx_cur = -1;
+    bus_free_ns = 0;
+    gen_next_ns = now_ns();
+}
+
+void ctucan_emu::raise(u32 bits)
+{
+    int_stat |= bits & ~int_mask;
+}
+
+/* Nominal and data bit time from BTR/BTR_FD, 1 Mbit/s if not configured */
+void ctucan_emu::bit_ns(uint64_t *nbit, uint64_t *dbit)
+{
+    union ctu_can_fd_btr btr;
+    union ctu_can_fd_btr_fd btr_fd;
+
+    btr.u32 = regs[EMU_REG(CTU_CAN_FD_BTR)];
+    btr_fd.u32 = regs[EMU_REG(CTU_CAN_FD_BTR_FD)];
+    *nbit = (uint64_t)(1 + btr.s.prop + btr.s.ph1 + btr.s.ph2) * btr.s.brp *
+            EMU_NSEC / cfg.clk_freq;
+    *dbit = (uint64_t)(1 + btr_fd.s.prop_fd + btr_fd.s.ph1_fd + btr_fd.s.ph2_fd) *
+            btr_fd.s.brp_fd * EMU_NSEC / cfg.clk_freq;
+    if (!btr.s.brp)
+        *nbit = 1000;
+    if (!btr_fd.s.brp_fd)
+        *dbit = *nbit;
+}
+
+/* Frame length incl. stuff bits and intermission */
+uint64_t ctucan_emu::frame_ns(const u32 *words)
+{
+    union ctu_can_fd_mode_settings mode;
+    struct canfd_frame cf;
+    uint64_t nbit, dbit;
+    bool fdf;
+
+    if (cfg.instant)
+        return 0;
+    mode.u32 = regs[EMU_REG(CTU_CAN_FD_MODE)];
+    bit_ns(&nbit, &dbit);
+    can_frame_from_words(words, &cf, &fdf);
+    can_bitstream_encode(&bs, &cf, fdf, !mode.s.nisofd);
+    return can_bitstream_ns(&bs, nbit, dbit) + CAN_IFS_BITS * nbit;
+}
+
+bool ctucan_emu::rx_store(u32 ffw_u32, u32 idw, u64 ts, const u32 *data)
+{
+    union ctu_can_fd_frame_format_w ffw;
+    unsigned len, words;
+
+    ffw.u32 = ffw_u32 & 0x6ef;      /* dlc, rtr, ide, fdf, brs, esi */
+    len = ffw.s.rtr && !ffw.s.fdf ? 0 : can_dlc2len(ffw.s.dlc);
+    if (!ffw.s.fdf && len > 8)
+        len = 8;
+    words = (len + 3) / 4;
+    ffw.s.rwcnt = 3 + words;
+
+    if (rx_size - rx_used < 4 + words) {
+        dor = true;
+        raise(EMU_INT_DOI);
+        stats.rx_dropped++;
+        return false;
+    }
+    rx[rx_wr] = ffw.u32;
+    rx_wr = (rx_wr + 1) % rx_size;
+    rx[rx_wr] = idw;
+    rx_wr = (rx_wr + 1) % rx_size;
+    rx[rx_wr] = (u32)ts;
+    rx_wr = (rx_wr + 1) % rx_size;
+    rx[rx_wr] = (u32)(ts >> 32);
+    rx_wr = (rx_wr + 1) % rx_size;
+    for (unsigned i = 0; i < words; i++) {
+        rx[rx_wr] = data[i];
+        rx_wr = (rx_wr + 1) % rx_size;
+    }
+    rx_used += 4 + words;
+    rx_frames++;
+    rx_fr_ctr++;
+    stats.rx_frames++;
+    raise(EMU_INT_RXI | EMU_INT_RBNEI);
+    return true;
+}
+
+u32 ctucan_emu::rx_pop()
+{
+    u32 v;
+
+    if (!rx_used)
+        return 0;
+    v = rx[rx_rd];
+    if (!rx_frame_left) {
+        union ctu_can_fd_frame_format_w ffw;
+
+        ffw.u32 = v;
+        rx_frame_left = ffw.s.rwcnt + 1;
+    }
+    rx_rd = (rx_rd + 1) % rx_size;
+    rx_used--;
+    if (!--rx_frame_left)
+        rx_frames--;
+    return v;
+}
+
+/* Uniform in [-cfg.trv_jitter_ns, cfg.trv_jitter_ns] */
+int ctucan_emu::trv_jitter()
+{
+    if (!cfg.trv_jitter_ns)
+        return 0;
+    trv_rng ^= trv_rng << 13;
+    trv_rng ^= trv_rng >> 7;
+    trv_rng ^= trv_rng << 17;
+    return (int)(trv_rng % (2 * cfg.trv_jitter_ns + 1)) - (int)cfg.trv_jitter_ns;
+}
+
+/* Measure the loop delay of an own frame, false if its data bits were missed */
+bool ctucan_emu::data_sampled_ok(const u32 *words)
+{
+    union ctu_can_fd_frame_format_w ffw;
+    union ctu_can_fd_btr_fd btr_fd;
+    union ctu_can_fd_trv_delay_ssp_cfg ssp;
+    int64_t meas_ns, bit_ns, dbit, delay, pos;
+
+    ffw.u32 = words[0];
+    if (!cfg.trv_ns || !ffw.s.fdf || !ffw.s.brs)
+        return true;
+
+    meas_ns = (int64_t)cfg.trv_ns + trv_jitter();
+    if (meas_ns < 0)
+        meas_ns = 0;
+    trv_meas = meas_ns * cfg.clk_freq / EMU_NSEC;
+    if (trv_meas > 127)
+        trv_meas = 127;
+
+    /* Everything below in clock cycles */
+    btr_fd.u32 = regs[EMU_REG(CTU_CAN_FD_BTR_FD)];
+    ssp.u32 = regs[EMU_REG(CTU_CAN_FD_TRV_DELAY)];
+    dbit = (int64_t)(1 + btr_fd.s.prop_fd + btr_fd.s.ph1_fd + btr_fd.s.ph2_fd) *
+           btr_fd.s.brp_fd;
+    if (!dbit)
+        return true;
+    bit_ns = meas_ns + trv_jitter();
+    delay = bit_ns * cfg.clk_freq / EMU_NSEC;
+    switch (ssp.s.ssp_src) {
+    case SSP_SRC_MEAS_N_OFFSET:
+        pos = trv_meas + ssp.s.ssp_offset;
+        break;
+    case SSP_SRC_OFFSET:
+        pos = ssp.s.ssp_offset;
+        break;
+    default:
+        pos = (int64_t)(1 + btr_fd.s.prop_fd + btr_fd.s.ph1_fd) * btr_fd.s.brp_fd;
+        break;
+    }
+    return pos >= delay + dbit / 8 && pos <= delay + dbit - dbit / 8;
+}
+
+/* Failed attempt of buffer @buf, retransmitted unless limited or aborted */
+void ctucan_emu::tx_failed(unsigned buf, bool data_phase)
+{
+    union ctu_can_fd_mode_settings mode;
+    unsigned *st = &txt_state[buf];
+
+    mode.u32 = regs[EMU_REG(CTU_CAN_FD_MODE)];
+    stats.tx_errors++;
+    tec += 8;
+    if (data_phase)
+        err_fd++;
+    else
+        err_norm++;
+    raise(EMU_INT_BEI);
+    if (*st == TXT_ABTP)
+        *st = TXT_ABT;
+    else if ((mode.s.rtrle && ++txt_retr[buf] > mode.s.rtrth) || tec >= 256)
+        *st = TXT_ERR;
+    else
+        *st = TXT_RDY;
+    if (*st != TXT_RDY)
+        raise(EMU_INT_TXBHCI);
+}
+
+void ctucan_emu::tx_complete()
+{
+    union ctu_can_fd_mode_settings mode;
+    union ctu_can_fd_rx_status_rx_settings rxs;
+    u32 *buf = txt[tx_cur];
+
+    mode.u32 = regs[EMU_REG(CTU_CAN_FD_MODE)];
+    rxs.u32 = regs[EMU_REG(CTU_CAN_FD_RX_STATUS)];
+
+    bus_free_ns = tx_end_ns;
+    if (!data_sampled_ok(buf)) {
+        tx_failed(tx_cur, true);
+        tx_cur = -1;
+        return;
+    }
+    /* Abort during transmission does not stop a successful frame */
+    txt_state[tx_cur] = TXT_TOK;
+    tx_fr_ctr++;
+    stats.tx_frames++;
+    if (tec)
+        tec--;
+    raise(EMU_INT_TXI | EMU_INT_TXBHCI);
+    if (mode.s.ilbp)
+        rx_store(buf[0], buf[1],
+                 ns_to_ts(rxs.s.rtsop == RTS_BEG ? tx_start_ns : tx_end_ns),
+                 &buf[4]);
+    if (cfg.link)
+        link_send(buf);
+    tx_cur = -1;
+}
+
+/* Start the highest priority buffer which was ready when the bus got free */
+void ctucan_emu::tx_pick(uint64_t now)
+{
+    union ctu_can_fd_mode_settings mode;
+    u32 prio = regs[EMU_REG(CTU_CAN_FD_TX_PRIORITY)];
+    uint64_t start = UINT64_MAX;
+    int best = -1;
+
+    mode.u32 = regs[EMU_REG(CTU_CAN_FD_MODE)];
+    if (!mode.s.ena)
+        return;
+
+    for (unsigned i = 0; i < CTU_CAN_FD_TXT_BUFFER_COUNT; i++) {
+        if (txt_state[i] != TXT_RDY)
+            continue;
+        if (mode.s.bmm) {
+            /* Bus monitoring mode never transmits */
+            txt_state[i] = TXT_ERR;
+            raise(EMU_INT_TXBHCI);
+            continue;
+        }
+        if (txt_rdy_ns[i] < start)
+            start = txt_rdy_ns[i];
+    }
+    if (start == UINT64_MAX)
+        return;
+    if (start < bus_free_ns)
+        start = bus_free_ns;
+    if (start > now)
+        return;
+
+    for (unsigned i = 0; i < CTU_CAN_FD_TXT_BUFFER_COUNT; i++) {
+        if (txt_state[i] != TXT_RDY || txt_rdy_ns[i] > start)
+            continue;
+        if (best < 0 || ((prio >> (4 * i)) & 7) > ((prio >> (4 * best)) & 7))
+            best = i;
+    }
+    tx_cur = best;
+    txt_state[best] = TXT_TRAN;
+    tx_start_ns = start;
+    tx_end_ns = start + frame_ns(txt[best]);
+}
+
+/* Generated frame decoded with the node's bit timing, else count the error */
+bool ctucan_emu::bus_rate_ok(bool brs)
+{
+    union ctu_can_fd_btr btr;
+    union ctu_can_fd_btr_fd btr_fd;
+    union ctu_can_fd_err_capt_alc capt;
+    uint64_t cycles;
+
+    btr.u32 = regs[EMU_REG(CTU_CAN_FD_BTR)];
+    btr_fd.u32 = regs[EMU_REG(CTU_CAN_FD_BTR_FD)];
+    capt.u32 = 0;
+    if (cfg.bus_bitrate) {
+        cycles = (uint64_t)(1 + btr.s.prop + btr.s.ph1 + btr.s.ph2) * btr.s.brp;
+        /* |bit time - bus bit time| > 2% */
+        if (50 * llabs((int64_t)(cycles * cfg.bus_bitrate) - cfg.clk_freq) > cfg.clk_freq) {
+            err_norm++;
+            capt.s.err_type = ERC_STUF_ERR;
+            capt.s.err_pos = ERC_POS_ARB;
+            err_capt = capt.u32;
+            raise(EMU_INT_BEI);
+            return false;
+        }
+    }
+    if (brs && cfg.bus_dbitrate) {
+        cycles = (uint64_t)(1 + btr_fd.s.prop_fd + btr_fd.s.ph1_fd + btr_fd.s.ph2_fd) *
+                 btr_fd.s.brp_fd;
+        if (50 * llabs((int64_t)(cycles * cfg.bus_dbitrate) - cfg.clk_freq) > cfg.clk_freq) {
+            err_fd++;
+            capt.s.err_type = ERC_CRC_ERR;
+            capt.s.err_pos = ERC_POS_CRC;
+            err_capt = capt.u32;
+            raise(EMU_INT_BEI);
+            return false;
+        }
+    }
+    return true;
+}
+
+void ctucan_emu::generate(uint64_t now)
+{
+    uint64_t period = EMU_NSEC / cfg.rx_rate;
+    uint64_t behind;
+    union ctu_can_fd_frame_format_w ffw;
+    union ctu_can_fd_identifier_w idw;
+    union ctu_can_fd_mode_settings mode;
+
+    if (gen_next_ns > now)
+        return;
+    mode.u32 = regs[EMU_REG(CTU_CAN_FD_MODE)];
+    if (!mode.s.ena) {
+        gen_next_ns = now + period;
+        return;
+    }
+
+    /* Frames which cannot fit anyway are dropped without being built */
+    behind = (now - gen_next_ns) / period + 1;
+    if (behind > rx_size / 6) {
+        uint64_t skip = behind - rx_size / 6;
+
+        stats.rx_dropped += skip;
+        gen_seq += skip;
+        gen_next_ns += skip * period;
+        dor = true;
+        raise(EMU_INT_DOI);
+    }
+
+    ffw.u32 = 0;
+    ffw.s.dlc = 8;
+    if (cfg.bus_dbitrate) {
+        ffw.s.fdf = FD_CAN;
+        ffw.s.brs = BR_SHIFT;
+    }
+    idw.u32 = 0;
+    if (cfg.rx_id & CAN_EFF_FLAG) {
+        ffw.s.ide = EXTENDED;
+        idw.s.identifier_base = (cfg.rx_id & CAN_EFF_MASK) >> 18;
+        idw.s.identifier_ext = cfg.rx_id & 0x3ffff;
+    } else {
+        idw.s.identifier_base = cfg.rx_id & CAN_SFF_MASK;
+    }
+    while (gen_next_ns <= now) {
+        u32 data[2] = {(u32)gen_seq, (u32)(gen_seq >> 32)};
+
+        if (bus_rate_ok(ffw.s.brs))
+            rx_store(ffw.u32, idw.u32, ns_to_ts(gen_next_ns), data);
+        gen_seq++;
+        gen_next_ns += period;
+    }
+}
+
+static std::mutex emu_link_lock;
+static struct ctucan_emu *emu_links[EMU_LINK_MAX];
+static unsigned emu_nlinks;
+
+/* Called with the sender's lock held, queue frame to all other linked nodes */
+void ctucan_emu::link_send(const u32 *words)
+{
+    std::lock_guard<std::mutex> link_guard(emu_link_lock);
+
+    for (unsigned i = 0; i < emu_nlinks; i++) {
+        struct ctucan_emu *peer = emu_links[i];
+        struct ctucan_emu_link_frame *lf;
+        int64_t delta;
+
+        if (peer == this)
+            continue;
+        std::lock_guard<std::mutex> inbox_guard(peer->inbox_lock);
+        if (peer->inbox_len == EMU_INBOX) {
+            peer->inbox_lost++;
+            continue;
+        }
+        /* Frame times in the peer's time base */
+        delta = (int64_t)(t0.tv_sec - peer->t0.tv_sec) * (int64_t)EMU_NSEC +
+                (t0.tv_nsec - peer->t0.tv_nsec);
+        lf = &peer->inbox[peer->inbox_len++];
+        memcpy(lf->words, words, sizeof(lf->words));
+        lf->sof_ns = (int64_t)tx_start_ns + delta > 0 ? tx_start_ns + delta : 0;
+        lf->eof_ns = (int64_t)tx_end_ns + delta > 0 ? tx_end_ns + delta : 0;
+    }
+}
+
+void ctucan_emu::link_receive()
+{
+    std::lock_guard<std::mutex> inbox_guard(inbox_lock);
+    union ctu_can_fd_mode_settings mode;
+    union ctu_can_fd_rx_status_rx_settings rxs;
+
+    mode.u32 = regs[EMU_REG(CTU_CAN_FD_MODE)];
+    rxs.u32 = regs[EMU_REG(CTU_CAN_FD_RX_STATUS)];
+    for (unsigned i = 0; i < inbox_len; i++) {
+        const struct ctucan_emu_link_frame *lf = &inbox[i];
+
+        if (mode.s.ena)
+            rx_store(lf->words[0], lf->words[1],
+                     ns_to_ts(rxs.s.rtsop == RTS_BEG ? lf->sof_ns : lf->eof_ns),
+                     &lf->words[4]);
+    }
+    inbox_len = 0;
+    if (inbox_lost) {
+        stats.rx_dropped += inbox_lost;
+        inbox_lost = 0;
+        dor = true;
+        raise(EMU_INT_DOI);
+    }
+}
+
+void ctucan_emu::advance()
+{
+    uint64_t now;
+
+    if (cfg.rx_rate)
+        generate(now_ns());
+    if (cfg.link)
+        link_receive();
+    if (cfg.bus)
+        return;
+    now = now_ns();
+    for (;;) {
+        if (tx_cur >= 0) {
+            if (tx_end_ns > now)
+                break;
+            tx_complete();
+        }
+        tx_pick(now);
+        if (tx_cur < 0)
+            break;
+    }
+}
+
+void ctucan_emu::tx_command(u32 val)
+{
+    union ctu_can_fd_tx_command cmd;
+    uint64_t now = now_ns();
+
+    cmd.u32 = val;
+    for (unsigned i = 0; i < CTU_CAN_FD_TXT_BUFFER_COUNT; i++) {
+        unsigned *st = &txt_state[i];
+
+        if (!(val & (1u << (8 + i))))
+            continue;
+        if (cmd.s.txce && (*st == TXT_TOK || *st == TXT_ERR ||
+                           *st == TXT_ABT || *st == TXT_ETY))
+            *st = TXT_ETY;
+        if (cmd.s.txcr && (*st == TXT_TOK || *st == TXT_ERR ||
+                           *st == TXT_ABT || *st == TXT_ETY)) {
+            *st = TXT_RDY;
+            txt_rdy_ns[i] = now;
+            txt_retr[i] = 0;
+        }
+        if (cmd.s.txca) {
+            if (*st == TXT_RDY)
+                *st = TXT_ABT;
+            else if (*st == TXT_TRAN)
+                *st = TXT_ABTP;
+        }
+    }
+}
+
+u32 ctucan_emu::read(unsigned reg)
+{
+    union ctu_can_fd_status status;
+    union ctu_can_fd_rx_mem_info mem;
+    union ctu_can_fd_rx_pointers ptr;
+    union ctu_can_fd_rx_status_rx_settings rxs;
+    union ctu_can_fd_ewl_erp_fault_state ewl;
+    union ctu_can_fd_rec_tec rt;
+    u32 v = 0;
+
+    stats.reads++;
+    advance();
+
+    if (reg >= CTU_CAN_FD_TXTB1_DATA_1 &&
+        reg < CTU_CAN_FD_TXTB1_DATA_1 + 0x100 * CTU_CAN_FD_TXT_BUFFER_COUNT) {
+        unsigned off = (reg & 0xff) / 4;
+
+        return off < EMU_TXT_WORDS ? txt[(reg >> 8) - 1][off] : 0;
+    }
+
+    switch (reg) {
+    case CTU_CAN_FD_DEVICE_ID:
+        return EMU_DEVICE_ID;
+    case CTU_CAN_FD_STATUS:
+        status.u32 = 0;
+        status.s.rxne = !!rx_frames;
+        status.s.dor = dor;
+        for (unsigned i = 0; i < CTU_CAN_FD_TXT_BUFFER_COUNT; i++)
+            if (txt_state[i] != TXT_RDY && txt_state[i] != TXT_TRAN &&
+                txt_state[i] != TXT_ABTP)
+                status.s.txnf = 1;
+        ewl.u32 = regs[EMU_REG(CTU_CAN_FD_EWL)];
+        status.s.ewl = rec >= ewl.s.ew_limit || tec >= ewl.s.ew_limit;
+        status.s.txs = tx_cur >= 0;
+        status.s.idle = tx_cur < 0;
+        return status.u32;
+    case CTU_CAN_FD_INT_STAT:
+        return int_stat;
+    case CTU_CAN_FD_INT_ENA_SET:
+    case CTU_CAN_FD_INT_ENA_CLR:
+        return int_ena;
+    case CTU_CAN_FD_INT_MASK_SET:
+    case CTU_CAN_FD_INT_MASK_CLR:
+        return int_mask;
+    case CTU_CAN_FD_EWL:
+        ewl.u32 = regs[EMU_REG(CTU_CAN_FD_EWL)];
+        ewl.s.era = tec < ewl.s.erp_limit && rec < ewl.s.erp_limit;
+        ewl.s.erp = !ewl.s.era && tec < 256;
+        ewl.s.bof = tec >= 256;
+        return ewl.u32;
+    case CTU_CAN_FD_REC:
+        rt.u32 = 0;
+        rt.s.rec_val = rec;
+        rt.s.tec_val = tec;
+        return rt.u32;
+    case CTU_CAN_FD_ERR_NORM:
+        return (err_fd << 16) | (err_norm & 0xffff);
+    case CTU_CAN_FD_CTR_PRES:
+        return 0;
+    case CTU_CAN_FD_FILTER_CONTROL:
+        return regs[EMU_REG(reg)] & 0xffff;     /* No filters synthesized */
+    case CTU_CAN_FD_RX_MEM_INFO:
+        mem.u32 = 0;
+        mem.s.rx_buff_size = rx_size;
+        mem.s.rx_mem_free = rx_size - rx_used;
+        return mem.u32;
+    case CTU_CAN_FD_RX_POINTERS:
+        ptr.u32 = 0;
+        ptr.s.rx_wpp = rx_wr;
+        ptr.s.rx_rpp = rx_rd;
+        return ptr.u32;
+    case CTU_CAN_FD_RX_STATUS:
+        rxs.u32 = regs[EMU_REG(reg)] & 0xffff0000;
+        rxs.s.rxe = !rx_used;
+        rxs.s.rxf = rx_used == rx_size;
+        rxs.s.rxmof = !!rx_frame_left;
+        rxs.s.rxfrc = rx_frames;
+        return rxs.u32;
+    case CTU_CAN_FD_RX_DATA:
+        return rx_pop();
+    case CTU_CAN_FD_TX_STATUS:
+        for (unsigned i = 0; i < CTU_CAN_FD_TXT_BUFFER_COUNT; i++)
+            v |= txt_state[i] << (4 * i);
+        return v;
+    case CTU_CAN_FD_TX_COMMAND:
+        return 0;
+    case CTU_CAN_FD_ERR_CAPT:
+        return err_capt;
+    case CTU_CAN_FD_TRV_DELAY:
+        return (regs[EMU_REG(reg)] & 0xffff0000) | trv_meas;
+    case CTU_CAN_FD_RX_FR_CTR:
+        return rx_fr_ctr;
+    case CTU_CAN_FD_TX_FR_CTR:
+        return tx_fr_ctr;
+    case CTU_CAN_FD_DEBUG_REGISTER:
+        return 0;
+    case CTU_CAN_FD_YOLO_REG:
+        return EMU_YOLO;
+    case CTU_CAN_FD_TIMESTAMP_LOW:
+        return (u32)ns_to_ts(now_ns());
+    case CTU_CAN_FD_TIMESTAMP_HIGH:
+        return (u32)(ns_to_ts(now_ns()) >> 32);
+    case CTU_CAN_FD_MODE:
+    case CTU_CAN_FD_BTR:
+    case CTU_CAN_FD_BTR_FD:
+    case CTU_CAN_FD_FILTER_A_MASK:
+    case CTU_CAN_FD_FILTER_A_VAL:
+    case CTU_CAN_FD_FILTER_B_MASK:
+    case CTU_CAN_FD_FILTER_B_VAL:
+    case CTU_CAN_FD_FILTER_C_MASK:
+    case CTU_CAN_FD_FILTER_C_VAL:
+    case CTU_CAN_FD_FILTER_RAN_LOW:
+    case CTU_CAN_FD_FILTER_RAN_HIGH:
+    case CTU_CAN_FD_TX_PRIORITY:
+        return regs[EMU_REG(reg)];
+    default:
+        return 0;
+    }
+}
+
+void ctucan_emu::write(unsigned reg, u32 val, u32 mask)
+{
+    u32 *r;
+
+    stats.writes++;
+    advance();
+
+    if (reg >= CTU_CAN_FD_TXTB1_DATA_1 &&
+        reg < CTU_CAN_FD_TXTB1_DATA_1 + 0x100 * CTU_CAN_FD_TXT_BUFFER_COUNT) {
+        unsigned buf = (reg >> 8) - 1;
+        unsigned off = (reg & 0xff) / 4;
+        unsigned st = txt_state[buf];
+
+        /* TXT buffer RAM is locked while the buffer is in use */
+        if (off < EMU_TXT_WORDS && st != TXT_RDY && st != TXT_TRAN &&
+            st != TXT_ABTP)
+            txt[buf][off] = (txt[buf][off] & ~mask) | (val & mask);
+        return;
+    }
+
+    val &= mask;
+    switch (reg) {
+    case CTU_CAN_FD_MODE: {
+        union ctu_can_fd_mode_settings mode;
+
+        r = &regs[EMU_REG(reg)];
+        *r = (*r & ~mask) | val;
+        mode.u32 = *r;
+        if (mode.s.rst)
+            reset();
+        break;
+    }
+    case CTU_CAN_FD_COMMAND: {
+        union ctu_can_fd_command cmd;
+
+        cmd.u32 = val;
+        if (cmd.s.rrb) {
+            rx_rd = rx_wr = rx_used = rx_frames = rx_frame_left = 0;
+        }
+        if (cmd.s.cdo)
+            dor = false;
+        if (cmd.s.ercrst)
+            rec = tec = 0;
+        if (cmd.s.rxfcrst)
+            rx_fr_ctr = 0;
+        if (cmd.s.txfcrst)
+            tx_fr_ctr = 0;
+        break;
+    }
+    case CTU_CAN_FD_INT_STAT:
+        int_stat &= ~val;
+        break;
+    case CTU_CAN_FD_INT_ENA_SET:
+        int_ena |= val & EMU_INT_ALL;
+        break;
+    case CTU_CAN_FD_INT_ENA_CLR:
+        int_ena &= ~val;
+        break;
+    case CTU_CAN_FD_INT_MASK_SET:
+        int_mask |= val & EMU_INT_ALL;
+        break;
+    case CTU_CAN_FD_INT_MASK_CLR:
+        int_mask &= ~val;
+        break;
+    case CTU_CAN_FD_EWL:
+        r = &regs[EMU_REG(reg)];
+        *r = (*r & ~(mask & 0xffff)) | (val & 0xffff);
+        break;
+    case CTU_CAN_FD_CTR_PRES: {
+        union ctu_can_fd_ctr_pres pres;
+
+        pres.u32 = val;
+        if (pres.s.ptx)
+            tec = pres.s.ctpv;
+        if (pres.s.prx)
+            rec = pres.s.ctpv;
+        if (pres.s.enorm)
+            err_norm = 0;
+        if (pres.s.efd)
+            err_fd = 0;
+        break;
+    }
+    case CTU_CAN_FD_FILTER_CONTROL:
+    case CTU_CAN_FD_RX_STATUS:
+    case CTU_CAN_FD_TRV_DELAY:
+        /* Only the writable half of the word is stored */
+        mask &= reg == CTU_CAN_FD_FILTER_CONTROL ? 0xffff : 0xffff0000;
+        r = &regs[EMU_REG(reg)];
+        *r = (*r & ~mask) | (val & mask);
+        break;
+    case CTU_CAN_FD_TX_COMMAND:
+        tx_command(val);
+        advance();
+        break;
+    case CTU_CAN_FD_BTR:
+    case CTU_CAN_FD_BTR_FD:
+    case CTU_CAN_FD_FILTER_A_MASK:
+    case CTU_CAN_FD_FILTER_A_VAL:
+    case CTU_CAN_FD_FILTER_B_MASK:
+    case CTU_CAN_FD_FILTER_B_VAL:
+    case CTU_CAN_FD_FILTER_C_MASK:
+    case CTU_CAN_FD_FILTER_C_VAL:
+    case CTU_CAN_FD_FILTER_RAN_LOW:
+    case CTU_CAN_FD_FILTER_RAN_HIGH:
+    case CTU_CAN_FD_TX_PRIORITY:
+        r = &regs[EMU_REG(reg)];
+        *r = (*r & ~mask) | val;
+        break;
+    default:
+        break;
+    }
+}
+
+/* Access lock, skipped for single threaded instances (cfg.unlocked) */
+struct ctucan_emu_guard {
+    struct ctucan_emu *emu;
+
+    explicit ctucan_emu_guard(struct ctucan_emu *e) : emu(e)
+    {
+        if (!emu->cfg.unlocked)
+            emu->lock.lock();
+    }
+    ~ctucan_emu_guard()
+    {
+        if (!emu->cfg.unlocked)
+            emu->lock.unlock();
+    }
+};
+
+static struct ctucan_emu *ctucan_emu_of(struct ctucan_hw_priv *priv)
+{
+    return ((struct ctucan_emu_priv *)priv)->emu;
+}
+
+static u32 ctucan_emu_read32(struct ctucan_hw_priv *priv,
+                             enum ctu_can_fd_can_registers reg)
+{
+    struct ctucan_emu *emu = ctucan_emu_of(priv);
+    ctucan_emu_guard guard(emu);
+
+    return emu->read(reg & ~3u);
+}
+
+static void ctucan_emu_write32(struct ctucan_hw_priv *priv,
+                               enum ctu_can_fd_can_registers reg, u32 val)
+{
+    struct ctucan_emu *emu = ctucan_emu_of(priv);
+    ctucan_emu_guard guard(emu);
+
+    emu->write(reg & ~3u, val, 0xffffffff);
+}
+
+void ctucan_emu_write(struct ctucan_hw_priv *priv,
+                      enum ctu_can_fd_can_registers reg, u32 val, u32 mask)
+{
+    struct ctucan_emu *emu = ctucan_emu_of(priv);
+    ctucan_emu_guard guard(emu);
+
+    emu->write(reg & ~3u, val, mask);
+}
+
+bool ctucan_emu_is(const struct ctucan_hw_priv *priv)
+{
+    return priv->read_reg == ctucan_emu_read32;
+}
+
+struct ctucan_hw_priv *ctucan_emu_create(const struct ctucan_emu_config *cfg)
+{
+    struct ctucan_emu_priv *ep = new ctucan_emu_priv;
+    struct ctucan_emu *emu = new ctucan_emu;
+
+    emu->cfg = *cfg;
+    memset(&emu->stats, 0, sizeof(emu->stats));
+    clock_gettime(CLOCK_MONOTONIC, &emu->t0);
+    emu->rx_size = cfg->rx_words;
+    emu->rx = new u32[emu->rx_size];
+    emu->gen_seq = 0;
+    emu->trv_rng = 0x9e3779b97f4a7c15ull;
+    emu->inbox_len = 0;
+    emu->inbox_lost = 0;
+    emu->reset();
+    if (cfg->link) {
+        std::lock_guard<std::mutex> link_guard(emu_link_lock);
+
+        if (emu_nlinks < EMU_LINK_MAX)
+            emu_links[emu_nlinks++] = emu;
+        else
+            warnx("emulator: more than %d linked cores, not linked", EMU_LINK_MAX);
+    }
+
+    memset(&ep->priv, 0, sizeof(ep->priv));
+    ep->priv.read_reg = ctucan_emu_read32;
+    ep->priv.write_reg = ctucan_emu_write32;
+    ep->emu = emu;
+    return &ep->priv;
+}
+
+void ctucan_emu_destroy(struct ctucan_hw_priv *priv)
+{
+    struct ctucan_emu_priv *ep = (struct ctucan_emu_priv *)priv;
+
+    if (ep->emu->cfg.link) {
+        std::lock_guard<std::mutex> link_guard(emu_link_lock);
+
+        for (unsigned i = 0; i < emu_nlinks; i++) {
+            if (emu_links[i] == ep->emu) {
+                emu_links[i] = emu_links[--emu_nlinks];
+                break;
+            }
+        }
+    }
+    delete[] ep->emu->rx;
+    delete ep->emu;
+    delete ep;
+}
+
+bool ctucan_emu_inject(struct ctucan_hw_priv *priv, const struct canfd_frame *cf,
+                       bool fdf)
+{
+    struct ctucan_emu *emu = ctucan_emu_of(priv);
+    ctucan_emu_guard guard(emu);
+    union ctu_can_fd_frame_format_w ffw;
+    union ctu_can_fd_identifier_w idw;
+    u32 data[CANFD_MAX_DLEN / 4];
+
+    emu->advance();
+    ffw.u32 = 0;
+    idw.u32 = 0;
+    ffw.s.dlc = can_len2dlc(cf->len);
+    if (cf->can_id & CAN_EFF_FLAG) {
+        ffw.s.ide = EXTENDED;
+        idw.s.identifier_base = (cf->can_id & CAN_EFF_MASK) >> 18;
+        idw.s.identifier_ext = cf->can_id & 0x3ffff;
+    } else {
+        idw.s.identifier_base = cf->can_id & CAN_SFF_MASK;
+    }
+    if (fdf) {
+        ffw.s.fdf = FD_CAN;
+        if (cf->flags & CANFD_BRS)
+            ffw.s.brs = BR_SHIFT;
+        if (cf->flags & CANFD_ESI)
+            ffw.s.esi_rsv = ESI_ERR_PASIVE;
+    } else if (cf->can_id & CAN_RTR_FLAG) {
+        ffw.s.rtr = RTR_FRAME;
+    }
+    memset(data, 0, sizeof(data));
+    memcpy(data, cf->data, cf->len > CANFD_MAX_DLEN ? CANFD_MAX_DLEN : cf->len);
+    return emu->rx_store(ffw.u32, idw.u32, emu->ns_to_ts(emu->now_ns()), data);
+}
+
+void ctucan_emu_set_trv_delay(struct ctucan_hw_priv *priv, uint32_t trv_ns)
+{
+    struct ctucan_emu *emu = ctucan_emu_of(priv);
+    ctucan_emu_guard guard(emu);
+
+    emu->cfg.trv_ns = trv_ns;
+}
+
+void ctucan_emu_get_stats(struct ctucan_hw_priv *priv, struct ctucan_emu_stats *st)
+{
+    struct ctucan_emu *emu = ctucan_emu_of(priv);
+    ctucan_emu_guard guard(emu);
+
+    *st = emu->stats;
+}
+
+void ctucan_emu_report(struct ctucan_hw_priv *priv, FILE *f)
+{
+    struct ctucan_emu_stats st;
+
+    ctucan_emu_get_stats(priv, &st);
+    fprintf(f, "emulator: %llu reads, %llu writes, %llu frames sent, "
+               "%llu received, %llu dropped, %llu TX errors\n",
+            (unsigned long long)st.reads, (unsigned long long)st.writes,
+            (unsigned long long)st.tx_frames, (unsigned long long)st.rx_frames,
+            (unsigned long long)st.rx_dropped, (unsigned long long)st.tx_errors);
+}
+
+int ctucan_emu_bus_pending(struct ctucan_hw_priv *priv, const u32 **txt)
+{
+    struct ctucan_emu *emu = ctucan_emu_of(priv);
+    ctucan_emu_guard guard(emu);
+    union ctu_can_fd_mode_settings mode;
+    u32 prio = emu->regs[EMU_REG(CTU_CAN_FD_TX_PRIORITY)];
+    int best = -1;
+
+    mode.u32 = emu->regs[EMU_REG(CTU_CAN_FD_MODE)];
+    if (!mode.s.ena || emu->tec >= 256)
+        return -1;
+    for (unsigned i = 0; i < CTU_CAN_FD_TXT_BUFFER_COUNT; i++) {
+        if (emu->txt_state[i] != TXT_RDY)
+            continue;
+        if (mode.s.bmm) {
+            emu->txt_state[i] = TXT_ERR;
+            emu->raise(EMU_INT_TXBHCI);
+            continue;
+        }
+        if (best < 0 || ((prio >> (4 * i)) & 7) > ((prio >> (4 * best)) & 7))
+            best = i;
+    }
+    if (best >= 0)
+        *txt = emu->txt[best];
+    return best;
+}
+
+void ctucan_emu_bus_start(struct ctucan_hw_priv *priv, unsigned buf,
+                          uint64_t start_ns)
+{
+    struct ctucan_emu *emu = ctucan_emu_of(priv);
+    ctucan_emu_guard guard(emu);
+
+    emu->txt_state[buf] = TXT_TRAN;
+    emu->tx_cur = buf;
+    emu->tx_start_ns = start_ns;
+}
+
+unsigned ctucan_emu_bus_finish(struct ctucan_hw_priv *priv, unsigned buf,
+                               bool ok, uint64_t end_ns)
+{
+    struct ctucan_emu *emu = ctucan_emu_of(priv);
+    ctucan_emu_guard guard(emu);
+    union ctu_can_fd_mode_settings mode;
+    union ctu_can_fd_rx_status_rx_settings rxs;
+    unsigned *st = &emu->txt_state[buf];
+
+    mode.u32 = emu->regs[EMU_REG(CTU_CAN_FD_MODE)];
+    emu->tx_cur = -1;
+    emu->bus_free_ns = end_ns;
+
+    if (ok) {
+        /* Abort during transmission does not stop a successful frame */
+        *st = TXT_TOK;
+        emu->tx_fr_ctr++;
+        emu->stats.tx_frames++;
+        if (emu->tec)
+            emu->tec--;
+        emu->raise(EMU_INT_TXI | EMU_INT_TXBHCI);
+        if (mode.s.ilbp) {
+            rxs.u32 = emu->regs[EMU_REG(CTU_CAN_FD_RX_STATUS)];
+            emu->rx_store(emu->txt[buf][0], emu->txt[buf][1],
+                          emu->ns_to_ts(rxs.s.rtsop == RTS_BEG ?
+                                        emu->tx_start_ns : end_ns),
+                          &emu->txt[buf][4]);
+        }
+        return *st;
+    }
+
+    emu->tx_failed(buf, false);
+    return *st;
+}
+
+bool ctucan_emu_bus_receive(struct ctucan_hw_priv *priv, const u32 *txt,
+                            uint64_t sof_ns, uint64_t eof_ns)
+{
+    struct ctucan_emu *emu = ctucan_emu_of(priv);
+    ctucan_emu_guard guard(emu);
+    union ctu_can_fd_mode_settings mode;
+    union ctu_can_fd_rx_status_rx_settings rxs;
+
+    mode.u32 = emu->regs[EMU_REG(CTU_CAN_FD_MODE)];
+    if (!mode.s.ena)
+        return false;
+    rxs.u32 = emu->regs[EMU_REG(CTU_CAN_FD_RX_STATUS)];
+    return emu->rx_store(txt[0], txt[1],
+                         emu->ns_to_ts(rxs.s.rtsop == RTS_BEG ? sof_ns : eof_ns),
+                         &txt[4]);
+}
@@ -0,0 +1,166 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#pragma once
+
+#include "userspace_utils.h"
+
+/*
+ * Register-level emulator of the CTU CAN FD core.
+ *
+ * The emulator plugs into ctucan_hw_priv read_reg/write_reg, so the HAL and
+ * everything above it run on a host without the FPGA. ctucanfd_init() uses
+ * it instead of /dev/mem when CTUCANFD_EMU is set in the environment, its
+ * value is parsed by ctucan_emu_config_parse().
+ *
+ * Modelled: DEVICE_ID/VERSION, MODE/SETTINGS (incl. soft reset), STATUS,
+ * COMMAND, INT_STAT/INT_ENA/INT_MASK, error counters and CTR_PRES, RX
+ * buffer with RX_MEM_INFO/RX_POINTERS/RX_STATUS/RX_DATA, TXT buffers with
+ * the TX_COMMAND/TX_STATUS state machine and TX_PRIORITY arbitration, frame
+ * counters and TIMESTAMP. Acceptance filters are not synthesized
+ * (FILTER_STATUS reads 0). Errors only occur when injected by the owner of
+ * an external bus, see below.
+ *
+ * With cfg.trv_ns set, own FD frames with BRS see a transceiver loop
+ * delay: TRV_DELAY reads the delay measured in the last such frame, and
+ * the data bits are checked against the sample point (SSP_CFG, or the
+ * data sample point without SSP). Sampling closer than 1/8 bit to an edge
+ * of the delayed bit is a data phase bit error (ERR_FD, retransmission).
+ * The delay of the data bits differs from the measured one by up to
+ * cfg.trv_jitter_ns, as does the measurement between frames.
+ *
+ * cfg.bus_bitrate/bus_dbitrate give generated frames a bit rate of their
+ * own (FD with BRS if bus_dbitrate is set). A node whose BTR or BTR_FD
+ * differs from it by more than 2% does not receive them. Instead ERR_NORM
+ * or ERR_FD counts, and ERR_CAPT shows a stuff or CRC error.
+ *
+ * The bus is simulated lazily against the host clock on every register
+ * access: ready TXT buffers are sent one at a time in TX_PRIORITY order,
+ * each occupying the bus for its exact length (stuff bits included, see
+ * userspace_bitstream.h) at the bit rates set in BTR/BTR_FD. A virtual
+ * peer acknowledges every frame. With internal loopback (SETTINGS.ILBP)
+ * sent frames are also received. Optionally a stream of frames from other
+ * nodes is generated at a fixed rate.
+ *
+ * Emulators created with cfg.link (CTUCANFD_EMU=link) in one process
+ * share a bus: every frame sent by one is received by the others, with the
+ * RX timestamp taken from the sender's frame time. There is no arbitration
+ * between linked nodes, each keeps its own bus timing; the multi-node
+ * simulator is the tool for contention.
+ *
+ * With cfg.bus set the emulator does not transmit by itself, the owner of
+ * the bus (e.g. the multi-node simulator) arbitrates between nodes and
+ * drives transmission with the ctucan_emu_bus_*() calls, usually on a
+ * virtual clock supplied through cfg.clock.
+ */
+
+struct ctucan_emu_config {
+    unsigned rx_words;      /* RX buffer size in 32-bit words */
+    unsigned rx_rate;       /* Generated RX frames per second, 0 = none */
+    canid_t rx_id;          /* ID of generated frames */
+    uint32_t clk_freq;      /* Core clock, bit time base */
+    uint32_t ts_freq;       /* TIMESTAMP counter frequency */
+    bool instant;           /* Frames take no bus time */
+    bool link;              /* Share the bus with other linked emulators */
+    bool bus;               /* Transmission driven by ctucan_emu_bus_*() */
+    bool unlocked;          /* Single threaded use, no access lock */
+    uint32_t trv_ns;        /* Transceiver loop delay, 0 = none */
+    uint32_t trv_jitter_ns;
+    uint32_t bus_bitrate;   /* Of generated frames, 0 = the node's */
+    uint32_t bus_dbitrate;
+    uint64_t (*clock)(void *arg);   /* Time in ns, NULL = CLOCK_MONOTONIC */
+    void *clock_arg;
+};
+
+struct ctucan_emu_stats {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t tx_frames;
+    uint64_t rx_frames;     /* Stored in RX buffer (generated, injected, loopback) */
+    uint64_t rx_dropped;    /* Lost on full RX buffer */
+    uint64_t tx_errors;     /* Failed attempts, incl. retransmitted ones */
+};
+
+void ctucan_emu_config_defaults(struct ctucan_emu_config *cfg);
+
+/*
+ * Parse comma separated options: rx=<words>, rate=<fps>, id=<can id>,
+ * clk=<Hz>, ts=<Hz>, trv=<ns>, trvj=<ns>, bus=<bps>, dbus=<bps>, instant,
+ * link. Any other single token (e.g. "1") is
+ * accepted as "defaults". Returns 0 on success, -1 on unknown option.
+ */
+int ctucan_emu_config_parse(struct ctucan_emu_config *cfg, const char *str);
+
+/* Create emulated core in reset state */
+struct ctucan_hw_priv *ctucan_emu_create(const struct ctucan_emu_config *cfg);
+
+void ctucan_emu_destroy(struct ctucan_hw_priv *priv);
+
+/* True if @priv belongs to the emulator */
+bool ctucan_emu_is(const struct ctucan_hw_priv *priv);
+
+/* Write with byte enables, @mask selects the written bits of word @reg */
+void ctucan_emu_write(struct ctucan_hw_priv *priv,
+                      enum ctu_can_fd_can_registers reg, u32 val, u32 mask);
+
+/* Receive a frame sent by another node now. Returns false if it was dropped. */
+bool ctucan_emu_inject(struct ctucan_hw_priv *priv, const struct canfd_frame *cf,
+                       bool fdf);
+
+/* Change the transceiver loop delay, e.g. to follow temperature */
+void ctucan_emu_set_trv_delay(struct ctucan_hw_priv *priv, uint32_t trv_ns);
+
+void ctucan_emu_get_stats(struct ctucan_hw_priv *priv, struct ctucan_emu_stats *st);
+
+void ctucan_emu_report(struct ctucan_hw_priv *priv, FILE *f);
+
+/*
+ * External bus interface (cfg.bus). ctucan_emu_bus_pending() returns the
+ * TXT buffer the core would send next (highest TX_PRIORITY among ready
+ * buffers) and its words (FFW, IDW, timestamp, data), or -1 if the node has
+ * nothing to send or cannot transmit (disabled, bus monitoring, bus off).
+ */
+int ctucan_emu_bus_pending(struct ctucan_hw_priv *priv, const u32 **txt);
+
+/* Buffer @buf won arbitration at @start_ns and is being transmitted */
+void ctucan_emu_bus_start(struct ctucan_hw_priv *priv, unsigned buf,
+                          uint64_t start_ns);
+
+/*
+ * End of transmission of @buf. A failed attempt (@ok false) raises TEC and
+ * leaves the buffer ready for retransmission unless the retransmission
+ * limit (SETTINGS.RTRLE/RTRTH) is reached or it was aborted meanwhile.
+ * Returns the new TXT buffer state.
+ */
+unsigned ctucan_emu_bus_finish(struct ctucan_hw_priv *priv, unsigned buf,
+                               bool ok, uint64_t end_ns);
+
+/* Receive frame @txt (TXT buffer words) sent by another node */
+bool ctucan_emu_bus_receive(struct ctucan_hw_priv *priv, const u32 *txt,
+                            uint64_t sof_ns, uint64_t eof_ns);
@@ -0,0 +1,155 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Log-linear histogram of 64-bit values (timestamp ticks, nanoseconds).
+ * Every power of two is split into USERSPACE_HIST_SUB linear sub-buckets,
+ * so the relative error of a reported percentile is below 1/SUB. Adding
+ * a sample is a few shifts and one increment, no allocation, so it can be
+ * used from the RX hot path.
+ */
+#define USERSPACE_HIST_SUB_BITS 4
+#define USERSPACE_HIST_SUB (1u << USERSPACE_HIST_SUB_BITS)
+#define USERSPACE_HIST_BUCKETS ((64 - USERSPACE_HIST_SUB_BITS + 1) * USERSPACE_HIST_SUB)
+
+struct userspace_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t bucket[USERSPACE_HIST_BUCKETS];
+};
+
+static inline void userspace_hist_init(struct userspace_hist *h)
+{
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+static inline unsigned userspace_hist_index(uint64_t v)
+{
+    unsigned msb;
+
+    if (v < USERSPACE_HIST_SUB)
+        return (unsigned)v;
+    msb = 63 - __builtin_clzll(v);
+    return (msb - USERSPACE_HIST_SUB_BITS + 1) * USERSPACE_HIST_SUB +
+           (unsigned)((v >> (msb - USERSPACE_HIST_SUB_BITS)) & (USERSPACE_HIST_SUB - 1));
+}
+
+/* Upper bound of values that fall into bucket @idx */
+static inline uint64_t userspace_hist_bucket_max(unsigned idx)
+{
+    unsigned exp = idx / USERSPACE_HIST_SUB;
+    uint64_t sub = idx % USERSPACE_HIST_SUB;
+    unsigned shift;
+
+    if (exp == 0)
+        return sub;
+    shift = exp - 1;
+    return ((USERSPACE_HIST_SUB + sub + 1) << shift) - 1;
+}
+
+static inline void userspace_hist_add(struct userspace_hist *h, uint64_t v)
+{
+    h->bucket[userspace_hist_index(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v < h->min)
+        h->min = v;
+    if (v > h->max)
+        h->max = v;
+}
+
+static inline void userspace_hist_merge(struct userspace_hist *dst,
+                                        const struct userspace_hist *src)
+{
+    for (unsigned i = 0; i < USERSPACE_HIST_BUCKETS; i++)
+        dst->bucket[i] += src->bucket[i];
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->min < dst->min)
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+/* Value below which @permille of the samples lie (e.g. 990 for p99) */
+static inline uint64_t userspace_hist_percentile(const struct userspace_hist *h,
+                                                 unsigned permille)
+{
+    uint64_t target, acc = 0;
+
+    if (!h->count)
+        return 0;
+    target = (h->count * permille + 999) / 1000;
+    if (!target)
+        target = 1;
+    for (unsigned i = 0; i < USERSPACE_HIST_BUCKETS; i++) {
+        acc += h->bucket[i];
+        if (acc >= target) {
+            uint64_t v = userspace_hist_bucket_max(i);
+            return v > h->max ? h->max : v;
+        }
+    }
+    return h->max;
+}
+
+/*
+ * Print one summary line. @scale_num/@scale_den convert the stored unit
+ * into the printed one (e.g. timestamp ticks into nanoseconds).
+ */
+static inline void userspace_hist_print(FILE *f, const char *name,
+                                        const struct userspace_hist *h,
+                                        uint64_t scale_num, uint64_t scale_den,
+                                        const char *unit)
+{
+    static const unsigned pct[] = {500, 900, 990, 999};
+
+    if (!h->count) {
+        fprintf(f, "%s: no samples\n", name);
+        return;
+    }
+    fprintf(f, "%s: n=%llu min=%llu avg=%llu", name,
+            (unsigned long long)h->count,
+            (unsigned long long)(h->min * scale_num / scale_den),
+            (unsigned long long)(h->sum / h->count * scale_num / scale_den));
+    for (unsigned i = 0; i < sizeof(pct) / sizeof(pct[0]); i++)
+        fprintf(f, " p%g=%llu", pct[i] / 10.0,
+                (unsigned long long)(userspace_hist_percentile(h, pct[i]) *
+                                     scale_num / scale_den));
+    fprintf(f, " max=%llu %s\n",
+            (unsigned long long)(h->max * scale_num / scale_den), unit);
+}
@@ -0,0 +1,438 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#include "userspace_pcapng.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <time.h>
+
+#define PCAPNG_SHB              0x0a0d0d0au
+#define PCAPNG_IDB              0x00000001u
+#define PCAPNG_EPB              0x00000006u
+#define PCAPNG_BOM              0x1a2b3c4du
+#define PCAPNG_OPT_END          0
+#define PCAPNG_OPT_IF_NAME      2
+#define PCAPNG_OPT_IF_TSRESOL   9
+#define LINKTYPE_CAN_SOCKETCAN  227
+
+#define PCAPNG_EPB_FIXED        32      /* EPB without packet data */
+#define PCAPNG_SLL_HDR          8       /* SocketCAN header before data */
+
+static uint64_t pcapng_clock_ns(clockid_t clk)
+{
+    struct timespec t;
+
+    clock_gettime(clk, &t);
+    return (uint64_t)t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+static inline uint8_t *put16(uint8_t *p, uint16_t v)
+{
+    memcpy(p, &v, 2);
+    return p + 2;
+}
+
+static inline uint8_t *put32(uint8_t *p, uint32_t v)
+{
+    memcpy(p, &v, 4);
+    return p + 4;
+}
+
+static uint8_t *put_opt(uint8_t *p, uint16_t code, const void *val, uint16_t len)
+{
+    p = put16(p, code);
+    p = put16(p, len);
+    memcpy(p, val, len);
+    memset(p + len, 0, (4 - len % 4) % 4);
+    return p + (len + 3) / 4 * 4;
+}
+
+void pcapng_config_defaults(struct pcapng_config *cfg)
+{
+    cfg->buf_size = 4u << 20;
+    cfg->nbufs = 8;
+    cfg->flush_ms = 1000;
+    cfg->rotate_bytes = 0;
+    cfg->rotate_sec = 0;
+}
+
+int pcapng_rotate_parse(struct pcapng_config *cfg, const char *str)
+{
+    unsigned long long mib;
+    char *e;
+
+    mib = strtoull(str, &e, 0);
+    cfg->rotate_bytes = mib << 20;
+    cfg->rotate_sec = 0;
+    if (*e == ',') {
+        cfg->rotate_sec = strtoul(e + 1, &e, 0);
+    }
+    if (*e) {
+        warnx("rotation expects <MiB>[,<seconds>]");
+        return -1;
+    }
+    return 0;
+}
+
+/* File name of file number @seq: <base>_NNNNN<ext> when rotating */
+static void pcapng_file_name(const struct pcapng_writer *w, unsigned seq,
+                             char *buf, size_t len)
+{
+    const char *slash = strrchr(w->path, '/');
+    const char *dot = strrchr(slash ? slash : w->path, '.');
+
+    if (!w->cfg.rotate_bytes && !w->cfg.rotate_sec) {
+        snprintf(buf, len, "%s", w->path);
+        return;
+    }
+    if (!dot)
+        dot = w->path + strlen(w->path);
+    snprintf(buf, len, "%.*s_%05u%s", (int)(dot - w->path), w->path, seq, dot);
+}
+
+static int pcapng_open_file(struct pcapng_writer *w)
+{
+    char name[300];
+
+    pcapng_file_name(w, w->file_seq, name, sizeof(name));
+    w->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w->fd < 0) {
+        if (!w->stats.error)
+            w->stats.error = errno;
+        warn("%s", name);
+        return -1;
+    }
+    w->stats.files++;
+    return 0;
+}
+
+static void pcapng_write_buf(struct pcapng_writer *w, const struct pcapng_buf *b)
+{
+    const uint8_t *p = b->data;
+    size_t left = b->len;
+    uint64_t t0, dt;
+
+    if (b->rotate) {
+        if (w->fd >= 0)
+            close(w->fd);
+        w->file_seq++;
+        pcapng_open_file(w);
+    }
+    if (w->fd < 0)
+        return;
+    t0 = pcapng_clock_ns(CLOCK_MONOTONIC);
+    while (left) {
+        ssize_t n = write(w->fd, p, left);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (!w->stats.error) {
+                w->stats.error = errno;
+                warn("pcapng write");
+            }
+            return;
+        }
+        p += n;
+        left -= n;
+    }
+    dt = pcapng_clock_ns(CLOCK_MONOTONIC) - t0;
+    if (dt > w->stats.max_write_ns)
+        w->stats.max_write_ns = dt;
+    w->stats.bytes += b->len;
+    w->stats.writes++;
+}
+
+/* Hand the current buffer to the writer thread, next one must be free */
+static void pcapng_submit_locked(struct pcapng_writer *w)
+{
+    struct pcapng_buf *next;
+
+    w->bufs[w->cur].state = PCAPNG_BUF_FULL;
+    if (++w->queued > w->stats.max_queued)
+        w->stats.max_queued = w->queued;
+    w->cur = (w->cur + 1) % w->cfg.nbufs;
+    next = &w->bufs[w->cur];
+    next->len = 0;
+    next->rotate = false;
+    w->cv.notify_one();
+}
+
+/* Put the file header into the current buffer, starting a file */
+static void pcapng_start_file_locked(struct pcapng_writer *w, uint64_t now)
+{
+    struct pcapng_buf *b = &w->bufs[w->cur];
+
+    memcpy(b->data + b->len, w->hdr, w->hdr_len);
+    b->len += w->hdr_len;
+    w->file_bytes = w->hdr_len;
+    w->file_start_ns = now;
+    w->started = true;
+}
+
+static void *pcapng_thread(void *arg)
+{
+    struct pcapng_writer *w = (struct pcapng_writer *)arg;
+    std::unique_lock<std::mutex> guard(w->lock);
+
+    for (;;) {
+        struct pcapng_buf *b;
+
+        while (!w->queued && !w->stop) {
+            w->cv.wait_for(guard, std::chrono::milliseconds(w->cfg.flush_ms));
+            if (!w->queued && w->bufs[w->cur].len &&
+                pcapng_clock_ns(CLOCK_MONOTONIC) - w->cur_start_ns >=
+                (uint64_t)w->cfg.flush_ms * 1000000)
+                pcapng_submit_locked(w);
+        }
+        if (!w->queued) {
+            /* Stopping: write the partial buffer last */
+            if (!w->bufs[w->cur].len)
+                break;
+            pcapng_submit_locked(w);
+        }
+
+        b = &w->bufs[(w->cur + w->cfg.nbufs - w->queued) % w->cfg.nbufs];
+        guard.unlock();
+        pcapng_write_buf(w, b);
+        guard.lock();
+        b->state = PCAPNG_BUF_FREE;
+        w->queued--;
+    }
+    return NULL;
+}
+
+int pcapng_open(struct pcapng_writer *w, const char *path,
+                const struct pcapng_config *cfg)
+{
+    uint8_t *p;
+    int err;
+
+    w->cfg = *cfg;
+    if (w->cfg.nbufs < 2)
+        w->cfg.nbufs = 2;
+    if (w->cfg.buf_size < PCAPNG_HDR_MAX + 4096)
+        w->cfg.buf_size = PCAPNG_HDR_MAX + 4096;
+    if (!w->cfg.flush_ms)
+        w->cfg.flush_ms = 1000;
+    snprintf(w->path, sizeof(w->path), "%s", path);
+    memset(&w->stats, 0, sizeof(w->stats));
+    w->file_seq = 0;
+    w->stop = false;
+    w->cur = 0;
+    w->queued = 0;
+    w->cur_start_ns = 0;
+    w->file_bytes = 0;
+    w->file_start_ns = 0;
+    w->started = false;
+    w->nifaces = 0;
+
+    w->bufs = (struct pcapng_buf *)calloc(w->cfg.nbufs, sizeof(*w->bufs));
+    if (!w->bufs) {
+        warnx("cannot allocate pcapng buffers");
+        return -1;
+    }
+    for (unsigned i = 0; i < w->cfg.nbufs; i++) {
+        w->bufs[i].data = (uint8_t *)malloc(w->cfg.buf_size);
+        if (!w->bufs[i].data) {
+            warnx("cannot allocate %u pcapng buffers of %zu bytes",
+                  w->cfg.nbufs, w->cfg.buf_size);
+            goto fail;
+        }
+        /* Fault the pages in now, not on the RX path */
+        memset(w->bufs[i].data, 0, w->cfg.buf_size);
+    }
+
+    /* Section header, interfaces are appended by pcapng_add_interface() */
+    p = w->hdr;
+    p = put32(p, PCAPNG_SHB);
+    p = put32(p, 28);
+    p = put32(p, PCAPNG_BOM);
+    p = put16(p, 1);
+    p = put16(p, 0);
+    p = put32(p, 0xffffffffu);      /* Section length unknown */
+    p = put32(p, 0xffffffffu);
+    p = put32(p, 28);
+    w->hdr_len = p - w->hdr;
+
+    if (pcapng_open_file(w))
+        goto fail;
+    err = pthread_create(&w->thread, NULL, pcapng_thread, w);
+    if (err) {
+        warnx("cannot start pcapng writer thread: %s", strerror(err));
+        close(w->fd);
+        goto fail;
+    }
+    return 0;
+fail:
+    for (unsigned i = 0; i < w->cfg.nbufs; i++)
+        free(w->bufs[i].data);
+    free(w->bufs);
+    w->bufs = NULL;
+    return -1;
+}
+
+int pcapng_add_interface(struct pcapng_writer *w, const char *name,
+                         uint32_t ts_freq, u64 ts_now)
+{
+    std::lock_guard<std::mutex> guard(w->lock);
+    size_t name_len = strlen(name);
+    uint8_t tsresol = 9;                /* 10^-9 s */
+    uint8_t *start, *p;
+    uint64_t ticks_ns;
+
+    if (w->started || w->nifaces == PCAPNG_MAX_IFACES || !ts_freq ||
+        w->hdr_len + 40 + name_len > PCAPNG_HDR_MAX) {
+        warnx("pcapng: cannot add interface %s", name);
+        return -1;
+    }
+    start = p = w->hdr + w->hdr_len;
+    p = put32(p, PCAPNG_IDB);
+    p = put32(p, 0);                    /* Length, filled below */
+    p = put16(p, LINKTYPE_CAN_SOCKETCAN);
+    p = put16(p, 0);
+    p = put32(p, 0);                    /* No snap length */
+    p = put_opt(p, PCAPNG_OPT_IF_NAME, name, name_len);
+    p = put_opt(p, PCAPNG_OPT_IF_TSRESOL, &tsresol, 1);
+    p = put_opt(p, PCAPNG_OPT_END, NULL, 0);
+    p = put32(p, p + 4 - start);
+    put32(start + 4, p - start);
+    w->hdr_len = p - w->hdr;
+
+    ticks_ns = ts_now / ts_freq * 1000000000ull +
+               ts_now % ts_freq * 1000000000ull / ts_freq;
+    w->iface[w->nifaces].ts_freq = ts_freq;
+    w->iface[w->nifaces].epoch_ns = (int64_t)(pcapng_clock_ns(CLOCK_REALTIME) - ticks_ns);
+    return w->nifaces++;
+}
+
+void pcapng_write_frame(struct pcapng_writer *w, unsigned ifc,
+                        const struct canfd_frame *cf, u64 ts)
+{
+    const struct pcapng_iface *iface = &w->iface[ifc];
+    bool fd = (cf->flags & CANFD_FDF) || cf->len > CAN_MAX_DLEN;
+    uint32_t caplen = PCAPNG_SLL_HDR + (fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN);
+    uint32_t blk = PCAPNG_EPB_FIXED + caplen;
+    unsigned len = cf->len > (fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN) ?
+                   (fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN) : cf->len;
+    uint64_t now = pcapng_clock_ns(CLOCK_MONOTONIC);
+    uint64_t ns;
+    struct pcapng_buf *b;
+    uint8_t *p;
+
+    ns = iface->epoch_ns + ts / iface->ts_freq * 1000000000ull +
+         ts % iface->ts_freq * 1000000000ull / iface->ts_freq;
+
+    std::lock_guard<std::mutex> guard(w->lock);
+    bool rotate = w->started &&
+        ((w->cfg.rotate_bytes && w->file_bytes + blk > w->cfg.rotate_bytes &&
+          w->file_bytes > w->hdr_len) ||
+         (w->cfg.rotate_sec &&
+          now - w->file_start_ns >= (uint64_t)w->cfg.rotate_sec * 1000000000ull));
+
+    b = &w->bufs[w->cur];
+    if (rotate || b->len + blk > w->cfg.buf_size) {
+        if (b->len) {
+            if (w->bufs[(w->cur + 1) % w->cfg.nbufs].state != PCAPNG_BUF_FREE) {
+                w->stats.dropped++;
+                return;
+            }
+            pcapng_submit_locked(w);
+        }
+        if (rotate) {
+            w->bufs[w->cur].rotate = true;
+            pcapng_start_file_locked(w, now);
+        }
+        b = &w->bufs[w->cur];
+    }
+    if (!w->started)
+        pcapng_start_file_locked(w, now);
+    if (b->len == 0 || b->len == w->hdr_len)
+        w->cur_start_ns = now;
+
+    p = b->data + b->len;
+    p = put32(p, PCAPNG_EPB);
+    p = put32(p, blk);
+    p = put32(p, ifc);
+    p = put32(p, ns >> 32);
+    p = put32(p, (uint32_t)ns);
+    p = put32(p, caplen);
+    p = put32(p, caplen);
+    p = put32(p, htonl(cf->can_id));
+    *p++ = len;
+    *p++ = fd ? (cf->flags | CANFD_FDF) : 0;
+    *p++ = 0;
+    *p++ = 0;
+    memcpy(p, cf->data, len);
+    memset(p + len, 0, caplen - PCAPNG_SLL_HDR - len);
+    p += caplen - PCAPNG_SLL_HDR;
+    put32(p, blk);
+
+    b->len += blk;
+    w->file_bytes += blk;
+    w->stats.frames++;
+}
+
+int pcapng_close(struct pcapng_writer *w)
+{
+    if (!w->bufs)
+        return -1;
+    {
+        std::lock_guard<std::mutex> guard(w->lock);
+
+        /* An empty capture is still a valid file */
+        if (!w->started)
+            pcapng_start_file_locked(w, pcapng_clock_ns(CLOCK_MONOTONIC));
+        w->stop = true;
+        w->cv.notify_one();
+    }
+    pthread_join(w->thread, NULL);
+    if (w->fd >= 0 && close(w->fd) < 0 && !w->stats.error)
+        w->stats.error = errno;
+    w->fd = -1;
+    for (unsigned i = 0; i < w->cfg.nbufs; i++)
+        free(w->bufs[i].data);
+    free(w->bufs);
+    w->bufs = NULL;
+    return w->stats.error ? -1 : 0;
+}
+
+void pcapng_report(const struct pcapng_writer *w, FILE *f)
+{
+    fprintf(f, "pcapng: %llu frames, %llu dropped, %.1f MiB in %llu file(s), "
+            "%llu writes, max %u of %u buffers queued, longest write %.3f ms\n",
+            (unsigned long long)w->stats.frames,
+            (unsigned long long)w->stats.dropped,
+            w->stats.bytes / 1048576.0, (unsigned long long)w->stats.files,
+            (unsigned long long)w->stats.writes, w->stats.max_queued,
+            w->cfg.nbufs, w->stats.max_write_ns / 1e6);
+    if (w->stats.error)
+        fprintf(f, "pcapng: write error: %s\n", strerror(w->stats.error));
+}
@@ -0,0 +1,150 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#pragma once
+
+#include "userspace_utils.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <pthread.h>
+
+/*
+ * pcapng capture writer for received frames, readable by Wireshark.
+ *
+ * Every channel is one interface (IDB) with LINKTYPE_CAN_SOCKETCAN and
+ * nanosecond resolution. Packets are the SocketCAN header (CAN ID in
+ * network order, length, flags) followed by the data, 16 bytes for CAN and
+ * 72 bytes (CANFD_MTU) for CAN FD frames. Core timestamp ticks are turned
+ * into wall clock time with the offset between CLOCK_REALTIME and the
+ * core's TIMESTAMP taken when the interface is added.
+ *
+ * Frames are appended to large in-memory buffers under a short lock, so
+ * several RX pollers may share one writer. Full buffers are written by a
+ * separate thread; a frame only gets dropped (and counted) when all
+ * buffers wait for the disk. Partial buffers are flushed after
+ * flush_ms. With rotation the file name gets a _NNNNN suffix before the
+ * extension and a new file is started (with SHB and IDBs) when the size
+ * or age limit would be exceeded.
+ */
+
+#define PCAPNG_MAX_IFACES   8
+#define PCAPNG_HDR_MAX      512     /* SHB plus all IDBs */
+
+struct pcapng_config {
+    size_t buf_size;            /* Bytes per buffer */
+    unsigned nbufs;             /* Buffers, at least 2 */
+    unsigned flush_ms;          /* Write partial buffers after this time */
+    uint64_t rotate_bytes;      /* Start new file after this size, 0 = never */
+    unsigned rotate_sec;        /* Start new file after this time, 0 = never */
+};
+
+struct pcapng_stats {
+    uint64_t frames;
+    uint64_t dropped;           /* All buffers full */
+    uint64_t bytes;             /* Written to files */
+    uint64_t writes;            /* Buffers written */
+    uint64_t files;
+    unsigned max_queued;        /* Most buffers waiting for the disk */
+    uint64_t max_write_ns;      /* Longest write() */
+    int error;                  /* errno of the first failed open/write */
+};
+
+enum pcapng_buf_state {
+    PCAPNG_BUF_FREE,
+    PCAPNG_BUF_FULL,            /* Waiting for the writer thread */
+};
+
+struct pcapng_buf {
+    uint8_t *data;
+    size_t len;
+    bool rotate;                /* Starts a new file */
+    enum pcapng_buf_state state;
+};
+
+struct pcapng_iface {
+    uint32_t ts_freq;
+    int64_t epoch_ns;           /* Wall clock at tick 0 */
+};
+
+struct pcapng_writer {
+    struct pcapng_config cfg;
+    char path[256];
+    int fd;
+    unsigned file_seq;
+
+    std::mutex lock;            /* Everything below */
+    std::condition_variable cv;
+    pthread_t thread;
+    bool stop;
+    struct pcapng_buf *bufs;
+    unsigned cur;               /* Buffer being filled */
+    unsigned queued;            /* Buffers in state FULL */
+    uint64_t cur_start_ns;      /* First frame in the current buffer */
+    uint64_t file_bytes;        /* Assigned to the current file */
+    uint64_t file_start_ns;
+    bool started;               /* First frame written, no more interfaces */
+
+    uint8_t hdr[PCAPNG_HDR_MAX];
+    size_t hdr_len;
+    struct pcapng_iface iface[PCAPNG_MAX_IFACES];
+    unsigned nifaces;
+
+    struct pcapng_stats stats;
+};
+
+/* 8 buffers of 4 MiB, flush after 1 s, no rotation */
+void pcapng_config_defaults(struct pcapng_config *cfg);
+
+/*
+ * Parse rotation "<MiB>[,<seconds>]", either may be 0. Returns 0 on
+ * success, -1 on malformed input.
+ */
+int pcapng_rotate_parse(struct pcapng_config *cfg, const char *str);
+
+/* Create the (first) file and start the writer thread. Returns -1 on error. */
+int pcapng_open(struct pcapng_writer *w, const char *path,
+                const struct pcapng_config *cfg);
+
+/*
+ * Add interface @name with timestamp counter frequency @ts_freq, @ts_now
+ * being the core's TIMESTAMP read right now. Must be called before the
+ * first frame. Returns the interface index or -1.
+ */
+int pcapng_add_interface(struct pcapng_writer *w, const char *name,
+                         uint32_t ts_freq, u64 ts_now);
+
+/* Append a frame received on interface @ifc with core timestamp @ts */
+void pcapng_write_frame(struct pcapng_writer *w, unsigned ifc,
+                        const struct canfd_frame *cf, u64 ts);
+
+/* Flush, stop the writer thread and close the file. Returns -1 on write errors. */
+int pcapng_close(struct pcapng_writer *w);
+
+void pcapng_report(const struct pcapng_writer *w, FILE *f);
@@ -0,0 +1,328 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#include "userspace_refgen.h"
+
+static const char refgen_hex[] = "0123456789abcdef";
+
+/* Data lengths the logger picks from */
+static const uint8_t refgen_lens[] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64};
+
+void refgen_config_defaults(struct refgen_config *cfg)
+{
+    /* As log_500Kb_2Mb_80p_1K_samples_* were recorded */
+    cfg->clk_freq = 100000000;
+    cfg->bitrate = 500000;
+    cfg->dbitrate = 2000000;
+    cfg->sp = 800;
+    cfg->dsp = 800;
+    cfg->pretrigger = 8192;
+    cfg->samples = 65536;
+    cfg->ack_delay = 10;
+    cfg->iso = true;
+}
+
+/* Bit timing of one frame, in samples from SOF */
+struct refgen_timing {
+    uint32_t nq, dq;                /* Bit lengths */
+    uint32_t brs_w, del_w;          /* BRS bit and CRC delimiter, sampled at both rates */
+    uint32_t ack_delay;
+    unsigned brs_pos, data_end, len;
+};
+
+/* Start of bit @i, i <= len */
+static inline uint32_t refgen_bit_start(const struct refgen_timing *t, unsigned i)
+{
+    uint32_t s;
+
+    if (!t->brs_pos || i <= t->brs_pos)
+        s = i * t->nq;
+    else if (i < t->data_end)
+        s = t->brs_pos * t->nq + t->brs_w + (i - t->brs_pos - 1) * t->dq;
+    else
+        s = t->brs_pos * t->nq + t->brs_w + (t->data_end - t->brs_pos - 2) * t->dq +
+            t->del_w + (i - t->data_end) * t->nq;
+
+    /* Late ACK: CRC delimiter longer, ACK delimiter shorter by as much */
+    if (i == t->len - 9 || i == t->len - 8)
+        s += t->ack_delay;
+    return s;
+}
+
+unsigned refgen_runs(const struct refgen_config *cfg, const struct refgen_frame *f,
+                     uint32_t *run)
+{
+    struct can_bitstream bs;
+    struct refgen_timing t;
+    uint32_t end = cfg->samples;
+    uint32_t start, prev;
+    uint16_t edge[CAN_BITSTREAM_MAX];
+    unsigned nedge = 0, n;
+
+    can_bitstream_encode(&bs, &f->cf, f->fdf, cfg->iso);
+
+    t.nq = (cfg->clk_freq + cfg->bitrate / 2) / cfg->bitrate;
+    t.dq = (cfg->clk_freq + cfg->dbitrate / 2) / cfg->dbitrate;
+    t.brs_w = t.nq * cfg->sp / 1000 + t.dq - t.dq * cfg->dsp / 1000;
+    t.del_w = t.dq * cfg->dsp / 1000 + t.nq - t.nq * cfg->sp / 1000;
+    t.ack_delay = cfg->ack_delay < t.nq ? cfg->ack_delay : t.nq;
+    t.brs_pos = bs.brs_pos;
+    t.data_end = bs.data_end;
+    t.len = bs.len;
+
+    /* Level changes, SOF is the first one */
+    edge[nedge++] = 0;
+    for (unsigned i = 1; i < bs.len; i++) {
+        edge[nedge] = i;
+        nedge += bs.bit[i] != bs.bit[i - 1];
+    }
+
+    /* Idle before SOF, runs between the changes, idle after EOF */
+    start = cfg->pretrigger < end ? cfg->pretrigger : end;
+    run[0] = start;
+    n = 1;
+    prev = start;
+    for (unsigned k = 1; k < nedge && prev < end; k++) {
+        uint32_t s = start + refgen_bit_start(&t, edge[k]);
+
+        if (s > end)
+            s = end;
+        run[n++] = s - prev;
+        prev = s;
+    }
+    if (prev < end)
+        run[n++] = end - prev;
+    return n;
+}
+
+static const char refgen_digits2[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/* Two digits at a time, most runs are 2-4 digits */
+static char *refgen_put_uint(char *p, uint32_t v)
+{
+    char digits[10];
+    char *q = digits + sizeof(digits);
+    size_t n;
+
+    while (v >= 100) {
+        q -= 2;
+        memcpy(q, &refgen_digits2[(v % 100) * 2], 2);
+        v /= 100;
+    }
+    if (v >= 10) {
+        q -= 2;
+        memcpy(q, &refgen_digits2[v * 2], 2);
+    } else {
+        *--q = '0' + v;
+    }
+    n = digits + sizeof(digits) - q;
+    memcpy(p, q, n);
+    return p + n;
+}
+
+/* Right aligned in @width, as printf("%*u") */
+static char *refgen_put_uint_w(char *p, uint32_t v, unsigned width)
+{
+    char *end = p + width;
+    char *q = end;
+
+    do {
+        *--q = '0' + v % 10;
+        v /= 10;
+    } while (v && q > p);
+    while (q > p)
+        *--q = ' ';
+    return end;
+}
+
+static char *refgen_put_str(char *p, const char *s, size_t n)
+{
+    memcpy(p, s, n);
+    return p + n;
+}
+
+size_t refgen_format(char *buf, const struct refgen_frame *f,
+                     const uint32_t *run, unsigned n)
+{
+    const struct canfd_frame *cf = &f->cf;
+    bool ext = cf->can_id & CAN_EFF_FLAG;
+    char *p = buf;
+
+    /* Fields and widths of store_frame_info() */
+    p = refgen_put_str(p, f->fdf ? "CAN FD  " : "CAN 2.0 ", 8);
+    p = refgen_put_str(p, ext ? "EXTENDED " : "BASE     ", 9);
+    p = refgen_put_str(p, !f->fdf && (cf->can_id & CAN_RTR_FLAG) ? "RTR " : "    ", 4);
+    p = refgen_put_str(p, f->fdf && (cf->flags & CANFD_BRS) ? "BRS " : "    ", 4);
+    p = refgen_put_str(p, "Data length: ", 13);
+    p = refgen_put_uint_w(p, cf->len, 2);
+    p = refgen_put_str(p, " ID: ", 5);
+    p = refgen_put_uint_w(p, cf->can_id & (ext ? CAN_EFF_MASK : CAN_SFF_MASK), 9);
+    p = refgen_put_str(p, " Data: ", 7);
+    for (unsigned i = 0; i < CANFD_MAX_DLEN; i++) {
+        uint8_t b = i < cf->len ? cf->data[i] : 0;
+
+        *p++ = refgen_hex[b >> 4];
+        *p++ = refgen_hex[b & 0xf];
+        *p++ = ' ';
+    }
+
+    p = refgen_put_str(p, "Bit sequence: ", 14);
+    for (unsigned i = 0; i < n; i++) {
+        p = refgen_put_uint(p, i ? run[i] - 1 : run[i]);
+        *p++ = ' ';
+        *p++ = '0' + (i & 1);
+        *p++ = ' ';
+    }
+    for (unsigned i = 0; i < f->pad; i++)
+        *p++ = ' ';
+    *p++ = '\n';
+    return p - buf;
+}
+
+static const char *refgen_skip(const char *p, const char *word)
+{
+    size_t n = strlen(word);
+
+    while (*p == ' ')
+        p++;
+    return strncmp(p, word, n) ? NULL : p + n;
+}
+
+int refgen_parse(const char *line, struct refgen_frame *f, uint32_t *run,
+                 unsigned max_runs)
+{
+    struct canfd_frame *cf = &f->cf;
+    const char *p = line;
+    unsigned long v;
+    char *e;
+    int n = 0;
+
+    memset(f, 0, sizeof(*f));
+    if (!strncmp(p, "CAN FD  ", 8))
+        f->fdf = true;
+    else if (strncmp(p, "CAN 2.0 ", 8))
+        return -1;
+    p += 8;
+    if (!strncmp(p, "EXTENDED ", 9))
+        cf->can_id |= CAN_EFF_FLAG;
+    else if (strncmp(p, "BASE     ", 9))
+        return -1;
+    p += 9;
+    if (!strncmp(p, "RTR ", 4))
+        cf->can_id |= CAN_RTR_FLAG;
+    p += 4;
+    if (!strncmp(p, "BRS ", 4))
+        cf->flags |= CANFD_BRS;
+    p += 4;
+
+    if (!(p = refgen_skip(p, "Data length:")))
+        return -1;
+    v = strtoul(p, &e, 10);
+    if (e == p || v > CANFD_MAX_DLEN || (!f->fdf && v > CAN_MAX_DLEN))
+        return -1;
+    cf->len = v;
+    if (!(p = refgen_skip(e, "ID:")))
+        return -1;
+    v = strtoul(p, &e, 10);
+    if (e == p || v > ((cf->can_id & CAN_EFF_FLAG) ? CAN_EFF_MASK : CAN_SFF_MASK))
+        return -1;
+    cf->can_id |= v;
+    if (!(p = refgen_skip(e, "Data:")))
+        return -1;
+    for (unsigned i = 0; i < CANFD_MAX_DLEN; i++) {
+        v = strtoul(p, &e, 16);
+        if (e == p || v > 0xff)
+            return -1;
+        if (i < cf->len)
+            cf->data[i] = v;
+        p = e;
+    }
+    if (!run)
+        return 0;
+
+    if (!(p = refgen_skip(p, "Bit sequence:")))
+        return -1;
+    for (;;) {
+        v = strtoul(p, &e, 10);
+        if (e == p)
+            break;
+        p = e;
+        while (*p == ' ')
+            p++;
+        if (*p != '0' + (n & 1) || (unsigned)n == max_runs)
+            return -1;
+        p++;
+        run[n] = n ? v + 1 : v;
+        n++;
+    }
+    /* Some recorded lines end with more than the one space after a run */
+    if (*p == ' ')
+        while (p[f->pad + 1] == ' ' && f->pad < REFGEN_PAD_MAX)
+            f->pad++;
+    return n;
+}
+
+static uint32_t refgen_rand(uint64_t *s)
+{
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return (*s * 0x2545f4914f6cdd1dull) >> 32;
+}
+
+void refgen_random(uint64_t *rng, struct refgen_frame *f)
+{
+    struct canfd_frame *cf = &f->cf;
+    bool ext = refgen_rand(rng) & 1;
+    bool flag = refgen_rand(rng) & 1;
+
+    memset(f, 0, sizeof(*f));
+    f->fdf = refgen_rand(rng) & 1;
+    if (f->fdf) {
+        if (flag)
+            cf->flags |= CANFD_BRS;
+        cf->len = refgen_lens[refgen_rand(rng) % (flag ? 16 : 11)];
+    } else if (flag) {
+        cf->can_id |= CAN_RTR_FLAG;
+    } else {
+        cf->len = refgen_lens[refgen_rand(rng) % 9];
+    }
+    if (ext)
+        cf->can_id |= CAN_EFF_FLAG | (refgen_rand(rng) & CAN_EFF_MASK);
+    else
+        cf->can_id |= refgen_rand(rng) & CAN_SFF_MASK;
+    for (unsigned i = 0; i < cf->len; i += 4) {
+        uint32_t r = refgen_rand(rng);
+
+        memcpy(&cf->data[i], &r, cf->len - i < 4 ? cf->len - i : 4);
+    }
+}
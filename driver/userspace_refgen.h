@@ -0,0 +1,98 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#pragma once
+
+#include "userspace_utils.h"
+#include "userspace_bitstream.h"
+
+/*
+ * Reference bit sequences as recorded by tools/Kvaser_logger, computed
+ * instead of captured: the input of test/reference/tb_reference.vhd.
+ *
+ * The logger samples the bus at cfg.clk_freq for cfg.samples samples,
+ * triggered on SOF after cfg.pretrigger idle samples, and stores one line
+ * per frame: the frame fields as written by store_frame_info(), then
+ * "Bit sequence: " and "<count> <level> " pairs. Level 1 is dominant. The
+ * first count is the number of samples, every later one is one less (the
+ * way data_processor.c counts). Runs here are plain sample counts of
+ * alternating levels starting with recessive; they sum to cfg.samples.
+ *
+ * The frame is encoded by can_bitstream_encode() and acknowledged. The bit
+ * rate switches at the sample points of BRS and of the CRC delimiter, so
+ * those two bits are partly nominal and partly data bit long. The ACK of
+ * the receiver comes cfg.ack_delay samples late (its loop delay).
+ */
+
+#define REFGEN_MAX_RUNS     (CAN_BITSTREAM_MAX + 2)
+#define REFGEN_PAD_MAX      16
+#define REFGEN_LINE_LEN(n)  (288 + REFGEN_PAD_MAX + (n) * 14)
+#define REFGEN_LINE_MAX     REFGEN_LINE_LEN(REFGEN_MAX_RUNS)
+
+struct refgen_config {
+    uint32_t clk_freq;          /* Samples per second */
+    uint32_t bitrate;
+    uint32_t dbitrate;
+    unsigned sp;                /* Nominal sample point, per mille */
+    unsigned dsp;               /* Data sample point, per mille */
+    unsigned pretrigger;        /* Idle samples before SOF */
+    unsigned samples;           /* Per frame */
+    unsigned ack_delay;         /* Samples */
+    bool iso;                   /* ISO CAN FD */
+};
+
+/* The fields store_frame_info() records */
+struct refgen_frame {
+    struct canfd_frame cf;
+    bool fdf;
+    unsigned pad;               /* Extra spaces before the newline, up to REFGEN_PAD_MAX */
+};
+
+void refgen_config_defaults(struct refgen_config *cfg);
+
+/*
+ * Sample runs of @f into @run (REFGEN_MAX_RUNS). A frame longer than
+ * cfg.samples is cut there. Returns the number of runs.
+ */
+unsigned refgen_runs(const struct refgen_config *cfg, const struct refgen_frame *f,
+                     uint32_t *run);
+
+/* The logger's line for @f and its runs, with newline. Returns its length. */
+size_t refgen_format(char *buf, const struct refgen_frame *f,
+                     const uint32_t *run, unsigned n);
+
+/*
+ * Parse a logger line: frame fields into @f, runs into @run if not NULL.
+ * Returns the number of runs, -1 if the line is malformed.
+ */
+int refgen_parse(const char *line, struct refgen_frame *f, uint32_t *run,
+                 unsigned max_runs);
+
+/* Random frame with the distribution of the logger's generate_can_frame() */
+void refgen_random(uint64_t *rng, struct refgen_frame *f);
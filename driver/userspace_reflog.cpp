@@ -0,0 +1,261 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#include "userspace_reflog.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+void reflog_header(uint8_t *buf)
+{
+    memcpy(buf, REFLOG_MAGIC, REFLOG_HDR_SIZE);
+}
+
+static inline uint8_t *reflog_put_varint(uint8_t *p, uint32_t v)
+{
+    while (v >= 0x80) {
+        *p++ = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+size_t reflog_encode(uint8_t *buf, const struct refgen_frame *f,
+                     const uint32_t *run, unsigned n)
+{
+    const struct canfd_frame *cf = &f->cf;
+    bool ext = cf->can_id & CAN_EFF_FLAG;
+    uint8_t *p = buf;
+
+    *p++ = (f->fdf ? REFLOG_FDF : 0) | (ext ? REFLOG_EFF : 0) |
+           (!f->fdf && (cf->can_id & CAN_RTR_FLAG) ? REFLOG_RTR : 0) |
+           (f->fdf && (cf->flags & CANFD_BRS) ? REFLOG_BRS : 0) |
+           (f->pad ? REFLOG_PAD : 0);
+    *p++ = cf->len;
+    p = reflog_put_varint(p, cf->can_id & (ext ? CAN_EFF_MASK : CAN_SFF_MASK));
+    memcpy(p, cf->data, cf->len);
+    p += cf->len;
+    p = reflog_put_varint(p, n);
+    for (unsigned i = 0; i < n; i++)
+        p = reflog_put_varint(p, i ? run[i] - 1 : run[i]);
+    if (f->pad)
+        p = reflog_put_varint(p, f->pad);
+    return p - buf;
+}
+
+bool reflog_detect(const char *path)
+{
+    char magic[REFLOG_HDR_SIZE];
+    int fd = open(path, O_RDONLY);
+    bool res;
+
+    if (fd < 0)
+        return false;
+    res = pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+          !memcmp(magic, REFLOG_MAGIC, sizeof(magic));
+    close(fd);
+    return res;
+}
+
+int reflog_open(struct reflog_reader *r, const char *path)
+{
+    struct stat st;
+    void *map;
+
+    memset(r, 0, sizeof(*r));
+    r->fd = open(path, O_RDONLY);
+    if (r->fd < 0) {
+        warn("reflog: %s", path);
+        return -1;
+    }
+    if (fstat(r->fd, &st) < 0 || (size_t)st.st_size < REFLOG_HDR_SIZE) {
+        warnx("reflog: %s: not a binary data set", path);
+        goto fail;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED | MAP_POPULATE, r->fd, 0);
+    if (map == MAP_FAILED) {
+        warn("reflog: mmap %s", path);
+        goto fail;
+    }
+    r->map = (const uint8_t *)map;
+    r->size = st.st_size;
+    if (memcmp(r->map, REFLOG_MAGIC, REFLOG_HDR_SIZE)) {
+        warnx("reflog: %s: not a binary data set", path);
+        goto fail;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    r->pos = r->map + REFLOG_HDR_SIZE;
+    return 0;
+
+fail:
+    reflog_close(r);
+    return -1;
+}
+
+/* Up to 32 bits, *bad is set on a truncated or longer varint */
+static inline uint32_t reflog_get_varint(const uint8_t **pp, const uint8_t *end, bool *bad)
+{
+    const uint8_t *p = *pp;
+    uint32_t v = 0;
+
+    for (unsigned shift = 0; p < end && shift < 35; shift += 7) {
+        uint8_t b = *p++;
+
+        v |= (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *pp = p;
+            return v;
+        }
+    }
+    *bad = true;
+    return 0;
+}
+
+/* Varint of one or two bytes of @w, from bit @s to the byte at bit @e, as samples */
+static inline uint32_t reflog_run(uint64_t w, unsigned s, unsigned e)
+{
+    return ((w >> s & 0x7f) | ((w >> e & 0x7f) << 7 & -(uint32_t)(e != s))) + 1;
+}
+
+int reflog_next(struct reflog_reader *r, struct refgen_frame *f, uint32_t *run,
+                unsigned max_runs)
+{
+    struct canfd_frame *cf = &f->cf;
+    const uint8_t *p = r->pos, *end = r->map + r->size;
+    bool bad = false;
+    uint32_t id, n;
+    uint8_t flags;
+
+    memset(f, 0, sizeof(*f));
+    if (end - p < 2)
+        return -1;
+    flags = p[0];
+    cf->len = p[1];
+    p += 2;
+    f->fdf = flags & REFLOG_FDF;
+    if (flags & ~(REFLOG_FDF | REFLOG_EFF | REFLOG_RTR | REFLOG_BRS | REFLOG_PAD) ||
+        cf->len > (f->fdf ? CANFD_MAX_DLEN : CAN_MAX_DLEN))
+        return -1;
+    id = reflog_get_varint(&p, end, &bad);
+    if (bad || id > (flags & REFLOG_EFF ? CAN_EFF_MASK : CAN_SFF_MASK) ||
+        (size_t)(end - p) < cf->len)
+        return -1;
+    cf->can_id = id | (flags & REFLOG_EFF ? CAN_EFF_FLAG : 0) |
+                 (flags & REFLOG_RTR ? CAN_RTR_FLAG : 0);
+    if (flags & REFLOG_BRS)
+        cf->flags |= CANFD_BRS;
+    memcpy(cf->data, p, cf->len);
+    p += cf->len;
+
+    n = reflog_get_varint(&p, end, &bad);
+    if (bad || (run && n > max_runs))
+        return -1;
+    if (run) {
+        uint32_t i = 0;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        /*
+         * Four runs from eight bytes while they are short: a varint ends at
+         * a byte without bit 7, so the four are found without waiting for
+         * each other's length, and without a branch on it. Runs below 16384
+         * samples take one or two bytes.
+         */
+        while (n - i >= 4 && end - p >= 8) {
+            uint64_t w, t0, t1, t2, t3;
+            unsigned e0, e1, e2, e3;
+
+            memcpy(&w, p, sizeof(w));
+            t0 = ~w & 0x8080808080808080ull;
+            t1 = t0 & (t0 - 1);
+            t2 = t1 & (t1 - 1);
+            t3 = t2 & (t2 - 1);
+            if (!t3)
+                break;
+            e0 = __builtin_ctzll(t0) - 7;
+            e1 = __builtin_ctzll(t1) - 7;
+            e2 = __builtin_ctzll(t2) - 7;
+            e3 = __builtin_ctzll(t3) - 7;
+            if (e0 > 8 || e1 - e0 > 16 || e2 - e1 > 16 || e3 - e2 > 16)
+                break;
+            run[i] = reflog_run(w, 0, e0);
+            run[i + 1] = reflog_run(w, e0 + 8, e1);
+            run[i + 2] = reflog_run(w, e1 + 8, e2);
+            run[i + 3] = reflog_run(w, e2 + 8, e3);
+            i += 4;
+            p += e3 / 8 + 1;
+        }
+#endif
+        for (; i < n; i++)
+            run[i] = reflog_get_varint(&p, end, &bad) + 1;
+        /* The first count is the number of samples, later ones one less */
+        if (n)
+            run[0]--;
+    } else {
+        uint32_t i = 0;
+
+        /* Only the ends of the varints, eight bytes at a time */
+        while (end - p >= 8) {
+            uint64_t w;
+            uint32_t ends;
+
+            memcpy(&w, p, sizeof(w));
+            ends = ((~w & 0x8080808080808080ull) >> 7) * 0x0101010101010101ull >> 56;
+            if (ends >= n - i)
+                break;
+            i += ends;
+            p += 8;
+        }
+        for (; i < n && !bad; i++, p++) {
+            while (p < end && (*p & 0x80))
+                p++;
+            bad = p == end;
+        }
+    }
+    if (flags & REFLOG_PAD) {
+        f->pad = reflog_get_varint(&p, end, &bad);
+        if (f->pad > REFGEN_PAD_MAX)
+            bad = true;
+    }
+    if (bad)
+        return -1;
+    r->pos = p;
+    return n;
+}
+
+void reflog_close(struct reflog_reader *r)
+{
+    if (r->map)
+        munmap((void *)r->map, r->size);
+    if (r->fd >= 0)
+        close(r->fd);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
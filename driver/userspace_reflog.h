@@ -0,0 +1,104 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#pragma once
+
+#include "userspace_utils.h"
+#include "userspace_refgen.h"
+
+/*
+ * Binary form of the reference data sets of tools/Kvaser_logger (the text
+ * format is described in userspace_refgen.h). A file is an 8 byte magic
+ * followed by one record per frame:
+ *
+ *   u8      FDF | EFF << 1 | RTR << 2 | BRS << 3 | PAD << 4
+ *   u8      data length in bytes
+ *   varint  CAN ID
+ *   u8[]    data, only the valid bytes
+ *   varint  number of runs
+ *   varint  runs, the counts of the text format
+ *   varint  with PAD only: extra spaces before the newline (refgen_frame.pad)
+ *
+ * Varints are LEB128 (7 bits per byte, low first). Runs alternate starting
+ * with level 0, as in the text. The reference data sets take about 5.3
+ * times less space than as text, and a record is decoded without any
+ * number formatting. Lines in the spacing of store_frame_info(), with
+ * the extra trailing spaces some recorded lines have, convert to binary
+ * and back byte for byte.
+ *
+ * The reader mmaps the file and walks it record by record.
+ */
+
+#define REFLOG_MAGIC        "CTUREFB1"
+#define REFLOG_HDR_SIZE     8
+#define REFLOG_REC_MAX(n)   (2 + 5 + CANFD_MAX_DLEN + 5 + 5 * (n) + 5)
+
+#define REFLOG_FDF          0x01
+#define REFLOG_EFF          0x02
+#define REFLOG_RTR          0x04
+#define REFLOG_BRS          0x08
+#define REFLOG_PAD          0x10
+
+/* The magic, REFLOG_HDR_SIZE bytes into @buf */
+void reflog_header(uint8_t *buf);
+
+/*
+ * Record of @f and its @n runs (sample counts, as from refgen_runs() or
+ * refgen_parse()) into @buf of REFLOG_REC_MAX(@n) bytes. Returns its length.
+ */
+size_t reflog_encode(uint8_t *buf, const struct refgen_frame *f,
+                     const uint32_t *run, unsigned n);
+
+/* True if the file at @path starts with REFLOG_MAGIC */
+bool reflog_detect(const char *path);
+
+struct reflog_reader {
+    int fd;
+    const uint8_t *map;
+    size_t size;
+    const uint8_t *pos;
+};
+
+/* mmap a binary data set. Returns -1 if it cannot be opened or is not one. */
+int reflog_open(struct reflog_reader *r, const char *path);
+
+static inline bool reflog_end(const struct reflog_reader *r)
+{
+    return r->pos == r->map + r->size;
+}
+
+/*
+ * Decode the next record like refgen_parse(): frame fields into @f, runs
+ * into @run if not NULL. Returns the number of runs, -1 if the record is
+ * malformed or has more than @max_runs runs.
+ */
+int reflog_next(struct reflog_reader *r, struct refgen_frame *f, uint32_t *run,
+                unsigned max_runs);
+
+void reflog_close(struct reflog_reader *r);
@@ -0,0 +1,348 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#include "userspace_replay.h"
+#include "userspace_rxpoll.h"
+
+#include <sched.h>
+#include <time.h>
+
+#define ECHO_TIMEOUT_NS 10000000ull     /* Wait for last echoes */
+#define MAX_SLEEP_NS    100000000ull    /* Check stop at least this often */
+
+void replay_config_defaults(struct replay_config *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->speed = 1.0;
+    cfg->ts_freq = 100000000;
+    cfg->start_ms = 20;
+    cfg->spin_us = 100;
+    cfg->cpu = -1;
+}
+
+void replay_init(struct replay *rp, struct ctucan_hw_priv *priv,
+                 const struct replay_config *cfg, struct canlog_iter *it,
+                 uint32_t log_freq)
+{
+    memset(&rp->stats, 0, sizeof(rp->stats));
+    userspace_hist_init(&rp->stats.dev);
+    rp->priv = priv;
+    rp->cfg = *cfg;
+    rp->it = it;
+    rp->log_freq = log_freq ? log_freq : cfg->ts_freq;
+    rp->have_first = rp->log_done = false;
+    rp->scale = (double)cfg->ts_freq / rp->log_freq / cfg->speed;
+    rp->nbufs = CTU_CAN_FD_TXT_BUFFER_COUNT;
+    rp->loaded = rp->released = rp->completed = 0;
+    rp->echo_head = rp->echo_count = 0;
+    rp->stop = false;
+
+    if (cfg->echo_ts) {
+        struct can_ctrlmode mode = {CAN_CTRLMODE_LOOPBACK, CAN_CTRLMODE_LOOPBACK};
+
+        ctucan_hw_set_mode_reg(priv, &mode);
+        ctucan_hw_set_rx_tsop(priv, RTS_BEG);
+    }
+}
+
+static uint64_t ticks_ns(const struct replay *rp, u64 ticks)
+{
+    return (uint64_t)((double)ticks * 1e9 / rp->cfg.ts_freq);
+}
+
+/* Load the next frames of the log into free TXT buffers */
+static void replay_fill(struct replay *rp)
+{
+    while (!rp->log_done && rp->loaded - rp->completed < rp->nbufs) {
+        unsigned buf = rp->loaded % rp->nbufs;
+        struct replay_slot *s = &rp->slot[buf];
+        u64 lts;
+
+        if (!canlog_iter_next(rp->it, &s->cf, &s->fdf, &lts)) {
+            rp->log_done = true;
+            break;
+        }
+        if (!rp->have_first) {
+            rp->log_first = lts;
+            rp->start = ctucan_hw_read_timestamp(rp->priv) +
+                        (u64)rp->cfg.start_ms * rp->cfg.ts_freq / 1000;
+            rp->have_first = true;
+        }
+        s->target = rp->start;
+        if (lts > rp->log_first)
+            s->target += (u64)((double)(lts - rp->log_first) * rp->scale);
+        s->seq = rp->stats.frames++;
+        s->failed = false;
+        if (!ctucan_hw_insert_frame(rp->priv, &s->cf, s->target, buf, s->fdf)) {
+            rp->stats.failed++;
+            continue;
+        }
+        rp->loaded++;
+    }
+}
+
+/* Buffers in frame order get descending priority */
+static void replay_set_priorities(struct replay *rp)
+{
+    u8 prio[CTU_CAN_FD_TXT_BUFFER_COUNT] = {0};
+
+    for (unsigned k = 0; k < rp->nbufs; k++)
+        prio[(rp->completed + k) % rp->nbufs] = 7 - k;
+    ctucan_hw_set_txt_priority(rp->priv, prio);
+}
+
+static void replay_account(struct replay *rp, const struct replay_slot *s, u64 actual)
+{
+    struct replay_stats *st = &rp->stats;
+    int64_t dev = (int64_t)(actual - s->target);
+
+    if (!st->dev.count || dev < st->dev_min)
+        st->dev_min = dev;
+    if (!st->dev.count || dev > st->dev_max)
+        st->dev_max = dev;
+    st->dev_sum += dev;
+    if (dev < 0)
+        st->early++;
+    userspace_hist_add(&st->dev, dev < 0 ? -dev : dev);
+    if (rp->cfg.frames)
+        fprintf(rp->cfg.frames, "%llu %llu %llu %+lld %x\n",
+                (unsigned long long)s->seq, (unsigned long long)s->target,
+                (unsigned long long)actual,
+                (long long)(dev < 0 ? -(int64_t)ticks_ns(rp, -dev) : (int64_t)ticks_ns(rp, dev)),
+                s->cf.can_id);
+}
+
+/* Set ready every loaded buffer whose target is reached */
+static void replay_release(struct replay *rp, u64 now)
+{
+    u64 lead = (u64)rp->cfg.lead_ns * rp->cfg.ts_freq / 1000000000u;
+    u64 late = (u64)rp->cfg.spin_us * rp->cfg.ts_freq / 1000000u;
+    bool prio_set = false;
+
+    while (rp->released < rp->loaded) {
+        unsigned buf = rp->released % rp->nbufs;
+        struct replay_slot *s = &rp->slot[buf];
+
+        if (now + lead < s->target)
+            break;
+        if (!prio_set) {
+            replay_set_priorities(rp);
+            prio_set = true;
+        }
+        ctucan_hw_txt_set_rdy(rp->priv, buf);
+        s->release = now;
+        if (now > s->target + late)
+            rp->stats.late_releases++;
+        if (rp->cfg.echo_ts) {
+            unsigned tail;
+
+            if (rp->echo_count == REPLAY_ECHO_RING) {
+                rp->echo_head = (rp->echo_head + 1) % REPLAY_ECHO_RING;
+                rp->echo_count--;
+                rp->stats.lost_echoes++;
+            }
+            tail = (rp->echo_head + rp->echo_count) % REPLAY_ECHO_RING;
+            rp->echo[tail] = *s;
+            rp->echo_count++;
+        }
+        rp->released++;
+    }
+}
+
+/* Mark the echo of a failed frame as not coming */
+static void replay_echo_failed(struct replay *rp, uint64_t seq)
+{
+    for (unsigned i = 0; i < rp->echo_count; i++) {
+        struct replay_slot *e = &rp->echo[(rp->echo_head + i) % REPLAY_ECHO_RING];
+
+        if (e->seq == seq) {
+            e->failed = true;
+            return;
+        }
+    }
+}
+
+static void replay_echo_pop(struct replay *rp)
+{
+    rp->echo_head = (rp->echo_head + 1) % REPLAY_ECHO_RING;
+    rp->echo_count--;
+}
+
+static void replay_poll_echo(struct replay *rp)
+{
+    u32 n = ctucan_hw_get_rx_frame_count(rp->priv);
+
+    while (n--) {
+        struct canfd_frame cf;
+        unsigned i;
+        u64 ts;
+
+        ctucan_hw_read_rx_frame(rp->priv, &cf, &ts);
+        while (rp->echo_count && rp->echo[rp->echo_head].failed)
+            replay_echo_pop(rp);
+        /* Echoes come in TX order, earlier unmatched ones were lost */
+        for (i = 0; i < rp->echo_count; i++) {
+            const struct replay_slot *e = &rp->echo[(rp->echo_head + i) % REPLAY_ECHO_RING];
+
+            if (!e->failed && e->cf.can_id == cf.can_id && e->cf.len == cf.len &&
+                !memcmp(e->cf.data, cf.data, (cf.can_id & CAN_RTR_FLAG) ? 0 : cf.len))
+                break;
+        }
+        if (i == rp->echo_count) {
+            rp->stats.foreign++;
+            continue;
+        }
+        for (; i; i--) {
+            if (!rp->echo[rp->echo_head].failed)
+                rp->stats.lost_echoes++;
+            replay_echo_pop(rp);
+        }
+        rp->stats.echoes++;
+        replay_account(rp, &rp->echo[rp->echo_head], ts);
+        replay_echo_pop(rp);
+    }
+}
+
+/* Retire finished buffers in frame order */
+static void replay_collect(struct replay *rp)
+{
+    union ctu_can_fd_tx_status txs;
+
+    if (rp->completed < rp->released) {
+        txs.u32 = rp->priv->read_reg(rp->priv, CTU_CAN_FD_TX_STATUS);
+        while (rp->completed < rp->released) {
+            unsigned buf = rp->completed % rp->nbufs;
+            unsigned st = (txs.u32 >> (4 * buf)) & 0xf;
+            struct replay_slot *s = &rp->slot[buf];
+
+            if (st != TXT_TOK && st != TXT_ERR && st != TXT_ABT)
+                break;
+            if (st == TXT_TOK) {
+                rp->stats.sent++;
+                if (!rp->cfg.echo_ts)
+                    replay_account(rp, s, s->release);
+            } else {
+                rp->stats.failed++;
+                if (rp->cfg.echo_ts)
+                    replay_echo_failed(rp, s->seq);
+            }
+            rp->completed++;
+        }
+    }
+    if (rp->cfg.echo_ts)
+        replay_poll_echo(rp);
+}
+
+static uint64_t mono_ns(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+static void sleep_ns(uint64_t ns)
+{
+    struct timespec t;
+
+    t.tv_sec = ns / 1000000000ull;
+    t.tv_nsec = ns % 1000000000ull;
+    clock_nanosleep(CLOCK_MONOTONIC, 0, &t, NULL);
+}
+
+void replay_run(struct replay *rp)
+{
+    uint64_t spin_ns = rp->cfg.spin_us * 1000ull;
+    u64 lead = (u64)rp->cfg.lead_ns * rp->cfg.ts_freq / 1000000000u;
+    uint64_t drain_since = 0;
+
+    if (rp->cfg.cpu >= 0 || rp->cfg.rt_prio > 0)
+        rxpoll_pin_thread(rp->cfg.cpu, rp->cfg.rt_prio);
+
+    while (!rp->stop.load(std::memory_order_relaxed)) {
+        u64 now;
+
+        replay_collect(rp);
+        replay_fill(rp);
+        if (rp->log_done && rp->completed == rp->loaded) {
+            if (!rp->echo_count)
+                break;
+            if (!drain_since)
+                drain_since = mono_ns();
+            else if (mono_ns() - drain_since > ECHO_TIMEOUT_NS)
+                break;
+        }
+
+        now = ctucan_hw_read_timestamp(rp->priv);
+        replay_release(rp, now);
+        if (rp->released < rp->loaded) {
+            u64 due = rp->slot[rp->released % rp->nbufs].target - lead;
+            uint64_t wait = due > now ? ticks_ns(rp, due - now) : 0;
+
+            if (wait > spin_ns) {
+                wait -= spin_ns;
+                sleep_ns(wait < MAX_SLEEP_NS ? wait : MAX_SLEEP_NS);
+            }
+        } else {
+            /* Frames on the bus, their buffers are needed for the next ones */
+            sched_yield();
+        }
+    }
+
+    /* Stopped early: do not leave ready buffers behind */
+    for (; rp->completed < rp->released; rp->completed++)
+        ctucan_hw_txt_set_abort(rp->priv, rp->completed % rp->nbufs);
+    for (unsigned i = 0; i < rp->echo_count; i++)
+        if (!rp->echo[(rp->echo_head + i) % REPLAY_ECHO_RING].failed)
+            rp->stats.lost_echoes++;
+    rp->echo_count = 0;
+}
+
+void replay_report(const struct replay *rp, FILE *f)
+{
+    const struct replay_stats *st = &rp->stats;
+    double us = 1e6 / rp->cfg.ts_freq;
+
+    fprintf(f, "replay: %llu frames at speed %g, %llu sent, %llu failed, "
+               "%llu released late\n",
+            (unsigned long long)st->frames, rp->cfg.speed,
+            (unsigned long long)st->sent, (unsigned long long)st->failed,
+            (unsigned long long)st->late_releases);
+    if (rp->cfg.echo_ts)
+        fprintf(f, "replay: %llu echoed frames, %llu echoes lost, %llu foreign frames\n",
+                (unsigned long long)st->echoes, (unsigned long long)st->lost_echoes,
+                (unsigned long long)st->foreign);
+    if (!st->dev.count)
+        return;
+    fprintf(f, "replay: %s deviation min %+.3f avg %+.3f max %+.3f us, %llu early\n",
+            rp->cfg.echo_ts ? "SOF" : "release",
+            st->dev_min * us, (double)st->dev_sum / st->dev.count * us,
+            st->dev_max * us, (unsigned long long)st->early);
+    userspace_hist_print(f, "replay |deviation|", &st->dev, 1000000, rp->cfg.ts_freq, "us");
+}
@@ -0,0 +1,129 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#pragma once
+
+#include "userspace_utils.h"
+#include "userspace_hist.h"
+#include "userspace_canlog.h"
+
+#include <atomic>
+
+/*
+ * Replay of a recorded log (userspace_canlog.h) with its original timing.
+ *
+ * Every frame gets a target time on the core's TIMESTAMP counter: the
+ * start of replay plus its offset in the recording, scaled by speed. The
+ * next frames are kept loaded in all TXT buffers, in recording order, with
+ * the target in the buffer timestamp words. This core has no time
+ * triggered transmission, so a buffer is set ready when TIMESTAMP reaches
+ * its target (minus lead_ns); the thread sleeps until spin_us before that
+ * and then busy-polls the counter. TX_PRIORITY follows the buffer order, so
+ * frames which are due together go out back-to-back in recording order.
+ *
+ * Deviation is the actual start of frame minus the target. With echo_ts the
+ * core's internal loopback is enabled and the SOF timestamps of the echoed
+ * frames are used; without it, the time the buffer was set ready, which
+ * misses bus access delay.
+ */
+
+struct replay_config {
+    double speed;               /* 2.0 replays twice as fast */
+    uint32_t ts_freq;           /* Core timestamp counter frequency in Hz */
+    unsigned start_ms;          /* Delay from start to the first frame */
+    unsigned lead_ns;           /* Set ready this much before the target */
+    unsigned spin_us;           /* Busy-poll TIMESTAMP this long before due */
+    bool echo_ts;               /* Deviation from loopback SOF timestamps */
+    int cpu;                    /* CPU to pin to, -1 = no pinning */
+    int rt_prio;                /* SCHED_FIFO priority, 0 = keep policy */
+    FILE *frames;               /* Per frame deviation lines, NULL = none */
+};
+
+struct replay_slot {
+    struct canfd_frame cf;
+    bool fdf;
+    uint64_t seq;
+    u64 target;                 /* Core ticks */
+    u64 release;                /* TIMESTAMP when set ready */
+    bool failed;                /* TX error, no echo will come */
+};
+
+#define REPLAY_ECHO_RING    64
+
+struct replay_stats {
+    uint64_t frames;            /* Read from the log */
+    uint64_t sent;
+    uint64_t failed;
+    uint64_t late_releases;     /* Set ready more than spin_us after the target */
+    uint64_t echoes;
+    uint64_t lost_echoes;
+    uint64_t foreign;           /* RX frames other than the echoes */
+    int64_t dev_min, dev_max;   /* Ticks */
+    int64_t dev_sum;
+    uint64_t early;             /* Frames which started before the target */
+    struct userspace_hist dev;  /* |deviation| in ticks */
+};
+
+struct replay {
+    struct ctucan_hw_priv *priv;
+    struct replay_config cfg;
+    struct canlog_iter *it;
+    uint32_t log_freq;
+    bool have_first, log_done;
+    u64 log_first, start;
+    double scale;               /* Log ticks to core ticks */
+
+    /* Buffer of frame k is k % nbufs, loaded >= released >= completed */
+    unsigned nbufs;
+    uint64_t loaded, released, completed;
+    struct replay_slot slot[CTU_CAN_FD_TXT_BUFFER_COUNT];
+
+    /* Sent frames waiting for their loopback echo */
+    struct replay_slot echo[REPLAY_ECHO_RING];
+    unsigned echo_head, echo_count;
+
+    std::atomic<bool> stop;
+    struct replay_stats stats;
+};
+
+void replay_config_defaults(struct replay_config *cfg);
+
+/*
+ * Prepare replay of frames from @it (log opened with timestamp frequency
+ * @log_freq) on @priv, which has to be configured and enabled. Enables
+ * loopback for echo_ts.
+ */
+void replay_init(struct replay *rp, struct ctucan_hw_priv *priv,
+                 const struct replay_config *cfg, struct canlog_iter *it,
+                 uint32_t log_freq);
+
+/* Replay until the log ends or rp->stop is set */
+void replay_run(struct replay *rp);
+
+void replay_report(const struct replay *rp, FILE *f);
@@ -0,0 +1,142 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define USERSPACE_CACHELINE 64
+
+/*
+ * Lock-free single-producer / single-consumer ring.
+ *
+ * Head is written only by the producer and tail only by the consumer, each
+ * on its own cache line. Both sides keep a private copy of the other side's
+ * index and refresh it only when the ring looks full (producer) or empty
+ * (consumer), so in steady state every push/pop touches one shared line.
+ * Capacity is rounded up to a power of two.
+ */
+template <typename T>
+struct spsc_ring {
+    /* Producer side */
+    alignas(USERSPACE_CACHELINE) std::atomic<uint64_t> head;
+    uint64_t tail_cache;
+    uint64_t pushed;
+    uint64_t dropped;           /* Push attempts on a full ring */
+
+    /* Consumer side */
+    alignas(USERSPACE_CACHELINE) std::atomic<uint64_t> tail;
+    uint64_t head_cache;
+    uint64_t popped;
+    uint64_t batches;
+    uint64_t empty_reads;
+    uint64_t high_watermark;    /* Highest fill level seen by consumer */
+
+    /* Read-only after init */
+    alignas(USERSPACE_CACHELINE) uint64_t mask;
+    T *slots;
+};
+
+template <typename T>
+static inline int spsc_ring_init(struct spsc_ring<T> *r, uint64_t capacity)
+{
+    uint64_t size = 1;
+
+    while (size < capacity)
+        size <<= 1;
+
+    r->head = 0;
+    r->tail = 0;
+    r->tail_cache = 0;
+    r->head_cache = 0;
+    r->pushed = r->dropped = 0;
+    r->popped = r->batches = r->empty_reads = r->high_watermark = 0;
+    r->mask = size - 1;
+    if (posix_memalign((void **)&r->slots, USERSPACE_CACHELINE, size * sizeof(T)))
+        return -1;
+    memset((void *)r->slots, 0, size * sizeof(T));
+    return 0;
+}
+
+template <typename T>
+static inline void spsc_ring_free(struct spsc_ring<T> *r)
+{
+    free(r->slots);
+    r->slots = NULL;
+}
+
+/* Producer: copy one element in. Returns false and counts a drop if full. */
+template <typename T>
+static inline bool spsc_ring_push(struct spsc_ring<T> *r, const T *item)
+{
+    uint64_t head = r->head.load(std::memory_order_relaxed);
+
+    if (head - r->tail_cache > r->mask) {
+        r->tail_cache = r->tail.load(std::memory_order_acquire);
+        if (head - r->tail_cache > r->mask) {
+            r->dropped++;
+            return false;
+        }
+    }
+    r->slots[head & r->mask] = *item;
+    r->head.store(head + 1, std::memory_order_release);
+    r->pushed++;
+    return true;
+}
+
+/* Consumer: copy up to @max elements out. Returns number copied. */
+template <typename T>
+static inline unsigned spsc_ring_pop_batch(struct spsc_ring<T> *r, T *out,
+                                           unsigned max)
+{
+    uint64_t tail = r->tail.load(std::memory_order_relaxed);
+    uint64_t avail, i;
+
+    if (r->head_cache == tail) {
+        r->head_cache = r->head.load(std::memory_order_acquire);
+        if (r->head_cache == tail) {
+            r->empty_reads++;
+            return 0;
+        }
+    }
+    avail = r->head_cache - tail;
+    if (avail > r->high_watermark)
+        r->high_watermark = avail;
+    if (avail > max)
+        avail = max;
+    for (i = 0; i < avail; i++)
+        out[i] = r->slots[(tail + i) & r->mask];
+    r->tail.store(tail + avail, std::memory_order_release);
+    r->popped += avail;
+    r->batches++;
+    return (unsigned)avail;
+}
@@ -0,0 +1,212 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#include "userspace_rxpoll.h"
+#include "userspace_trace.h"
+
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
+
+void rxpoll_config_defaults(struct rxpoll_config *cfg)
+{
+    cfg->cpu = -1;
+    cfg->rt_prio = 0;
+    cfg->spin_polls = 1000;
+    cfg->pause_polls = 10000;
+    cfg->sleep_min_us = 10;
+    cfg->sleep_max_us = 100;
+    cfg->batch_max = 64;
+    cfg->ts_freq = 100000000;
+}
+
+int rxpoll_config_parse(struct rxpoll_config *cfg, const char *str)
+{
+    unsigned spin, pause, smin, smax;
+    int n;
+
+    n = sscanf(str, "%u,%u,%u,%u", &spin, &pause, &smin, &smax);
+    if (n < 3)
+        return -1;
+    if (n == 3)
+        smax = smin;
+    if (smax < smin)
+        return -1;
+
+    cfg->spin_polls = spin;
+    cfg->pause_polls = pause;
+    cfg->sleep_min_us = smin;
+    cfg->sleep_max_us = smax;
+    return 0;
+}
+
+void rxpoll_init(struct rxpoll *rp, struct ctucan_hw_priv *priv,
+                 const struct rxpoll_config *cfg)
+{
+    memset(&rp->stats, 0, sizeof(rp->stats));
+    userspace_hist_init(&rp->stats.latency);
+    userspace_hist_init(&rp->stats.batch);
+    rp->priv = priv;
+    rp->cfg = *cfg;
+    if (!rp->cfg.batch_max)
+        rp->cfg.batch_max = 1;
+    rp->stop = false;
+    rp->idle = 0;
+    rp->sleep_us = cfg->sleep_min_us;
+}
+
+int rxpoll_pin_thread(int cpu, int rt_prio)
+{
+    int res;
+
+    if (cpu >= 0) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        res = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (res) {
+            warnx("cannot pin poller to CPU %d: %s", cpu, strerror(res));
+            return -1;
+        }
+    }
+    if (rt_prio > 0) {
+        struct sched_param sp;
+
+        memset(&sp, 0, sizeof(sp));
+        sp.sched_priority = rt_prio;
+        res = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+        if (res) {
+            warnx("cannot set SCHED_FIFO %d: %s", rt_prio, strerror(res));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void rxpoll_backoff(struct rxpoll *rp)
+{
+    const struct rxpoll_config *cfg = &rp->cfg;
+
+    rp->idle++;
+    if (rp->idle <= cfg->spin_polls)
+        return;
+
+    if (rp->idle <= cfg->spin_polls + cfg->pause_polls) {
+        rp->stats.pauses++;
+        rxpoll_cpu_relax();
+        return;
+    }
+
+    rp->stats.sleeps++;
+    if (rp->sleep_us) {
+        struct timespec ts;
+
+        ts.tv_sec = rp->sleep_us / 1000000;
+        ts.tv_nsec = (rp->sleep_us % 1000000) * 1000;
+        nanosleep(&ts, NULL);
+        if (rp->sleep_us < cfg->sleep_max_us) {
+            rp->sleep_us *= 2;
+            if (rp->sleep_us > cfg->sleep_max_us)
+                rp->sleep_us = cfg->sleep_max_us;
+        }
+    } else {
+        sched_yield();
+    }
+}
+
+unsigned rxpoll_poll(struct rxpoll *rp, rxpoll_deliver_fn deliver, void *arg)
+{
+    struct ctucan_hw_priv *priv = rp->priv;
+    struct rxpoll_stats *st = &rp->stats;
+    unsigned nrxf, i;
+    u64 now;
+
+    st->polls++;
+    nrxf = ctucan_hw_get_rx_frame_count(priv);
+    if (!nrxf) {
+        rxpoll_backoff(rp);
+        return 0;
+    }
+
+    rp->idle = 0;
+    rp->sleep_us = rp->cfg.sleep_min_us;
+    st->hits++;
+    if (nrxf > rp->cfg.batch_max)
+        nrxf = rp->cfg.batch_max;
+
+    for (i = 0; i < nrxf; i++) {
+        struct canfd_frame cf;
+        u64 ts;
+
+        ctucan_hw_read_rx_frame(priv, &cf, &ts);
+        deliver(arg, &cf, ts);
+        /* RX timestamp to the handler returning, per frame */
+        now = ctucan_hw_read_timestamp(priv);
+        userspace_hist_add(&st->latency, now > ts ? now - ts : 0);
+    }
+    st->frames += nrxf;
+    userspace_hist_add(&st->batch, nrxf);
+
+    /* Overrun is cheap to check once per batch and worth knowing about */
+    {
+        union ctu_can_fd_status status = ctu_can_get_status(priv);
+
+        if (status.s.dor) {
+            st->overruns++;
+            ctucan_hw_clr_overrun_flag(priv);
+        }
+    }
+    return nrxf;
+}
+
+void rxpoll_run(struct rxpoll *rp, rxpoll_deliver_fn deliver, void *arg)
+{
+    rxpoll_pin_thread(rp->cfg.cpu, rp->cfg.rt_prio);
+    ctucan_trace_mark(rp->priv, "rxpoll");
+
+    while (!rp->stop.load(std::memory_order_relaxed))
+        rxpoll_poll(rp, deliver, arg);
+}
+
+void rxpoll_report(const struct rxpoll *rp, FILE *f)
+{
+    const struct rxpoll_stats *st = &rp->stats;
+    uint64_t freq = rp->cfg.ts_freq ? rp->cfg.ts_freq : 1;
+
+    fprintf(f, "rxpoll: %llu polls, %llu hits (%.3f %%), %llu frames, "
+               "%llu pauses, %llu sleeps, %llu overruns\n",
+            (unsigned long long)st->polls, (unsigned long long)st->hits,
+            st->polls ? 100.0 * st->hits / st->polls : 0.0,
+            (unsigned long long)st->frames, (unsigned long long)st->pauses,
+            (unsigned long long)st->sleeps, (unsigned long long)st->overruns);
+    userspace_hist_print(f, "rxpoll latency", &st->latency,
+                         1000000000ull, freq, "ns");
+    userspace_hist_print(f, "rxpoll batch", &st->batch, 1, 1, "frames");
+}
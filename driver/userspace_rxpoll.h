@@ -0,0 +1,120 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#pragma once
+
+#include "userspace_utils.h"
+#include "userspace_hist.h"
+
+#include <atomic>
+
+/*
+ * Busy-polling RX engine. The poller watches RX_STATUS.rxfrc and drains
+ * the RX FIFO with ctucan_hw_read_rx_frame. When the FIFO is empty it backs
+ * off adaptively: first it re-polls immediately ("spin"), then with a CPU
+ * relax hint between polls ("pause"), and finally it sleeps with the sleep
+ * time doubling from sleep_min_us up to sleep_max_us. Any received frame
+ * resets the backoff.
+ *
+ * Latency is measured with the core's own timestamp, RX timestamp to
+ * handler return, per frame: TIMESTAMP is read after each frame is
+ * delivered and the difference to its RX timestamp is recorded.
+ */
+
+struct rxpoll_config {
+    int cpu;                /* CPU to pin the poller to, -1 = no pinning */
+    int rt_prio;            /* SCHED_FIFO priority, 0 = keep policy */
+    unsigned spin_polls;    /* Empty polls before starting to pause */
+    unsigned pause_polls;   /* Empty polls with CPU relax before sleeping */
+    unsigned sleep_min_us;  /* First sleep when idle */
+    unsigned sleep_max_us;  /* Longest sleep when idle */
+    unsigned batch_max;     /* Max frames delivered per poll */
+    uint32_t ts_freq;       /* Timestamp counter frequency in Hz */
+};
+
+struct rxpoll_stats {
+    uint64_t polls;         /* RX_STATUS reads */
+    uint64_t hits;          /* Polls which found at least one frame */
+    uint64_t frames;
+    uint64_t pauses;
+    uint64_t sleeps;
+    uint64_t overruns;      /* Times STATUS.dor was seen set */
+    struct userspace_hist latency;  /* RX timestamp to handler return, in ticks */
+    struct userspace_hist batch;    /* Frames per successful poll */
+};
+
+typedef void (*rxpoll_deliver_fn)(void *arg, const struct canfd_frame *cf,
+                                  u64 ts);
+
+struct rxpoll {
+    struct ctucan_hw_priv *priv;
+    struct rxpoll_config cfg;
+    struct rxpoll_stats stats;
+    std::atomic<bool> stop;
+    unsigned idle;          /* Consecutive empty polls */
+    unsigned sleep_us;      /* Current sleep step */
+};
+
+/* Low latency defaults: spin for a while, never sleep longer than 100 us */
+void rxpoll_config_defaults(struct rxpoll_config *cfg);
+
+/*
+ * Parse backoff tuning in form "spin,pause,sleep_min_us[,sleep_max_us]".
+ * Returns 0 on success, -1 on malformed input.
+ */
+int rxpoll_config_parse(struct rxpoll_config *cfg, const char *str);
+
+void rxpoll_init(struct rxpoll *rp, struct ctucan_hw_priv *priv,
+                 const struct rxpoll_config *cfg);
+
+/* Pin calling thread to @cpu and optionally switch it to SCHED_FIFO */
+int rxpoll_pin_thread(int cpu, int rt_prio);
+
+/*
+ * One poll step: read frame count, deliver up to batch_max frames and apply
+ * backoff when nothing was pending. Returns number of delivered frames.
+ */
+unsigned rxpoll_poll(struct rxpoll *rp, rxpoll_deliver_fn deliver, void *arg);
+
+/* Pin according to config and poll until rp->stop is set */
+void rxpoll_run(struct rxpoll *rp, rxpoll_deliver_fn deliver, void *arg);
+
+/* Print hit rate, backoff counters and latency percentiles in ns */
+void rxpoll_report(const struct rxpoll *rp, FILE *f);
+
+static inline void rxpoll_cpu_relax(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#elif defined(__arm__) || defined(__aarch64__)
+    __asm__ __volatile__("yield" ::: "memory");
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
@@ -0,0 +1,108 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#include "userspace_rxring.h"
+
+static void rxring_push(void *arg, const struct canfd_frame *cf, u64 ts)
+{
+    struct rxring *rr = (struct rxring *)arg;
+    struct rxring_frame f;
+
+    f.ts = ts;
+    f.seq = rr->seq++;
+    f.cf = *cf;
+    spsc_ring_push(&rr->ring, &f);
+}
+
+static void *rxring_thread(void *arg)
+{
+    struct rxring *rr = (struct rxring *)arg;
+
+    rxpoll_run(&rr->poll, rxring_push, rr);
+    return NULL;
+}
+
+int rxring_start(struct rxring *rr, struct ctucan_hw_priv *priv,
+                 const struct rxpoll_config *cfg, unsigned capacity)
+{
+    int res;
+
+    if (spsc_ring_init(&rr->ring, capacity))
+        return -1;
+    rxpoll_init(&rr->poll, priv, cfg);
+    rr->seq = 0;
+    rr->next_seq = 0;
+    memset(&rr->cons, 0, sizeof(rr->cons));
+
+    res = pthread_create(&rr->thread, NULL, rxring_thread, rr);
+    if (res) {
+        warnx("cannot start RX poller thread: %s", strerror(res));
+        spsc_ring_free(&rr->ring);
+        return -1;
+    }
+    return 0;
+}
+
+void rxring_stop(struct rxring *rr)
+{
+    rr->poll.stop = true;
+    pthread_join(rr->thread, NULL);
+}
+
+unsigned rxring_read(struct rxring *rr, struct rxring_frame *out, unsigned max)
+{
+    unsigned n = spsc_ring_pop_batch(&rr->ring, out, max);
+
+    for (unsigned i = 0; i < n; i++) {
+        if (out[i].seq != rr->next_seq)
+            rr->cons.lost += out[i].seq - rr->next_seq;
+        rr->next_seq = out[i].seq + 1;
+    }
+    rr->cons.frames += n;
+    return n;
+}
+
+void rxring_report(const struct rxring *rr, FILE *f)
+{
+    const struct spsc_ring<struct rxring_frame> *r = &rr->ring;
+
+    fprintf(f, "rxring producer: %llu pushed, %llu dropped (ring full), "
+               "%llu HW overruns\n",
+            (unsigned long long)r->pushed, (unsigned long long)r->dropped,
+            (unsigned long long)rr->poll.stats.overruns);
+    fprintf(f, "rxring consumer: %llu frames in %llu batches, %llu lost, "
+               "%llu empty reads, high watermark %llu of %llu\n",
+            (unsigned long long)rr->cons.frames,
+            (unsigned long long)r->batches,
+            (unsigned long long)rr->cons.lost,
+            (unsigned long long)r->empty_reads,
+            (unsigned long long)r->high_watermark,
+            (unsigned long long)r->mask + 1);
+    rxpoll_report(&rr->poll, f);
+}
@@ -0,0 +1,77 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#pragma once
+
+#include "userspace_rxpoll.h"
+#include "userspace_ring.h"
+
+#include <pthread.h>
+
+/*
+ * Received frame as passed from the RX poller thread to consumers. Every
+ * frame read from the core gets a sequence number, including frames the
+ * poller had to drop, so the consumer sees exactly how many it missed.
+ */
+struct rxring_frame {
+    u64 ts;
+    u64 seq;
+    struct canfd_frame cf;
+};
+
+struct rxring_consumer_stats {
+    uint64_t frames;
+    uint64_t lost;              /* Sequence gaps seen by the consumer */
+};
+
+/*
+ * Poller thread draining one core into a SPSC ring. The poller uses the
+ * busy-poll engine, so its backoff and CPU pinning come from rxpoll_config.
+ */
+struct rxring {
+    struct spsc_ring<struct rxring_frame> ring;
+    struct rxpoll poll;
+    uint64_t seq;               /* Next sequence number, poller only */
+    uint64_t next_seq;          /* Expected sequence number, consumer only */
+    struct rxring_consumer_stats cons;
+    pthread_t thread;
+};
+
+/* Allocate ring of @capacity frames and start the poller thread */
+int rxring_start(struct rxring *rr, struct ctucan_hw_priv *priv,
+                 const struct rxpoll_config *cfg, unsigned capacity);
+
+/* Stop and join the poller thread. Frames left in the ring stay readable. */
+void rxring_stop(struct rxring *rr);
+
+/* Consumer: read up to @max frames. Returns number of frames read. */
+unsigned rxring_read(struct rxring *rr, struct rxring_frame *out, unsigned max);
+
+/* Print producer and consumer side accounting and poller statistics */
+void rxring_report(const struct rxring *rr, FILE *f);
@@ -0,0 +1,277 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#include "userspace_shm.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/stat.h>
+
+/*
+ * Shared fields are accessed with the __atomic builtins rather than through
+ * std::atomic, the layout is shared between processes and must stay plain.
+ */
+#define LOAD_ACQ(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define LOAD_RLX(p)     __atomic_load_n((p), __ATOMIC_RELAXED)
+#define STORE_REL(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define STORE_RLX(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+
+static void shmring_set_name(struct shmring *sr, const char *name)
+{
+    if (name[0] == '/')
+        snprintf(sr->name, sizeof(sr->name), "%s", name);
+    else
+        snprintf(sr->name, sizeof(sr->name), "/%s", name);
+}
+
+int shmring_create(struct shmring *sr, const char *name, unsigned capacity)
+{
+    uint32_t size = 1;
+    int fd;
+    void *mem;
+
+    while (size < capacity)
+        size <<= 1;
+
+    memset(sr, 0, sizeof(*sr));
+    shmring_set_name(sr, name);
+    sr->reader = -1;
+    sr->owner = true;
+    sr->map_size = sizeof(struct shmring_hdr) +
+                   (size_t)size * sizeof(struct shmring_slot);
+
+    shm_unlink(sr->name);
+    fd = shm_open(sr->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        warn("shm_open %s", sr->name);
+        return -1;
+    }
+    if (ftruncate(fd, sr->map_size) < 0) {
+        warn("ftruncate %s", sr->name);
+        close(fd);
+        shm_unlink(sr->name);
+        return -1;
+    }
+    mem = mmap(NULL, sr->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        warn("mmap %s", sr->name);
+        shm_unlink(sr->name);
+        return -1;
+    }
+
+    /* Fresh object is zero filled, readers check magic last */
+    sr->hdr = (struct shmring_hdr *)mem;
+    sr->hdr->version = SHMRING_VERSION;
+    sr->hdr->capacity = size;
+    sr->hdr->slot_size = sizeof(struct shmring_slot);
+    STORE_REL(&sr->hdr->magic, (uint32_t)SHMRING_MAGIC);
+    return 0;
+}
+
+void shmring_publish(struct shmring *sr, const struct canfd_frame *cf, u64 ts)
+{
+    struct shmring_hdr *hdr = sr->hdr;
+    uint64_t head = LOAD_RLX(&hdr->head);
+    struct shmring_slot *slot = &hdr->slots[head & (hdr->capacity - 1)];
+
+    STORE_RLX(&slot->seq, (uint64_t)0);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->ts = ts;
+    slot->cf = *cf;
+    STORE_REL(&slot->seq, head + 1);
+    STORE_REL(&hdr->head, head + 1);
+}
+
+static void shmring_claim(struct shmring *sr, int i)
+{
+    struct shmring_reader *rd = &sr->hdr->readers[i];
+
+    rd->frames = 0;
+    rd->dropped = 0;
+    rd->lag = 0;
+    rd->lag_max = 0;
+    STORE_REL(&rd->cursor, LOAD_ACQ(&sr->hdr->head));
+    sr->reader = i;
+}
+
+int shmring_attach(struct shmring *sr, const char *name)
+{
+    struct shmring_hdr *hdr;
+    struct stat st;
+    int fd;
+    void *mem;
+
+    memset(sr, 0, sizeof(*sr));
+    shmring_set_name(sr, name);
+    sr->reader = -1;
+
+    fd = shm_open(sr->name, O_RDWR, 0);
+    if (fd < 0) {
+        warn("shm_open %s", sr->name);
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct shmring_hdr)) {
+        warnx("%s: not a frame ring", sr->name);
+        close(fd);
+        return -1;
+    }
+    sr->map_size = st.st_size;
+    mem = mmap(NULL, sr->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        warn("mmap %s", sr->name);
+        return -1;
+    }
+    hdr = (struct shmring_hdr *)mem;
+    sr->hdr = hdr;
+
+    if (LOAD_ACQ(&hdr->magic) != SHMRING_MAGIC ||
+        hdr->version != SHMRING_VERSION ||
+        hdr->slot_size != sizeof(struct shmring_slot)) {
+        warnx("%s: incompatible frame ring", sr->name);
+        shmring_close(sr);
+        return -1;
+    }
+
+    for (int i = 0; i < SHMRING_MAX_READERS; i++) {
+        struct shmring_reader *rd = &hdr->readers[i];
+        uint32_t expected = 0;
+
+        if (!__atomic_compare_exchange_n(&rd->in_use, &expected, 1, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            continue;
+        STORE_REL(&rd->pid, (uint32_t)getpid());
+        shmring_claim(sr, i);
+        return 0;
+    }
+    /* All taken: take over a slot of a reader that died without closing */
+    for (int i = 0; i < SHMRING_MAX_READERS; i++) {
+        struct shmring_reader *rd = &hdr->readers[i];
+        uint32_t pid = LOAD_ACQ(&rd->pid);
+
+        /* pid 0: claimed, owner not written yet */
+        if (!pid || kill(pid, 0) == 0 || errno != ESRCH)
+            continue;
+        if (!__atomic_compare_exchange_n(&rd->pid, &pid, (uint32_t)getpid(), false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            continue;
+        shmring_claim(sr, i);
+        return 0;
+    }
+    warnx("%s: all %d reader slots are taken", sr->name, SHMRING_MAX_READERS);
+    shmring_close(sr);
+    return -1;
+}
+
+unsigned shmring_read(struct shmring *sr, struct canfd_frame *cf, u64 *ts,
+                      unsigned max)
+{
+    struct shmring_hdr *hdr = sr->hdr;
+    struct shmring_reader *rd = &hdr->readers[sr->reader];
+    uint64_t mask = hdr->capacity - 1;
+    uint64_t cursor = rd->cursor;
+    uint64_t head = LOAD_ACQ(&hdr->head);
+    uint64_t dropped = 0;
+    unsigned n = 0;
+
+    if (head - cursor > hdr->capacity) {
+        dropped += head - cursor - hdr->capacity;
+        cursor = head - hdr->capacity;
+    }
+    STORE_RLX(&rd->lag, head - cursor);
+    if (head - cursor > rd->lag_max)
+        STORE_RLX(&rd->lag_max, head - cursor);
+
+    while (n < max && cursor != head) {
+        struct shmring_slot *slot = &hdr->slots[cursor & mask];
+        uint64_t seq = LOAD_ACQ(&slot->seq);
+
+        if (seq == cursor + 1) {
+            ts[n] = slot->ts;
+            cf[n] = slot->cf;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (LOAD_RLX(&slot->seq) == seq) {
+                n++;
+                cursor++;
+                continue;
+            }
+        }
+        /* Publisher lapped us while copying, resynchronize */
+        head = LOAD_ACQ(&hdr->head);
+        if (head - cursor > mask) {
+            dropped += head - mask - cursor;
+            cursor = head - mask;
+        } else {
+            /* Slot not yet visible, try again on next call */
+            break;
+        }
+    }
+
+    STORE_REL(&rd->cursor, cursor);
+    STORE_RLX(&rd->frames, rd->frames + n);
+    if (dropped)
+        STORE_RLX(&rd->dropped, rd->dropped + dropped);
+    return n;
+}
+
+void shmring_close(struct shmring *sr)
+{
+    if (!sr->hdr)
+        return;
+    if (sr->reader >= 0) {
+        STORE_REL(&sr->hdr->readers[sr->reader].pid, (uint32_t)0);
+        STORE_REL(&sr->hdr->readers[sr->reader].in_use, (uint32_t)0);
+    }
+    munmap(sr->hdr, sr->map_size);
+    sr->hdr = NULL;
+    if (sr->owner)
+        shm_unlink(sr->name);
+}
+
+void shmring_report(const struct shmring *sr, FILE *f)
+{
+    const struct shmring_hdr *hdr = sr->hdr;
+    uint64_t head = LOAD_ACQ(&hdr->head);
+
+    fprintf(f, "shmring %s: %llu frames published, %u slots\n", sr->name,
+            (unsigned long long)head, hdr->capacity);
+    for (int i = 0; i < SHMRING_MAX_READERS; i++) {
+        const struct shmring_reader *rd = &hdr->readers[i];
+
+        if (!LOAD_ACQ(&rd->in_use))
+            continue;
+        fprintf(f, "  reader %d (pid %u): %llu frames, %llu dropped, "
+                   "lag %llu (max %llu)\n", i, rd->pid,
+                (unsigned long long)LOAD_RLX(&rd->frames),
+                (unsigned long long)LOAD_RLX(&rd->dropped),
+                (unsigned long long)(head - LOAD_ACQ(&rd->cursor)),
+                (unsigned long long)LOAD_RLX(&rd->lag_max));
+    }
+}
@@ -0,0 +1,113 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#pragma once
+
+#include "userspace_utils.h"
+#include "userspace_ring.h"
+
+/*
+ * Shared memory fan-out of received frames.
+ *
+ * One publisher process owns the core and writes frames into a ring in
+ * a POSIX shared memory object. Any number of reader processes (up to
+ * SHMRING_MAX_READERS) map the same object and follow the ring with their
+ * own cursor. The publisher never waits for readers: a slow reader is
+ * overrun and counts the frames it lost. Each slot carries its sequence
+ * number, written last, so a reader detects a slot that was overwritten
+ * while it was being copied.
+ *
+ * After shmring_attach() the reader does not need any syscalls, all
+ * state lives in the mapping. Per-reader lag and drop counters live there
+ * too, so the publisher can report them.
+ */
+
+#define SHMRING_MAGIC       0x43414e52  /* "CANR" */
+#define SHMRING_VERSION     1
+#define SHMRING_MAX_READERS 16
+
+struct shmring_slot {
+    uint64_t seq;               /* Sequence number + 1, 0 while written */
+    u64 ts;
+    struct canfd_frame cf;
+};
+
+struct shmring_reader {
+    alignas(USERSPACE_CACHELINE) uint32_t in_use;
+    uint32_t pid;               /* Owner, 0 when released */
+    uint64_t cursor;            /* Next sequence number to read */
+    uint64_t frames;
+    uint64_t dropped;
+    uint64_t lag;               /* Frames behind publisher at last read */
+    uint64_t lag_max;
+};
+
+struct shmring_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity;          /* Number of slots, power of two */
+    uint32_t slot_size;
+    alignas(USERSPACE_CACHELINE) uint64_t head;     /* Next sequence to publish */
+    struct shmring_reader readers[SHMRING_MAX_READERS];
+    alignas(USERSPACE_CACHELINE) struct shmring_slot slots[];
+};
+
+struct shmring {
+    struct shmring_hdr *hdr;
+    size_t map_size;
+    char name[64];
+    int reader;                 /* Reader index, -1 for publisher */
+    bool owner;                 /* Created the object, unlinks on close */
+};
+
+/* Publisher: create (or re-create) shared memory object @name */
+int shmring_create(struct shmring *sr, const char *name, unsigned capacity);
+
+/* Publisher: wait-free publication of one frame */
+void shmring_publish(struct shmring *sr, const struct canfd_frame *cf, u64 ts);
+
+/*
+ * Reader: map existing object and claim a reader slot, starting at head.
+ * When all slots are taken, a slot whose owner process no longer exists
+ * (a reader that died without shmring_close()) is taken over.
+ */
+int shmring_attach(struct shmring *sr, const char *name);
+
+/*
+ * Reader: copy up to @max frames. Frames overwritten before they could be
+ * read are skipped and counted as dropped. Returns number of frames read.
+ */
+unsigned shmring_read(struct shmring *sr, struct canfd_frame *cf, u64 *ts,
+                      unsigned max);
+
+/* Release reader slot (reader) or unlink the object (publisher), unmap */
+void shmring_close(struct shmring *sr);
+
+/* Print head and per-reader cursor, lag and drop counters */
+void shmring_report(const struct shmring *sr, FILE *f);
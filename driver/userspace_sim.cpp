@@ -0,0 +1,650 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#include "userspace_sim.h"
+#include "userspace_emu.h"
+#include "userspace_bitstream.h"
+
+#include <math.h>
+
+#define SIM_CLK_FREQ    100000000u
+#define SIM_NSEC        1000000000ull
+
+/* Frame tag: release time and message index */
+#define SIM_TAG(t, m)   ((t) * SIM_MAX_MSGS + (m))
+#define SIM_TAG_MSG(t)  ((unsigned)((t) % SIM_MAX_MSGS))
+#define SIM_TAG_TIME(t) ((t) / SIM_MAX_MSGS)
+
+void sim_config_defaults(struct sim_config *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->nodes = 100;
+    cfg->msgs_per_node = 8;
+    cfg->load = 0.6;
+    cfg->bitrate = 500000;
+    cfg->dbitrate = 2000000;
+    cfg->len = 8;
+    cfg->policy = SIM_POLICY_PRIO;
+    cfg->traffic = SIM_TRAFFIC_PERIODIC;
+    cfg->max_queue = 64;
+    cfg->retr_limit = -1;
+    cfg->rx_nodes = 1;
+    cfg->frames = 1000000;
+    cfg->duration_ns = UINT64_MAX;
+    cfg->seed = 1;
+}
+
+/* xorshift64*, plenty for traffic generation */
+static uint64_t sim_rand(struct sim *s)
+{
+    s->rng ^= s->rng >> 12;
+    s->rng ^= s->rng << 25;
+    s->rng ^= s->rng >> 27;
+    return s->rng * 0x2545f4914f6cdd1dull;
+}
+
+static double sim_uniform(struct sim *s)
+{
+    return (sim_rand(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint64_t sim_clock(void *arg)
+{
+    return ((struct sim *)arg)->now;
+}
+
+/*
+ * Bit timing for @bitrate from the core clock, as many time quanta per bit
+ * as the segment widths allow. Returns bit time in ns, 0 if not reachable.
+ */
+static uint64_t sim_bittiming(uint32_t bitrate, bool data, struct can_bittiming *bt)
+{
+    unsigned max_tq = data ? 40 : 80;
+
+    for (unsigned tq = max_tq; tq >= 5; tq--) {
+        uint64_t brp;
+
+        if (SIM_CLK_FREQ % ((uint64_t)bitrate * tq))
+            continue;
+        brp = SIM_CLK_FREQ / ((uint64_t)bitrate * tq);
+        if (brp > 255)
+            break;
+        memset(bt, 0, sizeof(*bt));
+        bt->bitrate = bitrate;
+        bt->brp = brp;
+        bt->phase_seg2 = tq / 5;
+        bt->phase_seg1 = tq / 5;
+        bt->prop_seg = tq - 1 - bt->phase_seg1 - bt->phase_seg2;
+        bt->sjw = bt->phase_seg2;
+        return (uint64_t)tq * brp * SIM_NSEC / SIM_CLK_FREQ;
+    }
+    return 0;
+}
+
+static unsigned sim_id_hash(canid_t id)
+{
+    return (id * 0x9e3779b1u) >> 7;
+}
+
+static struct sim_msg *sim_msg_of(const struct sim *s, canid_t id)
+{
+    for (unsigned h = sim_id_hash(id);; h++) {
+        unsigned m = s->idmap[h & s->idmap_mask];
+
+        if (!m)
+            return NULL;
+        if (s->msg[m - 1].id == id)
+            return &s->msg[m - 1];
+    }
+}
+
+static bool sim_id_add(struct sim *s, canid_t id, unsigned m)
+{
+    for (unsigned h = sim_id_hash(id);; h++) {
+        unsigned *slot = &s->idmap[h & s->idmap_mask];
+
+        if (!*slot) {
+            *slot = m + 1;
+            return true;
+        }
+        if (s->msg[*slot - 1].id == id)
+            return false;
+    }
+}
+
+static void sim_build_frame(const struct sim *s, const struct sim_msg *m,
+                            struct canfd_frame *cf)
+{
+    memset(cf, 0, sizeof(*cf));
+    cf->can_id = m->id;
+    cf->len = s->cfg.len;
+    if (s->cfg.brs)
+        cf->flags = CANFD_BRS;
+    memcpy(cf->data, m->data, cf->len);
+}
+
+/* Arbitration key of TXT buffer words, node index in the low half */
+static uint64_t sim_arb_key(const u32 *txt, unsigned node)
+{
+    struct canfd_frame cf;
+    bool fdf;
+
+    can_frame_from_words(txt, &cf, &fdf);
+    return (uint64_t)tx_sched_arb_key(cf.can_id) << 32 | node;
+}
+
+/* Refresh the buffer @n offers on the bus and its place among contenders */
+static void sim_node_update(struct sim *s, struct sim_node *n)
+{
+    const u32 *txt;
+
+    n->cand_buf = ctucan_emu_bus_pending(n->priv, &txt);
+    if (n->cand_buf >= 0) {
+        n->cand_key = sim_arb_key(txt, n->idx);
+        if (n->slot < 0) {
+            n->slot = s->ncontenders;
+            s->contenders[s->ncontenders++] = n->idx;
+        }
+    } else if (n->slot >= 0) {
+        unsigned last = s->contenders[--s->ncontenders];
+
+        s->contenders[n->slot] = last;
+        s->node[last].slot = n->slot;
+        n->slot = -1;
+    }
+}
+
+/*
+ * Run the node's driver as its interrupt handler would. Buffers aborted
+ * for preemption finish immediately when not on the bus, so poll again
+ * until the engine has nothing left to collect.
+ */
+static void sim_node_service(struct sim *s, struct sim_node *n)
+{
+    bool again;
+
+    do {
+        tx_sched_poll(&n->tx);
+        again = false;
+        for (unsigned i = 0; i < n->tx.nbufs; i++)
+            if (n->tx.buf[i].state == TX_SCHED_BUF_ABORTING &&
+                ctucan_hw_get_tx_status(n->priv, i) == TXT_ABT)
+                again = true;
+    } while (again);
+    sim_node_update(s, n);
+}
+
+static void sim_tx_done(void *arg, const struct tx_sched_frame *f, bool ok, u64 ts)
+{
+    struct sim_node *n = (struct sim_node *)arg;
+    struct sim *s = n->sim;
+    struct sim_msg *m = &s->msg[SIM_TAG_MSG(f->tag)];
+
+    (void)ts;
+    if (ok) {
+        uint64_t lat = s->now - SIM_TAG_TIME(f->tag);
+
+        m->sent++;
+        m->lat_sum += lat;
+        if (lat > m->lat_max)
+            m->lat_max = lat;
+        userspace_hist_add(&s->stats.latency, lat);
+    } else {
+        m->failed++;
+    }
+}
+
+static uint64_t sim_next_interval(struct sim *s, const struct sim_msg *m)
+{
+    if (s->cfg.traffic == SIM_TRAFFIC_POISSON)
+        return (uint64_t)(-log(1.0 - sim_uniform(s)) * m->period_ns) + 1;
+    return m->period_ns;
+}
+
+static bool sim_evq_before(const struct sim *s, unsigned a, unsigned b)
+{
+    return s->msg[a].next_ns < s->msg[b].next_ns;
+}
+
+static void sim_evq_down(struct sim *s, unsigned i)
+{
+    unsigned v = s->evq[i];
+
+    for (;;) {
+        unsigned c = 2 * i + 1;
+
+        if (c >= s->evq_len)
+            break;
+        if (c + 1 < s->evq_len && sim_evq_before(s, s->evq[c + 1], s->evq[c]))
+            c++;
+        if (!sim_evq_before(s, s->evq[c], v))
+            break;
+        s->evq[i] = s->evq[c];
+        i = c;
+    }
+    s->evq[i] = v;
+}
+
+static uint64_t sim_next_release(const struct sim *s)
+{
+    return s->msg[s->evq[0]].next_ns;
+}
+
+/* Release the earliest message into its node's driver */
+static void sim_release(struct sim *s)
+{
+    unsigned mi = s->evq[0];
+    struct sim_msg *m = &s->msg[mi];
+    struct sim_node *n = &s->node[m->node];
+    struct canfd_frame cf;
+
+    s->now = m->next_ns;
+    sim_build_frame(s, m, &cf);
+    m->released++;
+    if (tx_sched_queue(&n->tx, &cf, s->cfg.fdf, SIM_TAG(s->now, mi)))
+        sim_node_service(s, n);
+    else
+        m->dropped++;
+    s->stats.events++;
+
+    m->next_ns += sim_next_interval(s, m);
+    sim_evq_down(s, 0);
+}
+
+static int sim_node_init(struct sim *s, struct sim_node *n, unsigned idx,
+                         const struct can_bittiming *nbt,
+                         const struct can_bittiming *dbt)
+{
+    struct ctucan_emu_config ecfg;
+    struct can_bittiming bt;
+
+    ctucan_emu_config_defaults(&ecfg);
+    ecfg.rx_words = 256;
+    ecfg.clk_freq = SIM_CLK_FREQ;
+    ecfg.bus = true;
+    ecfg.unlocked = true;
+    ecfg.clock = sim_clock;
+    ecfg.clock_arg = s;
+
+    n->priv = ctucan_emu_create(&ecfg);
+    n->sim = s;
+    n->idx = idx;
+    n->cand_buf = -1;
+    n->slot = -1;
+    n->rx = idx < s->cfg.rx_nodes;
+
+    ctucan_hw_reset(n->priv);
+    bt = *nbt;
+    ctucan_hw_set_nom_bittiming(n->priv, &bt);
+    if (s->cfg.brs) {
+        bt = *dbt;
+        ctucan_hw_set_data_bittiming(n->priv, &bt);
+    }
+    ctucan_hw_set_ret_limit(n->priv, s->cfg.retr_limit >= 0,
+                            s->cfg.retr_limit >= 0 ? s->cfg.retr_limit : 0);
+    ctucan_hw_enable(n->priv, true);
+
+    if (tx_sched_init(&n->tx, n->priv, s->cfg.max_queue, sim_tx_done, n) < 0)
+        return -1;
+    if (s->cfg.policy != SIM_POLICY_PRIO) {
+        n->tx.fifo = true;
+        n->tx.preempt = false;
+    }
+    if (s->cfg.policy == SIM_POLICY_SINGLE)
+        n->tx.nbufs = 1;
+    return 0;
+}
+
+static int sim_msgs_init(struct sim *s)
+{
+    const struct sim_config *cfg = &s->cfg;
+    struct can_bitstream bs;
+    double *weight;
+    double sum = 0;
+
+    weight = (double *)calloc(s->nmsgs, sizeof(*weight));
+    if (!weight)
+        return -1;
+
+    for (unsigned i = 0; i < s->nmsgs; i++) {
+        struct sim_msg *m = &s->msg[i];
+        struct canfd_frame cf;
+
+        /* Unique random IDs, so priorities are spread over the nodes */
+        do {
+            if (cfg->ext)
+                m->id = (sim_rand(s) & CAN_EFF_MASK) | CAN_EFF_FLAG;
+            else
+                m->id = sim_rand(s) & CAN_SFF_MASK;
+        } while (!sim_id_add(s, m->id, i));
+        m->node = i / cfg->msgs_per_node;
+        for (unsigned j = 0; j < CANFD_MAX_DLEN; j++)
+            m->data[j] = sim_rand(s);
+
+        sim_build_frame(s, m, &cf);
+        can_bitstream_encode(&bs, &cf, cfg->fdf, true);
+        m->frame_ns = can_bitstream_ns(&bs, s->nbit_ns,
+                                       cfg->brs ? s->dbit_ns : s->nbit_ns) +
+                      CAN_IFS_BITS * s->nbit_ns;
+
+        /* Periods spread log-uniformly over a decade, scaled below */
+        weight[i] = pow(10.0, sim_uniform(s));
+        sum += m->frame_ns / weight[i];
+    }
+
+    for (unsigned i = 0; i < s->nmsgs; i++) {
+        struct sim_msg *m = &s->msg[i];
+
+        m->period_ns = (uint64_t)(weight[i] * sum / cfg->load);
+        if (!m->period_ns)
+            m->period_ns = 1;
+        if (cfg->traffic == SIM_TRAFFIC_POISSON)
+            m->next_ns = sim_next_interval(s, m);
+        else
+            m->next_ns = (uint64_t)(sim_uniform(s) * m->period_ns);
+        s->evq[i] = i;
+    }
+    s->evq_len = s->nmsgs;
+    for (unsigned i = s->evq_len / 2; i-- > 0;)
+        sim_evq_down(s, i);
+    free(weight);
+    return 0;
+}
+
+int sim_init(struct sim *s, const struct sim_config *cfg)
+{
+    struct can_bittiming nbt, dbt;
+    unsigned mapsize = 1;
+
+    memset(s, 0, sizeof(*s));
+    s->cfg = *cfg;
+    s->rng = 0x9e3779b97f4a7c15ull ^ cfg->seed;
+    s->nmsgs = cfg->nodes * cfg->msgs_per_node;
+    userspace_hist_init(&s->stats.latency);
+
+    if (!cfg->nodes || !cfg->msgs_per_node || s->nmsgs > SIM_MAX_MSGS ||
+        (!cfg->ext && s->nmsgs > 2048)) {
+        warnx("%u messages do not fit the %s ID space", s->nmsgs,
+              cfg->ext ? "simulator" : "11-bit");
+        return -1;
+    }
+    if (cfg->load <= 0 || cfg->len > (cfg->fdf ? 64u : 8u) ||
+        (cfg->fdf && can_dlc2len(can_len2dlc(cfg->len)) != cfg->len)) {
+        warnx("invalid load or payload length");
+        return -1;
+    }
+    s->nbit_ns = sim_bittiming(cfg->bitrate, false, &nbt);
+    s->dbit_ns = cfg->brs ? sim_bittiming(cfg->dbitrate, true, &dbt) : s->nbit_ns;
+    if (!s->nbit_ns || !s->dbit_ns) {
+        warnx("bit rate not reachable with %u Hz core clock", SIM_CLK_FREQ);
+        return -1;
+    }
+
+    while (mapsize < 2 * s->nmsgs)
+        mapsize <<= 1;
+    s->idmap_mask = mapsize - 1;
+    s->idmap = (unsigned *)calloc(mapsize, sizeof(*s->idmap));
+    s->msg = (struct sim_msg *)calloc(s->nmsgs, sizeof(*s->msg));
+    s->evq = (unsigned *)calloc(s->nmsgs, sizeof(*s->evq));
+    s->node = (struct sim_node *)calloc(cfg->nodes, sizeof(*s->node));
+    s->contenders = (unsigned *)calloc(cfg->nodes, sizeof(*s->contenders));
+    if (!s->idmap || !s->msg || !s->evq || !s->node || !s->contenders) {
+        warnx("cannot allocate simulation of %u nodes", cfg->nodes);
+        sim_free(s);
+        return -1;
+    }
+
+    for (unsigned i = 0; i < cfg->nodes; i++) {
+        if (sim_node_init(s, &s->node[i], i, &nbt, &dbt) < 0) {
+            sim_free(s);
+            return -1;
+        }
+    }
+    if (sim_msgs_init(s) < 0) {
+        sim_free(s);
+        return -1;
+    }
+    return 0;
+}
+
+void sim_free(struct sim *s)
+{
+    if (s->node) {
+        for (unsigned i = 0; i < s->cfg.nodes; i++) {
+            if (!s->node[i].priv)
+                continue;
+            tx_sched_free(&s->node[i].tx);
+            ctucan_emu_destroy(s->node[i].priv);
+        }
+    }
+    free(s->node);
+    free(s->contenders);
+    free(s->evq);
+    free(s->msg);
+    free(s->idmap);
+    s->node = NULL;
+    s->contenders = NULL;
+    s->evq = NULL;
+    s->msg = NULL;
+    s->idmap = NULL;
+}
+
+/* Hand a frame seen on the bus to the nodes that read their RX buffer */
+static void sim_deliver(struct sim *s, unsigned from, const u32 *txt,
+                        uint64_t sof, uint64_t eof)
+{
+    for (unsigned i = 0; i < s->cfg.rx_nodes && i < s->cfg.nodes; i++) {
+        struct sim_node *n = &s->node[i];
+        struct canfd_frame cf;
+        u64 ts;
+
+        if (i == from || !ctucan_emu_bus_receive(n->priv, txt, sof, eof))
+            continue;
+        while (ctucan_hw_get_rx_frame_count(n->priv)) {
+            ctucan_hw_read_rx_frame(n->priv, &cf, &ts);
+            n->rx_frames++;
+        }
+    }
+}
+
+void sim_run(struct sim *s)
+{
+    const struct sim_config *cfg = &s->cfg;
+    uint64_t ifs_ns = CAN_IFS_BITS * s->nbit_ns;
+
+    while (s->stats.frames < cfg->frames && s->now < cfg->duration_ns) {
+        struct sim_node *w = NULL;
+        struct sim_msg *m;
+        struct canfd_frame cf;
+        const u32 *txt;
+        uint64_t start, end, dur;
+        unsigned st;
+        bool ok, fdf;
+        int buf;
+
+        while (sim_next_release(s) <= s->now)
+            sim_release(s);
+
+        if (!s->ncontenders) {
+            s->now = sim_next_release(s);
+            continue;
+        }
+
+        /* Arbitration: lowest identifier field wins */
+        for (unsigned i = 0; i < s->ncontenders; i++) {
+            struct sim_node *n = &s->node[s->contenders[i]];
+
+            if (!w || n->cand_key < w->cand_key)
+                w = n;
+        }
+
+        buf = ctucan_emu_bus_pending(w->priv, &txt);
+        can_frame_from_words(txt, &cf, &fdf);
+        m = sim_msg_of(s, cf.can_id);
+        if (m) {
+            dur = m->frame_ns - ifs_ns;
+        } else {
+            /* Not one of ours, encode it now */
+            struct can_bitstream bs;
+
+            can_bitstream_encode(&bs, &cf, fdf, true);
+            dur = can_bitstream_ns(&bs, s->nbit_ns, s->dbit_ns);
+        }
+
+        start = s->now;
+        ctucan_emu_bus_start(w->priv, buf, start);
+        sim_node_update(s, w);
+
+        ok = !(cfg->err_rate > 0 && sim_uniform(s) < cfg->err_rate);
+        if (ok)
+            end = start + dur;
+        else
+            end = start + (uint64_t)(sim_uniform(s) * dur) +
+                  CAN_ERROR_FRAME_BITS * s->nbit_ns;
+
+        /* Drivers keep working while the frame is on the bus */
+        while (sim_next_release(s) < end)
+            sim_release(s);
+
+        s->now = end;
+        st = ctucan_emu_bus_finish(w->priv, buf, ok, end);
+        if (ok) {
+            s->stats.frames++;
+            sim_deliver(s, w->idx, txt, start, end);
+        } else {
+            s->stats.errors++;
+        }
+        s->stats.busy_ns += end - start + ifs_ns;
+        if (st == TXT_RDY)
+            sim_node_update(s, w);
+        else
+            sim_node_service(s, w);
+        s->now = end + ifs_ns;
+    }
+}
+
+struct sim_rank {
+    u32 key;
+    unsigned msg;
+};
+
+static int sim_rank_cmp(const void *a, const void *b)
+{
+    u32 ka = ((const struct sim_rank *)a)->key;
+    u32 kb = ((const struct sim_rank *)b)->key;
+
+    return ka < kb ? -1 : ka > kb;
+}
+
+static const char *const sim_policy_names[] = {"prio", "fifo", "single"};
+
+void sim_report(const struct sim *s, double wall_s, FILE *f)
+{
+    const struct sim_config *cfg = &s->cfg;
+    const unsigned nclasses = 5;
+    struct tx_sched_stats tx;
+    struct sim_rank *rank;
+    uint64_t rx = 0;
+
+    fprintf(f, "sim: %u nodes, %u messages, %s policy, %s traffic, "
+               "%u kbit/s", cfg->nodes, s->nmsgs, sim_policy_names[cfg->policy],
+            cfg->traffic == SIM_TRAFFIC_POISSON ? "poisson" : "periodic",
+            cfg->bitrate / 1000);
+    if (cfg->brs)
+        fprintf(f, " / %u kbit/s", cfg->dbitrate / 1000);
+    fprintf(f, ", %s %u B\n", cfg->fdf ? "CAN FD" : "CAN", cfg->len);
+    fprintf(f, "sim: %llu frames, %llu errors in %.3f s simulated, "
+               "bus load %.1f %% (offered %.1f %%)\n",
+            (unsigned long long)s->stats.frames,
+            (unsigned long long)s->stats.errors, s->now / 1e9,
+            s->now ? 100.0 * s->stats.busy_ns / s->now : 0.0, 100.0 * cfg->load);
+    if (wall_s > 0)
+        fprintf(f, "sim: %.3f s wall, %.0f frames/s, %.0f releases/s\n", wall_s,
+                s->stats.frames / wall_s, s->stats.events / wall_s);
+    userspace_hist_print(f, "sim: latency", &s->stats.latency, 1, 1000, "us");
+
+    /* Latency by priority, classes of messages ordered by ID */
+    rank = (struct sim_rank *)calloc(s->nmsgs, sizeof(*rank));
+    if (rank) {
+        for (unsigned i = 0; i < s->nmsgs; i++) {
+            rank[i].key = tx_sched_arb_key(s->msg[i].id);
+            rank[i].msg = i;
+        }
+        qsort(rank, s->nmsgs, sizeof(*rank), sim_rank_cmp);
+        for (unsigned c = 0; c < nclasses; c++) {
+            unsigned lo = c * s->nmsgs / nclasses;
+            unsigned hi = (c + 1) * s->nmsgs / nclasses;
+            uint64_t sent = 0, dropped = 0, failed = 0, sum = 0, max = 0;
+
+            if (lo == hi)
+                continue;
+            for (unsigned i = lo; i < hi; i++) {
+                const struct sim_msg *m = &s->msg[rank[i].msg];
+
+                sent += m->sent;
+                dropped += m->dropped;
+                failed += m->failed;
+                sum += m->lat_sum;
+                if (m->lat_max > max)
+                    max = m->lat_max;
+            }
+            fprintf(f, "  prio class %u (ID 0x%x..0x%x): %llu sent, %llu dropped, "
+                       "%llu failed, latency avg %llu max %llu us\n", c + 1,
+                    s->msg[rank[lo].msg].id & CAN_EFF_MASK,
+                    s->msg[rank[hi - 1].msg].id & CAN_EFF_MASK,
+                    (unsigned long long)sent, (unsigned long long)dropped,
+                    (unsigned long long)failed,
+                    (unsigned long long)(sent ? sum / sent / 1000 : 0),
+                    (unsigned long long)(max / 1000));
+        }
+        free(rank);
+    }
+
+    memset(&tx, 0, sizeof(tx));
+    for (unsigned i = 0; i < cfg->nodes; i++) {
+        const struct tx_sched_stats *st = &s->node[i].tx.stats;
+
+        tx.queued += st->queued;
+        tx.rejected += st->rejected;
+        tx.sent += st->sent;
+        tx.failed += st->failed;
+        tx.preempted += st->preempted;
+        tx.loads += st->loads;
+        if (st->max_depth > tx.max_depth)
+            tx.max_depth = st->max_depth;
+        rx += s->node[i].rx_frames;
+    }
+    fprintf(f, "drivers: %llu queued, %llu sent, %llu failed, %llu rejected, "
+               "%llu preempted, %llu buffer loads, max queue depth %llu, "
+               "%llu frames read\n",
+            (unsigned long long)tx.queued, (unsigned long long)tx.sent,
+            (unsigned long long)tx.failed, (unsigned long long)tx.rejected,
+            (unsigned long long)tx.preempted, (unsigned long long)tx.loads,
+            (unsigned long long)tx.max_depth, (unsigned long long)rx);
+}
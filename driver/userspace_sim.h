@@ -0,0 +1,148 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#pragma once
+
+#include "userspace_utils.h"
+#include "userspace_hist.h"
+#include "userspace_tx.h"
+
+/*
+ * Discrete-event simulator of a CAN bus with many CTU CAN FD nodes.
+ *
+ * Every node is an emulated core (userspace_emu.h, external bus mode)
+ * driven by the real HAL and the userspace TX engine (userspace_tx.h), so
+ * driver scheduling policies can be compared on networks of hundreds of
+ * nodes. Time is virtual (nanoseconds), the simulation runs as fast as
+ * events can be processed.
+ *
+ * Each node owns a set of messages with unique IDs. Messages are released
+ * periodically or as a Poisson process, with rates scaled so the offered
+ * load is the requested fraction of the bus capacity. When the bus gets
+ * free, each node offers the TXT buffer its core would send (TX_PRIORITY
+ * order) and the lowest arbitration field wins. Frame durations are bit
+ * accurate (stuff bits of the actual content, BRS data phase) plus
+ * intermission. Optionally frames are destroyed by errors at random, which
+ * triggers error frames and retransmission up to each core's limit.
+ */
+
+enum sim_policy {
+    SIM_POLICY_PRIO,        /* tx_sched: ID order, all buffers, preemption */
+    SIM_POLICY_FIFO,        /* tx_sched in queue order, all buffers */
+    SIM_POLICY_SINGLE,      /* Queue order through one TXT buffer */
+};
+
+enum sim_traffic {
+    SIM_TRAFFIC_PERIODIC,
+    SIM_TRAFFIC_POISSON,
+};
+
+struct sim_config {
+    unsigned nodes;
+    unsigned msgs_per_node;
+    double load;                /* Offered load, fraction of bus capacity */
+    uint32_t bitrate;
+    uint32_t dbitrate;          /* Data phase bit rate, FD with BRS only */
+    bool fdf;
+    bool brs;
+    unsigned len;               /* Payload bytes */
+    bool ext;                   /* 29-bit identifiers */
+    enum sim_policy policy;
+    enum sim_traffic traffic;
+    unsigned max_queue;         /* Per node TX queue */
+    double err_rate;            /* Probability a transmission is destroyed */
+    int retr_limit;             /* Retransmissions after error, -1 = unlimited */
+    unsigned rx_nodes;          /* Nodes reading every frame from RX buffer */
+    uint64_t frames;            /* Stop after this many frames on the bus */
+    uint64_t duration_ns;       /* Or after this much simulated time */
+    unsigned seed;
+};
+
+#define SIM_MAX_MSGS        65536
+
+struct sim_msg {
+    canid_t id;
+    unsigned node;
+    u8 data[CANFD_MAX_DLEN];
+    uint64_t period_ns;         /* Mean period for Poisson traffic */
+    uint64_t next_ns;
+    uint64_t frame_ns;          /* Bit accurate duration incl. intermission */
+    uint64_t released, sent, failed, dropped;
+    uint64_t lat_sum, lat_max;  /* Release to end of frame */
+};
+
+struct sim_node {
+    struct ctucan_hw_priv *priv;
+    struct tx_sched tx;
+    struct sim *sim;
+    unsigned idx;
+    int cand_buf;               /* Buffer offered on the bus, -1 = none */
+    uint64_t cand_key;
+    int slot;                   /* Index in sim->contenders, -1 if not there */
+    bool rx;
+    uint64_t rx_frames;
+};
+
+struct sim_stats {
+    uint64_t frames;            /* Successful frames on the bus */
+    uint64_t errors;            /* Destroyed transmissions */
+    uint64_t events;
+    uint64_t busy_ns;
+    struct userspace_hist latency;
+};
+
+struct sim {
+    struct sim_config cfg;
+    uint64_t now;
+    uint64_t nbit_ns, dbit_ns;
+    struct sim_node *node;
+    struct sim_msg *msg;
+    unsigned nmsgs;
+    unsigned *evq;              /* Binary heap of message indices by next_ns */
+    unsigned evq_len;
+    unsigned *idmap;            /* Open addressing canid -> message + 1 */
+    unsigned idmap_mask;
+    unsigned *contenders;       /* Nodes with a ready buffer */
+    unsigned ncontenders;
+    uint64_t rng;
+    struct sim_stats stats;
+};
+
+void sim_config_defaults(struct sim_config *cfg);
+
+/* Create nodes and messages. Returns -1 on invalid configuration. */
+int sim_init(struct sim *s, const struct sim_config *cfg);
+
+void sim_free(struct sim *s);
+
+/* Run until cfg.frames or cfg.duration_ns is reached */
+void sim_run(struct sim *s);
+
+/* Bus statistics, latency per priority class and per policy counters */
+void sim_report(const struct sim *s, double wall_s, FILE *f);
@@ -0,0 +1,366 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#include <time.h>
+
+#include "userspace_ssp.h"
+
+void ssp_config_defaults(struct ssp_config *cfg)
+{
+    cfg->clk_freq = 100000000;
+    cfg->burst = 64;
+    cfg->id = 0x7ff;
+    cfg->len = 64;
+    cfg->position = 0;
+    cfg->margin = 125;
+    cfg->window = 256;
+    cfg->retune_cycles = 2;
+    cfg->timeout_ms = 100;
+}
+
+static uint64_t mono_ns(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+int ssp_init(struct ssp_calib *cal, struct ctucan_hw_priv *priv,
+             const struct ssp_config *cfg, const struct can_bittiming *dbt)
+{
+    memset(cal, 0, sizeof(*cal));
+    cal->priv = priv;
+    cal->cfg = *cfg;
+    cal->dbit = (1 + dbt->prop_seg + dbt->phase_seg1 + dbt->phase_seg2) * dbt->brp;
+    cal->sp = (1 + dbt->prop_seg + dbt->phase_seg1) * dbt->brp;
+    if (!cal->dbit || !cfg->window) {
+        warnx("ssp: data bit timing not set");
+        return -1;
+    }
+    return 0;
+}
+
+/* Smallest delay with more than @pm per mille of the samples at or below it */
+static unsigned trv_percentile(const uint32_t *hist, unsigned n, unsigned pm)
+{
+    uint64_t sum = 0;
+
+    for (unsigned v = 0; v <= SSP_TRV_MAX; v++) {
+        sum += hist[v];
+        if (sum * 1000 > (uint64_t)n * pm)
+            return v;
+    }
+    return SSP_TRV_MAX;
+}
+
+void ssp_pick(const struct ssp_calib *cal, const uint32_t *hist, unsigned n,
+              struct ssp_setting *s, struct ssp_stats *st)
+{
+    unsigned margin = cal->dbit * cal->cfg.margin / 1000;
+    unsigned target = cal->cfg.position ? cal->dbit * cal->cfg.position / 1000
+                                        : cal->dbit / 2;
+    unsigned lo, med, hi, spread;
+
+    s->marginal = false;
+    if (!n) {
+        /* Nothing measured: data sample point behind the delay */
+        s->use_trv = true;
+        s->offset = cal->sp;
+        return;
+    }
+    lo = trv_percentile(hist, n, 10);
+    med = trv_percentile(hist, n, 500);
+    hi = trv_percentile(hist, n, 990);
+    if (st) {
+        st->trv_lo = lo;
+        st->trv_med = med;
+        st->trv_hi = hi;
+    }
+
+    if (hi >= SSP_TRV_MAX) {
+        /* Saturated, only a sweep (ssp_calibrate()) tells the real delay */
+        s->use_trv = false;
+        s->offset = med + target;
+        s->marginal = true;
+    } else {
+        spread = hi - lo;
+        s->use_trv = true;
+        if (2 * (margin + spread) > cal->dbit) {
+            s->offset = cal->dbit / 2;
+            s->marginal = true;
+        } else if (target < margin + spread) {
+            s->offset = margin + spread;
+        } else if (target > cal->dbit - margin - spread) {
+            s->offset = cal->dbit - margin - spread;
+        } else {
+            s->offset = target;
+        }
+    }
+    if (s->offset > 255)
+        s->offset = 255;
+}
+
+static void ssp_apply(struct ssp_calib *cal, const struct ssp_setting *s)
+{
+    ctucan_hw_configure_ssp(cal->priv, true, s->use_trv, s->offset);
+    cal->cur = *s;
+}
+
+/* One frame from SSP_TXT_BUF. Returns 1 if sent, 0 if failed, -1 if not loaded. */
+static int ssp_send(struct ssp_calib *cal, const struct canfd_frame *cf)
+{
+    struct ctucan_hw_priv *priv = cal->priv;
+    uint64_t deadline = mono_ns() + cal->cfg.timeout_ms * 1000000ull;
+    bool aborted = false;
+
+    if (!ctucan_hw_is_txt_buf_accessible(priv, SSP_TXT_BUF))
+        return -1;
+    if (!ctucan_hw_insert_frame(priv, cf, 0, SSP_TXT_BUF, true))
+        return -1;
+    ctucan_hw_txt_set_rdy(priv, SSP_TXT_BUF);
+    for (;;) {
+        enum ctu_can_fd_tx_status_tx1s st = ctucan_hw_get_tx_status(priv, SSP_TXT_BUF);
+
+        if (st == TXT_TOK)
+            return 1;
+        if (st == TXT_ERR || st == TXT_ABT || st == TXT_ETY)
+            return 0;
+        if (!aborted && mono_ns() > deadline) {
+            /* Retransmitted for too long, e.g. SSP far off */
+            ctucan_hw_txt_set_abort(priv, SSP_TXT_BUF);
+            aborted = true;
+        }
+    }
+}
+
+static void ssp_frame(const struct ssp_calib *cal, struct canfd_frame *cf)
+{
+    memset(cf, 0, sizeof(*cf));
+    cf->can_id = cal->cfg.id;
+    cf->len = cal->cfg.len;
+    cf->flags = CANFD_BRS;
+    /* Alternating bits, as many edges as possible */
+    memset(cf->data, 0x55, cf->len);
+}
+
+static void ssp_read_errs(struct ssp_calib *cal, u16 *norm, u16 *fd)
+{
+    union ctu_can_fd_err_norm_err_fd reg;
+
+    reg.u32 = cal->priv->read_reg(cal->priv, CTU_CAN_FD_ERR_NORM);
+    *norm = reg.s.err_norm_val;
+    *fd = reg.s.err_fd_val;
+}
+
+/*
+ * Fixed SSP for a delay beyond TRV_DELAY: middle of the longest run of
+ * offsets at which two frames got through
+ */
+static void ssp_sweep(struct ssp_calib *cal, struct ssp_setting *s)
+{
+    struct ssp_setting t = {false, false, 0};
+    struct canfd_frame cf;
+    unsigned run = 0, best = 0, best_end = 0;
+
+    ssp_frame(cal, &cf);
+    for (t.offset = SSP_TRV_MAX; t.offset <= 255; t.offset++) {
+        bool ok = true;
+
+        ssp_apply(cal, &t);
+        for (unsigned i = 0; i < 2 && ok; i++)
+            ok = ssp_send(cal, &cf) > 0;
+        run = ok ? run + 1 : 0;
+        if (run > best) {
+            best = run;
+            best_end = t.offset;
+        }
+    }
+    s->use_trv = false;
+    if (best) {
+        s->offset = best_end - (best - 1) / 2;
+        s->marginal = 2 * cal->dbit * cal->cfg.margin / 1000 + 1 > best;
+    }
+}
+
+int ssp_calibrate(struct ssp_calib *cal)
+{
+    struct ctucan_hw_priv *priv = cal->priv;
+    union ctu_can_fd_mode_settings mode;
+    struct ssp_setting s;
+    struct canfd_frame cf;
+    unsigned n = 0;
+
+    /* Start from the data sample point behind the measured delay */
+    ssp_pick(cal, NULL, 0, &s, NULL);
+    ssp_apply(cal, &s);
+    /* Single attempts, a frame failing in the data phase is not repeated */
+    mode.u32 = priv->read_reg(priv, CTU_CAN_FD_MODE);
+    ctucan_hw_set_ret_limit(priv, true, 0);
+
+    memset(cal->hist, 0, sizeof(cal->hist));
+    ssp_frame(cal, &cf);
+    for (unsigned i = 0; i < cal->cfg.burst; i++) {
+        u32 ctr = ctucan_hw_get_tx_frame_ctr(priv);
+        u16 norm, fd, norm2, fd2;
+        int res;
+
+        ssp_read_errs(cal, &norm, &fd);
+        res = ssp_send(cal, &cf);
+        if (res < 0) {
+            warnx("ssp: TXT buffer %d busy", SSP_TXT_BUF + 1);
+            break;
+        }
+        ssp_read_errs(cal, &norm2, &fd2);
+        /* Data phase reached: sent, or failed there */
+        if (res || fd2 != fd) {
+            cal->hist[ctucan_hw_get_tran_delay(priv)]++;
+            n++;
+        }
+        cal->stats.err_norm += (u16)(norm2 - norm);
+        cal->stats.err_fd += (u16)(fd2 - fd);
+        cal->stats.frames += ctucan_hw_get_tx_frame_ctr(priv) - ctr;
+    }
+    if (n) {
+        ssp_pick(cal, cal->hist, n, &s, &cal->stats);
+        if (!s.use_trv)
+            ssp_sweep(cal, &s);
+        ssp_apply(cal, &s);
+    }
+    ctucan_hw_set_ret_limit(priv, mode.s.rtrle, mode.s.rtrth);
+    if (!n) {
+        warnx("ssp: no calibration frame reached the data phase");
+        return -1;
+    }
+    cal->stats.samples += n;
+    if (s.marginal)
+        warnx("ssp: loop delay %u..%u cycles leaves no margin in a %u cycle data bit",
+              cal->stats.trv_lo, cal->stats.trv_hi, cal->dbit);
+
+    memset(cal->hist, 0, sizeof(cal->hist));
+    cal->nsamples = 0;
+    cal->retune = false;
+    cal->recalibrate = false;
+    cal->tx_ctr = ctucan_hw_get_tx_frame_ctr(priv);
+    ssp_read_errs(cal, &cal->err_norm, &cal->err_fd);
+    return 0;
+}
+
+bool ssp_poll(struct ssp_calib *cal)
+{
+    struct ctucan_hw_priv *priv = cal->priv;
+    u32 ctr = ctucan_hw_get_tx_frame_ctr(priv);
+    u16 norm, fd;
+
+    ssp_read_errs(cal, &norm, &fd);
+    cal->stats.err_norm += (u16)(norm - cal->err_norm);
+    cal->err_norm = norm;
+    if (ctr != cal->tx_ctr || fd != cal->err_fd) {
+        cal->stats.frames += ctr - cal->tx_ctr;
+        cal->stats.err_fd += (u16)(fd - cal->err_fd);
+        cal->tx_ctr = ctr;
+        cal->err_fd = fd;
+        cal->hist[ctucan_hw_get_tran_delay(priv)]++;
+        cal->nsamples++;
+        cal->stats.samples++;
+    }
+
+    if (cal->nsamples >= cal->cfg.window) {
+        struct ssp_setting s;
+        unsigned d;
+
+        ssp_pick(cal, cal->hist, cal->nsamples, &s, &cal->stats);
+        d = s.offset > cal->cur.offset ? s.offset - cal->cur.offset
+                                       : cal->cur.offset - s.offset;
+        if (!s.use_trv) {
+            /* Still out of range with a swept SSP: keep it */
+            cal->recalibrate = cal->cur.use_trv;
+        } else if (s.use_trv != cal->cur.use_trv || d >= cal->cfg.retune_cycles) {
+            cal->pending = s;
+            cal->retune = true;
+        }
+        memset(cal->hist, 0, sizeof(cal->hist));
+        cal->nsamples = 0;
+    }
+
+    if (cal->retune) {
+        union ctu_can_fd_status status;
+
+        status.u32 = priv->read_reg(priv, CTU_CAN_FD_STATUS);
+        if (!status.s.idle) {
+            cal->stats.deferred++;
+            return false;
+        }
+        ssp_apply(cal, &cal->pending);
+        cal->retune = false;
+        cal->stats.retunes++;
+        return true;
+    }
+    return false;
+}
+
+unsigned ssp_exercise(struct ssp_calib *cal, unsigned n)
+{
+    struct canfd_frame cf;
+    unsigned sent = 0;
+
+    ssp_frame(cal, &cf);
+    for (unsigned i = 0; i < n; i++) {
+        int res = ssp_send(cal, &cf);
+
+        if (res < 0)
+            break;
+        sent += res;
+        ssp_poll(cal);
+        if (cal->recalibrate && ssp_calibrate(cal))
+            break;
+    }
+    return sent;
+}
+
+void ssp_report(const struct ssp_calib *cal, FILE *f)
+{
+    const struct ssp_stats *st = &cal->stats;
+    double ns = 1e9 / cal->cfg.clk_freq;
+    uint64_t attempts = st->frames + st->err_fd;
+
+    fprintf(f, "ssp: data bit %u cycles, sample point %u; loop delay p1 %u, p50 %u, "
+               "p99 %u cycles (%.0f ns)\n",
+            cal->dbit, cal->sp, st->trv_lo, st->trv_med, st->trv_hi, st->trv_med * ns);
+    fprintf(f, "ssp: SSP at %s%u cycles%s\n",
+            cal->cur.use_trv ? "TRV_DELAY + " : "", cal->cur.offset,
+            cal->cur.marginal ? " (marginal)" : "");
+    fprintf(f, "ssp: %llu samples, %llu frames, %llu data phase errors (%.3f%% of attempts), "
+               "%llu nominal phase errors, %llu retunes, %llu deferred\n",
+            (unsigned long long)st->samples, (unsigned long long)st->frames,
+            (unsigned long long)st->err_fd,
+            attempts ? 100.0 * st->err_fd / attempts : 0.0,
+            (unsigned long long)st->err_norm, (unsigned long long)st->retunes,
+            (unsigned long long)st->deferred);
+}
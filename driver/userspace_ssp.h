@@ -0,0 +1,137 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#pragma once
+
+#include "userspace_utils.h"
+
+/*
+ * Transceiver delay compensation: secondary sample point (SSP) calibration.
+ *
+ * In the data phase the transmitter samples its own bits at the SSP,
+ * TRV_DELAY + SSP offset clock cycles after the start of the bit
+ * (SSP_SRC_MEAS_N_OFFSET). The core measures TRV_DELAY once per frame, on
+ * the edge before the data phase; the data bits may be delayed differently
+ * (edge asymmetry, jitter). ctucan_set_secondary_sample_point() places the
+ * SSP at the data sample point without looking at the delay.
+ *
+ * ssp_calibrate() sends a burst of FD frames with BRS from TXT buffer
+ * SSP_TXT_BUF and collects TRV_DELAY after each. The spread of the
+ * measurements (p1..p99) is taken as the possible deviation of a data bit
+ * from the measured delay. The offset puts the SSP in the middle of the
+ * delayed bit, or at cfg.position. It is then moved inwards until the SSP
+ * stays cfg.margin plus that spread away from both edges of the bit.
+ *
+ * A delay that saturates the 7-bit TRV_DELAY cannot be measured. In that
+ * case calibration sweeps a fixed SSP (SSP_SRC_OFFSET) from SSP_TRV_MAX
+ * upwards, sending single-attempt frames. It takes the middle of the
+ * longest run of offsets where no frame failed.
+ *
+ * ssp_poll() keeps sampling TRV_DELAY whenever TX_FR_CTR moves and counts
+ * ERR_NORM/ERR_FD. After every cfg.window samples the offset is picked
+ * again from the window. If it moved by cfg.retune_cycles or more, or the
+ * source changed, SSP_CFG is rewritten. The write happens between frames,
+ * when STATUS.idle is set. A window where the delay saturates sets
+ * cal->recalibrate instead, because only a sweep can find the offset.
+ * All positions are in core clock cycles.
+ */
+
+#define SSP_TXT_BUF     0
+#define SSP_TRV_MAX     127     /* TRV_DELAY saturates here */
+
+struct ssp_config {
+    uint32_t clk_freq;          /* Core clock, Hz */
+    unsigned burst;             /* Calibration frames */
+    canid_t id;                 /* Of calibration frames */
+    unsigned len;               /* Their data length */
+    unsigned position;          /* SSP in the delayed bit, per mille, 0 = middle */
+    unsigned margin;            /* To bit edges, per mille of the bit */
+    unsigned window;            /* Samples per online decision */
+    unsigned retune_cycles;     /* Offset change that reprograms SSP_CFG */
+    unsigned timeout_ms;        /* Per calibration frame */
+};
+
+struct ssp_setting {
+    bool use_trv;               /* SSP_SRC_MEAS_N_OFFSET, else SSP_SRC_OFFSET */
+    bool marginal;              /* Spread leaves no room for cfg.margin */
+    unsigned offset;
+};
+
+struct ssp_stats {
+    uint64_t samples;           /* TRV_DELAY readings */
+    uint64_t frames;            /* TX_FR_CTR progress seen by ssp_poll() */
+    uint64_t err_norm, err_fd;  /* ERR_NORM/ERR_FD progress */
+    uint64_t retunes;
+    uint64_t deferred;          /* Retune postponed, core not idle */
+    unsigned trv_lo, trv_med, trv_hi;   /* Last decision: p1, p50, p99 */
+};
+
+struct ssp_calib {
+    struct ctucan_hw_priv *priv;
+    struct ssp_config cfg;
+    unsigned dbit;              /* Data bit time */
+    unsigned sp;                /* Data sample point from bit start */
+    uint32_t hist[SSP_TRV_MAX + 1];
+    unsigned nsamples;          /* In hist */
+    u32 tx_ctr;
+    u16 err_norm, err_fd;
+    struct ssp_setting cur;
+    struct ssp_setting pending;
+    bool retune;
+    bool recalibrate;           /* Delay out of TRV_DELAY range, sweep needed */
+    struct ssp_stats stats;
+};
+
+void ssp_config_defaults(struct ssp_config *cfg);
+
+/* @dbt as programmed with ctucan_hw_set_data_bittiming() */
+int ssp_init(struct ssp_calib *cal, struct ctucan_hw_priv *priv,
+             const struct ssp_config *cfg, const struct can_bittiming *dbt);
+
+/*
+ * Measure TRV_DELAY over cfg.burst frames and program SSP_CFG. The core
+ * must be enabled and the frames acknowledged (bus or loopback with
+ * presumed ACK). Returns -1 if no frame could be sent.
+ */
+int ssp_calibrate(struct ssp_calib *cal);
+
+/* Offset for a TRV_DELAY histogram of @n samples */
+void ssp_pick(const struct ssp_calib *cal, const uint32_t *hist, unsigned n,
+              struct ssp_setting *s, struct ssp_stats *st);
+
+/* Online tracking, call regularly. Returns true if SSP_CFG was rewritten. */
+bool ssp_poll(struct ssp_calib *cal);
+
+/*
+ * Send @n calibration frames, with ssp_poll() after each and ssp_calibrate()
+ * when it asks for it. Returns frames sent.
+ */
+unsigned ssp_exercise(struct ssp_calib *cal, unsigned n);
+
+void ssp_report(const struct ssp_calib *cal, FILE *f);
@@ -0,0 +1,270 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#include "userspace_trace.h"
+
+#include <time.h>
+
+struct ctucan_trace_priv {
+    struct ctucan_hw_priv priv;     /* Must be first */
+    struct ctucan_hw_priv *inner;
+    struct ctucan_trace_rec *ring;
+    uint64_t mask;
+    uint64_t head;                  /* Records written, atomic */
+    struct timespec t0;
+    uint64_t start_realtime_ns;
+    char path[256];
+    unsigned nmarks;
+    char marks[CTUCAN_TRACE_MARKS][CTUCAN_TRACE_MARK_LEN];
+};
+
+static struct ctucan_trace_priv *ctucan_trace_of(struct ctucan_hw_priv *priv)
+{
+    return (struct ctucan_trace_priv *)priv;
+}
+
+static uint64_t ctucan_trace_now(const struct ctucan_trace_priv *tp)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)(t.tv_sec - tp->t0.tv_sec) * 1000000000ull +
+           t.tv_nsec - tp->t0.tv_nsec;
+}
+
+/* @ns is the time the access was started */
+static void ctucan_trace_put(struct ctucan_trace_priv *tp, uint64_t ns,
+                             enum ctucan_trace_op op, unsigned reg, u32 val,
+                             unsigned size)
+{
+    uint64_t i = __atomic_fetch_add(&tp->head, 1, __ATOMIC_RELAXED);
+    struct ctucan_trace_rec *r = &tp->ring[i & tp->mask];
+
+    r->ns = ns;
+    r->val = val;
+    r->reg = reg;
+    r->op = op;
+    r->size = size;
+}
+
+u32 ctucan_trace_read32(struct ctucan_hw_priv *priv,
+                        enum ctu_can_fd_can_registers reg)
+{
+    struct ctucan_trace_priv *tp = ctucan_trace_of(priv);
+    uint64_t ns = ctucan_trace_now(tp);
+    u32 val = tp->inner->read_reg(tp->inner, reg);
+
+    ctucan_trace_put(tp, ns, CTUCAN_TRACE_READ, reg, val, 4);
+    return val;
+}
+
+static void ctucan_trace_write32(struct ctucan_hw_priv *priv,
+                                 enum ctu_can_fd_can_registers reg, u32 val)
+{
+    struct ctucan_trace_priv *tp = ctucan_trace_of(priv);
+
+    ctucan_trace_put(tp, ctucan_trace_now(tp), CTUCAN_TRACE_WRITE, reg, val, 4);
+    tp->inner->write_reg(tp->inner, reg, val);
+}
+
+struct ctucan_hw_priv *ctucan_trace_attach(struct ctucan_hw_priv *inner,
+                                           const char *path, unsigned records)
+{
+    struct ctucan_trace_priv *tp;
+    struct timespec rt;
+    uint64_t size = 1;
+
+    while (size < records)
+        size <<= 1;
+    tp = (struct ctucan_trace_priv *)calloc(1, sizeof(*tp));
+    if (!tp)
+        return NULL;
+    tp->ring = (struct ctucan_trace_rec *)calloc(size, sizeof(*tp->ring));
+    if (!tp->ring) {
+        warnx("cannot allocate trace of %u records", records);
+        free(tp);
+        return NULL;
+    }
+    tp->mask = size - 1;
+    tp->inner = inner;
+    snprintf(tp->path, sizeof(tp->path), "%s", path);
+    clock_gettime(CLOCK_MONOTONIC, &tp->t0);
+    clock_gettime(CLOCK_REALTIME, &rt);
+    tp->start_realtime_ns = (uint64_t)rt.tv_sec * 1000000000ull + rt.tv_nsec;
+
+    tp->priv.mem_base = inner->mem_base;
+    tp->priv.read_reg = ctucan_trace_read32;
+    tp->priv.write_reg = ctucan_trace_write32;
+    return &tp->priv;
+}
+
+struct ctucan_hw_priv *ctucan_trace_inner(struct ctucan_hw_priv *priv)
+{
+    return ctucan_trace_of(priv)->inner;
+}
+
+void ctucan_trace_record(struct ctucan_hw_priv *priv, enum ctucan_trace_op op,
+                         unsigned reg, u32 val, unsigned size)
+{
+    struct ctucan_trace_priv *tp = ctucan_trace_of(priv);
+
+    ctucan_trace_put(tp, ctucan_trace_now(tp), op, reg, val, size);
+}
+
+/* Markers are few and set from one thread, linear lookup is fine */
+void ctucan_trace_mark_name(struct ctucan_hw_priv *priv, const char *name)
+{
+    struct ctucan_trace_priv *tp = ctucan_trace_of(priv);
+    unsigned i;
+
+    for (i = 0; i < tp->nmarks; i++)
+        if (!strncmp(tp->marks[i], name, CTUCAN_TRACE_MARK_LEN - 1))
+            break;
+    if (i == tp->nmarks) {
+        if (tp->nmarks == CTUCAN_TRACE_MARKS)
+            return;
+        snprintf(tp->marks[i], CTUCAN_TRACE_MARK_LEN, "%s", name);
+        tp->nmarks++;
+    }
+    ctucan_trace_put(tp, ctucan_trace_now(tp), CTUCAN_TRACE_MARK, 0, i, 0);
+}
+
+int ctucan_trace_save(struct ctucan_hw_priv *priv)
+{
+    struct ctucan_trace_priv *tp = ctucan_trace_of(priv);
+    struct ctucan_trace_hdr hdr;
+    uint64_t head = __atomic_load_n(&tp->head, __ATOMIC_ACQUIRE);
+    uint64_t size = tp->mask + 1;
+    uint64_t first = head > size ? head - size : 0;
+    FILE *f;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = CTUCAN_TRACE_MAGIC;
+    hdr.version = CTUCAN_TRACE_VERSION;
+    hdr.rec_size = sizeof(struct ctucan_trace_rec);
+    hdr.nmarks = tp->nmarks;
+    hdr.count = head - first;
+    hdr.dropped = first;
+    hdr.start_realtime_ns = tp->start_realtime_ns;
+    memcpy(hdr.marks, tp->marks, sizeof(hdr.marks));
+
+    f = fopen(tp->path, "wb");
+    if (!f) {
+        warn("%s", tp->path);
+        return -1;
+    }
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    /* Oldest first: tail of the ring, then its beginning */
+    for (uint64_t i = first; i < head; ) {
+        uint64_t idx = i & tp->mask;
+        uint64_t n = size - idx;
+
+        if (n > head - i)
+            n = head - i;
+        fwrite(&tp->ring[idx], sizeof(*tp->ring), n, f);
+        i += n;
+    }
+    if (fclose(f)) {
+        warn("%s", tp->path);
+        return -1;
+    }
+    fprintf(stderr, "trace: %llu register accesses saved to %s (%llu dropped)\n",
+            (unsigned long long)hdr.count, tp->path,
+            (unsigned long long)hdr.dropped);
+    return 0;
+}
+
+static const struct {
+    unsigned reg;
+    const char *name;
+} ctucan_reg_names[] = {
+    {CTU_CAN_FD_DEVICE_ID, "DEVICE_ID"},
+    {CTU_CAN_FD_VERSION, "VERSION"},
+    {CTU_CAN_FD_MODE, "MODE"},
+    {CTU_CAN_FD_SETTINGS, "SETTINGS"},
+    {CTU_CAN_FD_STATUS, "STATUS"},
+    {CTU_CAN_FD_COMMAND, "COMMAND"},
+    {CTU_CAN_FD_INT_STAT, "INT_STAT"},
+    {CTU_CAN_FD_INT_ENA_SET, "INT_ENA_SET"},
+    {CTU_CAN_FD_INT_ENA_CLR, "INT_ENA_CLR"},
+    {CTU_CAN_FD_INT_MASK_SET, "INT_MASK_SET"},
+    {CTU_CAN_FD_INT_MASK_CLR, "INT_MASK_CLR"},
+    {CTU_CAN_FD_BTR, "BTR"},
+    {CTU_CAN_FD_BTR_FD, "BTR_FD"},
+    {CTU_CAN_FD_EWL, "EWL"},
+    {CTU_CAN_FD_ERP, "ERP"},
+    {CTU_CAN_FD_FAULT_STATE, "FAULT_STATE"},
+    {CTU_CAN_FD_REC, "REC"},
+    {CTU_CAN_FD_TEC, "TEC"},
+    {CTU_CAN_FD_ERR_NORM, "ERR_NORM"},
+    {CTU_CAN_FD_ERR_FD, "ERR_FD"},
+    {CTU_CAN_FD_CTR_PRES, "CTR_PRES"},
+    {CTU_CAN_FD_FILTER_A_MASK, "FILTER_A_MASK"},
+    {CTU_CAN_FD_FILTER_A_VAL, "FILTER_A_VAL"},
+    {CTU_CAN_FD_FILTER_B_MASK, "FILTER_B_MASK"},
+    {CTU_CAN_FD_FILTER_B_VAL, "FILTER_B_VAL"},
+    {CTU_CAN_FD_FILTER_C_MASK, "FILTER_C_MASK"},
+    {CTU_CAN_FD_FILTER_C_VAL, "FILTER_C_VAL"},
+    {CTU_CAN_FD_FILTER_RAN_LOW, "FILTER_RAN_LOW"},
+    {CTU_CAN_FD_FILTER_RAN_HIGH, "FILTER_RAN_HIGH"},
+    {CTU_CAN_FD_FILTER_CONTROL, "FILTER_CONTROL"},
+    {CTU_CAN_FD_FILTER_STATUS, "FILTER_STATUS"},
+    {CTU_CAN_FD_RX_MEM_INFO, "RX_MEM_INFO"},
+    {CTU_CAN_FD_RX_POINTERS, "RX_POINTERS"},
+    {CTU_CAN_FD_RX_STATUS, "RX_STATUS"},
+    {CTU_CAN_FD_RX_SETTINGS, "RX_SETTINGS"},
+    {CTU_CAN_FD_RX_DATA, "RX_DATA"},
+    {CTU_CAN_FD_TX_STATUS, "TX_STATUS"},
+    {CTU_CAN_FD_TX_COMMAND, "TX_COMMAND"},
+    {CTU_CAN_FD_TX_PRIORITY, "TX_PRIORITY"},
+    {CTU_CAN_FD_ERR_CAPT, "ERR_CAPT"},
+    {CTU_CAN_FD_ALC, "ALC"},
+    {CTU_CAN_FD_TRV_DELAY, "TRV_DELAY"},
+    {CTU_CAN_FD_SSP_CFG, "SSP_CFG"},
+    {CTU_CAN_FD_RX_FR_CTR, "RX_FR_CTR"},
+    {CTU_CAN_FD_TX_FR_CTR, "TX_FR_CTR"},
+    {CTU_CAN_FD_DEBUG_REGISTER, "DEBUG_REGISTER"},
+    {CTU_CAN_FD_YOLO_REG, "YOLO_REG"},
+    {CTU_CAN_FD_TIMESTAMP_LOW, "TIMESTAMP_LOW"},
+    {CTU_CAN_FD_TIMESTAMP_HIGH, "TIMESTAMP_HIGH"},
+};
+
+const char *ctucan_reg_name(unsigned reg, char *buf, size_t len)
+{
+    if (reg >= CTU_CAN_FD_TXTB1_DATA_1 &&
+        reg < CTU_CAN_FD_TXTB1_DATA_1 + 0x100 * CTU_CAN_FD_TXT_BUFFER_COUNT) {
+        snprintf(buf, len, "TXTB%u+0x%02x", reg >> 8, reg & 0xff);
+        return buf;
+    }
+    for (size_t i = 0; i < sizeof(ctucan_reg_names) / sizeof(ctucan_reg_names[0]); i++)
+        if (ctucan_reg_names[i].reg == reg)
+            return ctucan_reg_names[i].name;
+    snprintf(buf, len, "0x%03x", reg);
+    return buf;
+}
@@ -0,0 +1,121 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#pragma once
+
+#include "userspace_utils.h"
+
+/*
+ * Register access trace.
+ *
+ * ctucan_trace_attach() returns a ctucan_hw_priv whose read_reg/write_reg
+ * record every access (time, register, value, direction, width) into an
+ * in-memory ring and then forward it to the wrapped priv. When tracing is
+ * not enabled the wrapper is simply not installed, so the access path is
+ * unchanged. ctucanfd_init() attaches it when CTUCANFD_TRACE=<file>[:<records>]
+ * is set and saves the ring at exit. The ring keeps the newest records,
+ * older ones are counted as dropped.
+ *
+ * ctucan_trace_mark() inserts a named marker, accesses up to the next
+ * marker are attributed to that code path by trace_replay.
+ *
+ * The kernel driver has equivalent tracepoints (ctucanfd:ctucan_reg_read,
+ * ctucanfd:ctucan_reg_write), trace_replay -k reads their ftrace output.
+ *
+ * File layout: struct ctucan_trace_hdr, then hdr.count records, oldest
+ * first, in host byte order.
+ */
+
+#define CTUCAN_TRACE_MAGIC      0x52544343  /* "CCTR" */
+#define CTUCAN_TRACE_VERSION    1
+#define CTUCAN_TRACE_MARKS      32
+#define CTUCAN_TRACE_MARK_LEN   24
+
+enum ctucan_trace_op {
+    CTUCAN_TRACE_READ,
+    CTUCAN_TRACE_WRITE,
+    CTUCAN_TRACE_MARK,          /* val = marker index, reg unused */
+};
+
+struct ctucan_trace_rec {
+    uint64_t ns;                /* Since start of trace, CLOCK_MONOTONIC */
+    uint32_t val;
+    uint16_t reg;               /* Byte offset */
+    uint8_t op;                 /* enum ctucan_trace_op */
+    uint8_t size;               /* Access width in bytes */
+};
+
+struct ctucan_trace_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t rec_size;
+    uint32_t nmarks;
+    uint64_t count;             /* Records in file */
+    uint64_t dropped;           /* Overwritten in the ring */
+    uint64_t start_realtime_ns; /* CLOCK_REALTIME at start, for correlation */
+    char marks[CTUCAN_TRACE_MARKS][CTUCAN_TRACE_MARK_LEN];
+};
+
+/*
+ * Wrap @inner, recording into a ring of @records entries (rounded up to a
+ * power of two), saved to @path by ctucan_trace_save(). Returns NULL on
+ * allocation failure.
+ */
+struct ctucan_hw_priv *ctucan_trace_attach(struct ctucan_hw_priv *inner,
+                                           const char *path, unsigned records);
+
+u32 ctucan_trace_read32(struct ctucan_hw_priv *priv,
+                        enum ctu_can_fd_can_registers reg);
+
+static inline bool ctucan_trace_is(const struct ctucan_hw_priv *priv)
+{
+    return priv->read_reg == ctucan_trace_read32;
+}
+
+/* Wrapped priv of a trace wrapper */
+struct ctucan_hw_priv *ctucan_trace_inner(struct ctucan_hw_priv *priv);
+
+/* Record an access done outside read_reg/write_reg (8/16-bit writes) */
+void ctucan_trace_record(struct ctucan_hw_priv *priv, enum ctucan_trace_op op,
+                         unsigned reg, u32 val, unsigned size);
+
+void ctucan_trace_mark_name(struct ctucan_hw_priv *priv, const char *name);
+
+/* Start of code path @name, no-op if @priv is not traced */
+static inline void ctucan_trace_mark(struct ctucan_hw_priv *priv, const char *name)
+{
+    if (ctucan_trace_is(priv))
+        ctucan_trace_mark_name(priv, name);
+}
+
+/* Write ring to the trace file. Returns 0 on success. */
+int ctucan_trace_save(struct ctucan_hw_priv *priv);
+
+/* Name of register at byte offset @reg, TXT buffer words as TXTBn+off */
+const char *ctucan_reg_name(unsigned reg, char *buf, size_t len);
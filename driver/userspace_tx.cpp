@@ -0,0 +1,312 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#include "userspace_tx.h"
+
+/* True if @a wins arbitration over @b, FIFO among equal IDs */
+static bool tx_sched_more_urgent(const struct tx_sched_frame *a,
+                                 const struct tx_sched_frame *b)
+{
+    if (a->arb != b->arb)
+        return a->arb < b->arb;
+    return a->seq < b->seq;
+}
+
+int tx_sched_init(struct tx_sched *ts, struct ctucan_hw_priv *priv,
+                  size_t max_queue, tx_sched_done_fn done, void *done_arg)
+{
+    memset(ts, 0, sizeof(*ts));
+    /* Room for frames coming back from preempted buffers */
+    ts->heap = (struct tx_sched_frame *)calloc(max_queue + CTU_CAN_FD_TXT_BUFFER_COUNT,
+                                               sizeof(*ts->heap));
+    if (!ts->heap) {
+        warnx("cannot allocate TX queue of %zu frames", max_queue);
+        return -1;
+    }
+    ts->priv = priv;
+    ts->max_queue = max_queue;
+    ts->nbufs = CTU_CAN_FD_TXT_BUFFER_COUNT;
+    ts->preempt = true;
+    ts->done = done;
+    ts->done_arg = done_arg;
+
+    for (unsigned i = 0; i < ts->nbufs; i++) {
+        ts->buf[i].state = TX_SCHED_BUF_FREE;
+        if (!ctucan_hw_is_txt_buf_accessible(priv, i))
+            ctucan_hw_txt_set_abort(priv, i);
+        ctucan_hw_txt_set_empty(priv, i);
+    }
+    return 0;
+}
+
+void tx_sched_free(struct tx_sched *ts)
+{
+    free(ts->heap);
+    ts->heap = NULL;
+    ts->depth = 0;
+}
+
+static void tx_sched_push(struct tx_sched *ts, const struct tx_sched_frame *f)
+{
+    size_t i = ts->depth++;
+
+    while (i) {
+        size_t parent = (i - 1) / 2;
+
+        if (!tx_sched_more_urgent(f, &ts->heap[parent]))
+            break;
+        ts->heap[i] = ts->heap[parent];
+        i = parent;
+    }
+    ts->heap[i] = *f;
+    if (ts->depth > ts->stats.max_depth)
+        ts->stats.max_depth = ts->depth;
+}
+
+static void tx_sched_pop(struct tx_sched *ts, struct tx_sched_frame *out)
+{
+    struct tx_sched_frame last = ts->heap[--ts->depth];
+    size_t i = 0;
+
+    *out = ts->heap[0];
+    for (;;) {
+        size_t child = 2 * i + 1;
+
+        if (child >= ts->depth)
+            break;
+        if (child + 1 < ts->depth &&
+            tx_sched_more_urgent(&ts->heap[child + 1], &ts->heap[child]))
+            child++;
+        if (!tx_sched_more_urgent(&ts->heap[child], &last))
+            break;
+        ts->heap[i] = ts->heap[child];
+        i = child;
+    }
+    ts->heap[i] = last;
+}
+
+bool tx_sched_queue_at(struct tx_sched *ts, const struct canfd_frame *cf,
+                       bool fdf, u64 tag, u64 txts)
+{
+    struct tx_sched_frame f;
+
+    if (ts->depth >= ts->max_queue) {
+        ts->stats.rejected++;
+        return false;
+    }
+    f.cf = *cf;
+    f.fdf = fdf;
+    f.arb = ts->fifo ? 0 : tx_sched_arb_key(cf->can_id);
+    f.seq = ts->next_seq++;
+    f.tag = tag;
+    f.ts = txts;
+    tx_sched_push(ts, &f);
+    ts->stats.queued++;
+    return true;
+}
+
+bool tx_sched_queue(struct tx_sched *ts, const struct canfd_frame *cf,
+                    bool fdf, u64 tag)
+{
+    return tx_sched_queue_at(ts, cf, fdf, tag, 0);
+}
+
+size_t tx_sched_pending(const struct tx_sched *ts)
+{
+    size_t n = ts->depth;
+
+    for (unsigned i = 0; i < ts->nbufs; i++)
+        if (ts->buf[i].state != TX_SCHED_BUF_FREE)
+            n++;
+    return n;
+}
+
+/* Most urgent loaded frame gets the highest TX_PRIORITY */
+static void tx_sched_set_priorities(struct tx_sched *ts)
+{
+    u8 prio[CTU_CAN_FD_TXT_BUFFER_COUNT] = {0};
+
+    for (unsigned i = 0; i < ts->nbufs; i++) {
+        unsigned rank = 0;
+
+        if (ts->buf[i].state == TX_SCHED_BUF_FREE)
+            continue;
+        for (unsigned j = 0; j < ts->nbufs; j++)
+            if (j != i && ts->buf[j].state != TX_SCHED_BUF_FREE &&
+                tx_sched_more_urgent(&ts->buf[j].frame, &ts->buf[i].frame))
+                rank++;
+        prio[i] = 7 - rank;
+    }
+    ctucan_hw_set_txt_priority(ts->priv, prio);
+}
+
+static void tx_sched_complete(struct tx_sched *ts, unsigned i, bool ok, u64 now)
+{
+    if (ok)
+        ts->stats.sent++;
+    else
+        ts->stats.failed++;
+    ts->buf[i].state = TX_SCHED_BUF_FREE;
+    if (ts->done)
+        ts->done(ts->done_arg, &ts->buf[i].frame, ok, now);
+}
+
+/*
+ * Number of queued frames more urgent than @f in the subtree at @i, counting
+ * stops at @limit. Children are never more urgent than their parent, so
+ * only matching nodes are descended into.
+ */
+static unsigned tx_sched_count_urgent(const struct tx_sched *ts, size_t i,
+                                      const struct tx_sched_frame *f,
+                                      unsigned limit)
+{
+    unsigned n;
+
+    if (!limit || i >= ts->depth || !tx_sched_more_urgent(&ts->heap[i], f))
+        return 0;
+    n = 1;
+    n += tx_sched_count_urgent(ts, 2 * i + 1, f, limit - n);
+    n += tx_sched_count_urgent(ts, 2 * i + 2, f, limit - n);
+    return n;
+}
+
+unsigned tx_sched_poll(struct tx_sched *ts)
+{
+    struct ctucan_hw_priv *priv = ts->priv;
+    union ctu_can_fd_tx_status txs;
+    unsigned completed = 0;
+    unsigned nfree = 0;
+    unsigned loaded = 0;            /* Buffers filled by this call */
+    bool have_now = false;
+    u64 now = 0;
+
+    txs.u32 = priv->read_reg(priv, CTU_CAN_FD_TX_STATUS);
+    for (unsigned i = 0; i < ts->nbufs; i++) {
+        struct tx_sched_buf *b = &ts->buf[i];
+        unsigned st = (txs.u32 >> (4 * i)) & 0xf;
+
+        if (b->state == TX_SCHED_BUF_FREE) {
+            nfree++;
+            continue;
+        }
+        if (st != TXT_TOK && st != TXT_ERR && st != TXT_ABT)
+            continue;
+
+        if (!have_now) {
+            now = ctucan_hw_read_timestamp(priv);
+            have_now = true;
+        }
+        if (st == TXT_ABT && b->state == TX_SCHED_BUF_ABORTING) {
+            /* Preempted frame keeps its place among equal IDs */
+            tx_sched_push(ts, &b->frame);
+            ts->stats.preempted++;
+            b->state = TX_SCHED_BUF_FREE;
+        } else {
+            tx_sched_complete(ts, i, st == TXT_TOK, now);
+            completed++;
+        }
+        nfree++;
+    }
+
+    /* Fill free buffers with the most urgent frames */
+    for (unsigned i = 0; i < ts->nbufs && nfree && ts->depth; i++) {
+        struct tx_sched_buf *b = &ts->buf[i];
+
+        if (b->state != TX_SCHED_BUF_FREE)
+            continue;
+        tx_sched_pop(ts, &b->frame);
+        if (!ctucan_hw_insert_frame(priv, &b->frame.cf, b->frame.ts, i,
+                                    b->frame.fdf)) {
+            /* Buffer still busy in HW or frame invalid */
+            if (ctucan_hw_is_txt_buf_accessible(priv, i)) {
+                ts->stats.failed++;
+                if (ts->done)
+                    ts->done(ts->done_arg, &b->frame, false, 0);
+            } else {
+                tx_sched_push(ts, &b->frame);
+            }
+            continue;
+        }
+        b->state = TX_SCHED_BUF_LOADED;
+        ts->stats.loads++;
+        nfree--;
+        loaded |= 1u << i;
+    }
+
+    if (loaded) {
+        tx_sched_set_priorities(ts);
+        /*
+         * Only the buffers filled now: an older one may have finished
+         * since TX_STATUS was read and must not be sent again.
+         */
+        for (unsigned i = 0; i < ts->nbufs; i++)
+            if (loaded & (1u << i))
+                ctucan_hw_txt_set_rdy(priv, i);
+    }
+
+    /*
+     * No free buffer but something more urgent waits: preempt least urgent.
+     * A buffer already being aborted makes room for one waiting frame, so
+     * abort another only for frames beyond those.
+     */
+    if (ts->preempt && !nfree && ts->depth) {
+        unsigned aborting = 0;
+        int victim = -1;
+
+        for (unsigned i = 0; i < ts->nbufs; i++) {
+            if (ts->buf[i].state == TX_SCHED_BUF_ABORTING)
+                aborting++;
+            if (ts->buf[i].state != TX_SCHED_BUF_LOADED)
+                continue;
+            if (victim < 0 || tx_sched_more_urgent(&ts->buf[victim].frame,
+                                                    &ts->buf[i].frame))
+                victim = i;
+        }
+        if (victim >= 0 &&
+            tx_sched_count_urgent(ts, 0, &ts->buf[victim].frame, aborting + 1) >
+            aborting) {
+            ts->buf[victim].state = TX_SCHED_BUF_ABORTING;
+            ctucan_hw_txt_set_abort(priv, victim);
+        }
+    }
+
+    return completed;
+}
+
+void tx_sched_report(const struct tx_sched *ts, FILE *f)
+{
+    const struct tx_sched_stats *st = &ts->stats;
+
+    fprintf(f, "tx_sched: %llu queued, %llu sent, %llu failed, %llu rejected, "
+               "%llu preempted, %llu buffer loads, max queue depth %llu\n",
+            (unsigned long long)st->queued, (unsigned long long)st->sent,
+            (unsigned long long)st->failed, (unsigned long long)st->rejected,
+            (unsigned long long)st->preempted, (unsigned long long)st->loads,
+            (unsigned long long)st->max_depth);
+}
@@ -0,0 +1,139 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*******************************************************************************
+ *
+ * CTU CAN FD IP Core
+ *
+ * Copyright (C) 2015-2018 Ondrej Ille <ondrej.ille@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Ondrej Ille <ondrej.ille@gmail.com> self-funded
+ * Copyright (C) 2018-2019 Martin Jerabek <martin.jerabek01@gmail.com> FEE CTU
+ * Copyright (C) 2018-2020 Pavel Pisa <pisa@cmp.felk.cvut.cz> FEE CTU/self-funded
+ *
+ * Project advisors:
+ *     Jiri Novak <jnovak@fel.cvut.cz>
+ *     Pavel Pisa <pisa@cmp.felk.cvut.cz>
+ *
+ * Department of Measurement         (http://meas.fel.cvut.cz/)
+ * Faculty of Electrical Engineering (http://www.fel.cvut.cz)
+ * Czech Technical University        (http://www.cvut.cz/)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ ******************************************************************************/
+
+#pragma once
+
+#include "userspace_utils.h"
+
+/*
+ * Userspace TX engine using all TXT buffers.
+ *
+ * Frames are queued in a software heap ordered by CAN arbitration priority
+ * (the order in which they would win arbitration on the bus), FIFO among
+ * frames with the same arbitration field. tx_sched_poll() keeps the most
+ * urgent pending frames loaded in the TXT buffers and programs TX_PRIORITY
+ * so that the core picks them in the same order.
+ *
+ * When all buffers are occupied and a frame more urgent than the least
+ * urgent loaded one is queued, that buffer is aborted and its frame goes
+ * back to the queue, so a burst of low priority traffic cannot delay a high
+ * priority frame by more than the frame currently on the bus. Aborts still
+ * in progress count: each waiting urgent frame causes at most one abort.
+ */
+
+struct tx_sched_frame {
+    struct canfd_frame cf;
+    bool fdf;                   /* Send as CAN FD frame */
+    u32 arb;                    /* Arbitration key, lower wins */
+    u64 seq;                    /* Queue order, breaks ties in arb */
+    u64 tag;                    /* Opaque user cookie */
+    u64 ts;                     /* TXT buffer timestamp (time-triggered TX) */
+};
+
+enum tx_sched_buf_state {
+    TX_SCHED_BUF_FREE,
+    TX_SCHED_BUF_LOADED,        /* Ready or being transmitted */
+    TX_SCHED_BUF_ABORTING,      /* Abort requested to make room */
+};
+
+struct tx_sched_buf {
+    enum tx_sched_buf_state state;
+    struct tx_sched_frame frame;
+};
+
+/* Completion callback, @ok false for TX error or abort failure */
+typedef void (*tx_sched_done_fn)(void *arg, const struct tx_sched_frame *f,
+                                 bool ok, u64 ts);
+
+struct tx_sched_stats {
+    uint64_t queued;
+    uint64_t rejected;          /* Queue full */
+    uint64_t sent;
+    uint64_t failed;
+    uint64_t preempted;         /* Aborted to make room, re-queued */
+    uint64_t loads;             /* Frames written to TXT buffers */
+    uint64_t max_depth;
+};
+
+struct tx_sched {
+    struct ctucan_hw_priv *priv;
+    struct tx_sched_frame *heap;    /* Binary heap, most urgent first */
+    size_t depth;
+    size_t max_queue;
+    u64 next_seq;
+    unsigned nbufs;
+    struct tx_sched_buf buf[CTU_CAN_FD_TXT_BUFFER_COUNT];
+    bool preempt;
+    bool fifo;                      /* Ignore IDs, send in queue order */
+    tx_sched_done_fn done;
+    void *done_arg;
+    struct tx_sched_stats stats;
+};
+
+/* Arbitration key of a frame: base ID, SRR/RTR, IDE, extended ID, RTR */
+static inline u32 tx_sched_arb_key(canid_t id)
+{
+    u32 rtr = !!(id & CAN_RTR_FLAG);
+
+    if (id & CAN_EFF_FLAG) {
+        id &= CAN_EFF_MASK;
+        return ((id >> 18) << 21) | (1u << 20) | (1u << 19) |
+               ((id & 0x3ffff) << 1) | rtr;
+    }
+    return ((id & CAN_SFF_MASK) << 21) | (rtr << 20);
+}
+
+/*
+ * Initialize engine on all TXT buffers and mark them empty. @max_queue
+ * bounds the software queue, @done is called for every finished frame.
+ * Returns -1 if the queue cannot be allocated.
+ */
+int tx_sched_init(struct tx_sched *ts, struct ctucan_hw_priv *priv,
+                   size_t max_queue, tx_sched_done_fn done, void *done_arg);
+
+/* Queue a frame. Returns false if the queue is full. */
+bool tx_sched_queue(struct tx_sched *ts, const struct canfd_frame *cf,
+                    bool fdf, u64 tag);
+
+/* Same as tx_sched_queue, with TXT buffer timestamp for time-triggered TX */
+bool tx_sched_queue_at(struct tx_sched *ts, const struct canfd_frame *cf,
+                       bool fdf, u64 tag, u64 txts);
+
+/*
+ * Collect finished buffers from TX_STATUS and refill free buffers from the
+ * queue. Returns number of frames completed by this call.
+ */
+unsigned tx_sched_poll(struct tx_sched *ts);
+
+void tx_sched_free(struct tx_sched *ts);
+
+/* Frames queued or in TXT buffers */
+size_t tx_sched_pending(const struct tx_sched *ts);
+
+void tx_sched_report(const struct tx_sched *ts, FILE *f);
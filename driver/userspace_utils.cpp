@@ -28,6 +28,8 @@
  ******************************************************************************/
 
 #include "userspace_utils.h"
+#include "userspace_emu.h"
+#include "userspace_trace.h"
 
 #include <iostream>
 
@@ -75,19 +77,70 @@ unsigned ctu_can_fd_read8(struct ctucan_hw_priv *priv, enum ctu_can_fd_can_regis
 unsigned ctu_can_fd_read16(struct ctucan_hw_priv *priv, enum ctu_can_fd_can_registers reg) {
     return priv->read_reg(priv, (enum ctu_can_fd_can_registers)(reg & ~1)) >> (8 * (reg & 1));
 }
-/*
 void ctu_can_fd_write8(struct ctucan_hw_priv *priv, enum ctu_can_fd_can_registers reg, uint8_t val) {
+    if (ctucan_trace_is(priv)) {
+        ctucan_trace_record(priv, CTUCAN_TRACE_WRITE, reg, val, 1);
+        return ctu_can_fd_write8(ctucan_trace_inner(priv), reg, val);
+    }
+    if (ctucan_emu_is(priv))
+        return ctucan_emu_write(priv, reg, (u32)val << (8 * (reg & 3)), 0xffu << (8 * (reg & 3)));
     iowrite8(val, (uint8_t*)priv->mem_base + reg);
 }
 void ctu_can_fd_write16(struct ctucan_hw_priv *priv, enum ctu_can_fd_can_registers reg, uint16_t val) {
+    if (ctucan_trace_is(priv)) {
+        ctucan_trace_record(priv, CTUCAN_TRACE_WRITE, reg, val, 2);
+        return ctu_can_fd_write16(ctucan_trace_inner(priv), reg, val);
+    }
+    if (ctucan_emu_is(priv))
+        return ctucan_emu_write(priv, reg, (u32)val << (8 * (reg & 2)), 0xffffu << (8 * (reg & 2)));
     iowrite16(val, (uint8_t*)priv->mem_base + reg);
-}*/
+}
 
-struct ctucan_hw_priv* ctucanfd_init(uint32_t addr)
+static struct ctucan_hw_priv *traced[4];
+static unsigned ntraced;
+
+static void trace_save_all()
 {
-    mem_open();
-    volatile void * const base = mem_map(addr, CANFD_ADDR_RANGE);
+    for (unsigned i = 0; i < ntraced; i++)
+        ctucan_trace_save(traced[i]);
+}
 
+/* CTUCANFD_TRACE=<file>[:<records>], further cores get <file>.<n> */
+static struct ctucan_hw_priv *trace_attach(struct ctucan_hw_priv *priv,
+                                           const char *spec)
+{
+    char path[256];
+    unsigned records = 1u << 20;
+    const char *colon = strrchr(spec, ':');
+    struct ctucan_hw_priv *tp;
+
+    if (ntraced == sizeof(traced) / sizeof(traced[0]))
+        return priv;
+    if (colon) {
+        char *e;
+
+        records = strtoul(colon + 1, &e, 0);
+        if (*e || !records)
+            errx(1, "CTUCANFD_TRACE=<file>[:<records>]");
+        snprintf(path, sizeof(path), "%.*s", (int)(colon - spec), spec);
+    } else {
+        snprintf(path, sizeof(path), "%s", spec);
+    }
+    if (ntraced)
+        snprintf(path + strlen(path), sizeof(path) - strlen(path), ".%u", ntraced);
+
+    tp = ctucan_trace_attach(priv, path, records);
+    if (!tp)
+        return priv;
+    if (!ntraced)
+        atexit(trace_save_all);
+    traced[ntraced++] = tp;
+    fprintf(stderr, "tracing register accesses to %s\n", path);
+    return tp;
+}
+
+static struct ctucan_hw_priv *mmio_priv(volatile void *base)
+{
     struct ctucan_hw_priv *priv = new ctucan_hw_priv;
     memset(priv, 0, sizeof(*priv));
 
@@ -98,3 +151,64 @@ struct ctucan_hw_priv* ctucanfd_init(uint32_t addr)
      // will leak memory, but who cares, this is just a prototype testing tool
     return priv;
 }
+
+static struct ctucan_hw_priv *ctucanfd_open(uint32_t addr)
+{
+    const char *emu = getenv("CTUCANFD_EMU");
+
+    if (emu && *emu && strcmp(emu, "0")) {
+        struct ctucan_emu_config cfg;
+
+        ctucan_emu_config_defaults(&cfg);
+        if (ctucan_emu_config_parse(&cfg, emu))
+            exit(1);
+        fprintf(stderr, "emulated core at 0x%lx (CTUCANFD_EMU=%s)\n",
+                (unsigned long)addr, emu);
+        return ctucan_emu_create(&cfg);
+    }
+
+    mem_open();
+    return mmio_priv(mem_map(addr, CANFD_ADDR_RANGE));
+}
+
+static struct ctucan_hw_priv *ctucanfd_traced(struct ctucan_hw_priv *priv)
+{
+    const char *trace = getenv("CTUCANFD_TRACE");
+
+    if (trace && *trace)
+        priv = trace_attach(priv, trace);
+    return priv;
+}
+
+struct ctucan_hw_priv* ctucanfd_init(uint32_t addr)
+{
+    return ctucanfd_traced(ctucanfd_open(addr));
+}
+
+struct ctucan_hw_priv *ctucanfd_init_uio(const char *dev)
+{
+    const char *name = strrchr(dev, '/') ? strrchr(dev, '/') + 1 : dev;
+    unsigned long size = CANFD_ADDR_RANGE;
+    char path[128];
+    void *mm;
+    FILE *f;
+    int fd;
+
+    snprintf(path, sizeof(path), "/sys/class/uio/%s/maps/map0/size", name);
+    f = fopen(path, "r");
+    if (f) {
+        if (fscanf(f, "%lx", &size) != 1 || !size)
+            size = CANFD_ADDR_RANGE;
+        fclose(f);
+    }
+
+    fd = open(dev, O_RDWR|O_SYNC);
+    if (fd < 0)
+        err(1, "open %s", dev);
+    /* UIO selects the mapping by offset, map0 is at offset 0 */
+    mm = mmap(NULL, size, PROT_WRITE|PROT_READ, MAP_SHARED, fd, 0);
+    if (mm == MAP_FAILED)
+        err(1, "mmap %s", dev);
+    fprintf(stderr, "mmap %s (%lu bytes) -> %p\n", dev, size, mm);
+    return ctucanfd_traced(mmio_priv(mm));
+}
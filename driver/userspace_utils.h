@@ -44,10 +44,25 @@ extern "C" {
 #include <inttypes.h>
 #include <err.h>
 
+/*
+ * Map the core at physical address @addr through /dev/mem. If CTUCANFD_EMU
+ * is set in the environment, an emulated core is returned instead, see
+ * userspace_emu.h. CTUCANFD_TRACE=<file>[:<records>] wraps the core in a
+ * register access trace saved at exit, see userspace_trace.h.
+ */
 struct ctucan_hw_priv *ctucanfd_init(uint32_t addr);
 
+/* Map the core through a UIO device (e.g. /dev/uio0), map0 of the device */
+struct ctucan_hw_priv *ctucanfd_init_uio(const char *dev);
+
 unsigned int ctu_can_fd_read8(struct ctucan_hw_priv *priv,
 				enum ctu_can_fd_can_registers reg);
 
 unsigned int ctu_can_fd_read16(struct ctucan_hw_priv *priv,
 				enum ctu_can_fd_can_registers reg);
+
+void ctu_can_fd_write8(struct ctucan_hw_priv *priv,
+				enum ctu_can_fd_can_registers reg, uint8_t val);
+
+void ctu_can_fd_write16(struct ctucan_hw_priv *priv,
+				enum ctu_can_fd_can_registers reg, uint16_t val);
@@ -5,7 +5,10 @@ import click
 import os
 import re
 import sys
+import time
 from pathlib import Path
+from contextlib import nullcontext
+from typing import Optional, Tuple
 from os.path import abspath
 from .log import MyLogRecord
 
@@ -24,7 +27,7 @@ def setup_logging() -> None:
 
 setup_logging()
 
-from . import vunit_ifc
+from . import vunit_ifc, sharding
 from . import test_unit, test_sanity, test_feature, test_reference, test_compliance
 from vunit.ui import VUnit
 from .test_common import add_rtl_sources, add_tb_sources, get_compile_options
@@ -72,10 +75,16 @@ def create():
 
 
 @cli.command()
+@click.option('--jobs', '-j', type=int, default=1,
+              help='Number of parallel shards sharing the CPUs, 0 for one per {} CPUs.'
+              .format(sharding.SHARD_THREADS))
+@click.option('--slowest', type=int, default=20,
+              help='Number of slowest tests listed in the timing report.')
+@click.option('--shard', hidden=True)
 @click.argument('config', type=click.Path())
 @click.argument('vunit_args', nargs=-1)
 @click.pass_obj
-def test(obj, *, config, vunit_args):
+def test(obj, *, config, vunit_args, jobs, slowest, shard):
     """Run the tests. Configuration is passed in YAML config file.
 
     You mas pass arguments directly to VUnit by appending them at the command end.
@@ -94,6 +103,9 @@ def test(obj, *, config, vunit_args):
 
     # run all feature tests (configured in config file)\n
     ./run test tests_fast.yml 'lib.tb_feature.*'
+
+    # run in several processes, tests balanced by their past run times\n
+    ./run test --jobs 0 tests_fast.yml
     """
 
     base = d.parent
@@ -101,12 +113,47 @@ def test(obj, *, config, vunit_args):
 
     config_file = base / config
     out_basename = os.path.splitext(config)[0]
+    build.mkdir(exist_ok=True)
+
+    if shard is None and sharding.wanted(obj, jobs, vunit_args):
+        res = sharding.run_sharded(config, vunit_args, jobs, slowest,
+                                   build, out_basename)
+        move_code_coverage(config_file, build, out_basename)
+        sys.exit(res)
+
     with config_file.open('rt', encoding='utf-8') as f:
         config = yaml.safe_load(f)
-    build.mkdir(exist_ok=True)
     os.chdir(str(build))
 
-    ui = create_vunit(obj, vunit_args, out_basename)
+    if shard is not None:
+        i, _ = sharding.parse_shard(shard)
+        xunit_basename = '{}.shard{}'.format(out_basename, i)
+    else:
+        xunit_basename = out_basename
+        vunit_args = sharding.default_threads(vunit_args)
+
+    with sharding.setup_lock(build) if shard is not None else nullcontext():
+        ui, conf_ok = setup_vunit(obj, vunit_args, xunit_basename, config, build, base)
+
+    t0 = time.monotonic()
+    res, report = vunit_run(ui, build, xunit_basename)
+    if not all(conf_ok):
+        log.error('Some test cases were discovered but not configured (see above).')
+
+    if shard is None:
+        root = sharding.read_xunit(report) if report else None
+        if root is not None:
+            times = sharding.xunit_times(root)
+            sharding.update_history(build, times)
+            sharding.write_report(build / 'test_times_{}.txt'.format(out_basename),
+                                  times, time.monotonic() - t0, slowest)
+        move_code_coverage(config_file, build, out_basename)
+
+    sys.exit(res)
+
+
+def setup_vunit(obj, vunit_args, xunit_basename, config, build, base):
+    ui = create_vunit(obj, vunit_args, xunit_basename, config['_default'])
 
     ctu_can_fd_rtl = ui.add_library("ctu_can_fd_rtl")
     ctu_can_fd_tb = ui.add_library("ctu_can_fd_tb")
@@ -153,34 +200,49 @@ def test(obj, *, config, vunit_args):
         log.warn('Unknown tests (defaults will be used): {}'
                  .format(', '.join(tb.name for tb in unknown_tests)))
 
-    res = vunit_run(ui, build, out_basename)
-    if not all(conf_ok):
-        log.error('Some test cases were discovered but not configured (see above).')
+    return ui, conf_ok
 
+
+def move_code_coverage(config_file, build, out_basename) -> None:
     # Move code coverage results to stand-alone directory to avoid overwriting it by runs
     # of other configs
-    if config['_default']['code_coverage']:
+    with config_file.open('rt', encoding='utf-8') as f:
+        config = yaml.safe_load(f)
+    if config['_default'].get('code_coverage', False):
         code_coverage = build / 'code_coverage_{}'.format(out_basename)
         code_coverage.mkdir(exist_ok=True)
-        os.system("mv *.gcda {}".format(code_coverage))
-        os.system("mv *.gcno {}".format(code_coverage))
+        os.system("mv {}/*.gcda {}".format(build, code_coverage))
+        os.system("mv {}/*.gcno {}".format(build, code_coverage))
 
-    sys.exit(res)
+
+def output_path(default_config) -> str:
+    # Libraries compiled with different flags get their own output path, so
+    # switching between configs does not recompile everything each time.
+    suffix = ''
+    if default_config.get('code_coverage', False):
+        suffix += '_cov'
+    if default_config.get('functional_coverage', False):
+        suffix += '_psl'
+    return 'vunit_out' + suffix
 
 
-def create_vunit(obj, vunit_args, out_basename):
+def create_vunit(obj, vunit_args, out_basename, default_config):
     # fill vunit arguments
     args = []
     # hack for vunit_compile TCL command
     if obj['compile']:
         args += ['--compile']
+    if not any(a in ('-o', '--output-path') or a.startswith('--output-path=')
+               for a in vunit_args):
+        args += ['--output-path', output_path(default_config)]
     args += ['--xunit-xml', '../{}.xml1'.format(out_basename)] + list(vunit_args)
     ui = VUnit.from_argv(args)
     ui.add_com()
     return ui
 
 
-def vunit_run(ui, build, out_basename) -> int:
+def vunit_run(ui, build, out_basename) -> Tuple[int, Optional[Path]]:
+    """Run the tests; return the exit code and the xunit report, if any."""
     try:
         vunit_ifc.run(ui)
         res = None
@@ -196,4 +258,5 @@ def vunit_run(ui, build, out_basename) -> int:
             print('<?xml-stylesheet href="xunit.xsl" type="text/xsl"?>', file=f)
             f.write(c)
         out.unlink()
-    return res
+        return res, ofile
+    return res, None
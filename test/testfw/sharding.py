@@ -0,0 +1,322 @@
+"""Split a test run into shards executed by parallel run.py processes.
+
+The coordinator compiles the libraries once, lists the selected tests and
+partitions them over the shards by their historical wall time (longest
+first, each test to the shard that would finish it first). The CPUs are
+split between the shards, and every shard is a run.py process running its
+tests with that many VUnit threads against the shared, already compiled
+output path. Within a shard VUnit still hands the tests out to its threads
+as they become free, so a test slower than its history holds up one
+thread, not a whole shard. The per-shard xunit reports are merged into
+the usual <config>.xml and the measured times are folded back into the
+history for the next run.
+"""
+
+import fcntl
+import json
+import logging
+import os
+import signal
+import subprocess
+import sys
+import threading
+import time
+import xml.etree.ElementTree as ET
+from contextlib import contextmanager
+from pathlib import Path
+from statistics import median
+from typing import Dict, Iterable, List, Optional, Sequence, Tuple
+
+from . import vunit_ifc
+
+__all__ = ['wanted', 'run_sharded', 'setup_lock', 'parse_shard',
+           'default_threads', 'split_cpus', 'load_history', 'update_history',
+           'partition', 'read_xunit', 'write_report']
+
+log = logging.getLogger(__name__)
+
+HISTORY_FILE = 'test_durations.json'
+# Weight of the newest measurement in the smoothed duration
+HISTORY_ALPHA = 0.5
+XML_HEADER = ('<?xml version="1.0" encoding="utf-8"?>\n'
+              '<?xml-stylesheet href="xunit.xsl" type="text/xsl"?>\n')
+
+# VUnit options that do not run tests; these always go to one process
+_NO_SHARD_OPTS = {'-l', '--list', '-f', '--files', '--compile', '-g', '--gui'}
+# VUnit threads each shard gets with --jobs 0
+SHARD_THREADS = 4
+
+
+def wanted(obj, jobs: int, vunit_args: Sequence[str]) -> bool:
+    if jobs == 1 or obj['compile']:
+        return False
+    return not any(a in _NO_SHARD_OPTS for a in vunit_args)
+
+
+def default_threads(vunit_args: Sequence[str]) -> List[str]:
+    """VUnit arguments with one thread per CPU, unless they set the threads."""
+    args = list(vunit_args)
+    if not any(a.startswith('-p') or a.startswith('--num-threads') for a in args):
+        args.append('-p{}'.format(os.cpu_count() or 1))
+    return args
+
+
+def split_cpus(ncpu: int, n: int) -> List[int]:
+    """VUnit threads of each of n shards, together ncpu (at least 1 each)."""
+    return [max(1, ncpu // n + (i < ncpu % n)) for i in range(n)]
+
+
+def parse_shard(shard: str) -> Tuple[int, int]:
+    i, n = (int(x) for x in shard.split('/'))
+    if not 0 <= i < n:
+        raise ValueError('bad shard {}'.format(shard))
+    return i, n
+
+
+@contextmanager
+def setup_lock(build: Path):
+    """Serialize source setup of the shards.
+
+    Adding sources writes the preprocessed files and the generated
+    testbench wrappers into the shared build directory; a shard reading a
+    half-written file would see a changed source and recompile it under
+    the others.
+    """
+    with (build / '.vunit_setup.lock').open('w') as f:
+        fcntl.flock(f, fcntl.LOCK_EX)
+        try:
+            yield
+        finally:
+            fcntl.flock(f, fcntl.LOCK_UN)
+
+
+#-------------------------------------------------------------------------------
+# Duration history
+
+
+def load_history(build: Path) -> Dict[str, float]:
+    try:
+        with (build / HISTORY_FILE).open('rt', encoding='utf-8') as f:
+            return {k: float(v) for k, v in json.load(f).items()}
+    except (OSError, ValueError, AttributeError):
+        return {}
+
+
+def update_history(build: Path, times: Dict[str, float]) -> None:
+    hist = load_history(build)
+    for name, t in times.items():
+        old = hist.get(name)
+        hist[name] = t if old is None else \
+            HISTORY_ALPHA * t + (1 - HISTORY_ALPHA) * old
+    tmp = build / (HISTORY_FILE + '.tmp')
+    with tmp.open('wt', encoding='utf-8') as f:
+        json.dump(hist, f, indent=1, sort_keys=True)
+    tmp.replace(build / HISTORY_FILE)
+
+
+def partition(tests: Iterable[str], hist: Dict[str, float],
+              threads: Sequence[int]) -> List[Tuple[float, List[str]]]:
+    """Split tests over shards running threads[i] tests at a time each.
+
+    Each test, longest first, goes to the shard whose expected time (test
+    time over its threads) grows least with it. Tests without history are
+    expected to take the median known time. Returns (expected time, tests)
+    per shard; shards keep the tests in descending expected time.
+    """
+    tests = list(tests)
+    known = [hist[t] for t in tests if t in hist]
+    guess = median(known) if known else 1.0
+    cost = {t: hist.get(t, guess) for t in tests}
+    order = sorted(tests, key=lambda t: (-cost[t], t))
+
+    loads = [0.0] * len(threads)
+    shards = [[] for _ in threads]  # type: List[List[str]]
+    for t in order:
+        i = min(range(len(threads)),
+                key=lambda i: ((loads[i] + cost[t]) / threads[i], i))
+        loads[i] += cost[t]
+        shards[i].append(t)
+    return [(load / p, lst) for load, p, lst in zip(loads, threads, shards)]
+
+
+#-------------------------------------------------------------------------------
+# Reports
+
+
+def _test_name(tc: ET.Element) -> str:
+    cls = tc.get('classname', '')
+    name = tc.get('name', '')
+    return '{}.{}'.format(cls, name) if cls else name
+
+
+def read_xunit(path: Path) -> Optional[ET.Element]:
+    try:
+        return ET.parse(str(path)).getroot()
+    except (OSError, ET.ParseError):
+        return None
+
+
+def xunit_times(root: ET.Element) -> Dict[str, float]:
+    return {_test_name(tc): float(tc.get('time', 0))
+            for tc in root.iter('testcase')}
+
+
+def merge_xunit(roots: Sequence[ET.Element], ofile: Path, wall: float) -> None:
+    merged = ET.Element('testsuite')
+    counts = dict.fromkeys(('errors', 'failures', 'skipped', 'tests'), 0)
+    for root in roots:
+        for k in counts:
+            counts[k] += int(root.get(k, 0))
+        merged.extend(root.findall('testcase'))
+    for k, v in counts.items():
+        merged.set(k, str(v))
+    merged.set('name', roots[0].get('name', '') if roots else '')
+    merged.set('time', '{:.1f}'.format(wall))
+    with ofile.open('wt', encoding='utf-8') as f:
+        f.write(XML_HEADER)
+        f.write(ET.tostring(merged, encoding='unicode'))
+
+
+def write_report(ofile: Path, times: Dict[str, float], wall: float, slowest: int,
+                 shards: Sequence[Tuple[float, float, int, int]] = ()) -> None:
+    """Per-test wall time report; printed and written to ofile.
+
+    shards: (expected, measured, number of tests, threads) per shard.
+    """
+    lines = []
+    total = sum(times.values())
+    lines.append('Wall time {:.1f} s, test time {:.1f} s, {} tests'
+                 .format(wall, total, len(times)))
+    if shards:
+        lines.append('')
+        lines.append('{:>5}  {:>7}  {:>6}  {:>10}  {:>10}'
+                     .format('shard', 'threads', 'tests', 'expected', 'measured'))
+        for i, (exp, meas, cnt, p) in enumerate(shards):
+            lines.append('{:>5}  {:>7}  {:>6}  {:>9.1f}s  {:>9.1f}s'
+                         .format(i, p, cnt, exp, meas))
+    ranked = sorted(times.items(), key=lambda kv: (-kv[1], kv[0]))
+    if slowest:
+        lines.append('')
+        lines.append('Slowest {} tests:'.format(min(slowest, len(ranked))))
+        for name, t in ranked[:slowest]:
+            lines.append('{:>9.2f}s  {}'.format(t, name))
+
+    text = '\n'.join(lines) + '\n'
+    print(text, end='')
+    with ofile.open('wt', encoding='utf-8') as f:
+        f.write(text)
+        f.write('\nAll tests:\n')
+        for name, t in ranked:
+            f.write('{:>9.2f}s  {}\n'.format(t, name))
+
+
+#-------------------------------------------------------------------------------
+# Coordinator
+
+
+def _strip_patterns(vunit_args: Sequence[str]) -> Tuple[List[str], List[str]]:
+    from vunit.vunit_cli import VUnitCLI
+    patterns = VUnitCLI().parse_args(list(vunit_args)).test_patterns
+    opts = list(vunit_args)
+    for p in patterns:
+        opts.remove(p)
+    return opts, patterns
+
+
+def _run_py(*args) -> List[str]:
+    return [sys.executable, sys.argv[0]] + list(args)
+
+
+def _list_tests(config: str, vunit_args: Sequence[str]) -> Optional[List[str]]:
+    res = subprocess.run(_run_py('test', config, '--', *vunit_args, '--list'),
+                         stdout=subprocess.PIPE, universal_newlines=True)
+    if res.returncode != 0:
+        return None
+    tests = []
+    for line in res.stdout.splitlines():
+        if line.startswith('Listed '):
+            break
+        if line and not line[0].isspace():
+            tests.append(line.strip())
+    return tests
+
+
+def _pump(i: int, stream) -> None:
+    prefix = '[{}] '.format(i)
+    for line in stream:
+        sys.stdout.write(prefix + line)
+        sys.stdout.flush()
+
+
+def run_sharded(config: str, vunit_args: Sequence[str], jobs: int, slowest: int,
+                build: Path, out_basename: str) -> int:
+    opts, patterns = _strip_patterns(vunit_args)
+    ncpu = os.cpu_count() or 1
+    t0 = time.monotonic()
+
+    log.info('Compiling libraries')
+    res = subprocess.run(_run_py('--compile', 'test', config, '--', *opts,
+                                 '-p{}'.format(ncpu)))
+    if res.returncode != 0:
+        log.error('Compilation failed')
+        return res.returncode
+
+    tests = _list_tests(config, vunit_args)
+    if tests is None:
+        log.error('Could not list the tests')
+        return 1
+    if not tests:
+        log.warning('No tests selected')
+        return 0
+
+    n = jobs if jobs > 0 else -(-ncpu // SHARD_THREADS)
+    n = min(n, len(tests))
+    threads = split_cpus(ncpu, n)
+    hist = load_history(build)
+    shards = partition(tests, hist, threads)
+    log.info('Running {} tests in {} shards of {} threads'
+             .format(len(tests), n, '/'.join(str(p) for p in threads)))
+
+    signal.signal(signal.SIGTERM, vunit_ifc.sighandler)
+    signal.signal(signal.SIGINT, vunit_ifc.sighandler)
+    procs = []
+    for i, (_, lst) in enumerate(shards):
+        p = subprocess.Popen(
+            _run_py('test', '--shard', '{}/{}'.format(i, n), config,
+                    '--', *opts, '-p{}'.format(threads[i]), *lst),
+            stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+            universal_newlines=True)
+        th = threading.Thread(target=_pump, args=(i, p.stdout), daemon=True)
+        th.start()
+        procs.append((p, th, time.monotonic()))
+
+    rcs = []
+    measured = []
+    for p, th, start in procs:
+        rcs.append(p.wait())
+        th.join()
+        measured.append(time.monotonic() - start)
+    wall = time.monotonic() - t0
+
+    roots = []
+    for i in range(n):
+        sfile = build / '../{}.shard{}.xml'.format(out_basename, i)
+        root = read_xunit(sfile)
+        if root is None:
+            log.error('Shard {} left no xunit report'.format(i))
+            rcs[i] = rcs[i] or 1
+            continue
+        roots.append(root)
+        sfile.unlink()
+
+    merge_xunit(roots, build / '../{}.xml'.format(out_basename), wall)
+    times = {}
+    for root in roots:
+        times.update(xunit_times(root))
+    update_history(build, times)
+    summary = [(exp, meas, len(lst), p)
+               for (exp, lst), meas, p in zip(shards, measured, threads)]
+    write_report(build / 'test_times_{}.txt'.format(out_basename), times, wall,
+                 slowest, summary)
+
+    return next((rc for rc in rcs if rc), 0)
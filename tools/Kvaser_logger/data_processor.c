@@ -24,6 +24,7 @@
 *******************************************************************************/
 
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <string.h>
@@ -41,61 +42,308 @@
 #include <time.h>
 #include <stdlib.h>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
 #include "include/kvaser.h"
-#include <regex.h> 
+#include "include/data_processor.h"
 
 
-int parse_stp_output(FILE *stp, FILE *out)
+/*
+ * Sample lines of the export look like "<index>> <signal> = <value>", e.g.
+ * "  -8191> 0 = 1". The test is the one of the regex used before,
+ * "[ ]*[0-9]*.[0-9]> [0-9] = [0-9]*", done by hand on a line of len bytes.
+ */
+static inline int stp_is_digit(char c)
 {
-	char line_buf[30];
-	regex_t regex;
-	int reg_res;
-	int first_sample = 0;
-	int eq_pos = 0;
+	return (unsigned char)(c - '0') < 10;
+}
 
-	char prev_val = '0';
-	int eq_count = 0;
-	
-	/* Parse sampled lines */
-	reg_res = regcomp(&regex, "[ ]*[0-9]*.[0-9]> [0-9] = [0-9]*", 0);
-	if (reg_res) {
-		fprintf(stderr, "Unable to compile Regex\n");
-		return EXIT_FAILURE;
+/* Offset of the '>' of the sample pattern in the line, -1 if none */
+static long stp_sample_gt(const char *line, size_t len)
+{
+	const char *end = line + len;
+	const char *p = line;
+
+	while ((p = memchr(p, '>', end - p)) != NULL) {
+		if (p - line >= 2 && end - p >= 6 && stp_is_digit(p[-1]) &&
+		    p[1] == ' ' && stp_is_digit(p[2]) && p[3] == ' ' &&
+		    p[4] == '=' && p[5] == ' ')
+			return p - line;
+		p++;
 	}
+	return -1;
+}
 
-	fprintf(out, "Bit sequence: ");
+/*
+ * Sample lines of one width, checked in place a word at a time. The
+ * pattern is the 8 bytes from the digit before '>' to the value; the
+ * bytes before and after it (at most 16 each) must not hold a newline.
+ */
+struct stp_stride {
+	size_t width;			/* Without the newline, 0 = not used */
+	size_t win;			/* Offset of the pattern word */
+	size_t pre, suf;		/* Bytes before and after it */
+	uint64_t pre_mask, suf_mask;	/* High bits of the bytes to check */
+};
+
+#define STP_ONES	0x0101010101010101ull
+#define STP_HIGH	(STP_ONES << 7)
+/* " > ' ' _ ' ' '=' ' ' _" in bytes 1-6 of the pattern word */
+#define STP_FIX_MASK	0x00ffffff00ffff00ull
+#define STP_FIX		0x00203d2000203e00ull
+#define STP_DIG_MASK	0x00000000ff0000ffull
+
+static inline uint64_t stp_load(const char *p)
+{
+	uint64_t w;
 
-	while (1) {
-		fgets(line_buf, 30, stp);
-		if (feof(stp))
-			break;
+	memcpy(&w, p, 8);
+	return w;
+}
+
+/* High bit set in every byte of w that is a newline */
+static inline uint64_t stp_nl_bytes(uint64_t w)
+{
+	w ^= 0x0a * STP_ONES;
+	return (w - STP_ONES) & ~w & STP_HIGH;
+}
 
-		/* Evaluate Regex over the line */
-		reg_res = regexec(&regex, line_buf, 0, NULL, 0);
+static uint64_t stp_low_bytes(size_t n)
+{
+	return n >= 8 ? ~0ull : (1ull << (8 * n)) - 1;
+}
+
+static void stp_stride_init(struct stp_stride *st, size_t width, size_t gt)
+{
+	memset(st, 0, sizeof(*st));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	st->win = gt - 1;
+	st->pre = st->win;
+	st->suf = width - (st->win + 8);
+	if (width < 8 || st->pre > 16 || st->suf > 16)
+		return;
+	st->pre_mask = stp_low_bytes(st->pre) & STP_HIGH;
+	st->suf_mask = ~stp_low_bytes(8 - (st->suf < 8 ? st->suf : 8)) & STP_HIGH;
+	st->width = width;
+#else
+	(void)width;
+	(void)gt;
+#endif
+}
+
+static inline int stp_is_sample_at(const char *line, const struct stp_stride *st)
+{
+	uint64_t w = stp_load(line + st->win);
+	uint64_t d = w & STP_DIG_MASK;
+	uint64_t bad;
+
+	/* One branch for the common case: everything or'ed together */
+	bad = ((w & STP_FIX_MASK) ^ STP_FIX) |
+	      ((d & 0xf00000f0ull) ^ 0x30000030ull) |
+	      (((d & 0x0f00000full) + 0x06000006ull) & 0xf00000f0ull) |
+	      stp_nl_bytes(w) |
+	      (stp_nl_bytes(stp_load(line)) & st->pre_mask) |
+	      ((uint64_t)(unsigned char)line[st->width] ^ '\n');
+	if (bad)
+		return 0;
+	if (st->pre > 8 && stp_nl_bytes(stp_load(line + st->pre - 8)))
+		return 0;
+	if (st->suf && (stp_nl_bytes(stp_load(line + st->width - 8)) & st->suf_mask))
+		return 0;
+	if (st->suf > 8 && stp_nl_bytes(stp_load(line + st->win + 8)))
+		return 0;
+	return 1;
+}
+
+/*
+ * Output of "<count> <value> " pairs, formatted without stdio per pair, or
+ * for a binary data set the counts as varints, kept until the record is
+ * written (see store_frame_record()).
+ */
+struct stp_rle_out {
+	FILE *out;
+	size_t len;
+	char buf[8192];
+
+	int binary;
+	int bad;			/* Values do not alternate from '0' */
+	unsigned int runs;
+	unsigned char *bin;
+	size_t bin_len, bin_size;
+};
+
+static void stp_rle_flush(struct stp_rle_out *o)
+{
+	fwrite(o->buf, 1, o->len, o->out);
+	o->len = 0;
+}
 
-		/* Process only matching Elements */
-		if (reg_res == REG_NOMATCH)
+static unsigned char *put_varint(unsigned char *p, unsigned long v)
+{
+	while (v >= 0x80) {
+		*p++ = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static void stp_bin_put(struct stp_rle_out *o, unsigned int count, char val)
+{
+	if (o->bin_size - o->bin_len < 5) {
+		size_t size = o->bin_size ? 2 * o->bin_size : 4096;
+		unsigned char *bin = realloc(o->bin, size);
+
+		if (!bin) {
+			o->bad = 1;
+			return;
+		}
+		o->bin = bin;
+		o->bin_size = size;
+	}
+	if (val != '0' + (o->runs & 1))
+		o->bad = 1;
+	o->bin_len = put_varint(o->bin + o->bin_len, count) - o->bin;
+	o->runs++;
+}
+
+static void stp_rle_put(struct stp_rle_out *o, unsigned int count, char val)
+{
+	char digits[12];
+	int n = 0;
+
+	if (o->binary) {
+		stp_bin_put(o, count, val);
+		return;
+	}
+	if (o->len > sizeof(o->buf) - sizeof(digits) - 4)
+		stp_rle_flush(o);
+	do {
+		digits[n++] = '0' + count % 10;
+		count /= 10;
+	} while (count);
+	while (n)
+		o->buf[o->len++] = digits[--n];
+	o->buf[o->len++] = ' ';
+	o->buf[o->len++] = val;
+	o->buf[o->len++] = ' ';
+}
+
+/*
+ * One pass over the whole export. The value column is where it was in the
+ * first sample line (two characters after its '='); that line only gives
+ * the column. Counts follow the format of the existing data sets: a change
+ * of value writes the count so far and restarts it at 0.
+ *
+ * Signal TAP pads the sample index, so sample lines all have the width of
+ * the first one. They are taken at that stride with the pattern checked in
+ * place; any other line goes through the general line scan.
+ */
+static void parse_stp_buf(const char *buf, size_t size, struct stp_rle_out *o)
+{
+	const char *end = buf + size;
+	const char *p = buf;
+	int first_sample = 0;
+	size_t eq_pos = 0;
+	struct stp_stride st = { 0 };
+
+	char prev_val = '0';
+	unsigned int eq_count = 0;
+
+	if (!o->binary)
+		fprintf(o->out, "Bit sequence: ");
+
+	while (p < end) {
+		const char *line;
+		const char *nl;
+		size_t len;
+		long pos;
+		char val;
+
+		/* Run of sample lines at the stride */
+		while (st.width && (size_t)(end - p) > st.width &&
+		       stp_is_sample_at(p, &st)) {
+			val = p[eq_pos + 2];
+			p += st.width + 1;
+			if (val != prev_val) {
+				stp_rle_put(o, eq_count, prev_val);
+				eq_count = 0;
+				prev_val = val;
+			} else {
+				eq_count++;
+			}
+		}
+		if (p >= end)
+			break;
+
+		line = p;
+		nl = memchr(p, '\n', end - p);
+		len = (nl ? nl : end) - line;
+		p = line + len + 1;
+		pos = stp_sample_gt(line, len);
+		if (pos < 0)
 			continue;
 
-		/* Extract position of '=' in first line */
-		if (first_sample == 0) {
-			eq_pos = strcspn(line_buf, "=");
+		if (!first_sample) {
+			eq_pos = (const char *)memchr(line, '=', len) - line;
 			first_sample = 1;
+			/* The stride needs the pattern at the value column */
+			if (nl && eq_pos == (size_t)pos + 4 && eq_pos + 2 < len)
+				stp_stride_init(&st, len, pos);
 			continue;
 		}
 
+		/* Too short for the column, not a sample of this signal */
+		if (eq_pos + 2 >= len)
+			continue;
+		val = line[eq_pos + 2];
+
 		/* Count and write when signal value changes */
-		if (prev_val != line_buf[eq_pos + 2]){
-			fprintf(out, "%d %c ", eq_count, prev_val);			
+		if (val != prev_val) {
+			stp_rle_put(o, eq_count, prev_val);
 			eq_count = 0;
 		} else {
 			eq_count++;
 		}
-		prev_val = line_buf[eq_pos + 2];
+		prev_val = val;
+	}
+	stp_rle_put(o, eq_count, prev_val);
+	if (o->binary)
+		return;
+	o->buf[o->len++] = '\n';
+	stp_rle_flush(o);
+}
+
+
+/*
+ * Parse the export opened as fd. It is mapped whole, lines of any length
+ * are seen complete.
+ */
+int parse_stp_output(int fd, struct stp_rle_out *o)
+{
+	struct stat st;
+	void *map;
+
+	if (fstat(fd, &st) == -1) {
+		perror("fstat");
+		return EXIT_FAILURE;
+	}
+	if (st.st_size == 0) {
+		parse_stp_buf("", 0, o);
+		return EXIT_SUCCESS;
 	}
-	fprintf(out, "%d %c \n", eq_count, prev_val);
 
-	regfree(&regex);
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return EXIT_FAILURE;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	parse_stp_buf(map, st.st_size, o);
+	munmap(map, st.st_size);
 
 	return EXIT_SUCCESS;
 }
@@ -138,41 +386,190 @@ int store_frame_info(struct kvalt_can_frame *frame, FILE *out)
 }
 
 
+/*
+ * Record of a frame in a binary data set, the format of
+ * driver/userspace_reflog.h: flags, data length, varint identifier, valid
+ * data bytes, varint number of runs and the runs. A new file gets the
+ * magic first.
+ */
+int store_frame_record(struct kvalt_can_frame *frame, struct stp_rle_out *o,
+			FILE *out)
+{
+	unsigned char rec[2 + 5 + 64 + 5];
+	unsigned char *p = rec;
+	struct stat st;
+
+	if (o->bad || frame->data_length > 64) {
+		fprintf(stderr, "Frame can not be stored as binary record!\n");
+		return EXIT_FAILURE;
+	}
+	if (fstat(fileno(out), &st) == 0 && st.st_size == 0)
+		fwrite(BIN_MAGIC, 1, BIN_MAGIC_LEN, out);
+
+	*p++ = (frame->fr_type ? 1 : 0) | (frame->id_type ? 2 : 0) |
+		(frame->rtr ? 4 : 0) | (frame->brs ? 8 : 0);
+	*p++ = frame->data_length;
+	p = put_varint(p, frame->id);
+	memcpy(p, frame->data, frame->data_length);
+	p += frame->data_length;
+	p = put_varint(p, o->runs);
+	fwrite(rec, 1, p - rec, out);
+	fwrite(o->bin, 1, o->bin_len, out);
+
+	return ferror(out) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+int output_is_binary(const char *path)
+{
+	size_t len = strlen(path);
+
+	return len >= strlen(BIN_EXT) && !strcmp(path + len - strlen(BIN_EXT), BIN_EXT);
+}
+
+
 int process_stp_output(char *in_path, char *out_path, struct kvalt_can_frame *frame)
 {
-	FILE *stp;
+	int stp;
 	FILE *out;
+	int res;
 	char path_with_ext[200];
+	struct stp_rle_out o;
 
 	memset(path_with_ext, '\0', sizeof(path_with_ext));
 	strcpy(path_with_ext, "./");
 	strcat(path_with_ext, in_path);
 	strcat(path_with_ext, ".tbl");
 
-	stp = fopen(path_with_ext, "r");
+	stp = open(path_with_ext, O_RDONLY);
 
-	if (stp == NULL){
+	if (stp == -1){
 		fprintf(stderr, "Could not open Signal TAP II Exported file!\n");
 		fprintf(stderr, "Path: %s\n", path_with_ext);
 		return EXIT_FAILURE;
 	}
 
 	out = fopen(out_path, "a");
-	if (stp == NULL){
+	if (out == NULL){
 		fprintf(stderr, "Could not open output file!\n");
 		fprintf(stderr, "Path: %s\n", out_path);
+		close(stp);
 		return EXIT_FAILURE;
 	}
-	store_frame_info(frame, out);
-	parse_stp_output(stp, out);
-
-	fclose(stp);
+	memset(&o, 0, sizeof(o));
+	o.out = out;
+	o.binary = output_is_binary(out_path);
+	if (!o.binary)
+		store_frame_info(frame, out);
+	res = parse_stp_output(stp, &o);
+	if (o.binary && res == EXIT_SUCCESS)
+		res = store_frame_record(frame, &o, out);
+
+	free(o.bin);
+	close(stp);
 	fclose(out);
 
+	return res;
+}
+
+
+/* Exports waiting for the worker thread */
+struct proc_job {
+	char in_path[200];
+	char out_path[200];
+	struct kvalt_can_frame frame;
+};
+
+static struct proc_job proc_jobs[PROC_QUEUE_LEN];
+static unsigned int proc_head, proc_tail;	/* Free running */
+static int proc_done, proc_failed;
+static pthread_t proc_thread;
+static pthread_mutex_t proc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t proc_cond = PTHREAD_COND_INITIALIZER;
+
+
+static void *processor_thread(void *arg)
+{
+	char path_with_ext[210];
+
+	pthread_mutex_lock(&proc_lock);
+	while (1) {
+		struct proc_job *job;
+		int res;
+
+		while (proc_head == proc_tail && !proc_done)
+			pthread_cond_wait(&proc_cond, &proc_lock);
+		if (proc_head == proc_tail)
+			break;
+		job = &proc_jobs[proc_tail % PROC_QUEUE_LEN];
+		pthread_mutex_unlock(&proc_lock);
+
+		/* Slot stays ours until proc_tail moves */
+		res = process_stp_output(job->in_path, job->out_path, &job->frame);
+		snprintf(path_with_ext, sizeof(path_with_ext), "%s.tbl", job->in_path);
+		unlink(path_with_ext);
+
+		pthread_mutex_lock(&proc_lock);
+		if (res)
+			proc_failed = 1;
+		proc_tail++;
+		pthread_cond_broadcast(&proc_cond);
+	}
+	pthread_mutex_unlock(&proc_lock);
+
+	return NULL;
+}
+
+
+int processor_start(void)
+{
+	proc_head = proc_tail = 0;
+	proc_done = proc_failed = 0;
+	if (pthread_create(&proc_thread, NULL, processor_thread, NULL)) {
+		fprintf(stderr, "Unable to start processing thread!\n");
+		return EXIT_FAILURE;
+	}
 	return EXIT_SUCCESS;
 }
 
 
+int processor_queue(char *in_path, char *out_path, struct kvalt_can_frame *frame)
+{
+	struct proc_job *job;
+
+	if (strlen(in_path) >= sizeof(job->in_path) ||
+	    strlen(out_path) >= sizeof(job->out_path)) {
+		fprintf(stderr, "Path too long!\n");
+		return EXIT_FAILURE;
+	}
+
+	pthread_mutex_lock(&proc_lock);
+	while (proc_head - proc_tail == PROC_QUEUE_LEN)
+		pthread_cond_wait(&proc_cond, &proc_lock);
+	job = &proc_jobs[proc_head % PROC_QUEUE_LEN];
+	strcpy(job->in_path, in_path);
+	strcpy(job->out_path, out_path);
+	job->frame = *frame;
+	proc_head++;
+	pthread_cond_broadcast(&proc_cond);
+	pthread_mutex_unlock(&proc_lock);
+
+	return EXIT_SUCCESS;
+}
+
+
+int processor_finish(void)
+{
+	pthread_mutex_lock(&proc_lock);
+	proc_done = 1;
+	pthread_cond_broadcast(&proc_cond);
+	pthread_mutex_unlock(&proc_lock);
+	pthread_join(proc_thread, NULL);
+
+	return proc_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
 void erase_file(char *path)
 {
 	char cmd[100];
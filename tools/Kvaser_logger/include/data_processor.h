@@ -44,6 +44,48 @@
 int process_stp_output(char *in_path, char *out_path, struct kvalt_can_frame *frame);
 
 
+/*
+ * Output files ending with BIN_EXT are binary data sets instead: the same
+ * frames and bit sequences, stored as records of the header fields, the
+ * valid data bytes and varint counts (driver/userspace_reflog.h). The
+ * driver's "reflog" tool converts between the two.
+ */
+#define BIN_EXT		".refb"
+#define BIN_MAGIC	"CTUREFB1"
+#define BIN_MAGIC_LEN	8
+
+int output_is_binary(const char *path);
+
+
+#define PROC_QUEUE_LEN 16
+
+/* 
+ * Starts worker thread which runs process_stp_output() on queued exports,
+ * in the order they were queued.
+ */
+int processor_start(void);
+
+
+/* 
+ * Queues Signal TAP II export for the worker thread. Frame and paths are
+ * copied, exported file is removed once processed. Blocks while
+ * PROC_QUEUE_LEN exports are pending.
+ *
+ * Arguments:
+ *	in_path		Exported file without ".tbl" extension.
+ *	out_path	Output file, appended to.
+ *	frame		Frame the export belongs to.
+ */
+int processor_queue(char *in_path, char *out_path, struct kvalt_can_frame *frame);
+
+
+/* 
+ * Waits until all queued exports are processed and stops worker thread.
+ * Returns EXIT_FAILURE if processing of any of them failed.
+ */
+int processor_finish(void);
+
+
 /* 
  * Erase file.
  *
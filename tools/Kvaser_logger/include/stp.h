@@ -25,10 +25,21 @@
 
 #define QUARTUS_STP_PATH "/opt/quartus/bin/quartus_stp"
 
+/* Printed by "quartus_stp --shell" when a command has finished */
+#define STP_PROMPT "tcl> "
+
+/* Time for "run" to arm the trigger, KVALT_STP_ARM_US overrides */
+#define STP_ARM_US 20000
+
+#define STP_START_TIMEOUT_MS 60000
+#define STP_ACQ_TIMEOUT_MS 5000
+
 
 /* 
  * Initializes Quartus Signal TAP II Logic analyzer.
- * Forks new process, connects input path and starts execution of command.
+ * Forks new process on a pty, starts execution of command and waits for
+ * its first prompt. Any program behaving like "quartus_stp --shell" can
+ * stand in for it.
  * 
  * Arguments:
  *	stp_path	Path to Signal TAP II Analyzer binary.
@@ -36,6 +47,17 @@
 int stp_init(char *stp_path);
 
 
+/* 
+ * Waits for the oldest command sent to Signal TAP II shell to finish, i.e.
+ * for its STP_PROMPT. Each prompt is consumed by one wait, so commands
+ * can be queued and their prompts collected later in the same order.
+ * 
+ * Arguments:
+ *	timeout_ms	Longest wait for the prompt.
+ */
+int stp_wait_prompt(int timeout_ms);
+
+
 /* 
  * Terminates Quartus Signal TAP II Logic analyzer.
  */
@@ -64,6 +86,7 @@ int stp_start_session(char *session);
 
 /* 
  * Sends command to Signal TAP II Logic analyzer to start aquisition.
+ * Does not wait, the shell starts it once all earlier commands finished.
  * 
  * Arguments:
  *	instance	Name of the instance within session
@@ -74,20 +97,26 @@ int stp_run_aquisition(int log, char *instance, char *signals, char *trigger);
 
 
 /* 
- * Waits 500 ms. Signal TAP II Aquisition should be over by then.
- * 
- * Arguments:
- *	instance	Name of the instance within session
- *	signals		Name of signal set
- *	trigger		Name of trigger
+ * Waits STP_ARM_US (or KVALT_STP_ARM_US) for the trigger to arm. Call it
+ * once the commands queued before "run" have finished; the shell does not
+ * report arming, so this is a fixed delay.
  */
-void stp_wait_aquisition_end(void);
+void stp_wait_armed(void);
+
+
+/* 
+ * Waits until the aquisition started by stp_run_aquisition() is over,
+ * that is until Signal TAP II shell returns to its prompt. Fails after
+ * STP_ACQ_TIMEOUT_MS.
+ */
+int stp_wait_aquisition_end(void);
 
 
 
 /* 
  * Export logged data from Signal TAP II logic analyzer aquisition.
- * Exported data are not stored in the session anymore!
+ * Exported data are not stored in the session anymore! Only sends the
+ * command, the file is complete after stp_wait_export_end().
  * 
  * Arguments:
  *	instance	Name of the instance within session
@@ -98,6 +127,13 @@ void stp_wait_aquisition_end(void);
 int stp_export_log(int log, char *instance, char *signals, char *trigger, char *dest);
 
 
+/* 
+ * Waits for the oldest pending stp_export_log() to finish. Fails after
+ * STP_ACQ_TIMEOUT_MS.
+ */
+int stp_wait_export_end(void);
+
+
 /* 
  * Closes Signal TAP II Logic analyzer session. Session is automatically
  * saved to .stp file. 
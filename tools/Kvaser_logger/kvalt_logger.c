@@ -69,6 +69,11 @@ void print_help(void)
         		        "/Quartus/CAN_FD_SoC/output_files/debug.stp "
 				"\"signal_set: 2018/06/14 15:19:43  #0\" "
 				"\"trigger: 2018/06/14 15:19:43  #1\" \n");
+	fprintf(stdout, "Environment:\n");
+	fprintf(stdout, "	KVALT_STP		Signal TAP II shell instead of "
+			QUARTUS_STP_PATH "\n");
+	fprintf(stdout, "	KVALT_STP_ARM_US	Wait for trigger to arm after "
+			"\"run\" [us]\n");
 	fprintf(stdout, "\n");
 }
 
@@ -76,11 +81,13 @@ void print_help(void)
 int kvaalt_start_log(int num_frames, char *session, char *instance, 
 			char *signals, char *trigger, char *outfile)
 {
-	struct kvalt_can_frame tx_frame;
+	struct kvalt_can_frame tx_frame[2];
 	struct kvalt_can_frame rx_frame;
 
-	char *export = "build/tmp_export";
+	char export[2][64];
 	char *tmp_session = "build/tmp_session.stp";
+	char *stp_path = getenv("KVALT_STP");
+	int res = 0;
 
 	/* Randomize for generator */
 	srand(time(NULL));
@@ -92,7 +99,7 @@ int kvaalt_start_log(int num_frames, char *session, char *instance,
 	}
 
 	/* Start Altera Quartus Signal TAP II in separate shell */
-	if (stp_init(QUARTUS_STP_PATH)){
+	if (stp_init(stp_path ? stp_path : QUARTUS_STP_PATH)){
 		fprintf(stderr, "Error in Signal TAP II initialization\n");
 		return 1;
 	}
@@ -101,26 +108,61 @@ int kvaalt_start_log(int num_frames, char *session, char *instance,
 	erase_file(outfile);
 
 	stp_create_temp_session(session, tmp_session);
-	stp_start_session(tmp_session);
+	if (stp_start_session(tmp_session) || processor_start()){
+		stp_exit();
+		return 1;
+	}
 	
-	/* Execute logging itself */
+	/*
+	 * Execute logging itself. Export of a frame is only queued to the
+	 * shell: its prompt is collected after "run" of the next frame is
+	 * queued behind it, and the processing thread parses the export
+	 * while the next frame is being acquired. Frame i uses tx_frame[i & 1]
+	 * and export[i & 1], the other pair belongs to the pending export.
+	 */
 	for (int i = 0; i < num_frames; i++){
-		generate_can_frame(&tx_frame);
-		stp_run_aquisition(i, instance, signals, trigger);
-		kvaser_send_frame(&tx_frame, 0);
+		int cur = i & 1;
+
+		generate_can_frame(&tx_frame[cur]);
+		if (stp_run_aquisition(i, instance, signals, trigger)){
+			res = 1;
+			break;
+		}
+		if (i > 0 && (stp_wait_export_end() ||
+		    processor_queue(export[!cur], outfile, &tx_frame[!cur]))){
+			res = 1;
+			break;
+		}
+		stp_wait_armed();
+		kvaser_send_frame(&tx_frame[cur], 0);
 		kvaser_read_frame(&rx_frame, 1);
-		stp_wait_aquisition_end();
-		stp_export_log(i, instance, signals, trigger, export);
-		process_stp_output(export, outfile, &tx_frame);
+		sprintf(export[cur], "build/tmp_export_%d", i);
+		if (stp_wait_aquisition_end() ||
+		    stp_export_log(i, instance, signals, trigger, export[cur])){
+			res = 1;
+			break;
+		}
 		fprintf(stdout, "Iteration nr: %d\n", i + 1);
 	}
+
+	/* Last export, unless the loop failed before it was collected */
+	if (!res && num_frames > 0){
+		int last = (num_frames - 1) & 1;
+
+		if (stp_wait_export_end() ||
+		    processor_queue(export[last], outfile, &tx_frame[last]))
+			res = 1;
+	}
+
+	if (processor_finish())
+		res = 1;
 	
 	stp_close_session();
 
 	/* Close Altera Quartus Signal Tap II */
 	stp_exit();
 
-	return 0;
+	return res;
 }
 
 
@@ -35,6 +35,8 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <poll.h>
+#include <termios.h>
 
 #include <canlib.h>
 
@@ -47,48 +49,124 @@
 /* Signal tap variables */
 static char *stp_args[] = {"quartus_stp", "--shell", NULL};
 static pid_t stp_pid;
-int pipes[2];
+static int stp_fd = -1;		/* Master side of the shell's pty */
+static int stp_arm_us = STP_ARM_US;
 
+/* Tail of the shell output, kept to report where a wait gave up */
+static char stp_out[256];
+static size_t stp_out_len;
 
+/*
+ * Prompts read but not waited for yet, commands may be queued to the shell
+ * before the previous one has finished. stp_match is the part of STP_PROMPT
+ * matched at the end of the output so far.
+ */
+static unsigned stp_prompts;
+static size_t stp_match;
 
-int prepare_child_pipes(void)
+
+int stp_wait_prompt(int timeout_ms)
 {
-	if (close(pipes[STDOUT_FILENO]) == -1) {
-    		perror("CHILD: close write");
-    		return EXIT_FAILURE;
- 	}
-	if (dup2(pipes[STDIN_FILENO], STDIN_FILENO) == -1) {
-   		perror("CHILD: dup2 read STDIN_FILENO");
-    		return EXIT_FAILURE;
+	const size_t plen = strlen(STP_PROMPT);
+	struct timespec now, end;
+	char buf[512];
+
+	if (stp_prompts) {
+		stp_prompts--;
+		return EXIT_SUCCESS;
 	}
-	if (close(pipes[STDIN_FILENO]) == -1) {
-    		perror("CHILD: close read");
-    		return EXIT_FAILURE;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	end.tv_sec += timeout_ms / 1000;
+	end.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (end.tv_nsec >= 1000000000L) {
+		end.tv_sec++;
+		end.tv_nsec -= 1000000000L;
 	}
-	return EXIT_SUCCESS;
+	stp_out_len = 0;
+
+	while (1) {
+		struct pollfd pfd = {stp_fd, POLLIN, 0};
+		long left;
+		ssize_t n;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		left = (end.tv_sec - now.tv_sec) * 1000 +
+			(end.tv_nsec - now.tv_nsec) / 1000000;
+		if (left <= 0)
+			break;
+		if (poll(&pfd, 1, left) <= 0)
+			continue;
+
+		n = read(stp_fd, buf, sizeof(buf));
+		if (n <= 0) {
+			fprintf(stderr, "Signal TAP II shell exited!\n");
+			return EXIT_FAILURE;
+		}
+
+		/* Keep the tail, the prompt may come split over reads */
+		for (ssize_t i = 0; i < n; i++) {
+			if (stp_out_len == sizeof(stp_out) - 1) {
+				memmove(stp_out, stp_out + sizeof(stp_out) / 2,
+					stp_out_len - sizeof(stp_out) / 2);
+				stp_out_len -= sizeof(stp_out) / 2;
+			}
+			stp_out[stp_out_len++] = buf[i];
+
+			if (buf[i] == STP_PROMPT[stp_match])
+				stp_match++;
+			else
+				stp_match = (buf[i] == STP_PROMPT[0]);
+			if (stp_match == plen) {
+				stp_prompts++;
+				stp_match = 0;
+			}
+		}
+		stp_out[stp_out_len] = '\0';
+
+		if (stp_prompts) {
+			stp_prompts--;
+			return EXIT_SUCCESS;
+		}
+	}
+
+	fprintf(stderr, "No Signal TAP II prompt in %d ms, last output:\n%s\n",
+		timeout_ms, stp_out);
+	return EXIT_FAILURE;
 }
 
 
+static int stp_send(const char *cmd)
+{
+	size_t len = strlen(cmd);
+
+	return write(stp_fd, cmd, len) == (ssize_t)len ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 
 int stp_init(char *stp_path)
 {
+	char *arm;
+
 	if (stp_path == NULL){
 		fprintf(stderr, "Invalid path pointer!\n");	
 		return EXIT_FAILURE;
 	};
 
-	if (pipe(pipes) == -1){
-		fprintf(stderr, "Pipe error!\n");
-		return EXIT_FAILURE;
-	};
+	arm = getenv("KVALT_STP_ARM_US");
+	if (arm)
+		stp_arm_us = atoi(arm);
 
-	stp_pid = fork();
+	stp_pid = forkpty(&stp_fd, NULL, NULL, NULL);
 
 	if (!stp_pid) {
+		struct termios tio;
 
-		if (prepare_child_pipes())
-			return EXIT_FAILURE;
-
+		/* No echo of commands, shell output is only output */
+		if (!tcgetattr(STDIN_FILENO, &tio)) {
+			tio.c_lflag &= ~(ECHO | ECHONL);
+			tcsetattr(STDIN_FILENO, TCSANOW, &tio);
+		}
 		execv(stp_path, stp_args);
 		fprintf(stderr, "Unable to start Signal TAP II!\n");
 		exit(127);
@@ -97,9 +175,10 @@ int stp_init(char *stp_path)
 		fprintf(stdout, "Started Signal TAP II. PID: %d\n", stp_pid);
 	} else {
 		fprintf(stdout, "Unable to start Signal TAP II! %d\n", stp_pid);
+		return EXIT_FAILURE;
 	}
 
-	return EXIT_SUCCESS;
+	return stp_wait_prompt(STP_START_TIMEOUT_MS);
 }
 
 
@@ -109,6 +188,8 @@ void stp_exit(void)
 	fprintf(stdout, "\n");
 	kill(stp_pid, SIGTERM);
 	waitpid(stp_pid, 0, 0);
+	close(stp_fd);
+	stp_fd = -1;
 }
 
 
@@ -128,19 +209,16 @@ int stp_start_session(char *session)
 {
 
 	char cmd[300];
-	int nbytes;
 
 	memset(&cmd, '\0', sizeof(cmd));
 	sprintf(cmd, "open_session -name %s\n", session);
 
 	/* Sending command to signal tap to start session */
 	fprintf(stdout, "Sending command to start Signal tap II session...\n");
-	nbytes = write(pipes[STDOUT_FILENO], cmd, strlen(cmd));
-	if (nbytes != strlen(cmd)){
+	if (stp_send(cmd) || stp_wait_prompt(STP_START_TIMEOUT_MS)){
 		fprintf(stderr,"Session not started properly!\n");
 		return EXIT_FAILURE;
 	}
-	usleep(1000000);
 	fprintf(stdout, "Signal tap II session started...\n");
 	
 	return EXIT_SUCCESS;
@@ -150,62 +228,74 @@ int stp_start_session(char *session)
 int stp_run_aquisition(int log, char *instance, char *signals, char *trigger)
 {
 	char cmd[400];
-	int nbytes;
 
 	memset(&cmd, '\0', sizeof(cmd));
 	sprintf(cmd, "run -instance \"%s\" -signal_set \"%s\" "
 			"-trigger \"%s\" -data_log log_%d\n", instance, signals, trigger, log);
 
-	nbytes = write(pipes[STDOUT_FILENO], cmd, strlen(cmd));
-	if (nbytes != strlen(cmd)){
+	if (stp_send(cmd)){
 		fprintf(stderr,"Aquisition not started!\n");
 		return EXIT_FAILURE;
 	}
-	usleep(200000);
 	
 	return EXIT_SUCCESS;
 }
 
 
-void stp_wait_aquisition_end(void)
+void stp_wait_armed(void)
+{
+	usleep(stp_arm_us);
+}
+
+
+int stp_wait_aquisition_end(void)
 {
-	usleep(200000);
+	/* "run" returns to the prompt once the buffer is full */
+	if (stp_wait_prompt(STP_ACQ_TIMEOUT_MS)) {
+		fprintf(stderr, "Aquisition not finished!\n");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
 }
 
 
 int stp_export_log(int log, char *instance, char *signals, char *trigger, char *dest)
 {
 	char cmd[200];
-	int nbytes;
 
 	memset(&cmd, '\0', sizeof(cmd));
 	sprintf(cmd, "export_data_log -instance %s -signal_set \"%s\" "
 		     "-trigger \"%s\" -data_log log_%d -filename %s -format tlb\n",
 			instance, signals, trigger, log, dest);
 
-	nbytes = write(pipes[STDOUT_FILENO], cmd, strlen(cmd));
-	if (nbytes != strlen(cmd)){
+	if (stp_send(cmd)){
 		fprintf(stderr,"Data not exported properly!\n");
 		return EXIT_FAILURE;
 	}
-	usleep(200000);
 	
 	return EXIT_SUCCESS;
 }
 
 
+int stp_wait_export_end(void)
+{
+	if (stp_wait_prompt(STP_ACQ_TIMEOUT_MS)) {
+		fprintf(stderr,"Data not exported properly!\n");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+
 int stp_close_session(void)
 {
 	char *cmd = "close_session\n";
-	int nbytes;
 
 	fprintf(stdout, "Closing session from Signal tap II...\n");
-	nbytes = write(pipes[STDOUT_FILENO], cmd, strlen(cmd));
-	if (nbytes != strlen(cmd)){
+	if (stp_send(cmd) || stp_wait_prompt(STP_START_TIMEOUT_MS)){
 		fprintf(stderr,"Session not closed!\n");
 		return EXIT_FAILURE;
 	}
-	usleep(1000000);
 
 	return EXIT_SUCCESS;
 }
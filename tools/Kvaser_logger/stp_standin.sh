@@ -0,0 +1,33 @@
+#!/bin/sh
+#
+# Stand-in for "quartus_stp --shell" to run kvalt_logger without FPGA:
+#
+#	KVALT_STP=./stp_standin.sh ./build/kvalt_logger ...
+#
+# Answers every command with the prompt, "run" after STANDIN_ACQ_S seconds.
+# "export_data_log" writes <filename>.tbl with a random bit sequence in
+# the format of Signal TAP II table export.
+
+printf 'tcl> '
+while IFS= read -r line; do
+	case "$line" in
+	run\ *)
+		sleep "${STANDIN_ACQ_S:-0.01}"
+		;;
+	export_data_log\ *)
+		dest=$(printf '%s\n' "$line" | sed -n 's/.*-filename \([^ ]*\).*/\1/p')
+		awk -v seed="$(date +%N)" 'BEGIN {
+			srand(seed);
+			print "Signal TAP II table export (stand-in)";
+			print "";
+			v = 1;
+			for (i = -8192; i < 40000; i++) {
+				if (i >= 0 && rand() < 0.005)
+					v = 1 - v;
+				printf "%8d> 0 = %d\n", i, v;
+			}
+		}' > "$dest.tbl"
+		;;
+	esac
+	printf 'tcl> '
+done